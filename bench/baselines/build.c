@@ -0,0 +1,27 @@
+// Hand-written C for build.gel. Each row is allocated on the heap, as gel's
+// arrays are.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int64_t* row(int64_t n) {
+  int64_t* r = malloc(16 * sizeof(int64_t));
+  const int64_t values[16] = {n,     n + 1, n + 2, n + 3, n * 2, n * 3,
+                              n * 4, n * 5, n - 1, n - 2, n - 3, n - 4,
+                              n / 2, n / 3, n / 4, n / 5};
+  for (int i = 0; i < 16; i++) r[i] = values[i];
+  return r;
+}
+
+int main(void) {
+  int64_t total = 0;
+  for (int64_t i = 0; i < 2000000; i++) {
+    int64_t* r = row(i);
+    const int64_t j = i % 16;
+    r[j] = r[15 - j] - r[j];
+    total += r[j] + 16;
+    free(r);
+  }
+  printf("%lld\n", (long long)total);
+  return 0;
+}
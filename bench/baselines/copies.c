@@ -0,0 +1,20 @@
+// Hand-written C for copies.gel. The previous version of the array is kept by
+// copying it, which is what gel has to do too.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(void) {
+  int64_t a[64] = {0}, before[64];
+  int64_t total = 0;
+  for (int64_t round = 0; round < 500000; round++) {
+    const int64_t i = round % 64;
+    memcpy(before, a, sizeof(a));
+    a[i] += i;
+    total += a[i] - before[i];
+  }
+  int64_t sum = 0;
+  for (int i = 0; i < 64; i++) sum += a[i];
+  printf("%lld\n%lld\n", (long long)total, (long long)sum);
+  return 0;
+}
@@ -0,0 +1,12 @@
+// Hand-written C for divide.gel.
+#include <stdint.h>
+#include <stdio.h>
+
+int main(void) {
+  int64_t total = 0;
+  for (int64_t i = -5000000; i < 5000000; i++) {
+    total += i / 7 + i / 8 - i / 10 + i / -3 + i * 12 / 1000;
+  }
+  printf("%lld\n", (long long)total);
+  return 0;
+}
@@ -0,0 +1,26 @@
+// Hand-written C for elementwise.gel, with one loop for the whole expression
+// rather than one for each operator.
+#include <stdint.h>
+#include <stdio.h>
+
+int main(void) {
+  const int64_t a[64] = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9, 3,
+                         2, 3, 8, 4, 6, 2, 6, 4, 3, 3, 8, 3, 2, 7, 9, 5,
+                         0, 2, 8, 8, 4, 1, 9, 7, 1, 6, 9, 3, 9, 9, 3, 7,
+                         5, 1, 0, 5, 8, 2, 0, 9, 7, 4, 9, 4, 4, 5, 9, 2};
+  const int64_t b[64] = {2, 7, 1, 8, 2, 8, 1, 8, 2, 8, 4, 5, 9, 0, 4, 5,
+                         2, 3, 5, 3, 6, 0, 2, 8, 7, 4, 7, 1, 3, 5, 2, 6,
+                         6, 2, 4, 9, 7, 7, 5, 7, 2, 4, 7, 0, 9, 3, 6, 9,
+                         9, 9, 5, 9, 5, 7, 4, 9, 6, 6, 9, 6, 7, 6, 2, 7};
+  int64_t total = 0;
+  for (int round = 0; round < 200000; round++) {
+    int64_t sum = 0, count = 0;
+    for (int i = 0; i < 64; i++) {
+      sum += (a[i] + b[i]) * a[i] - b[i];
+      count += a[i] < b[i];
+    }
+    total += sum - count;
+  }
+  printf("%lld\n", (long long)total);
+  return 0;
+}
@@ -0,0 +1,13 @@
+// Hand-written C for fib.gel: the same exponential recursion.
+#include <stdint.h>
+#include <stdio.h>
+
+static int64_t fib(int64_t n) {
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int main(void) {
+  for (int64_t i = 0; i < 32; i++) printf("%lld\n", (long long)fib(i));
+  return 0;
+}
@@ -0,0 +1,22 @@
+// Hand-written C for loops.gel, with a remainder where gel divides,
+// multiplies and subtracts.
+#include <stdint.h>
+#include <stdio.h>
+
+static int64_t gcd(int64_t x, int64_t y) {
+  while (y != 0) {
+    const int64_t r = x % y;
+    x = y;
+    y = r;
+  }
+  return x;
+}
+
+int main(void) {
+  int64_t total = 0;
+  for (int64_t i = 1; i < 2000; i++) {
+    for (int64_t j = 1; j < 2000; j++) total += gcd(i, j);
+  }
+  printf("%lld\n", (long long)total);
+  return 0;
+}
@@ -0,0 +1,29 @@
+// Hand-written C for matrix.gel.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static void multiply(const int64_t* a, const int64_t* b, int64_t n,
+                     int64_t* result) {
+  for (int64_t i = 0; i < n; i++) {
+    for (int64_t j = 0; j < n; j++) {
+      int64_t total = 0;
+      for (int64_t k = 0; k < n; k++) total += a[i * n + k] * b[k * n + j];
+      result[i * n + j] = total % 97;
+    }
+  }
+}
+
+int main(void) {
+  int64_t a[64] = {1, 2, 3, 4, 5, 6, 7, 8, 8, 7, 6, 5, 4, 3, 2, 1,
+                   1, 3, 5, 7, 2, 4, 6, 8, 8, 6, 4, 2, 7, 5, 3, 1,
+                   2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5,
+                   1, 0, 1, 0, 1, 0, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1};
+  int64_t result[64];
+  for (int round = 0; round < 200000; round++) {
+    multiply(a, a, 8, result);
+    memcpy(a, result, sizeof(a));
+  }
+  printf("%lld\n%lld\n", (long long)a[0], (long long)a[63]);
+  return 0;
+}
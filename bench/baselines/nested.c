@@ -0,0 +1,62 @@
+// Hand-written C for nested.gel, with the grid in a two dimensional array.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { N = 16 };
+
+static int64_t grid[N][N] = {
+    {1, 1, 0, 1, 1, 0, 0, 0, 0, 1, 0, 1, 1, 1, 1, 0},
+    {0, 0, 0, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1},
+    {0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 1},
+    {1, 0, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 0, 0, 1, 0},
+    {0, 1, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0},
+    {1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 0, 0, 1, 1},
+    {1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 0},
+    {1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0, 0},
+    {1, 1, 1, 1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0},
+    {0, 1, 0, 0, 0, 1, 0, 1, 0, 0, 1, 1, 0, 0, 0, 0},
+    {1, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0},
+    {0, 0, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1},
+    {0, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 1},
+    {0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 0, 1},
+    {1, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0},
+};
+
+static int64_t alive(int64_t i, int64_t j) {
+  return grid[(i + N) % N][(j + N) % N];
+}
+
+static void step(void) {
+  static int64_t next[N][N];
+  memcpy(next, grid, sizeof(grid));
+  for (int64_t i = 0; i < N; i++) {
+    for (int64_t j = 0; j < N; j++) {
+      const int64_t count = alive(i - 1, j - 1) + alive(i - 1, j) +
+                            alive(i - 1, j + 1) + alive(i, j - 1) +
+                            alive(i, j + 1) + alive(i + 1, j - 1) +
+                            alive(i + 1, j) + alive(i + 1, j + 1);
+      if (count == 3) {
+        next[i][j] = 1;
+      } else if (count != 2) {
+        next[i][j] = 0;
+      }
+    }
+  }
+  memcpy(grid, next, sizeof(grid));
+}
+
+int main(void) {
+  for (int generation = 1; generation <= 5000; generation++) {
+    step();
+    if (generation % 500 == 0) {
+      int64_t population = 0;
+      for (int i = 0; i < N; i++) {
+        for (int j = 0; j < N; j++) population += grid[i][j];
+      }
+      printf("%lld\n", (long long)population);
+    }
+  }
+  return 0;
+}
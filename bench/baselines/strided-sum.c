@@ -0,0 +1,20 @@
+// Hand-written C for strided-sum.gel.
+#include <stdint.h>
+#include <stdio.h>
+
+static int64_t sum(const int64_t* a, int64_t size, int64_t start) {
+  int64_t total = 0;
+  for (int64_t i = 0; i < size / 4; i++) total += a[i * 4 + start];
+  return total;
+}
+
+int main(void) {
+  const int64_t a[32] = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9, 3,
+                         2, 3, 8, 4, 6, 2, 6, 4, 3, 3, 8, 3, 2, 7, 9, 5};
+  int64_t total = 0;
+  for (int64_t round = 0; round < 2000000; round++) {
+    total += sum(a, 32, round % 4);
+  }
+  printf("%lld\n", (long long)total);
+  return 0;
+}
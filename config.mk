@@ -7,6 +7,7 @@ CXXFLAGS += -std=c++17 -Werror -Weverything  \
             -Wno-return-std-move-in-c++11
 opt: CXXFLAGS += -ffunction-sections -fdata-sections -flto -Ofast -march=native
 debug: CXXFLAGS += -O0 -g
+allocations: CPPFLAGS += -DGEL_ALLOCATIONS
 
 LDFLAGS += -fuse-ld=gold
 opt: LDFLAGS += -s -Wl,--gc-sections -flto -Ofast
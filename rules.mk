@@ -11,6 +11,10 @@ opt: all
 .PHONY: debug
 debug: all
 
+# Build with every heap allocation counted, and a summary printed at exit.
+.PHONY: allocations
+allocations: all
+
 .PHONY: clean
 clean:
 	@echo Removing output directories
@@ -0,0 +1,204 @@
+#include "allocations.h"
+
+#ifdef GEL_ALLOCATIONS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace allocations {
+namespace {
+
+// A label within a parent site, along with the allocations made there. Sites
+// are never removed, so a site which is entered again keeps adding to the
+// same counts. Site 0 is everything outside of any scope.
+struct Site {
+  std::size_t parent;
+  char label[40];
+  std::atomic<std::uint64_t> count, bytes, frees, freed_bytes;
+};
+
+// Once this many sites exist, scopes with new labels count towards their
+// parents instead. The table is fixed so that allocating never allocates.
+constexpr std::size_t kMaxSites = 1024;
+Site sites[kMaxSites];
+// Only guards adding sites. Allocations update the counts of existing sites
+// with atomics.
+std::mutex sites_mutex;
+std::size_t site_count = 1;
+
+// The site of the innermost scope on this thread.
+thread_local std::size_t current;
+
+std::atomic<std::uint64_t> live, peak;
+
+// Every allocation is preceded by its size and its site, so that freeing it
+// can be attributed to the same site. The header keeps the default alignment.
+struct alignas(std::max_align_t) Header {
+  std::size_t size;
+  std::size_t site;
+};
+
+// Writes the labels of the site and its parents, outermost first.
+void PrintPath(std::size_t site) {
+  if (site == 0) {
+    std::fputs("(outside any phase)", stderr);
+    return;
+  }
+  if (sites[site].parent != 0) {
+    PrintPath(sites[site].parent);
+    std::fputs(" > ", stderr);
+  }
+  std::fputs(sites[site].label, stderr);
+}
+
+void Print() {
+  std::size_t count;
+  {
+    std::lock_guard lock{sites_mutex};
+    count = site_count;
+  }
+  std::uint64_t allocations = 0, bytes = 0, frees = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    allocations += sites[i].count;
+    bytes += sites[i].bytes;
+    frees += sites[i].frees;
+  }
+  std::fprintf(stderr,
+               "\nAllocations:  %" PRIu64 " (%" PRIu64 " bytes, %" PRIu64
+               " bytes on average)\n"
+               "Frees:        %" PRIu64 "\n"
+               "Peak live:    %" PRIu64 " bytes\n"
+               "Live at exit: %" PRIu64 " bytes\n",
+               allocations, bytes, allocations ? bytes / allocations : 0, frees,
+               peak.load(), live.load());
+  // The sites which allocated the most bytes, by their own allocations rather
+  // than those of the scopes within them.
+  std::size_t top = 20;
+  if (const char* value = std::getenv("GEL_ALLOCATIONS_TOP")) {
+    top = std::strtoull(value, nullptr, 10);
+  }
+  std::array<std::size_t, kMaxSites> order;
+  for (std::size_t i = 0; i < count; i++) order[i] = i;
+  std::sort(order.begin(), order.begin() + static_cast<std::ptrdiff_t>(count),
+            [](std::size_t left, std::size_t right) {
+              return sites[left].bytes > sites[right].bytes;
+            });
+  std::fprintf(stderr, "\n%12s %14s %12s %12s  %s\n", "Allocations", "Bytes",
+               "Average", "Live", "Site");
+  for (std::size_t i = 0; i < std::min(top, count); i++) {
+    const Site& site = sites[order[i]];
+    const std::uint64_t site_allocations = site.count;
+    const std::uint64_t site_bytes = site.bytes;
+    if (site_allocations == 0) break;
+    std::fprintf(stderr, "%12" PRIu64 " %14" PRIu64 " %12" PRIu64
+                 " %12" PRIu64 "  ",
+                 site_allocations, site_bytes, site_bytes / site_allocations,
+                 site_bytes - site.freed_bytes);
+    PrintPath(order[i]);
+    std::fputc('\n', stderr);
+  }
+}
+
+void* Allocate(std::size_t size) {
+  if (size > SIZE_MAX - sizeof(Header)) throw std::bad_alloc();
+  // The summary is printed after the static objects which were constructed
+  // after the first allocation have been destroyed.
+  static const int registered = std::atexit(Print);
+  static_cast<void>(registered);
+  while (true) {
+    if (void* block = std::malloc(sizeof(Header) + size)) {
+      auto* header = static_cast<Header*>(block);
+      header->size = size;
+      header->site = current;
+      Site& site = sites[current];
+      site.count.fetch_add(1, std::memory_order_relaxed);
+      site.bytes.fetch_add(size, std::memory_order_relaxed);
+      const std::uint64_t now =
+          live.fetch_add(size, std::memory_order_relaxed) + size;
+      std::uint64_t highest = peak.load(std::memory_order_relaxed);
+      while (now > highest &&
+             !peak.compare_exchange_weak(highest, now,
+                                         std::memory_order_relaxed)) {
+      }
+      return header + 1;
+    }
+    const std::new_handler handler = std::get_new_handler();
+    if (!handler) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void Free(void* pointer) {
+  if (!pointer) return;
+  auto* header = static_cast<Header*>(pointer) - 1;
+  Site& site = sites[header->site];
+  site.frees.fetch_add(1, std::memory_order_relaxed);
+  site.freed_bytes.fetch_add(header->size, std::memory_order_relaxed);
+  live.fetch_sub(header->size, std::memory_order_relaxed);
+  std::free(header);
+}
+
+void* TryAllocate(std::size_t size) noexcept {
+  try {
+    return Allocate(size);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+}  // namespace
+
+Scope::Scope(std::string_view label) : parent_(current) {
+  const auto name = label.substr(0, sizeof(Site::label) - 1);
+  std::lock_guard lock{sites_mutex};
+  for (std::size_t i = 1; i < site_count; i++) {
+    if (sites[i].parent == parent_ && sites[i].label == name) {
+      current = i;
+      return;
+    }
+  }
+  if (site_count == kMaxSites) return;
+  Site& site = sites[site_count];
+  site.parent = parent_;
+  name.copy(site.label, name.size());
+  current = site_count++;
+}
+
+Scope::~Scope() { current = parent_; }
+
+}  // namespace allocations
+
+// Every form of new and delete goes through the counting allocator, except
+// for over-aligned types, which gel does not use.
+void* operator new(std::size_t size) { return allocations::Allocate(size); }
+void* operator new[](std::size_t size) { return allocations::Allocate(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return allocations::TryAllocate(size);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return allocations::TryAllocate(size);
+}
+void operator delete(void* pointer) noexcept { allocations::Free(pointer); }
+void operator delete[](void* pointer) noexcept { allocations::Free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept {
+  allocations::Free(pointer);
+}
+void operator delete[](void* pointer, std::size_t) noexcept {
+  allocations::Free(pointer);
+}
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+  allocations::Free(pointer);
+}
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+  allocations::Free(pointer);
+}
+
+#endif
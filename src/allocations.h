@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace allocations {
+
+// Whether gel was built with `make allocations`, which counts every heap
+// allocation and prints a summary of them when gel exits.
+#ifdef GEL_ALLOCATIONS
+inline constexpr bool kEnabled = true;
+#else
+inline constexpr bool kEnabled = false;
+#endif
+
+// Attributes the allocations made on this thread while the scope exists to
+// the label, nested within the labels of the scopes which enclose it. Scopes
+// do nothing unless allocations are being counted.
+class Scope {
+ public:
+  explicit Scope(std::string_view label);
+  ~Scope();
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+#ifdef GEL_ALLOCATIONS
+ private:
+  // The site which was current before this scope was entered.
+  std::size_t parent_;
+#endif
+};
+
+#ifndef GEL_ALLOCATIONS
+inline Scope::Scope(std::string_view) {}
+inline Scope::~Scope() {}
+#endif
+
+}  // namespace allocations
@@ -1,5 +1,6 @@
 #include "analysis.h"
 
+#include "allocations.h"
 #include "util.h"
 
 #include <algorithm>
@@ -19,6 +20,47 @@ std::optional<types::Type> GetType(
   return AnnotatedAst::GetMeta(*expression).type;
 }
 
+// The operators and names which every program starts with. They never change,
+// so a single copy is shared by every check, including concurrent ones.
+struct Builtins {
+  Operators operators;
+  Scope scope;
+};
+
+const Builtins& GetBuiltins() {
+  static const auto* const builtins = [] {
+    auto* result = new Builtins{
+        {
+            {
+                {ast::Arithmetic::ADD, types::Primitive::INTEGER},
+                {ast::Arithmetic::DIVIDE, types::Primitive::INTEGER},
+                {ast::Arithmetic::MULTIPLY, types::Primitive::INTEGER},
+                {ast::Arithmetic::SUBTRACT, types::Primitive::INTEGER},
+                // Arrays of integers combine element by element.
+                {ast::Arithmetic::ADD,
+                 types::Array{types::Primitive::INTEGER}},
+                {ast::Arithmetic::DIVIDE,
+                 types::Array{types::Primitive::INTEGER}},
+                {ast::Arithmetic::MULTIPLY,
+                 types::Array{types::Primitive::INTEGER}},
+                {ast::Arithmetic::SUBTRACT,
+                 types::Array{types::Primitive::INTEGER}},
+            },
+            {types::Primitive::BOOLEAN, types::Primitive::INTEGER},
+            {types::Primitive::INTEGER},
+            {types::Array{types::Primitive::INTEGER}},
+        },
+        Scope{}};
+    result->scope.Define(
+        "print",
+        Scope::Entry{BuiltinLocation(),
+                     types::Function{types::Void{},
+                                     {types::Primitive::INTEGER}}});
+    return result;
+  }();
+  return *builtins;
+}
+
 }  // namespace
 
 MessageBuilder::~MessageBuilder() {
@@ -26,26 +68,14 @@ MessageBuilder::~MessageBuilder() {
 }
 
 Checker::Checker()
-    : operators_{
-          {
-              {ast::Arithmetic::ADD, types::Primitive::INTEGER},
-              {ast::Arithmetic::DIVIDE, types::Primitive::INTEGER},
-              {ast::Arithmetic::MULTIPLY, types::Primitive::INTEGER},
-              {ast::Arithmetic::SUBTRACT, types::Primitive::INTEGER},
-          },
-          {types::Primitive::BOOLEAN, types::Primitive::INTEGER},
-          {types::Primitive::INTEGER},
-      },
+    : operators_(GetBuiltins().operators),
+      builtins_(GetBuiltins().scope),
       types_{
           types::Void{},
           types::Primitive::BOOLEAN,
           types::Primitive::INTEGER,
-      } {
-  scope_.Define("print", analysis::Scope::Entry{
-                             BuiltinLocation(),
-                             types::Function{types::Void{},
-                                             {types::Primitive::INTEGER}}});
-}
+      },
+      scope_(&builtins_) {}
 
 void Checker::AddType(const types::Type& type) {
   auto i = std::find(types_.begin(), types_.end(), type);
@@ -81,8 +111,19 @@ const Scope::Entry* Scope::Lookup(std::string_view name) const {
   return parent_->Lookup(name);
 }
 
+bool Scope::Defines(std::string_view name) const {
+  return bindings_.find(name) != bindings_.end();
+}
+
 std::optional<AnnotatedAst::Identifier> FunctionChecker::CheckExpression(
     const ParsedAst::Identifier& identifier) {
+  auto result = CheckVariable(identifier);
+  if (result.has_value()) NoteArrayUse(identifier, result->type, nullptr);
+  return result;
+}
+
+std::optional<AnnotatedAst::Identifier> FunctionChecker::CheckVariable(
+    const ParsedAst::Identifier& identifier) {
   auto* entry = scope_->Lookup(identifier.name);
   if (entry == nullptr) {
     checker_->Error(identifier.location)
@@ -191,6 +232,12 @@ std::optional<AnnotatedAst::Compare> FunctionChecker::CheckExpression(
   }
   const auto& inferred_type = left_type;
 
+  if (checker_->operators_.elementwise_comparable.count(inferred_type)) {
+    auto type = types::Array{types::Primitive::BOOLEAN};
+    checker_->AddType(type);
+    return AnnotatedAst::Compare{
+        {std::move(type)}, binary.operation, *left, *right};
+  }
   if (binary.operation == ast::Compare::EQUAL ||
       binary.operation == ast::Compare::NOT_EQUAL) {
     const auto& types = checker_->operators_.equality_comparable;
@@ -302,6 +349,24 @@ std::optional<AnnotatedAst::FunctionCall> FunctionChecker::CheckExpression(
     }
     if (error) return std::nullopt;
   }
+
+  // Printing is the only way that the order in which the iterations of
+  // a parallel loop run could be observed.
+  const bool prints = call.function == "print" ||
+                      checker_->printing_.count(call.function) > 0;
+  if (prints) checker_->prints_ = true;
+  if (parallel_ != nullptr && prints) {
+    if (call.function == "print") {
+      checker_->Error(call.location) << "Parallel loops cannot print.";
+    } else {
+      checker_->Error(call.location)
+          << "Parallel loops cannot call " << util::Detail(call.function)
+          << ", which may print.";
+    }
+    return std::nullopt;
+  }
+  if (parallel_ != nullptr && call.function == this_function_)
+    checker_->parallel_recursion_.push_back(call.location);
   return AnnotatedAst::FunctionCall{
       {type->return_type}, call.function, std::move(arguments)};
 }
@@ -322,8 +387,46 @@ std::optional<AnnotatedAst::LogicalNot> FunctionChecker::CheckExpression(
   return AnnotatedAst::LogicalNot{{types::Primitive::BOOLEAN}, *argument};
 }
 
+std::optional<AnnotatedAst::Index> FunctionChecker::CheckExpression(
+    const ParsedAst::Index& index) {
+  // Indexing a variable only reads a single element of it, which a parallel
+  // loop may allow where it wouldn't allow reading the whole array.
+  std::optional<AnnotatedAst::Expression> array;
+  if (const auto* variable = index.array.get_if<ParsedAst::Identifier>()) {
+    if (auto result = CheckVariable(*variable)) {
+      NoteArrayUse(*variable, result->type, &index.index);
+      array = std::move(*result);
+    }
+  } else {
+    array = CheckAnyExpression(index.array);
+  }
+  auto value = CheckAnyExpression(index.index);
+  auto type = GetType(array);
+  const auto* array_type = CheckArray(index.array, type);
+  const bool index_ok = CheckIndex(index.index, GetType(value));
+  if (!array_type || !index_ok) return std::nullopt;
+  return AnnotatedAst::Index{
+      {array_type->element_type}, std::move(*array), std::move(*value)};
+}
+
+std::optional<AnnotatedAst::Size> FunctionChecker::CheckExpression(
+    const ParsedAst::Size& size) {
+  checker_->AddType(types::Primitive::INTEGER);
+  // The size of an array doesn't depend on its elements, so it can be read
+  // even while a parallel loop is assigning to them.
+  std::optional<AnnotatedAst::Expression> array;
+  if (const auto* variable = size.array.get_if<ParsedAst::Identifier>()) {
+    if (auto result = CheckVariable(*variable)) array = std::move(*result);
+  } else {
+    array = CheckAnyExpression(size.array);
+  }
+  if (!CheckArray(size.array, GetType(array))) return std::nullopt;
+  return AnnotatedAst::Size{{types::Primitive::INTEGER}, std::move(*array)};
+}
+
 std::optional<AnnotatedAst::Expression> FunctionChecker::CheckAnyExpression(
     const ParsedAst::Expression& expression) {
+  checker_->nodes_++;
   return expression.visit(
       [&](const auto& value) -> std::optional<AnnotatedAst::Expression> {
         return CheckExpression(value);
@@ -388,6 +491,20 @@ std::optional<AnnotatedAst::Assign> FunctionChecker::CheckStatement(
                   Scope::Entry{assignment.location, type});
     entry = scope_->Lookup(assignment.variable.name);
   }
+  if (parallel_ != nullptr) {
+    if (IsShared(assignment.variable.name, *parallel_)) {
+      checker_->Error(assignment.location)
+          << "Iterations of a parallel loop cannot assign to "
+          << util::Detail(assignment.variable.name)
+          << ", which is shared between them.";
+      return std::nullopt;
+    }
+    if (IsLoopVariable(assignment.variable.name, *parallel_)) {
+      checker_->Error(assignment.location)
+          << "Cannot assign to the variable of a parallel loop.";
+      return std::nullopt;
+    }
+  }
   if (entry->type.has_value() && type.has_value()) {
     if (*entry->type == *type) {
       assert(value.has_value());
@@ -410,6 +527,64 @@ std::optional<AnnotatedAst::Assign> FunctionChecker::CheckStatement(
   }
 }
 
+std::optional<AnnotatedAst::AssignElement> FunctionChecker::CheckStatement(
+    const ParsedAst::AssignElement& assignment) {
+  auto index = CheckAnyExpression(assignment.index);
+  auto value = CheckAnyExpression(assignment.value);
+  const bool index_ok = CheckIndex(assignment.index, GetType(index));
+  const auto* entry = scope_->Lookup(assignment.variable.name);
+  if (entry == nullptr) {
+    checker_->Error(assignment.variable.location)
+        << "Assignment to element of undefined variable "
+        << util::Detail(assignment.variable.name) << ".";
+    return std::nullopt;
+  }
+  if (!entry->type.has_value()) return std::nullopt;
+  const auto* array_type = entry->type->get_if<types::Array>();
+  if (array_type == nullptr) {
+    checker_->Error(assignment.variable.location)
+        << util::Detail(assignment.variable.name) << " has type "
+        << util::Detail(*entry->type) << ", which is not an array type.";
+    checker_->Note(entry->location)
+        << util::Detail(assignment.variable.name) << " is declared here.";
+    return std::nullopt;
+  }
+  // A variable which is local to a parallel loop is also local to every loop
+  // which encloses that one.
+  for (auto* loop = parallel_;
+       loop != nullptr && IsShared(assignment.variable.name, *loop);
+       loop = loop->outer) {
+    const auto* own = assignment.index.get_if<ParsedAst::Identifier>();
+    if (own == nullptr || !IsLoopVariable(own->name, *loop)) {
+      checker_->Error(assignment.location)
+          << "Iterations of a parallel loop can only assign to their own "
+          << "element of the shared array "
+          << util::Detail(assignment.variable.name) << ", which is "
+          << util::Detail(assignment.variable.name + "[" + loop->variable +
+                          "]")
+          << ".";
+      return std::nullopt;
+    }
+    loop->written.emplace(assignment.variable.name,
+                          assignment.variable.location);
+  }
+  auto type = GetType(value);
+  if (!index_ok || !type.has_value()) return std::nullopt;
+  if (*type != array_type->element_type) {
+    checker_->Error(assignment.location)
+        << "Type mismatch in assignment: elements of "
+        << util::Detail(assignment.variable.name) << " have type "
+        << util::Detail(array_type->element_type)
+        << ", but expression yields type " << util::Detail(*type) << ".";
+    return std::nullopt;
+  }
+  return AnnotatedAst::AssignElement{
+      {},
+      AnnotatedAst::Identifier{{*entry->type}, assignment.variable.name},
+      std::move(*index),
+      std::move(*value)};
+}
+
 std::optional<AnnotatedAst::DoFunction> FunctionChecker::CheckStatement(
     const ParsedAst::DoFunction& do_function) {
   auto call = CheckExpression(do_function.function_call);
@@ -433,10 +608,12 @@ std::optional<AnnotatedAst::If> FunctionChecker::CheckStatement(
         << ", not " << util::Detail(types::Primitive::BOOLEAN) << ".";
   }
   Scope true_scope{scope_};
-  FunctionChecker true_checker{type_, this_function_, checker_, &true_scope};
+  FunctionChecker true_checker{type_, this_function_, checker_, &true_scope,
+                               parallel_};
   auto if_true = true_checker.CheckStatement(if_statement.if_true);
   Scope false_scope{scope_};
-  FunctionChecker false_checker{type_, this_function_, checker_, &false_scope};
+  FunctionChecker false_checker{type_, this_function_, checker_,
+                                &false_scope, parallel_};
   auto if_false = false_checker.CheckStatement(if_statement.if_false);
   if (condition.has_value() && if_true.has_value() && if_false.has_value()) {
     return AnnotatedAst::If{
@@ -456,7 +633,8 @@ std::optional<AnnotatedAst::While> FunctionChecker::CheckStatement(
         << ", not " << util::Detail(types::Primitive::BOOLEAN) << ".";
   }
   Scope body_scope{scope_};
-  FunctionChecker body_checker{type_, this_function_, checker_, &body_scope};
+  FunctionChecker body_checker{type_, this_function_, checker_, &body_scope,
+                               parallel_};
   auto body = body_checker.CheckStatement(while_statement.body);
   if (condition.has_value() && body.has_value()) {
     return AnnotatedAst::While{{}, std::move(*condition), std::move(*body)};
@@ -465,8 +643,71 @@ std::optional<AnnotatedAst::While> FunctionChecker::CheckStatement(
   }
 }
 
+std::optional<AnnotatedAst::ParallelFor> FunctionChecker::CheckStatement(
+    const ParsedAst::ParallelFor& parallel_for) {
+  checker_->AddType(types::Primitive::INTEGER);
+  auto begin = CheckAnyExpression(parallel_for.begin);
+  auto end = CheckAnyExpression(parallel_for.end);
+  bool bounds_ok = begin.has_value() && end.has_value();
+  auto check_bound = [&](const ParsedAst::Expression& bound,
+                         const std::optional<AnnotatedAst::Expression>& value) {
+    auto type = GetType(value);
+    if (type.has_value() && *type != types::Primitive::INTEGER) {
+      checker_->Error(ParsedAst::GetMeta(bound).location)
+          << "Bound of parallel loop has type " << util::Detail(*type)
+          << ", not " << util::Detail(types::Primitive::INTEGER) << ".";
+      bounds_ok = false;
+    }
+  };
+  check_bound(parallel_for.begin, begin);
+  check_bound(parallel_for.end, end);
+  const auto& variable = parallel_for.variable;
+  if (auto* previous_entry = scope_->Lookup(variable.name)) {
+    checker_->Warning(variable.location)
+        << "Loop variable " << util::Detail(variable.name)
+        << " shadows an existing definition.";
+    checker_->Note(previous_entry->location)
+        << util::Detail(variable.name) << " was previously declared here.";
+  }
+  Scope body_scope{scope_};
+  body_scope.Define(variable.name,
+                    Scope::Entry{variable.location, types::Primitive::INTEGER});
+  ParallelLoop loop{&body_scope, variable.name, parallel_, {}, {}};
+  FunctionChecker body_checker{type_, this_function_, checker_, &body_scope,
+                               &loop};
+  auto body = body_checker.CheckStatement(parallel_for.body);
+  // Element assignments are only checked against the loop variable, so an
+  // array which is written can't also be read in any other way.
+  bool independent = true;
+  for (const auto& [name, location] : loop.shared_uses) {
+    auto i = loop.written.find(name);
+    if (i == loop.written.end()) continue;
+    checker_->Error(location)
+        << "Iterations of a parallel loop can only use their own element of "
+        << util::Detail(name) << ", since they assign to its elements.";
+    checker_->Note(i->second)
+        << util::Detail(name) << " is assigned to here.";
+    independent = false;
+  }
+  if (bounds_ok && body.has_value() && independent) {
+    return AnnotatedAst::ParallelFor{
+        {},
+        AnnotatedAst::Identifier{{types::Primitive::INTEGER}, variable.name},
+        std::move(*begin),
+        std::move(*end),
+        std::move(*body)};
+  } else {
+    return std::nullopt;
+  }
+}
+
 std::optional<AnnotatedAst::ReturnVoid> FunctionChecker::CheckStatement(
     const ParsedAst::ReturnVoid& return_statement) {
+  if (parallel_ != nullptr) {
+    checker_->Error(return_statement.location)
+        << "Cannot return from inside a parallel loop.";
+    return std::nullopt;
+  }
   if (type_.return_type != types::Void{}) {
     checker_->Error(return_statement.location)
         << "Cannot return without a value: " << util::Detail(this_function_)
@@ -478,6 +719,11 @@ std::optional<AnnotatedAst::ReturnVoid> FunctionChecker::CheckStatement(
 
 std::optional<AnnotatedAst::Return> FunctionChecker::CheckStatement(
     const ParsedAst::Return& return_statement) {
+  if (parallel_ != nullptr) {
+    checker_->Error(return_statement.location)
+        << "Cannot return from inside a parallel loop.";
+    return std::nullopt;
+  }
   auto value = CheckAnyExpression(return_statement.value);
   if (!value.has_value()) return std::nullopt;
   auto type = AnnotatedAst::GetMeta(*value).type;
@@ -512,15 +758,78 @@ FunctionChecker::CheckStatement(
 
 std::optional<AnnotatedAst::Statement> FunctionChecker::CheckAnyStatement(
     const ParsedAst::Statement& statement) {
+  checker_->nodes_++;
   return statement.visit(
       [&](const auto& x) -> std::optional<AnnotatedAst::Statement> {
         return CheckStatement(x);
       });
 }
 
+const types::Array* FunctionChecker::CheckArray(
+    const ParsedAst::Expression& expression,
+    const std::optional<types::Type>& type) {
+  if (!type.has_value()) return nullptr;
+  const auto* array_type = type->get_if<types::Array>();
+  if (array_type == nullptr) {
+    checker_->Error(ParsedAst::GetMeta(expression).location)
+        << "Expression should be an array, but is actually of type "
+        << util::Detail(*type) << ".";
+  }
+  return array_type;
+}
+
+bool FunctionChecker::CheckIndex(const ParsedAst::Expression& expression,
+                                 const std::optional<types::Type>& type) {
+  if (!type.has_value()) return false;
+  if (*type != types::Primitive::INTEGER) {
+    checker_->Error(ParsedAst::GetMeta(expression).location)
+        << "Array index should be of type "
+        << util::Detail(types::Primitive::INTEGER)
+        << ", but is actually of type " << util::Detail(*type) << ".";
+    return false;
+  }
+  return true;
+}
+
+void FunctionChecker::NoteArrayUse(const ParsedAst::Identifier& variable,
+                                   const types::Type& type,
+                                   const ParsedAst::Expression* index) {
+  if (!type.is<types::Array>()) return;
+  const auto* index_variable =
+      index ? index->get_if<ParsedAst::Identifier>() : nullptr;
+  for (auto* loop = parallel_;
+       loop != nullptr && IsShared(variable.name, *loop); loop = loop->outer) {
+    if (index_variable && IsLoopVariable(index_variable->name, *loop))
+      continue;
+    loop->shared_uses.emplace_back(variable.name, variable.location);
+  }
+}
+
+bool FunctionChecker::IsShared(std::string_view name,
+                               const ParallelLoop& loop) const {
+  for (const Scope* scope = scope_; scope != loop.scope;
+       scope = scope->parent()) {
+    if (scope->Defines(name)) return false;
+  }
+  return !loop.scope->Defines(name);
+}
+
+bool FunctionChecker::IsLoopVariable(std::string_view name,
+                                     const ParallelLoop& loop) const {
+  if (name != loop.variable) return false;
+  for (const Scope* scope = scope_; scope != loop.scope;
+       scope = scope->parent()) {
+    if (scope->Defines(name)) return false;
+  }
+  return true;
+}
+
 std::optional<AnnotatedAst::DefineFunction> Checker::CheckTopLevel(
     const ParsedAst::DefineFunction& definition) {
-  if (!scope_.Define(definition.name,
+  allocations::Scope scope{"FunctionChecker"};
+  nodes_++;
+  if (builtins_.Defines(definition.name) ||
+      !scope_.Define(definition.name,
                      Scope::Entry{definition.location, definition.type})) {
     Error(definition.location)
         << "Redefinition of name " << util::Detail(definition.name)
@@ -529,6 +838,9 @@ std::optional<AnnotatedAst::DefineFunction> Checker::CheckTopLevel(
     Note(previous_entry->location)
         << util::Detail(definition.name) << " previously declared here.";
   }
+  // The signature may mention types which aren't otherwise used.
+  AddType(definition.type.return_type);
+  for (const auto& type : definition.type.parameters) AddType(type);
   Scope function_scope{&scope_};
   assert(definition.parameters.size() == definition.type.parameters.size());
   std::size_t n = definition.parameters.size();
@@ -551,7 +863,16 @@ std::optional<AnnotatedAst::DefineFunction> Checker::CheckTopLevel(
   }
   FunctionChecker function_checker{definition.type, definition.name, this,
                                    &function_scope};
+  prints_ = false;
+  parallel_recursion_.clear();
   auto body = function_checker.CheckStatement(definition.body);
+  if (prints_) {
+    printing_.insert(definition.name);
+    for (const auto& location : parallel_recursion_) {
+      Error(location) << "Parallel loops cannot call "
+                      << util::Detail(definition.name) << ", which may print.";
+    }
+  }
   if (!parameter_error && body.has_value()) {
     return AnnotatedAst::DefineFunction{{},
                                         definition.type,
@@ -592,6 +913,244 @@ Result Check(const ParsedAst::TopLevel& top_level) {
   result.annotated_ast = checker.CheckAnyTopLevel(top_level);
   result.required_types = checker.ConsumeTypes();
   result.diagnostics = checker.ConsumeDiagnostics();
+  result.scopes = checker.scopes();
+  result.nodes = checker.nodes();
+  return result;
+}
+
+namespace {
+
+// The side effects of a function, excluding those of the functions it calls.
+struct Effects {
+  // Parameters which are not values, such as functions, could have effects of
+  // their own.
+  bool value_parameters = true;
+  // Arrays live in memory, so code which handles them reads or writes it.
+  bool uses_memory = false;
+  bool loops = false;
+  std::set<std::string, std::less<>> calls;
+};
+
+class EffectFinder {
+ public:
+  void Visit(const AnnotatedAst::Identifier&) {}
+  void Visit(const AnnotatedAst::Boolean&) {}
+  void Visit(const AnnotatedAst::Integer&) {}
+  void Visit(const AnnotatedAst::ArrayLiteral&);
+  void Visit(const AnnotatedAst::Arithmetic&);
+  void Visit(const AnnotatedAst::Compare&);
+  void Visit(const AnnotatedAst::Logical&);
+  void Visit(const AnnotatedAst::FunctionCall&);
+  void Visit(const AnnotatedAst::LogicalNot&);
+  void Visit(const AnnotatedAst::Index&);
+  void Visit(const AnnotatedAst::Size&);
+  void VisitAny(const AnnotatedAst::Expression&);
+
+  void Visit(const AnnotatedAst::DefineVariable&);
+  void Visit(const AnnotatedAst::Assign&);
+  void Visit(const AnnotatedAst::AssignElement&);
+  void Visit(const AnnotatedAst::DoFunction&);
+  void Visit(const AnnotatedAst::If&);
+  void Visit(const AnnotatedAst::While&);
+  void Visit(const AnnotatedAst::ParallelFor&);
+  void Visit(const AnnotatedAst::ReturnVoid&) {}
+  void Visit(const AnnotatedAst::Return&);
+  void Visit(const std::vector<AnnotatedAst::Statement>&);
+  void VisitAny(const AnnotatedAst::Statement&);
+
+  void Visit(const AnnotatedAst::DefineFunction&);
+
+  const Effects& effects() const { return effects_; }
+
+ private:
+  Effects effects_;
+};
+
+void EffectFinder::Visit(const AnnotatedAst::ArrayLiteral& array) {
+  for (const auto& part : array.parts) VisitAny(part);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Arithmetic& binary) {
+  VisitAny(binary.left);
+  VisitAny(binary.right);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Compare& binary) {
+  VisitAny(binary.left);
+  VisitAny(binary.right);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Logical& binary) {
+  VisitAny(binary.left);
+  VisitAny(binary.right);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::FunctionCall& call) {
+  effects_.calls.insert(call.function);
+  for (const auto& argument : call.arguments) VisitAny(argument);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::LogicalNot& op) {
+  VisitAny(op.argument);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Index& index) {
+  VisitAny(index.array);
+  VisitAny(index.index);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Size& size) {
+  VisitAny(size.array);
+}
+
+void EffectFinder::VisitAny(
+    const AnnotatedAst::Expression& expression) {
+  if (AnnotatedAst::GetMeta(expression).type.is<types::Array>())
+    effects_.uses_memory = true;
+  expression.visit([this](const auto& x) { Visit(x); });
+}
+
+void EffectFinder::Visit(
+    const AnnotatedAst::DefineVariable& definition) {
+  VisitAny(definition.value);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::Assign& assignment) {
+  VisitAny(assignment.value);
+}
+
+void EffectFinder::Visit(
+    const AnnotatedAst::AssignElement& assignment) {
+  effects_.uses_memory = true;
+  VisitAny(assignment.index);
+  VisitAny(assignment.value);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::DoFunction& statement) {
+  Visit(statement.function_call);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::If& if_statement) {
+  VisitAny(if_statement.condition);
+  Visit(if_statement.if_true);
+  Visit(if_statement.if_false);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::While& while_statement) {
+  effects_.loops = true;
+  VisitAny(while_statement.condition);
+  Visit(while_statement.body);
+}
+
+void EffectFinder::Visit(const AnnotatedAst::ParallelFor& parallel_for) {
+  effects_.loops = true;
+  VisitAny(parallel_for.begin);
+  VisitAny(parallel_for.end);
+  Visit(parallel_for.body);
+}
+
+void EffectFinder::Visit(
+    const AnnotatedAst::Return& return_statement) {
+  VisitAny(return_statement.value);
+}
+
+void EffectFinder::Visit(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  for (const auto& statement : statements) VisitAny(statement);
+}
+
+void EffectFinder::VisitAny(
+    const AnnotatedAst::Statement& statement) {
+  statement.visit([this](const auto& x) { Visit(x); });
+}
+
+void EffectFinder::Visit(
+    const AnnotatedAst::DefineFunction& definition) {
+  if (definition.type.return_type.is<types::Array>())
+    effects_.uses_memory = true;
+  for (const auto& parameter : definition.parameters) {
+    if (!IsValueType(parameter.type)) effects_.value_parameters = false;
+    if (parameter.type.is<types::Array>()) effects_.uses_memory = true;
+  }
+  Visit(definition.body);
+}
+
+void AddEffects(const AnnotatedAst::DefineFunction& definition,
+                std::map<std::string, Effects, std::less<>>* effects) {
+  EffectFinder finder;
+  finder.Visit(definition);
+  effects->emplace(definition.name, finder.effects());
+}
+
+void AddEffects(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions,
+    std::map<std::string, Effects, std::less<>>* effects) {
+  for (const auto& definition : definitions) AddEffects(definition, effects);
+}
+
+// Remove every function from the set which calls a function outside of it,
+// until only functions which call nothing but each other remain.
+void RemoveCallers(const std::map<std::string, Effects, std::less<>>& effects,
+                   std::set<std::string, std::less<>>* functions) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto i = functions->begin(); i != functions->end();) {
+      const auto& calls = effects.at(*i).calls;
+      bool closed = std::all_of(calls.begin(), calls.end(), [&](auto& callee) {
+        return functions->count(callee) > 0;
+      });
+      if (closed) {
+        ++i;
+      } else {
+        i = functions->erase(i);
+        changed = true;
+      }
+    }
+  }
+}
+
+// Add every function to the set which calls a function in it, until all of the
+// callers of the functions in the set are in it too.
+void AddCallers(const std::map<std::string, Effects, std::less<>>& effects,
+                std::set<std::string, std::less<>>* functions) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (const auto& [name, function_effects] : effects) {
+      if (functions->count(name)) continue;
+      const auto& calls = function_effects.calls;
+      bool reaches = std::any_of(calls.begin(), calls.end(), [&](auto& callee) {
+        return functions->count(callee) > 0;
+      });
+      if (reaches) {
+        functions->insert(name);
+        changed = true;
+      }
+    }
+  }
+}
+
+}  // namespace
+
+Purity AnalyzePurity(const AnnotatedAst::TopLevel& top_level) {
+  std::map<std::string, Effects, std::less<>> effects;
+  top_level.visit([&](const auto& x) { AddEffects(x, &effects); });
+  // print is a builtin rather than a function in the program, so it is never
+  // in either set and anything which calls it is removed.
+  Purity result;
+  for (const auto& [name, function_effects] : effects) {
+    if (function_effects.value_parameters) result.pure.insert(name);
+    if (function_effects.value_parameters && !function_effects.uses_memory)
+      result.memoryless.insert(name);
+    if (function_effects.calls.count(name)) result.recursive.insert(name);
+    result.calls.emplace(name, function_effects.calls);
+    if (function_effects.loops || function_effects.calls.count(name))
+      result.unbounded.insert(name);
+  }
+  RemoveCallers(effects, &result.pure);
+  RemoveCallers(effects, &result.memoryless);
+  AddCallers(effects, &result.unbounded);
   return result;
 }
 
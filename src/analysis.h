@@ -51,6 +51,9 @@ struct Operators {
   std::set<ArithmeticKey> arithmetic;
   std::set<types::Type> equality_comparable;
   std::set<types::Type> ordered;
+  // Array types whose elements can be compared pairwise, giving an array of
+  // booleans.
+  std::set<types::Type> elementwise_comparable;
 };
 
 class Scope {
@@ -61,16 +64,35 @@ class Scope {
     // contained an an error.
     std::optional<types::Type> type;
   };
-  explicit Scope(Scope* parent = nullptr) : parent_(parent) {}
+  explicit Scope(const Scope* parent = nullptr) : parent_(parent) {}
 
   bool Define(std::string name, Entry entry);
   const Entry* Lookup(std::string_view name) const;
+  // Whether the name is defined in this scope rather than an enclosing one.
+  bool Defines(std::string_view name) const;
+  const Scope* parent() const { return parent_; }
 
  private:
   const Scope* parent_ = nullptr;
   std::map<std::string, Entry, std::less<>> bindings_;
 };
 
+// A parallel loop whose body is being checked. Variables which are defined
+// outside of the loop are shared by every iteration, so the iterations may
+// only read them, except that each iteration may assign to its own element of
+// a shared array: the element whose index is the loop variable.
+struct ParallelLoop {
+  // The scope of the loop body, which defines the loop variable.
+  const Scope* scope;
+  std::string variable;
+  ParallelLoop* outer;
+  // Shared arrays which the iterations assign elements of.
+  std::map<std::string, Reader::Location, std::less<>> written;
+  // Uses of shared arrays which may touch elements belonging to other
+  // iterations. None of these arrays may be written.
+  std::vector<std::pair<std::string, Reader::Location>> shared_uses;
+};
+
 class Checker {
  public:
   Checker();
@@ -89,24 +111,46 @@ class Checker {
 
   std::vector<Message> ConsumeDiagnostics() { return std::move(diagnostics_); }
   std::vector<types::Type> ConsumeTypes() { return std::move(types_); }
+  std::size_t scopes() const { return scopes_; }
+  std::size_t nodes() const { return nodes_; }
 
  private:
   friend class MessageBuilder;
   friend class FunctionChecker;
 
-  const Operators operators_;
+  // Shared with every other checker, so these are never modified.
+  const Operators& operators_;
+  const Scope& builtins_;
   std::vector<Message> diagnostics_;
   std::vector<types::Type> types_;
+  // The global scope, whose parent is the builtin scope.
   Scope scope_;
+  // Functions which may print, directly or through the functions they call.
+  // Functions can only call themselves or functions defined before them, so
+  // the set is complete for every function which the current one can call
+  // except itself.
+  std::set<std::string, std::less<>> printing_;
+  // Whether the current function may print, and the calls it makes to itself
+  // from parallel loops, which are only allowed if it doesn't.
+  bool prints_ = false;
+  std::vector<Reader::Location> parallel_recursion_;
+  // The number of scopes created, including the global scope, and the number
+  // of expressions, statements and functions checked.
+  std::size_t scopes_ = 1;
+  std::size_t nodes_ = 0;
 };
 
 class FunctionChecker {
  public:
   FunctionChecker(types::Function type, std::string this_function,
-                  Checker* checker, Scope* scope)
+                  Checker* checker, Scope* scope,
+                  ParallelLoop* parallel = nullptr)
       : type_(std::move(type)),
         this_function_(std::move(this_function)),
-        checker_(checker), scope_(scope) {}
+        checker_(checker), scope_(scope), parallel_(parallel) {
+    // Each scope is checked by a FunctionChecker of its own.
+    checker_->scopes_++;
+  }
 
   std::optional<AnnotatedAst::Identifier> CheckExpression(
       const ParsedAst::Identifier&);
@@ -126,16 +170,22 @@ class FunctionChecker {
       const ParsedAst::FunctionCall&);
   std::optional<AnnotatedAst::LogicalNot> CheckExpression(
       const ParsedAst::LogicalNot&);
+  std::optional<AnnotatedAst::Index> CheckExpression(const ParsedAst::Index&);
+  std::optional<AnnotatedAst::Size> CheckExpression(const ParsedAst::Size&);
   std::optional<AnnotatedAst::Expression> CheckAnyExpression(
       const ParsedAst::Expression&);
 
   std::optional<AnnotatedAst::DefineVariable> CheckStatement(
       const ParsedAst::DefineVariable&);
   std::optional<AnnotatedAst::Assign> CheckStatement(const ParsedAst::Assign&);
+  std::optional<AnnotatedAst::AssignElement> CheckStatement(
+      const ParsedAst::AssignElement&);
   std::optional<AnnotatedAst::DoFunction> CheckStatement(
       const ParsedAst::DoFunction&);
   std::optional<AnnotatedAst::If> CheckStatement(const ParsedAst::If&);
   std::optional<AnnotatedAst::While> CheckStatement(const ParsedAst::While&);
+  std::optional<AnnotatedAst::ParallelFor> CheckStatement(
+      const ParsedAst::ParallelFor&);
   std::optional<AnnotatedAst::ReturnVoid> CheckStatement(
       const ParsedAst::ReturnVoid&);
   std::optional<AnnotatedAst::Return> CheckStatement(const ParsedAst::Return&);
@@ -145,17 +195,64 @@ class FunctionChecker {
       const ParsedAst::Statement&);
 
  private:
+  // Check that the expression is an array, yielding the array type if so.
+  const types::Array* CheckArray(const ParsedAst::Expression& expression,
+                                 const std::optional<types::Type>& type);
+  // Check that the expression is an integer which can be used as an index.
+  bool CheckIndex(const ParsedAst::Expression& expression,
+                  const std::optional<types::Type>& type);
+  // Look up a variable which is being read.
+  std::optional<AnnotatedAst::Identifier> CheckVariable(
+      const ParsedAst::Identifier&);
+  // Record a use of an array variable for each enclosing parallel loop which
+  // shares it, unless the use is confined to the element at the given index
+  // and that index is the variable of the loop.
+  void NoteArrayUse(const ParsedAst::Identifier& variable,
+                    const types::Type& type,
+                    const ParsedAst::Expression* index);
+  // Whether the variable is defined outside of the given enclosing loop.
+  bool IsShared(std::string_view name, const ParallelLoop& loop) const;
+  // Whether the name refers to the variable of the given enclosing loop.
+  bool IsLoopVariable(std::string_view name, const ParallelLoop& loop) const;
+
   types::Function type_;
   std::string this_function_;
   Checker* checker_;
   Scope* scope_;
+  // The innermost parallel loop containing the code being checked, if any.
+  ParallelLoop* parallel_;
 };
 
 struct Result {
   std::vector<types::Type> required_types;
   std::optional<AnnotatedAst::TopLevel> annotated_ast;
   std::vector<Message> diagnostics;
+  // How much work checking took.
+  std::size_t scopes = 0;
+  std::size_t nodes = 0;
 };
 Result Check(const ParsedAst::TopLevel&);
 
+// Facts about which functions in a checked program have side effects. Calls
+// to print are the only observable effect a program can have, besides its
+// result.
+struct Purity {
+  // Functions whose result depends only on their arguments and which have no
+  // other effect: every parameter has a value type, and they never print or
+  // call a function which is not pure.
+  std::set<std::string, std::less<>> pure;
+  // Pure functions which additionally handle no arrays, so they neither read
+  // nor write any memory besides their own stack.
+  std::set<std::string, std::less<>> memoryless;
+  // Functions which call themselves. A function can only call functions which
+  // are defined before it, so it can't call itself through other functions.
+  std::set<std::string, std::less<>> recursive;
+  // The functions which each function calls directly.
+  std::map<std::string, std::set<std::string, std::less<>>, std::less<>> calls;
+  // Functions which loop, recurse, or call a function which does, so that the
+  // time a call takes is not bounded by the size of the function.
+  std::set<std::string, std::less<>> unbounded;
+};
+Purity AnalyzePurity(const AnnotatedAst::TopLevel&);
+
 }  // namespace analysis
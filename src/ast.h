@@ -49,9 +49,11 @@ struct Ast {
   struct Logical;
   struct FunctionCall;
   struct LogicalNot;
+  struct Index;
+  struct Size;
   using Expression =
       one_of<Identifier, Boolean, Integer, ArrayLiteral, Arithmetic, Compare,
-             Logical, FunctionCall, LogicalNot>;
+             Logical, FunctionCall, LogicalNot, Index, Size>;
 
   struct Identifier : ExpressionMetadata {
     std::string name;
@@ -93,15 +95,26 @@ struct Ast {
     Expression argument;
   };
 
+  struct Index : ExpressionMetadata {
+    Expression array, index;
+  };
+
+  // The number of elements in an array.
+  struct Size : ExpressionMetadata {
+    Expression array;
+  };
+
   struct DefineVariable;
   struct Assign;
+  struct AssignElement;
   struct DoFunction;
   struct If;
   struct While;
+  struct ParallelFor;
   struct ReturnVoid;
   struct Return;
-  using Statement =
-      one_of<DefineVariable, Assign, DoFunction, If, While, ReturnVoid, Return>;
+  using Statement = one_of<DefineVariable, Assign, AssignElement, DoFunction,
+                          If, While, ParallelFor, ReturnVoid, Return>;
 
   struct DefineVariable : StatementMetadata {
     Identifier variable;
@@ -113,6 +126,11 @@ struct Ast {
     Expression value;
   };
 
+  struct AssignElement : StatementMetadata {
+    Identifier variable;
+    Expression index, value;
+  };
+
   struct DoFunction : StatementMetadata {
     FunctionCall function_call;
   };
@@ -127,6 +145,15 @@ struct Ast {
     std::vector<Statement> body;
   };
 
+  // Runs the body once for each integer from begin up to but excluding end.
+  // The iterations are independent of each other, so they may run in any
+  // order or at the same time.
+  struct ParallelFor : StatementMetadata {
+    Identifier variable;
+    Expression begin, end;
+    std::vector<Statement> body;
+  };
+
   struct ReturnVoid : StatementMetadata {};
 
   struct Return : StatementMetadata {
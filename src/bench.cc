@@ -0,0 +1,388 @@
+#include "analysis.h"
+#include "bounds.h"
+#include "optimize.h"
+#include "ownership.h"
+#include "parser.h"
+#include "reader.h"
+#include "synthetic.h"
+#include "target-c.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+// Hardware counters for the work done by this thread in user space, from
+// perf_event_open. Counters which the kernel or the processor does not
+// support are left out, which is all of them in most containers.
+class Counters {
+ public:
+  Counters();
+  ~Counters();
+  Counters(const Counters&) = delete;
+  Counters& operator=(const Counters&) = delete;
+
+  std::vector<std::string> names() const;
+  void Start();
+  // Stop counting, and return the counts since Start in the order of names.
+  std::vector<std::uint64_t> Stop();
+
+ private:
+  struct Event {
+    std::string name;
+    int descriptor;
+  };
+  std::vector<Event> events_;
+};
+
+Counters::Counters() {
+  constexpr std::pair<const char*, std::uint64_t> kEvents[] = {
+      {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+      {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES},
+      {"cache-misses", PERF_COUNT_HW_CACHE_MISSES},
+  };
+  for (const auto& [name, config] : kEvents) {
+    perf_event_attr attributes = {};
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    const long descriptor = syscall(SYS_perf_event_open, &attributes, 0, -1,
+                                    -1, PERF_FLAG_FD_CLOEXEC);
+    if (descriptor >= 0) {
+      events_.push_back(Event{name, static_cast<int>(descriptor)});
+    }
+  }
+}
+
+Counters::~Counters() {
+  for (const auto& event : events_) close(event.descriptor);
+}
+
+std::vector<std::string> Counters::names() const {
+  std::vector<std::string> names;
+  for (const auto& event : events_) names.push_back(event.name);
+  return names;
+}
+
+void Counters::Start() {
+  for (const auto& event : events_) {
+    ioctl(event.descriptor, PERF_EVENT_IOC_RESET, 0);
+    ioctl(event.descriptor, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+std::vector<std::uint64_t> Counters::Stop() {
+  for (const auto& event : events_) {
+    ioctl(event.descriptor, PERF_EVENT_IOC_DISABLE, 0);
+  }
+  std::vector<std::uint64_t> counts;
+  for (const auto& event : events_) {
+    std::uint64_t count = 0;
+    if (read(event.descriptor, &count, sizeof(count)) != sizeof(count)) {
+      count = 0;
+    }
+    counts.push_back(count);
+  }
+  return counts;
+}
+
+struct Options {
+  std::size_t repetitions = 10;
+  std::size_t warmup = 2;
+};
+
+// The times of one stage over every repetition, and the mean of each counter.
+struct Stage {
+  std::string name;
+  std::vector<double> milliseconds;
+  std::vector<double> counts;
+};
+
+template <typename Function>
+Stage Measure(std::string name, const Options& options, Counters* counters,
+              Function function) {
+  for (std::size_t i = 0; i < options.warmup; i++) function();
+  Stage stage{std::move(name), {}, {}};
+  stage.counts.resize(counters->names().size());
+  for (std::size_t i = 0; i < options.repetitions; i++) {
+    counters->Start();
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    const auto end = std::chrono::steady_clock::now();
+    const auto counts = counters->Stop();
+    stage.milliseconds.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+    for (std::size_t j = 0; j < counts.size(); j++) {
+      stage.counts[j] += static_cast<double>(counts[j]) /
+                         static_cast<double>(options.repetitions);
+    }
+  }
+  return stage;
+}
+
+struct Statistics {
+  double min, median, mean, deviation, max;
+};
+
+Statistics Summarize(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  const auto n = static_cast<double>(samples.size());
+  double total = 0;
+  for (double sample : samples) total += sample;
+  const double mean = total / n;
+  double squares = 0;
+  for (double sample : samples) squares += (sample - mean) * (sample - mean);
+  const std::size_t middle = samples.size() / 2;
+  const double median = samples.size() % 2
+                            ? samples[middle]
+                            : (samples[middle - 1] + samples[middle]) / 2;
+  return Statistics{samples.front(), median, mean,
+                    samples.size() > 1 ? std::sqrt(squares / (n - 1)) : 0,
+                    samples.back()};
+}
+
+struct Result {
+  std::string name;
+  synthetic::Shape shape;
+  std::size_t bytes;
+  std::vector<Stage> stages;
+};
+
+// Measure the parser, the checker and the C code generator on a program of
+// the given shape. The code generator is given the same optimized program as
+// gel would give it at -O1.
+std::optional<Result> Run(std::string name, const synthetic::Shape& shape,
+                          const Options& options, Counters* counters) {
+  const std::string source = synthetic::Generate(shape);
+  Result result{std::move(name), shape, source.size(), {}};
+  auto parse = [&] {
+    Reader reader{"synthetic", source};
+    Parser parser{reader};
+    auto program = parser.ParseProgram();
+    parser.CheckEnd();
+    return program;
+  };
+  const auto program = parse();
+  const auto checked = analysis::Check(program);
+  for (const auto& message : checked.diagnostics) {
+    if (message.type != Message::Type::ERROR) continue;
+    // The generator only makes valid programs, so this is a bug in one or
+    // the other.
+    std::cerr << "Generated program for " << result.name << " is invalid:\n";
+    for (const auto& diagnostic : checked.diagnostics) std::cerr << diagnostic;
+    return std::nullopt;
+  }
+  const auto optimized = optimize::Optimize(checked.annotated_ast.value());
+  const auto ownership_info = ownership::Analyze(optimized);
+  const auto bounds_info = bounds::Analyze(optimized);
+  target::c::Options compile_options;
+  compile_options.memoize = true;
+  result.stages.push_back(Measure("parse", options, counters, parse));
+  result.stages.push_back(Measure("check", options, counters, [&] {
+    return analysis::Check(program);
+  }));
+  result.stages.push_back(Measure("compile", options, counters, [&] {
+    std::ostringstream output;
+    target::c::Compile(checked.required_types, optimized, ownership_info,
+                       bounds_info, compile_options, &output);
+    return output.str();
+  }));
+  return result;
+}
+
+void PrintTable(const Result& result, const std::vector<std::string>& names) {
+  const auto& shape = result.shape;
+  std::cout << result.name << ": " << shape.functions << " functions, "
+            << shape.statements << " statements, depth " << shape.depth
+            << ", arrays of " << shape.array_size << " nested "
+            << shape.nesting << " deep, " << result.bytes << " bytes\n";
+  std::cout << std::left << std::setw(10) << "  Stage" << std::right;
+  for (const char* column : {"Min (ms)", "Median (ms)", "Mean (ms)",
+                             "Stddev (ms)", "Max (ms)"}) {
+    std::cout << std::setw(13) << column;
+  }
+  for (const auto& name : names) std::cout << std::setw(15) << name;
+  std::cout << '\n' << std::fixed << std::setprecision(3);
+  for (const auto& stage : result.stages) {
+    const auto statistics = Summarize(stage.milliseconds);
+    std::cout << "  " << std::left << std::setw(8) << stage.name << std::right
+              << std::setw(13) << statistics.min << std::setw(13)
+              << statistics.median << std::setw(13) << statistics.mean
+              << std::setw(13) << statistics.deviation << std::setw(13)
+              << statistics.max << std::setprecision(0);
+    for (double count : stage.counts) std::cout << std::setw(15) << count;
+    std::cout << std::setprecision(3) << '\n';
+  }
+  std::cout << '\n';
+}
+
+void PrintJson(std::ostream& output, const std::vector<Result>& results,
+               const Options& options, const std::vector<std::string>& names) {
+  output << std::fixed << std::setprecision(6) << "{\"repetitions\": "
+         << options.repetitions << ", \"warmup\": " << options.warmup
+         << ", \"counters\": [";
+  for (std::size_t i = 0; i < names.size(); i++) {
+    output << (i ? ", " : "") << '"' << names[i] << '"';
+  }
+  output << "], \"results\": [";
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const auto& result = results[i];
+    const auto& shape = result.shape;
+    output << (i ? ",\n" : "\n") << "  {\"shape\": \"" << result.name
+           << "\", \"functions\": " << shape.functions
+           << ", \"statements\": " << shape.statements
+           << ", \"depth\": " << shape.depth
+           << ", \"array_size\": " << shape.array_size
+           << ", \"nesting\": " << shape.nesting << ", \"seed\": " << shape.seed
+           << ", \"bytes\": " << result.bytes << ", \"stages\": [";
+    for (std::size_t j = 0; j < result.stages.size(); j++) {
+      const auto& stage = result.stages[j];
+      const auto statistics = Summarize(stage.milliseconds);
+      output << (j ? ",\n" : "\n") << "    {\"stage\": \"" << stage.name
+             << "\", \"min_ms\": " << statistics.min
+             << ", \"median_ms\": " << statistics.median
+             << ", \"mean_ms\": " << statistics.mean
+             << ", \"stddev_ms\": " << statistics.deviation
+             << ", \"max_ms\": " << statistics.max << ", \"counters\": {";
+      for (std::size_t k = 0; k < names.size(); k++) {
+        output << (k ? ", " : "") << '"' << names[k]
+               << "\": " << stage.counts[k];
+      }
+      output << "}}";
+    }
+    output << "]}";
+  }
+  output << "\n]}\n";
+}
+
+// Shapes which each stress a different part of the compiler, measured when
+// no shape is given on the command line.
+std::vector<std::pair<std::string, synthetic::Shape>> Suite() {
+  synthetic::Shape many_functions;
+  many_functions.functions = 1000;
+  many_functions.statements = 5;
+  many_functions.depth = 2;
+  synthetic::Shape long_functions;
+  long_functions.functions = 10;
+  long_functions.statements = 500;
+  synthetic::Shape deep_expressions;
+  deep_expressions.functions = 20;
+  deep_expressions.depth = 8;
+  synthetic::Shape nested_arrays;
+  nested_arrays.functions = 20;
+  nested_arrays.depth = 2;
+  nested_arrays.array_size = 6;
+  nested_arrays.nesting = 3;
+  return {{"default", synthetic::Shape{}},
+          {"many-functions", many_functions},
+          {"long-functions", long_functions},
+          {"deep-expressions", deep_expressions},
+          {"nested-arrays", nested_arrays}};
+}
+
+template <typename T>
+bool ParseNumber(std::string_view text, T* value) {
+  const auto end = text.data() + text.size();
+  const auto [parsed, error] = std::from_chars(text.data(), end, *value);
+  return error == std::errc{} && parsed == end;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // With no options, every shape in the suite is measured. Any of the shape
+  // options measures a single program of that shape instead, and --emit
+  // prints that program rather than measuring anything.
+  Options options;
+  synthetic::Shape shape;
+  bool custom = false;
+  bool emit = false;
+  std::string json;
+  const std::map<std::string_view, std::size_t*> shape_options = {
+      {"--functions=", &shape.functions},
+      {"--statements=", &shape.statements},
+      {"--depth=", &shape.depth},
+      {"--array-size=", &shape.array_size},
+      {"--nesting=", &shape.nesting},
+  };
+  for (int i = 1; i < argc; i++) {
+    const std::string_view argument = argv[i];
+    const auto equals = argument.find('=');
+    const auto name = argument.substr(
+        0, equals == std::string_view::npos ? argument.size() : equals + 1);
+    const auto value =
+        equals == std::string_view::npos ? "" : argument.substr(equals + 1);
+    bool valid = true;
+    if (argument == "--emit") {
+      emit = true;
+    } else if (auto j = shape_options.find(name); j != shape_options.end()) {
+      valid = ParseNumber(value, j->second);
+      custom = true;
+    } else if (name == "--seed=") {
+      valid = ParseNumber(value, &shape.seed);
+      custom = true;
+    } else if (name == "--repetitions=") {
+      valid = ParseNumber(value, &options.repetitions) &&
+              options.repetitions > 0;
+    } else if (name == "--warmup=") {
+      valid = ParseNumber(value, &options.warmup);
+    } else if (name == "--json=" && !value.empty()) {
+      json = std::string{value};
+    } else {
+      std::cerr << "Unknown option: " << argument << '\n';
+      return 1;
+    }
+    if (!valid) {
+      std::cerr << "Invalid value: " << argument << '\n';
+      return 1;
+    }
+  }
+  if (emit) {
+    std::cout << synthetic::Generate(shape);
+    return 0;
+  }
+  auto shapes = custom ? decltype(Suite()){{"custom", shape}} : Suite();
+  Counters counters;
+  const auto names = counters.names();
+  if (names.empty()) {
+    std::cerr << "Hardware counters are not available.\n";
+  }
+  std::vector<Result> results;
+  for (const auto& [shape_name, shape_value] : shapes) {
+    auto result = Run(shape_name, shape_value, options, &counters);
+    if (!result) return 1;
+    PrintTable(*result, names);
+    results.push_back(std::move(*result));
+  }
+  if (!json.empty()) {
+    std::ofstream file{json};
+    PrintJson(file, results, options, names);
+    if (!file) {
+      std::cerr << "Failed to write " << json << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
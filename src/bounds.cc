@@ -0,0 +1,559 @@
+#include "bounds.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+namespace bounds {
+namespace {
+
+using AnnotatedAst = analysis::AnnotatedAst;
+using Names = std::set<std::string, std::less<>>;
+// Additions which are known not to overflow.
+using Increments = std::set<const AnnotatedAst::Arithmetic*>;
+
+// Finds the integer variables in a function which can never hold a negative
+// value. A variable qualifies if every value assigned to it is non-negative,
+// assuming that the same is true for every other qualifying variable. The
+// analysis starts by assuming that every candidate qualifies and removes
+// variables which fail the test until nothing changes. Variables are tracked by
+// name, so only names which are defined exactly once in the function are
+// candidates. Sums and products of non-negative values can overflow, so they
+// only qualify where the range analysis has shown that they can't.
+class SignAnalysis {
+ public:
+  void AnalyzeStatement(const AnnotatedAst::DefineVariable&);
+  void AnalyzeStatement(const AnnotatedAst::Assign&);
+  void AnalyzeStatement(const AnnotatedAst::AssignElement&);
+  void AnalyzeStatement(const AnnotatedAst::DoFunction&);
+  void AnalyzeStatement(const AnnotatedAst::If&);
+  void AnalyzeStatement(const AnnotatedAst::While&);
+  void AnalyzeStatement(const AnnotatedAst::ParallelFor&);
+  void AnalyzeStatement(const AnnotatedAst::ReturnVoid&);
+  void AnalyzeStatement(const AnnotatedAst::Return&);
+  void AnalyzeStatement(const std::vector<AnnotatedAst::Statement>&);
+  void AnalyzeAnyStatement(const AnnotatedAst::Statement&);
+
+  void AnalyzeTopLevel(const AnnotatedAst::DefineFunction&);
+
+  // Names which are defined exactly once in the function.
+  Names Unique() const;
+  // Find the integer variables which are never negative, given the additions
+  // which can't overflow.
+  void Solve(const Increments& increments);
+  // Integer variables which are never negative.
+  const Names& NonNegative() const { return non_negative_; }
+
+ private:
+  bool IsNonNegative(const AnnotatedAst::Expression&) const;
+
+  const Increments* increments_ = nullptr;
+  std::map<std::string, int, std::less<>> definitions_;
+  // Every value which is assigned to each integer variable.
+  std::map<std::string, std::vector<const AnnotatedAst::Expression*>,
+           std::less<>>
+      values_;
+  Names non_negative_;
+};
+
+void SignAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DefineVariable& definition) {
+  definitions_[definition.variable.name]++;
+  if (definition.variable.type == types::Primitive::INTEGER)
+    values_[definition.variable.name].push_back(&definition.value);
+}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::Assign& assignment) {
+  if (assignment.variable.type == types::Primitive::INTEGER)
+    values_[assignment.variable.name].push_back(&assignment.value);
+}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::AssignElement&) {}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::DoFunction&) {}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::If& if_statement) {
+  AnalyzeStatement(if_statement.if_true);
+  AnalyzeStatement(if_statement.if_false);
+}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::While& while_statement) {
+  AnalyzeStatement(while_statement.body);
+}
+
+// The loop variable only counts up from the start of the range.
+void SignAnalysis::AnalyzeStatement(
+    const AnnotatedAst::ParallelFor& parallel_for) {
+  definitions_[parallel_for.variable.name]++;
+  values_[parallel_for.variable.name].push_back(&parallel_for.begin);
+  AnalyzeStatement(parallel_for.body);
+}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::ReturnVoid&) {}
+
+void SignAnalysis::AnalyzeStatement(const AnnotatedAst::Return&) {}
+
+void SignAnalysis::AnalyzeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  for (const auto& statement : statements) AnalyzeAnyStatement(statement);
+}
+
+void SignAnalysis::AnalyzeAnyStatement(
+    const AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { AnalyzeStatement(x); });
+}
+
+void SignAnalysis::AnalyzeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  for (const auto& parameter : definition.parameters)
+    definitions_[parameter.name]++;
+  AnalyzeStatement(definition.body);
+  for (const auto& [name, values] : values_) {
+    if (definitions_[name] == 1) non_negative_.insert(name);
+  }
+  // Parameters can hold any value, so they are never candidates.
+  for (const auto& parameter : definition.parameters)
+    non_negative_.erase(parameter.name);
+}
+
+void SignAnalysis::Solve(const Increments& increments) {
+  increments_ = &increments;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto i = non_negative_.begin(); i != non_negative_.end();) {
+      const auto& values = values_.at(*i);
+      auto valid = [&](auto* value) { return IsNonNegative(*value); };
+      if (std::all_of(values.begin(), values.end(), valid)) {
+        ++i;
+      } else {
+        i = non_negative_.erase(i);
+        changed = true;
+      }
+    }
+  }
+}
+
+Names SignAnalysis::Unique() const {
+  Names result;
+  for (const auto& [name, count] : definitions_) {
+    if (count == 1) result.insert(name);
+  }
+  return result;
+}
+
+bool SignAnalysis::IsNonNegative(
+    const AnnotatedAst::Expression& expression) const {
+  if (const auto* integer = expression.get_if<AnnotatedAst::Integer>())
+    return integer->value >= 0;
+  if (const auto* identifier = expression.get_if<AnnotatedAst::Identifier>())
+    return non_negative_.count(identifier->name) > 0;
+  if (expression.is<AnnotatedAst::Size>()) return true;
+  if (const auto* binary = expression.get_if<AnnotatedAst::Arithmetic>()) {
+    switch (binary->operation) {
+      case ast::Arithmetic::ADD:
+        return increments_->count(binary) && IsNonNegative(binary->left) &&
+               IsNonNegative(binary->right);
+      case ast::Arithmetic::DIVIDE:
+        return IsNonNegative(binary->left) && IsNonNegative(binary->right);
+      case ast::Arithmetic::MULTIPLY:
+      case ast::Arithmetic::SUBTRACT:
+        return false;
+    }
+  }
+  return false;
+}
+
+// Relationships between variables which hold at a point in the program.
+struct Facts {
+  // Pairs (i, a) such that i < size(a).
+  std::set<std::pair<std::string, std::string>> less_than_size;
+  // Pairs (n, a) such that n == size(a).
+  std::set<std::pair<std::string, std::string>> size_of;
+
+  // Discard all facts involving the named variable, because it has changed.
+  void Forget(std::string_view name);
+  // The facts which hold in both of the given states.
+  static Facts Intersect(const Facts& left, const Facts& right);
+
+  bool operator==(const Facts& other) const {
+    return less_than_size == other.less_than_size && size_of == other.size_of;
+  }
+  bool operator!=(const Facts& other) const { return !(*this == other); }
+};
+
+void Facts::Forget(std::string_view name) {
+  for (auto* facts : {&less_than_size, &size_of}) {
+    for (auto i = facts->begin(); i != facts->end();) {
+      if (i->first == name || i->second == name) {
+        i = facts->erase(i);
+      } else {
+        ++i;
+      }
+    }
+  }
+}
+
+Facts Facts::Intersect(const Facts& left, const Facts& right) {
+  Facts result;
+  std::set_intersection(
+      left.less_than_size.begin(), left.less_than_size.end(),
+      right.less_than_size.begin(), right.less_than_size.end(),
+      std::inserter(result.less_than_size, result.less_than_size.end()));
+  std::set_intersection(left.size_of.begin(), left.size_of.end(),
+                        right.size_of.begin(), right.size_of.end(),
+                        std::inserter(result.size_of, result.size_of.end()));
+  return result;
+}
+
+bool EndsWithReturn(const std::vector<AnnotatedAst::Statement>& statements) {
+  if (statements.empty()) return false;
+  return statements.back().is<AnnotatedAst::ReturnVoid>() ||
+         statements.back().is<AnnotatedAst::Return>();
+}
+
+// Forward analysis which tracks comparisons between indices and array sizes.
+// Conditions of if and while statements establish facts such as `i < size(a)`
+// which remain true until either variable is modified. An access a[i] is in
+// bounds if that fact holds and i is never negative.
+class RangeAnalysis {
+ public:
+  explicit RangeAnalysis(Info* info) : info_(info) {}
+
+  void AnalyzeExpression(const AnnotatedAst::Identifier&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Boolean&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Integer&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::ArrayLiteral&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Arithmetic&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Compare&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Logical&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::FunctionCall&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::LogicalNot&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Index&, const Facts&);
+  void AnalyzeExpression(const AnnotatedAst::Size&, const Facts&);
+  void AnalyzeAnyExpression(const AnnotatedAst::Expression&, const Facts&);
+
+  void AnalyzeStatement(const AnnotatedAst::DefineVariable&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::Assign&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::AssignElement&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::DoFunction&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::If&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::While&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::ParallelFor&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::ReturnVoid&, Facts* facts);
+  void AnalyzeStatement(const AnnotatedAst::Return&, Facts* facts);
+  void AnalyzeStatement(const std::vector<AnnotatedAst::Statement>&,
+                        Facts* facts);
+  void AnalyzeAnyStatement(const AnnotatedAst::Statement&, Facts* facts);
+
+  void AnalyzeTopLevel(const AnnotatedAst::DefineFunction&);
+  void AnalyzeTopLevel(const std::vector<AnnotatedAst::DefineFunction>&);
+  void AnalyzeAnyTopLevel(const AnnotatedAst::TopLevel&);
+
+ private:
+  // Add the facts implied by the condition having the given value.
+  void Assume(const AnnotatedAst::Expression& condition, bool value,
+              Facts* facts) const;
+  // Add the facts implied by `left < right`.
+  void AssumeLessThan(const AnnotatedAst::Expression& left,
+                      const AnnotatedAst::Expression& right,
+                      Facts* facts) const;
+  bool InBounds(std::string_view array, const AnnotatedAst::Expression& index,
+                const Facts& facts) const;
+  // Whether the expression is `i + 1` where i is less than the size of an
+  // array, so the sum is at most the size and can't overflow.
+  bool IsIncrement(const AnnotatedAst::Arithmetic& binary,
+                   const Facts& facts) const;
+
+  Info* info_;
+  // Properties of the function being analysed.
+  Names unique_;
+  Names non_negative_;
+  Increments increments_;
+  // Loops are analysed repeatedly until the facts reach a fixed point. Accesses
+  // are only recorded once the final facts are known.
+  bool record_ = true;
+};
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Identifier&,
+                                      const Facts&) {}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Boolean&,
+                                      const Facts&) {}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Integer&,
+                                      const Facts&) {}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::ArrayLiteral& array,
+                                      const Facts& facts) {
+  for (const auto& part : array.parts) AnalyzeAnyExpression(part, facts);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Arithmetic& binary,
+                                      const Facts& facts) {
+  AnalyzeAnyExpression(binary.left, facts);
+  AnalyzeAnyExpression(binary.right, facts);
+  if (record_ && IsIncrement(binary, facts)) increments_.insert(&binary);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Compare& binary,
+                                      const Facts& facts) {
+  AnalyzeAnyExpression(binary.left, facts);
+  AnalyzeAnyExpression(binary.right, facts);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Logical& binary,
+                                      const Facts& facts) {
+  // The right hand side is only evaluated if the left hand side didn't decide
+  // the result, as in `i < size(a) && a[i] == 0`.
+  AnalyzeAnyExpression(binary.left, facts);
+  Facts right = facts;
+  Assume(binary.left, binary.operation == ast::Logical::AND, &right);
+  AnalyzeAnyExpression(binary.right, right);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::FunctionCall& call,
+                                      const Facts& facts) {
+  for (const auto& argument : call.arguments)
+    AnalyzeAnyExpression(argument, facts);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::LogicalNot& op,
+                                      const Facts& facts) {
+  AnalyzeAnyExpression(op.argument, facts);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Index& index,
+                                      const Facts& facts) {
+  AnalyzeAnyExpression(index.array, facts);
+  AnalyzeAnyExpression(index.index, facts);
+  const auto* array = index.array.get_if<AnnotatedAst::Identifier>();
+  if (record_ && array && InBounds(array->name, index.index, facts))
+    info_->loads.insert(&index);
+}
+
+void RangeAnalysis::AnalyzeExpression(const AnnotatedAst::Size& size,
+                                      const Facts& facts) {
+  AnalyzeAnyExpression(size.array, facts);
+}
+
+void RangeAnalysis::AnalyzeAnyExpression(
+    const AnnotatedAst::Expression& expression, const Facts& facts) {
+  expression.visit([&](const auto& x) { AnalyzeExpression(x, facts); });
+}
+
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DefineVariable& definition, Facts* facts) {
+  AnalyzeAnyExpression(definition.value, *facts);
+  const auto& name = definition.variable.name;
+  facts->Forget(name);
+  const auto* size = definition.value.get_if<AnnotatedAst::Size>();
+  if (!size || !unique_.count(name)) return;
+  const auto* array = size->array.get_if<AnnotatedAst::Identifier>();
+  if (array && unique_.count(array->name))
+    facts->size_of.emplace(name, array->name);
+}
+
+void RangeAnalysis::AnalyzeStatement(const AnnotatedAst::Assign& assignment,
+                                     Facts* facts) {
+  AnalyzeAnyExpression(assignment.value, *facts);
+  facts->Forget(assignment.variable.name);
+}
+
+// Assigning to an element doesn't change the size of the array.
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::AssignElement& assignment, Facts* facts) {
+  AnalyzeAnyExpression(assignment.index, *facts);
+  AnalyzeAnyExpression(assignment.value, *facts);
+  if (record_ &&
+      InBounds(assignment.variable.name, assignment.index, *facts)) {
+    info_->stores.insert(&assignment);
+  }
+}
+
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DoFunction& do_function, Facts* facts) {
+  AnalyzeExpression(do_function.function_call, *facts);
+}
+
+void RangeAnalysis::AnalyzeStatement(const AnnotatedAst::If& if_statement,
+                                     Facts* facts) {
+  AnalyzeAnyExpression(if_statement.condition, *facts);
+  Facts if_true = *facts;
+  Assume(if_statement.condition, true, &if_true);
+  AnalyzeStatement(if_statement.if_true, &if_true);
+  Facts if_false = std::move(*facts);
+  Assume(if_statement.condition, false, &if_false);
+  AnalyzeStatement(if_statement.if_false, &if_false);
+  // A branch which returns doesn't reach the code after the if statement.
+  if (EndsWithReturn(if_statement.if_true)) {
+    *facts = std::move(if_false);
+  } else if (EndsWithReturn(if_statement.if_false)) {
+    *facts = std::move(if_true);
+  } else {
+    *facts = Facts::Intersect(if_true, if_false);
+  }
+}
+
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::While& while_statement, Facts* facts) {
+  // Facts only hold at the head of the loop if they hold on entry and at the
+  // end of the body. Iterate to find the largest set satisfying this.
+  auto body = [&](const Facts& head) {
+    AnalyzeAnyExpression(while_statement.condition, head);
+    Facts result = head;
+    Assume(while_statement.condition, true, &result);
+    AnalyzeStatement(while_statement.body, &result);
+    return result;
+  };
+  const bool record = record_;
+  record_ = false;
+  Facts head = std::move(*facts);
+  Facts next = Facts::Intersect(head, body(head));
+  while (next != head) {
+    head = std::move(next);
+    next = Facts::Intersect(head, body(head));
+  }
+  record_ = record;
+  body(head);
+  Assume(while_statement.condition, false, &head);
+  *facts = std::move(head);
+}
+
+// Iterations can't assign to variables from outside the loop or change the
+// size of any array, so the facts on entry hold throughout the loop and after
+// it. Within the body, the loop variable is also less than the end of the
+// range.
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::ParallelFor& parallel_for, Facts* facts) {
+  AnalyzeAnyExpression(parallel_for.begin, *facts);
+  AnalyzeAnyExpression(parallel_for.end, *facts);
+  facts->Forget(parallel_for.variable.name);
+  Facts body = *facts;
+  AssumeLessThan(parallel_for.variable, parallel_for.end, &body);
+  AnalyzeStatement(parallel_for.body, &body);
+}
+
+void RangeAnalysis::AnalyzeStatement(const AnnotatedAst::ReturnVoid&, Facts*) {}
+
+void RangeAnalysis::AnalyzeStatement(
+    const AnnotatedAst::Return& return_statement, Facts* facts) {
+  AnalyzeAnyExpression(return_statement.value, *facts);
+}
+
+void RangeAnalysis::AnalyzeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements, Facts* facts) {
+  for (const auto& statement : statements) AnalyzeAnyStatement(statement, facts);
+}
+
+void RangeAnalysis::AnalyzeAnyStatement(
+    const AnnotatedAst::Statement& statement, Facts* facts) {
+  statement.visit([&](const auto& x) { AnalyzeStatement(x, facts); });
+}
+
+void RangeAnalysis::AnalyzeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  SignAnalysis signs;
+  signs.AnalyzeTopLevel(definition);
+  unique_ = signs.Unique();
+  // The facts don't depend on which variables are non-negative, so a first
+  // pass finds the increments which can't overflow for the sign analysis.
+  // Without any non-negative variables, it doesn't record any accesses.
+  increments_.clear();
+  non_negative_.clear();
+  Facts facts;
+  AnalyzeStatement(definition.body, &facts);
+  signs.Solve(increments_);
+  non_negative_ = signs.NonNegative();
+  facts = Facts{};
+  AnalyzeStatement(definition.body, &facts);
+}
+
+void RangeAnalysis::AnalyzeTopLevel(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) AnalyzeTopLevel(definition);
+}
+
+void RangeAnalysis::AnalyzeAnyTopLevel(
+    const AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { AnalyzeTopLevel(x); });
+}
+
+void RangeAnalysis::Assume(const AnnotatedAst::Expression& condition,
+                           bool value, Facts* facts) const {
+  if (const auto* op = condition.get_if<AnnotatedAst::LogicalNot>()) {
+    Assume(op->argument, !value, facts);
+  } else if (const auto* binary = condition.get_if<AnnotatedAst::Logical>()) {
+    // Both sides are known when `x && y` is true or when `x || y` is false.
+    if (value == (binary->operation == ast::Logical::AND)) {
+      Assume(binary->left, value, facts);
+      Assume(binary->right, value, facts);
+    }
+  } else if (const auto* binary = condition.get_if<AnnotatedAst::Compare>()) {
+    switch (binary->operation) {
+      case ast::Compare::LESS_THAN:
+        if (value) AssumeLessThan(binary->left, binary->right, facts);
+        break;
+      case ast::Compare::GREATER_THAN:
+        if (value) AssumeLessThan(binary->right, binary->left, facts);
+        break;
+      case ast::Compare::LESS_OR_EQUAL:
+        if (!value) AssumeLessThan(binary->right, binary->left, facts);
+        break;
+      case ast::Compare::GREATER_OR_EQUAL:
+        if (!value) AssumeLessThan(binary->left, binary->right, facts);
+        break;
+      case ast::Compare::EQUAL:
+      case ast::Compare::NOT_EQUAL:
+        break;
+    }
+  }
+}
+
+void RangeAnalysis::AssumeLessThan(const AnnotatedAst::Expression& left,
+                                   const AnnotatedAst::Expression& right,
+                                   Facts* facts) const {
+  const auto* index = left.get_if<AnnotatedAst::Identifier>();
+  if (!index || !unique_.count(index->name)) return;
+  if (const auto* size = right.get_if<AnnotatedAst::Size>()) {
+    const auto* array = size->array.get_if<AnnotatedAst::Identifier>();
+    if (array && unique_.count(array->name))
+      facts->less_than_size.emplace(index->name, array->name);
+  } else if (const auto* bound = right.get_if<AnnotatedAst::Identifier>()) {
+    // Collect first, since the set can't be modified while iterating it.
+    std::vector<std::string> arrays;
+    for (const auto& [n, array] : facts->size_of) {
+      if (n == bound->name) arrays.push_back(array);
+    }
+    for (auto& array : arrays)
+      facts->less_than_size.emplace(index->name, std::move(array));
+  }
+}
+
+bool RangeAnalysis::InBounds(std::string_view array,
+                             const AnnotatedAst::Expression& index,
+                             const Facts& facts) const {
+  const auto* i = index.get_if<AnnotatedAst::Identifier>();
+  return i && non_negative_.count(i->name) &&
+         facts.less_than_size.count({i->name, std::string{array}});
+}
+
+bool RangeAnalysis::IsIncrement(const AnnotatedAst::Arithmetic& binary,
+                                const Facts& facts) const {
+  if (binary.operation != ast::Arithmetic::ADD) return false;
+  const auto* i = binary.left.get_if<AnnotatedAst::Identifier>();
+  const auto* one = binary.right.get_if<AnnotatedAst::Integer>();
+  if (!i || !one || one->value != 1) return false;
+  const auto fact = facts.less_than_size.lower_bound({i->name, ""});
+  return fact != facts.less_than_size.end() && fact->first == i->name;
+}
+
+}  // namespace
+
+Info Analyze(const analysis::AnnotatedAst::TopLevel& top_level) {
+  Info info;
+  RangeAnalysis{&info}.AnalyzeAnyTopLevel(top_level);
+  return info;
+}
+
+}  // namespace bounds
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "analysis.h"
+
+#include <set>
+
+namespace bounds {
+
+// Array accesses which are known to be in bounds, so the code generator can
+// omit the bounds checks for them. Nodes are identified by address, so the
+// annotated AST must not be copied or moved between the analysis and code
+// generation.
+struct Info {
+  std::set<const analysis::AnnotatedAst::Index*> loads;
+  std::set<const analysis::AnnotatedAst::AssignElement*> stores;
+};
+
+Info Analyze(const analysis::AnnotatedAst::TopLevel& top_level);
+
+}  // namespace bounds
@@ -0,0 +1,172 @@
+#include "cache.h"
+
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <system_error>
+
+namespace cache {
+namespace {
+
+// SHA-256, as specified in FIPS 180-4. Binaries are looked up by hash alone, so
+// the hash needs to be collision resistant rather than just well distributed.
+class Sha256 {
+ public:
+  void Update(std::string_view data) {
+    for (char c : data) {
+      block_[used_++] = static_cast<std::uint8_t>(c);
+      if (used_ == block_.size()) Transform();
+    }
+    length_ += data.size();
+  }
+
+  void Update(std::uint64_t value) {
+    char bytes[8];
+    for (int i = 0; i < 8; i++) {
+      bytes[i] = static_cast<char>(value >> (56 - 8 * i));
+    }
+    Update(std::string_view{bytes, sizeof(bytes)});
+  }
+
+  std::string Finish() {
+    const std::uint64_t bits = length_ * 8;
+    Update(std::string_view{"\x80", 1});
+    while (used_ != 56) Update(std::string_view{"\0", 1});
+    Update(bits);
+    std::string result;
+    for (std::uint32_t word : state_) {
+      for (int shift = 28; shift >= 0; shift -= 4) {
+        result.push_back("0123456789abcdef"[(word >> shift) & 0xF]);
+      }
+    }
+    return result;
+  }
+
+ private:
+  static std::uint32_t Rotate(std::uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void Transform() {
+    static constexpr std::uint32_t kRounds[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+        0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+        0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+        0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+        0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+        0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+        0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    std::uint32_t w[64];
+    for (std::size_t i = 0; i < 16; i++) {
+      w[i] = std::uint32_t{block_[4 * i]} << 24 |
+             std::uint32_t{block_[4 * i + 1]} << 16 |
+             std::uint32_t{block_[4 * i + 2]} << 8 |
+             std::uint32_t{block_[4 * i + 3]};
+    }
+    for (int i = 16; i < 64; i++) {
+      const std::uint32_t s0 =
+          Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const std::uint32_t s1 =
+          Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    auto [a, b, c, d, e, f, g, h] = state_;
+    for (int i = 0; i < 64; i++) {
+      const std::uint32_t s1 = Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25);
+      const std::uint32_t choose = (e & f) ^ (~e & g);
+      const std::uint32_t t1 = h + s1 + choose + kRounds[i] + w[i];
+      const std::uint32_t s0 = Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22);
+      const std::uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      const std::uint32_t t2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state_ = {state_[0] + a, state_[1] + b, state_[2] + c, state_[3] + d,
+              state_[4] + e, state_[5] + f, state_[6] + g, state_[7] + h};
+    used_ = 0;
+  }
+
+  std::array<std::uint32_t, 8> state_ = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                         0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                         0x1f83d9ab, 0x5be0cd19};
+  std::array<std::uint8_t, 64> block_ = {};
+  std::size_t used_ = 0;
+  std::uint64_t length_ = 0;
+};
+
+// A name for a temporary file next to the given path which no other process
+// or thread will pick.
+std::string Temporary(const std::string& path) {
+  static std::atomic<unsigned> counter;
+  return path + ".tmp-" + std::to_string(getpid()) + "-" +
+         std::to_string(counter++);
+}
+
+// Copies an executable to the destination such that the destination either
+// keeps its old contents or has the complete new contents. The copy would
+// otherwise take the mode of the source, which is writable by everyone when it
+// is a memory file.
+void Publish(const std::string& source, const std::string& destination) {
+  namespace fs = std::filesystem;
+  const std::string temporary = Temporary(destination);
+  std::error_code error;
+  fs::copy_file(source, temporary, error);
+  if (!error) {
+    fs::permissions(temporary,
+                    fs::perms::owner_all | fs::perms::group_read |
+                        fs::perms::group_exec | fs::perms::others_read |
+                        fs::perms::others_exec,
+                    fs::perm_options::replace, error);
+  }
+  if (!error) fs::rename(temporary, destination, error);
+  if (error) {
+    fs::remove(temporary, error);
+  }
+}
+
+}  // namespace
+
+Cache::Cache(std::string directory) : directory_(std::move(directory)) {}
+
+std::string Cache::Key(std::string_view command, std::string_view version,
+                       std::string_view source) {
+  // Each field is preceded by its length so that no two different
+  // combinations of fields are hashed as the same bytes.
+  Sha256 hash;
+  for (std::string_view field : {command, version, source}) {
+    hash.Update(std::uint64_t{field.size()});
+    hash.Update(field);
+  }
+  return hash.Finish();
+}
+
+std::optional<std::string> Cache::Lookup(std::string_view key) const {
+  std::string entry = directory_ + "/" + std::string{key};
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(entry, error)) return std::nullopt;
+  return entry;
+}
+
+void Cache::Store(std::string_view key, const std::string& binary) const {
+  std::error_code error;
+  std::filesystem::create_directories(directory_, error);
+  if (error) return;
+  Publish(binary, directory_ + "/" + std::string{key});
+}
+
+}  // namespace cache
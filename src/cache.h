@@ -0,0 +1,35 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace cache {
+
+// A directory of compiled binaries, keyed by a hash of everything which went
+// into building them. Entries are published by renaming a complete file into
+// place, so any number of processes can share a directory: a reader either
+// sees a whole binary or nothing, and two writers racing on the same key
+// publish equivalent binaries.
+class Cache {
+ public:
+  explicit Cache(std::string directory);
+
+  // Returns the key for a binary built from the given source with the given
+  // command line.
+  static std::string Key(std::string_view command, std::string_view version,
+                         std::string_view source);
+
+  // Returns the path of the entry for the key, if there is one. Entries are
+  // never modified in place, so the binary can be run from there.
+  std::optional<std::string> Lookup(std::string_view key) const;
+
+  // Adds the binary at the given path as the entry for the key. Failing to
+  // store an entry is not an error, since the binary has been built anyway.
+  void Store(std::string_view key, const std::string& binary) const;
+
+ private:
+  std::string directory_;
+};
+
+}  // namespace cache
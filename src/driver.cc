@@ -0,0 +1,490 @@
+#include "driver.h"
+
+#include "allocations.h"
+#include "analysis.h"
+#include "ast.h"
+#include "bounds.h"
+#include "cache.h"
+#include "jit.h"
+#include "optimize.h"
+#include "ownership.h"
+#include "parser.h"
+#include "process.h"
+#include "reader.h"
+#include "report.h"
+#include "target-c.h"
+#include "target-llvm.h"
+#include "target-x86-64.h"
+#include "vm.h"
+
+#include <charconv>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace driver {
+namespace {
+
+// Options for running the tools which build the program, so that their
+// diagnostics go to the same place as gel's.
+process::Options Tool(const Environment& environment) {
+  process::Options options;
+  options.descriptors = environment.descriptors;
+  options.watch = environment.watch;
+  return options;
+}
+
+// Whether the compiled program may replace this process. Programs which are
+// being measured run as children instead, so that the report and the counts
+// of allocations can be written once they have finished.
+bool Replace(const Environment& environment, report::Report* timing) {
+  return environment.exec && !timing && !allocations::kEnabled;
+}
+
+// Start the compiled program, either in place of this process or as a child.
+int Start(const std::string& path, const Environment& environment,
+          report::Report* timing) {
+  report::Phase phase{timing, "run"};
+  if (Replace(environment, timing)) return process::Exec(path);
+  return process::Run({path}, Tool(environment));
+}
+
+int Start(const process::MemoryFile& binary, const Environment& environment,
+          report::Report* timing) {
+  report::Phase phase{timing, "run"};
+  if (Replace(environment, timing)) return process::Exec(binary);
+  return process::Run({binary.path()}, Tool(environment));
+}
+
+// Run a program which is interpreted or compiled within this process, which
+// needs a process of its own unless it can take over this one.
+int Start(const std::function<int()>& program, const Environment& environment,
+          report::Report* timing) {
+  report::Phase phase{timing, "run"};
+  if (Replace(environment, timing)) return program();
+  return process::Call(program, Tool(environment));
+}
+
+// A new directory for temporary files, which is removed along with everything
+// in it when this is destroyed.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory()
+      : path_((std::filesystem::temp_directory_path() / "gel-XXXXXX")
+                  .string()) {
+    if (!mkdtemp(path_.data())) path_.clear();
+  }
+  ~TemporaryDirectory() {
+    std::error_code error;
+    if (!path_.empty()) std::filesystem::remove_all(path_, error);
+  }
+  TemporaryDirectory(const TemporaryDirectory&) = delete;
+  TemporaryDirectory& operator=(const TemporaryDirectory&) = delete;
+
+  // Empty if the directory couldn't be created.
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
+// A path from the options, relative to the directory of the environment.
+std::string Resolve(const Environment& environment, std::string_view path) {
+  const std::filesystem::path result{path};
+  if (environment.directory.empty() || result.is_absolute()) {
+    return result.string();
+  }
+  return (std::filesystem::path{environment.directory} / result).string();
+}
+
+// Writes out the report when a compilation finishes, whichever way it
+// finishes.
+struct Summary {
+  explicit Summary(std::ostream* output) : errors(output) {}
+  ~Summary() {
+    if (!timings) return;
+    if (print) timings->Print(*errors);
+    if (trace.empty()) return;
+    std::ofstream file{trace};
+    timings->PrintTrace(file);
+    if (!file) *errors << "Failed to write the trace to " << trace << '\n';
+  }
+
+  std::ostream* errors;
+  std::optional<report::Report> timings;
+  // Print the table of phases and counters to the errors stream.
+  bool print = false;
+  // Write Chrome trace events to this file.
+  std::string trace;
+};
+
+}  // namespace
+
+std::string DefaultCacheDirectory() {
+  const char* directory = std::getenv("GEL_CACHE_DIR");
+  return directory ? directory : "";
+}
+
+int Run(const std::vector<std::string_view>& arguments, std::string_view source,
+        const Environment& environment) {
+  auto& errors = *environment.errors;
+  Summary summary{&errors};
+  // Parse the command line options.
+  bool copy_on_write = false;
+  bool fork_join = false;
+  bool jit = false;
+  bool interpret = false;
+  bool pgo = false;
+  bool emit = false;
+  // -O0 turns off gel's own optimizations, and any other level turns them on.
+  // The level is also passed on to the C compiler.
+  int level = 1;
+  // The number of translation units to split C programs into, which gcc
+  // compiles at the same time. Profile-guided builds always use one.
+  std::size_t units = 1;
+  std::string_view target = "c";
+  // Compiled C programs are cached if a directory is given, either with
+  // --cache-dir or by the environment.
+  std::optional<cache::Cache> cache;
+  if (!environment.cache_directory.empty()) {
+    cache.emplace(Resolve(environment, environment.cache_directory));
+  }
+  for (const std::string_view argument : arguments) {
+    constexpr std::string_view kTarget = "--target=";
+    constexpr std::string_view kCacheDir = "--cache-dir=";
+    constexpr std::string_view kUnits = "--units=";
+    constexpr std::string_view kTrace = "--trace=";
+    if (argument == "--copy-on-write") {
+      copy_on_write = true;
+    } else if (argument == "--fork-join") {
+      fork_join = true;
+    } else if (argument == "--jit") {
+      jit = true;
+    } else if (argument == "--vm") {
+      interpret = true;
+    } else if (argument == "--pgo") {
+      pgo = true;
+    } else if (argument == "--emit") {
+      emit = true;
+    } else if (argument == "--time-report") {
+      summary.print = true;
+    } else if (argument.substr(0, kTrace.size()) == kTrace &&
+               argument.size() > kTrace.size()) {
+      summary.trace = Resolve(environment, argument.substr(kTrace.size()));
+    } else if (argument.size() == 3 && argument.substr(0, 2) == "-O" &&
+               '0' <= argument[2] && argument[2] <= '3') {
+      level = argument[2] - '0';
+    } else if (argument.substr(0, kUnits.size()) == kUnits) {
+      const auto count = argument.substr(kUnits.size());
+      const auto end = count.data() + count.size();
+      const auto [parsed, error] = std::from_chars(count.data(), end, units);
+      if (error != std::errc{} || parsed != end || units == 0) {
+        errors << "Invalid number of units: " << count << '\n';
+        return 1;
+      }
+    } else if (argument.substr(0, kCacheDir.size()) == kCacheDir) {
+      cache.emplace(Resolve(environment, argument.substr(kCacheDir.size())));
+    } else if (argument.substr(0, kTarget.size()) == kTarget &&
+               (argument.substr(kTarget.size()) == "c" ||
+                argument.substr(kTarget.size()) == "llvm" ||
+                argument.substr(kTarget.size()) == "x86-64")) {
+      target = argument.substr(kTarget.size());
+    } else {
+      errors << "Unknown option: " << argument << '\n';
+      return 1;
+    }
+  }
+
+  if (summary.print || !summary.trace.empty()) summary.timings.emplace();
+  report::Report* const timing =
+      summary.timings ? &*summary.timings : nullptr;
+  report::Phase total{timing, "total"};
+  auto count = [&](std::string_view name, std::size_t amount) {
+    if (timing) timing->Count(name, static_cast<std::int64_t>(amount));
+  };
+
+  // Parse the program.
+  Reader reader{"stdin", std::string{source}};
+  Parser parser{reader};
+  std::vector<ParsedAst::DefineFunction> program;
+  try {
+    report::Phase phase{timing, "parse"};
+    program = parser.ParseProgram();
+    parser.CheckEnd();
+  } catch (const CompileError& error) {
+    errors << error.message();
+    return 1;
+  }
+  count("tokens", reader.tokens());
+  count("functions", program.size());
+
+  // Perform semantics checks.
+  auto [types, annotated_ast, diagnostics, scopes, nodes] = [&] {
+    report::Phase phase{timing, "check"};
+    return analysis::Check(program);
+  }();
+  count("nodes", nodes);
+  count("scopes", scopes);
+  count("types", types.size());
+  count("diagnostics", diagnostics.size());
+  if (!diagnostics.empty()) {
+    for (const auto& message : diagnostics) {
+      errors << message;
+    }
+    std::map<Message::Type, int> totals;
+    for (const auto& message : diagnostics) totals[message.type]++;
+    errors << "Compile finished with " << totals[Message::Type::ERROR]
+           << " error(s) and " << totals[Message::Type::WARNING]
+           << " warning(s).\n";
+    // Abort compilation if there were errors but not if there were only
+    // warnings or notes.
+    if (totals[Message::Type::ERROR] > 0) return 1;
+  }
+  auto optimized = [&] {
+    report::Phase phase{timing, "optimize"};
+    return level > 0 ? optimize::Optimize(annotated_ast.value())
+                     : std::move(annotated_ast.value());
+  }();
+  std::optional<report::Phase> analyze{std::in_place, timing, "analyze"};
+  auto ownership_info = ownership::Analyze(optimized);
+  auto bounds_info =
+      level > 0 ? bounds::Analyze(optimized) : bounds::Info{};
+  analyze.reset();
+  if (interpret) {
+    // Run the program on the bytecode interpreter, which needs no native
+    // toolchain at all.
+    const auto bytecode = [&] {
+      report::Phase phase{timing, "generate"};
+      return vm::Compile(optimized, ownership_info, bounds_info);
+    }();
+    count("instructions", bytecode.code.size());
+    return Start([&] { return vm::Run(bytecode); }, environment, timing);
+  }
+  if (jit) {
+    // Run the program in this process without writing anything to disk. The
+    // machine code is generated as part of running it.
+    target::x86_64::Options options;
+    options.copy_on_write = copy_on_write;
+    return Start(
+        [&] {
+          return jit::Run(optimized, ownership_info, bounds_info, options);
+        },
+        environment, timing);
+  }
+  // Compiled programs are built in memory and run without going through a
+  // shell, so nothing is written to the working directory.
+  process::MemoryFile binary{"gel-output"};
+  if (target == "x86-64") {
+    // Assembly output needs neither a C compiler nor a C library.
+    std::ostringstream output;
+    target::x86_64::Options options;
+    options.copy_on_write = copy_on_write;
+    {
+      report::Phase phase{timing, "generate"};
+      target::x86_64::Compile(types, optimized, ownership_info, bounds_info,
+                              options, &output);
+    }
+    const std::string code = output.str();
+    count("bytes generated", code.size());
+    if (emit) {
+      *environment.output << code;
+      return 0;
+    }
+    process::MemoryFile object{"gel-output.o"};
+    auto assemble = Tool(environment);
+    assemble.input = code;
+    int assemble_status = [&] {
+      report::Phase phase{timing, "assemble"};
+      return process::Run({"as", "-o", object.path()}, assemble);
+    }();
+    if (assemble_status) return assemble_status;
+    int link_status = [&] {
+      report::Phase phase{timing, "link"};
+      return process::Run({"ld", object.path(), "-o", binary.path()},
+                          Tool(environment));
+    }();
+    if (link_status) return link_status;
+    return Start(binary, environment, timing);
+  }
+  if (target == "llvm") {
+    std::ostringstream output;
+    target::llvm::Options options;
+    options.copy_on_write = copy_on_write;
+    {
+      report::Phase phase{timing, "generate"};
+      target::llvm::Compile(types, optimized, ownership_info, bounds_info,
+                            options, &output);
+    }
+    const std::string code = output.str();
+    count("bytes generated", code.size());
+    if (emit) {
+      *environment.output << code;
+      return 0;
+    }
+    // LLVM's optimizer does all of the work, so there is no point in emitting
+    // the IR without optimizing it.
+    auto compile = Tool(environment);
+    compile.input = code;
+    int compile_status = [&] {
+      report::Phase phase{timing, "compile"};
+      return process::Run(
+          {"clang", "-O2", "-x", "ir", "-", "-o", binary.path()}, compile);
+    }();
+    if (compile_status) return compile_status;
+    return Start(binary, environment, timing);
+  }
+  target::c::Options options;
+  options.copy_on_write = copy_on_write;
+  options.fork_join = fork_join;
+  options.memoize = level > 0;
+  auto generate = [&] {
+    report::Phase phase{timing, "generate"};
+    std::ostringstream output;
+    target::c::Compile(types, optimized, ownership_info, bounds_info, options,
+                       &output);
+    std::string code = output.str();
+    count("bytes generated", code.size());
+    return code;
+  };
+  const std::vector<std::string> command = target::c::CompileCommand(level);
+  auto compile = [&](const std::string& code,
+                     std::vector<std::string> flags = {}) {
+    report::Phase phase{timing, "compile"};
+    flags.insert(flags.begin(), command.begin(), command.end());
+    flags.insert(flags.end(), {"-o", binary.path()});
+    auto compile_options = Tool(environment);
+    compile_options.input = code;
+    return process::Run(flags, compile_options);
+  };
+  // Each unit is compiled to an object of its own, and then they are all linked
+  // together.
+  auto compile_units = [&](const target::c::Units& split) {
+    report::Phase phase{timing, "compile"};
+    std::vector<std::string> codes;
+    for (const auto& unit_source : split.sources) {
+      codes.push_back(split.header + unit_source);
+    }
+    std::deque<process::MemoryFile> objects;
+    std::vector<std::function<int()>> tasks;
+    std::vector<std::string> link = {"gcc", "-pthread"};
+    for (std::size_t i = 0; i < codes.size(); i++) {
+      const auto& object = objects.emplace_back("gel-output.o");
+      tasks.push_back([&, i] {
+        report::Phase unit{timing, "compile unit " + std::to_string(i + 1)};
+        auto unit_command = command;
+        unit_command.insert(unit_command.end(), {"-c", "-o", object.path()});
+        auto unit_options = Tool(environment);
+        unit_options.input = codes[i];
+        return process::Run(unit_command, unit_options);
+      });
+      link.push_back(object.path());
+    }
+    const unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    for (int status : process::RunAll(tasks, jobs)) {
+      if (status) return status;
+    }
+    report::Phase link_phase{timing, "link"};
+    link.insert(link.end(), {"-o", binary.path()});
+    return process::Run(link, Tool(environment));
+  };
+  if (units > 1 && !pgo) {
+    const auto split = [&] {
+      report::Phase phase{timing, "generate"};
+      return target::c::CompileUnits(types, optimized, ownership_info,
+                                     bounds_info, options, units);
+    }();
+    std::string code = split.header;
+    for (std::size_t i = 0; i < split.sources.size(); i++) {
+      code += "\n// Translation unit " + std::to_string(i + 1) + ".\n" +
+              split.sources[i];
+    }
+    count("bytes generated", code.size());
+    if (emit) {
+      *environment.output << code;
+      return 0;
+    }
+    std::string command_line = "units=" + std::to_string(units) + " ";
+    for (const auto& argument : command) command_line += argument + " ";
+    const auto key =
+        cache::Cache::Key(command_line, target::c::kRuntimeVersion, code);
+    if (cache) {
+      if (auto entry = cache->Lookup(key)) {
+        return Start(*entry, environment, timing);
+      }
+    }
+    if (int status = compile_units(split)) return status;
+    if (cache) cache->Store(key, binary.path());
+    return Start(binary, environment, timing);
+  }
+  if (emit) {
+    *environment.output << generate();
+    return 0;
+  }
+  if (pgo) {
+    // Run an instrumented build of the program to find which functions and
+    // branches are hot, and let that guide the C code that gel generates. The
+    // profiles are files, so they are kept in a directory of their own, which
+    // is gone before the program starts.
+    const int build_status = [&] {
+      const TemporaryDirectory directory;
+      if (directory.path().empty()) {
+        errors << "Failed to create a directory for profiles.\n";
+        return 1;
+      }
+      auto training = Tool(environment);
+      training.quiet = true;
+      auto train = [&] {
+        report::Phase phase{timing, "train"};
+        process::Run({binary.path()}, training);
+      };
+      target::c::Profile profile;
+      options.instrument = directory.path() + "/counts";
+      if (int status = compile(generate())) return status;
+      train();
+      if (std::ifstream file{options.instrument}) {
+        profile = target::c::ReadProfile(file);
+        options.profile = &profile;
+      }
+      options.instrument.clear();
+      // Then profile the resulting C code for gcc. The C code must be the
+      // same when the profile is used, or gcc would ignore it.
+      const std::string code = generate();
+      if (int status = compile(code, {"-fprofile-generate=" + directory.path(),
+                                      "-fprofile-update=atomic"})) {
+        return status;
+      }
+      train();
+      return compile(code, {"-fprofile-use=" + directory.path()});
+    }();
+    if (build_status) return build_status;
+    return Start(binary, environment, timing);
+  }
+  const std::string code = generate();
+  if (!cache) {
+    if (int status = compile(code)) return status;
+    return Start(binary, environment, timing);
+  }
+  std::string command_line;
+  for (const auto& argument : command) command_line += argument + " ";
+  const auto key =
+      cache::Cache::Key(command_line, target::c::kRuntimeVersion, code);
+  if (auto entry = cache->Lookup(key)) {
+    return Start(*entry, environment, timing);
+  }
+  if (int status = compile(code)) return status;
+  cache->Store(key, binary.path());
+  return Start(binary, environment, timing);
+}
+
+}  // namespace driver
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace driver {
+
+// The value of GEL_CACHE_DIR, or nothing if it isn't set.
+std::string DefaultCacheDirectory();
+
+// Where a compilation writes its output, and where the compiled program runs.
+struct Environment {
+  // Generated code for --emit, and diagnostics.
+  std::ostream* output = &std::cout;
+  std::ostream* errors = &std::cerr;
+  // The standard input, output and error of the compiled program and of the
+  // tools which build it.
+  std::array<int, 3> descriptors = {0, 1, 2};
+  // If set, the compiled program and the tools are killed once the other end
+  // of this socket hangs up.
+  int watch = -1;
+  // Replace this process with the compiled program rather than running it as
+  // a child and waiting for it.
+  bool exec = true;
+  // Relative paths such as those given to --trace and --cache-dir are
+  // relative to this directory, or to the working directory if it is empty.
+  std::string directory;
+  // Where compiled C programs are cached unless --cache-dir says otherwise.
+  // Empty if they aren't cached.
+  std::string cache_directory = DefaultCacheDirectory();
+};
+
+// Compile the program with the given command line options and run it, as the
+// gel command does. Returns the exit status of the program, or of the step
+// which failed.
+int Run(const std::vector<std::string_view>& arguments, std::string_view source,
+        const Environment& environment);
+
+}  // namespace driver
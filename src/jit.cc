@@ -0,0 +1,189 @@
+#include "jit.h"
+
+#include "x86-64.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+
+namespace jit {
+namespace {
+
+// The layout of arrays in the generated code. An array of depth d has arrays of
+// depth d - 1 as its elements, and an array of depth 1 has 8 byte scalars.
+struct Array {
+  void* data;
+  std::int64_t size;
+};
+
+std::size_t Bytes(std::int64_t size, std::int64_t depth) {
+  return static_cast<std::size_t>(size) *
+         (depth == 1 ? sizeof(std::int64_t) : sizeof(Array));
+}
+
+void* Allocate(std::size_t bytes) {
+  void* data = std::malloc(bytes);
+  if (!data && bytes) {
+    std::fputs("Out of memory.\n", stderr);
+    std::exit(EXIT_FAILURE);
+  }
+  return data;
+}
+
+void Print(std::int64_t value) {
+  std::printf("%lld\n", static_cast<long long>(value));
+}
+
+[[noreturn]] void IndexError(std::int64_t index, std::int64_t size) {
+  std::fprintf(stderr,
+               "Array index %lld is out of bounds for array of size %lld.\n",
+               static_cast<long long>(index), static_cast<long long>(size));
+  std::exit(EXIT_FAILURE);
+}
+
+[[noreturn]] void SizeError(std::int64_t left, std::int64_t right) {
+  std::fprintf(stderr, "Array sizes %lld and %lld do not match.\n",
+               static_cast<long long>(left), static_cast<long long>(right));
+  std::exit(EXIT_FAILURE);
+}
+
+void* Alloc(std::int64_t bytes) {
+  return Allocate(static_cast<std::size_t>(bytes));
+}
+
+void Copy(Array* output, const Array* source, std::int64_t depth) {
+  const auto size = source->size;
+  void* data = Allocate(Bytes(size, depth));
+  if (depth == 1) {
+    if (size) std::memcpy(data, source->data, Bytes(size, depth));
+  } else {
+    auto* elements = static_cast<Array*>(data);
+    const auto* from = static_cast<const Array*>(source->data);
+    for (std::int64_t i = 0; i < size; i++) {
+      Copy(&elements[i], &from[i], depth - 1);
+    }
+  }
+  *output = Array{data, size};
+}
+
+void Destroy(Array* array, std::int64_t depth) {
+  if (depth > 1) {
+    auto* elements = static_cast<Array*>(array->data);
+    for (auto i = array->size; i-- > 0;) Destroy(&elements[i], depth - 1);
+  }
+  std::free(array->data);
+}
+
+// Shared arrays store their reference count immediately before the elements.
+std::int64_t* References(void* data) {
+  return static_cast<std::int64_t*>(data) - 1;
+}
+
+void* SharedAlloc(std::int64_t bytes) {
+  auto* references = static_cast<std::int64_t*>(
+      Allocate(sizeof(std::int64_t) + static_cast<std::size_t>(bytes)));
+  *references = 1;
+  return references + 1;
+}
+
+void SharedCopy(Array* output, const Array* source, std::int64_t) {
+  *output = *source;
+  if (output->data) ++*References(output->data);
+}
+
+void Unshare(Array* array, std::int64_t depth) {
+  void* shared = array->data;
+  if (!shared || *References(shared) == 1) return;
+  const auto size = array->size;
+  void* data = SharedAlloc(static_cast<std::int64_t>(Bytes(size, depth)));
+  --*References(shared);
+  if (depth == 1) {
+    if (size) std::memcpy(data, shared, Bytes(size, depth));
+  } else {
+    auto* elements = static_cast<Array*>(data);
+    const auto* from = static_cast<const Array*>(shared);
+    for (std::int64_t i = 0; i < size; i++) {
+      SharedCopy(&elements[i], &from[i], depth - 1);
+    }
+  }
+  array->data = data;
+}
+
+void SharedDestroy(Array* array, std::int64_t depth) {
+  void* data = array->data;
+  if (!data || --*References(data) > 0) return;
+  if (depth > 1) {
+    auto* elements = static_cast<Array*>(data);
+    for (auto i = array->size; i-- > 0;) {
+      SharedDestroy(&elements[i], depth - 1);
+    }
+  }
+  std::free(References(data));
+}
+
+template <typename F>
+std::uint64_t AddressOf(F* function) {
+  return reinterpret_cast<std::uint64_t>(function);
+}
+
+}  // namespace
+
+int Run(const analysis::AnnotatedAst::TopLevel& top_level,
+        const ownership::Info& ownership, const bounds::Info& bounds,
+        const target::x86_64::Options& options) {
+  // The runtime functions follow the same calling convention as the generated
+  // code, so they are called directly.
+  std::map<std::string, std::uint64_t, std::less<>> runtime = {
+      {"gel_print", AddressOf(Print)},
+      {"gelindexerror", AddressOf(IndexError)},
+      {"gelsizeerror", AddressOf(SizeError)},
+  };
+  if (options.copy_on_write) {
+    runtime.emplace("gelalloc", AddressOf(SharedAlloc));
+    runtime.emplace("gelcopy", AddressOf(SharedCopy));
+    runtime.emplace("gelunshare", AddressOf(Unshare));
+    runtime.emplace("geldestroy", AddressOf(SharedDestroy));
+  } else {
+    runtime.emplace("gelalloc", AddressOf(Alloc));
+    runtime.emplace("gelcopy", AddressOf(Copy));
+    runtime.emplace("geldestroy", AddressOf(Destroy));
+  }
+  const auto code = target::x86_64::Encode(
+      target::x86_64::Lower(top_level, ownership, bounds, options), runtime);
+  const auto main = code.symbols.find("gel_main");
+  if (main == code.symbols.end()) {
+    std::cerr << "Program has no main function.\n";
+    return 1;
+  }
+
+  // The code is written while the memory is writable and only then made
+  // executable, so it is never both at once.
+  const std::size_t size = code.bytes.size();
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    std::cerr << "Failed to map memory for the program.\n";
+    return 1;
+  }
+  std::memcpy(memory, code.bytes.data(), size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    std::cerr << "Failed to make the program executable.\n";
+    munmap(memory, size);
+    return 1;
+  }
+  using Main = std::int64_t (*)();
+  const auto gel_main =
+      reinterpret_cast<Main>(static_cast<std::uint8_t*>(memory) + main->second);
+  const auto status = gel_main();
+  munmap(memory, size);
+  std::fflush(stdout);
+  return static_cast<int>(status);
+}
+
+}  // namespace jit
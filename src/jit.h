@@ -0,0 +1,19 @@
+#pragma once
+
+#include "analysis.h"
+#include "ast.h"
+#include "bounds.h"
+#include "ownership.h"
+#include "target-x86-64.h"
+
+namespace jit {
+
+// Compile the program to x86-64 machine code in memory and run it within this
+// process. The runtime functions are provided natively instead of being
+// assembled along with the program, so nothing is written to disk and no
+// external tools are run. Returns the exit status of the program.
+int Run(const analysis::AnnotatedAst::TopLevel& top_level,
+        const ownership::Info& ownership, const bounds::Info& bounds,
+        const target::x86_64::Options& options);
+
+}  // namespace jit
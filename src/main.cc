@@ -1,42 +1,48 @@
-#include "analysis.h"
-#include "ast.h"
-#include "parser.h"
-#include "reader.h"
-#include "target-c.h"
+#include "driver.h"
+#include "server.h"
 
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
-#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
-int main() {
-  // Parse the program.
-  std::string input{std::istreambuf_iterator<char>{std::cin}, {}};
-  Reader reader{"stdin", input};
-  Parser parser{reader};
-  auto program = parser.ParseProgram();
-  parser.CheckEnd();
-
-  // Perform semantics checks.
-  auto [types, annotated_ast, diagnostics] = analysis::Check(program);
-  if (!diagnostics.empty()) {
-    for (const auto& message : diagnostics) {
-      std::cerr << message;
+int main(int argc, char* argv[]) {
+  // --server turns this process into a server, and --client sends the program
+  // to one instead of compiling it here. GEL_SERVER does the same as --client,
+  // so that gel can be pointed at a server without changing how it is run.
+  std::optional<std::string> server, client;
+  if (const char* path = std::getenv("GEL_SERVER")) {
+    if (*path) client = path;
+  }
+  std::vector<std::string_view> arguments;
+  for (int i = 1; i < argc; i++) {
+    std::string_view argument = argv[i];
+    constexpr std::string_view kServer = "--server=";
+    constexpr std::string_view kClient = "--client=";
+    if (argument.substr(0, kServer.size()) == kServer) {
+      server = argument.substr(kServer.size());
+    } else if (argument.substr(0, kClient.size()) == kClient) {
+      client = argument.substr(kClient.size());
+    } else {
+      arguments.push_back(argument);
+    }
+  }
+  if (server) {
+    if (!arguments.empty()) {
+      std::cerr << "--server takes options with each request instead.\n";
+      return 1;
     }
-    std::map<Message::Type, int> count;
-    for (const auto& message : diagnostics) count[message.type]++;
-    std::cerr << "Compile finished with " << count[Message::Type::ERROR]
-              << " error(s) and " << count[Message::Type::WARNING]
-              << " warning(s).\n";
-    // Abort compilation if there were errors but not if there were only
-    // warnings or notes.
-    if (count[Message::Type::ERROR] > 0) return 1;
+    return server::Serve(*server);
   }
-  {
-    std::ofstream output{".gel-output.c"};
-    target::c::Compile(types, annotated_ast.value(), &output);
+
+  std::string input{std::istreambuf_iterator<char>{std::cin}, {}};
+  // Programs are compiled here if there is no server to send them to.
+  if (client) {
+    if (auto status = server::Request(*client, arguments, input)) {
+      return *status;
+    }
   }
-  int compile_status = std::system("gcc .gel-output.c -o .gel-output");
-  if (compile_status) return compile_status;
-  return std::system("./.gel-output");
+  return driver::Run(arguments, input, driver::Environment{});
 }
@@ -0,0 +1,797 @@
+#include "optimize.h"
+
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <variant>
+
+namespace optimize {
+namespace {
+
+using AnnotatedAst = analysis::AnnotatedAst;
+
+constexpr auto kMinInteger = std::numeric_limits<std::int64_t>::min();
+
+// Constants are combined with wrapping arithmetic, which agrees with the
+// generated code for every program that doesn't overflow.
+std::uint64_t Bits(std::int64_t value) {
+  return static_cast<std::uint64_t>(value);
+}
+
+std::int64_t Wrap(std::uint64_t value) {
+  return static_cast<std::int64_t>(value);
+}
+
+// Returns the result of the operation on constant operands, or nothing if the
+// result must be left for run time.
+std::optional<std::int64_t> Evaluate(ast::Arithmetic operation,
+                                     std::int64_t left, std::int64_t right) {
+  switch (operation) {
+    case ast::Arithmetic::ADD:
+      return Wrap(Bits(left) + Bits(right));
+    case ast::Arithmetic::DIVIDE:
+      if (right == 0 || (left == kMinInteger && right == -1))
+        return std::nullopt;
+      return left / right;
+    case ast::Arithmetic::MULTIPLY:
+      return Wrap(Bits(left) * Bits(right));
+    case ast::Arithmetic::SUBTRACT:
+      return Wrap(Bits(left) - Bits(right));
+  }
+  return std::nullopt;
+}
+
+// Returns the value of an expression built only from integer constants.
+std::optional<std::int64_t> Constant(
+    const AnnotatedAst::Expression& expression) {
+  if (const auto* integer = expression.get_if<AnnotatedAst::Integer>())
+    return integer->value;
+  if (const auto* binary = expression.get_if<AnnotatedAst::Arithmetic>()) {
+    auto left = Constant(binary->left);
+    auto right = Constant(binary->right);
+    if (left && right) return Evaluate(binary->operation, *left, *right);
+  }
+  return std::nullopt;
+}
+
+AnnotatedAst::Expression MakeInteger(std::int64_t value) {
+  return AnnotatedAst::Integer{{types::Primitive::INTEGER}, value};
+}
+
+AnnotatedAst::Expression MakeVariable(std::string name) {
+  return AnnotatedAst::Identifier{{types::Primitive::INTEGER},
+                                  std::move(name)};
+}
+
+// Build `left op right`, simplifying it where possible.
+AnnotatedAst::Expression Simplify(ast::Arithmetic operation,
+                                  AnnotatedAst::Expression left,
+                                  AnnotatedAst::Expression right) {
+  {
+    const auto* a = left.get_if<AnnotatedAst::Integer>();
+    const auto* b = right.get_if<AnnotatedAst::Integer>();
+    if (a && b) {
+      if (auto value = Evaluate(operation, a->value, b->value))
+        return MakeInteger(*value);
+    }
+    // Keep constant operands of commutative operations on the right.
+    if (a && !b && (operation == ast::Arithmetic::ADD ||
+                    operation == ast::Arithmetic::MULTIPLY)) {
+      std::swap(left, right);
+    }
+  }
+  const auto* constant = right.get_if<AnnotatedAst::Integer>();
+  if (!constant) {
+    return AnnotatedAst::Arithmetic{{types::Primitive::INTEGER},
+                                    operation,
+                                    std::move(left),
+                                    std::move(right)};
+  }
+  std::int64_t value = constant->value;
+  // The left operand has already been simplified, so a chain of operations
+  // with constants has at most one constant which can be combined with this
+  // one.
+  const auto* inner = left.get_if<AnnotatedAst::Arithmetic>();
+  const auto* inner_constant =
+      inner ? inner->right.get_if<AnnotatedAst::Integer>() : nullptr;
+  switch (operation) {
+    case ast::Arithmetic::ADD:
+    case ast::Arithmetic::SUBTRACT: {
+      // (x + c1) - c2 is x + (c1 - c2).
+      std::uint64_t offset =
+          operation == ast::Arithmetic::ADD ? Bits(value) : -Bits(value);
+      if (inner_constant && (inner->operation == ast::Arithmetic::ADD ||
+                             inner->operation == ast::Arithmetic::SUBTRACT)) {
+        offset += inner->operation == ast::Arithmetic::ADD
+                      ? Bits(inner_constant->value)
+                      : -Bits(inner_constant->value);
+        auto x = inner->left;
+        left = std::move(x);
+      }
+      value = Wrap(offset);
+      if (value == 0) return left;
+      if (value < 0 && value != kMinInteger) {
+        return AnnotatedAst::Arithmetic{{types::Primitive::INTEGER},
+                                        ast::Arithmetic::SUBTRACT,
+                                        std::move(left),
+                                        MakeInteger(-value)};
+      }
+      return AnnotatedAst::Arithmetic{{types::Primitive::INTEGER},
+                                      ast::Arithmetic::ADD,
+                                      std::move(left),
+                                      MakeInteger(value)};
+    }
+    case ast::Arithmetic::MULTIPLY:
+      // (x * c1) * c2 is x * (c1 * c2).
+      if (inner_constant && inner->operation == ast::Arithmetic::MULTIPLY) {
+        value = Wrap(Bits(value) * Bits(inner_constant->value));
+        auto x = inner->left;
+        left = std::move(x);
+      }
+      if (value == 1) return left;
+      // Other operands may have side effects which must still happen.
+      if (value == 0 && (left.is<AnnotatedAst::Identifier>() ||
+                         left.is<AnnotatedAst::Integer>())) {
+        return MakeInteger(0);
+      }
+      break;
+    case ast::Arithmetic::DIVIDE:
+      // With truncating division, (x / c1) / c2 is x / (c1 * c2) as long as
+      // both divisors are positive.
+      if (value > 0 && inner_constant &&
+          inner->operation == ast::Arithmetic::DIVIDE &&
+          inner_constant->value > 0 &&
+          value <= std::numeric_limits<std::int64_t>::max() /
+                       inner_constant->value) {
+        value *= inner_constant->value;
+        auto x = inner->left;
+        left = std::move(x);
+      }
+      if (value == 1) return left;
+      break;
+  }
+  return AnnotatedAst::Arithmetic{{types::Primitive::INTEGER},
+                                  operation,
+                                  std::move(left),
+                                  MakeInteger(value)};
+}
+
+// If the assignment adds a constant to the variable, returns the constant.
+std::optional<std::int64_t> Increment(const AnnotatedAst::Assign& assignment) {
+  const auto* binary = assignment.value.get_if<AnnotatedAst::Arithmetic>();
+  if (!binary) return std::nullopt;
+  auto is_self = [&](const AnnotatedAst::Expression& expression) {
+    const auto* identifier = expression.get_if<AnnotatedAst::Identifier>();
+    return identifier && identifier->name == assignment.variable.name;
+  };
+  if (binary->operation == ast::Arithmetic::ADD) {
+    if (is_self(binary->left)) return Constant(binary->right);
+    if (is_self(binary->right)) return Constant(binary->left);
+  } else if (binary->operation == ast::Arithmetic::SUBTRACT &&
+             is_self(binary->left)) {
+    if (auto value = Constant(binary->right)) return Wrap(-Bits(*value));
+  }
+  return std::nullopt;
+}
+
+// Records how a region of a function uses its variables.
+class Usage {
+ public:
+  void ScanExpression(const AnnotatedAst::Identifier&) {}
+  void ScanExpression(const AnnotatedAst::Boolean&) {}
+  void ScanExpression(const AnnotatedAst::Integer&) {}
+  void ScanExpression(const AnnotatedAst::ArrayLiteral&);
+  void ScanExpression(const AnnotatedAst::Arithmetic&);
+  void ScanExpression(const AnnotatedAst::Compare&);
+  void ScanExpression(const AnnotatedAst::Logical&);
+  void ScanExpression(const AnnotatedAst::FunctionCall&);
+  void ScanExpression(const AnnotatedAst::LogicalNot&);
+  void ScanExpression(const AnnotatedAst::Index&);
+  void ScanExpression(const AnnotatedAst::Size&);
+  void ScanAnyExpression(const AnnotatedAst::Expression&);
+
+  void ScanStatement(const AnnotatedAst::DefineVariable&);
+  void ScanStatement(const AnnotatedAst::Assign&);
+  void ScanStatement(const AnnotatedAst::AssignElement&);
+  void ScanStatement(const AnnotatedAst::DoFunction&);
+  void ScanStatement(const AnnotatedAst::If&);
+  void ScanStatement(const AnnotatedAst::While&);
+  void ScanStatement(const AnnotatedAst::ParallelFor&);
+  void ScanStatement(const AnnotatedAst::ReturnVoid&) {}
+  void ScanStatement(const AnnotatedAst::Return&);
+  void ScanStatement(const std::vector<AnnotatedAst::Statement>&);
+  void ScanAnyStatement(const AnnotatedAst::Statement&);
+
+  // The number of definitions of each name in the region.
+  const std::map<std::string, int, std::less<>>& definitions() const {
+    return definitions_;
+  }
+  // For each variable assigned in the region, whether every assignment adds
+  // a constant to it.
+  const std::map<std::string, bool, std::less<>>& increments() const {
+    return increments_;
+  }
+  // The operands of each multiplication in the region.
+  const std::vector<std::pair<const AnnotatedAst::Expression*,
+                              const AnnotatedAst::Expression*>>&
+  multiplies() const {
+    return multiplies_;
+  }
+
+ private:
+  std::map<std::string, int, std::less<>> definitions_;
+  std::map<std::string, bool, std::less<>> increments_;
+  std::vector<
+      std::pair<const AnnotatedAst::Expression*, const AnnotatedAst::Expression*>>
+      multiplies_;
+};
+
+void Usage::ScanExpression(const AnnotatedAst::ArrayLiteral& array) {
+  for (const auto& part : array.parts) ScanAnyExpression(part);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::Arithmetic& binary) {
+  if (binary.operation == ast::Arithmetic::MULTIPLY &&
+      binary.type == types::Primitive::INTEGER) {
+    multiplies_.emplace_back(&binary.left, &binary.right);
+  }
+  ScanAnyExpression(binary.left);
+  ScanAnyExpression(binary.right);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::Compare& binary) {
+  ScanAnyExpression(binary.left);
+  ScanAnyExpression(binary.right);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::Logical& binary) {
+  ScanAnyExpression(binary.left);
+  ScanAnyExpression(binary.right);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::FunctionCall& call) {
+  for (const auto& argument : call.arguments) ScanAnyExpression(argument);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::LogicalNot& op) {
+  ScanAnyExpression(op.argument);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::Index& index) {
+  ScanAnyExpression(index.array);
+  ScanAnyExpression(index.index);
+}
+
+void Usage::ScanExpression(const AnnotatedAst::Size& size) {
+  ScanAnyExpression(size.array);
+}
+
+void Usage::ScanAnyExpression(const AnnotatedAst::Expression& expression) {
+  expression.visit([&](const auto& x) { ScanExpression(x); });
+}
+
+void Usage::ScanStatement(const AnnotatedAst::DefineVariable& definition) {
+  ScanAnyExpression(definition.value);
+  definitions_[definition.variable.name]++;
+}
+
+void Usage::ScanStatement(const AnnotatedAst::Assign& assignment) {
+  ScanAnyExpression(assignment.value);
+  auto [i, inserted] = increments_.emplace(assignment.variable.name, true);
+  if (!Increment(assignment)) i->second = false;
+}
+
+void Usage::ScanStatement(const AnnotatedAst::AssignElement& assignment) {
+  ScanAnyExpression(assignment.index);
+  ScanAnyExpression(assignment.value);
+  increments_[assignment.variable.name] = false;
+}
+
+void Usage::ScanStatement(const AnnotatedAst::DoFunction& do_function) {
+  ScanExpression(do_function.function_call);
+}
+
+void Usage::ScanStatement(const AnnotatedAst::If& if_statement) {
+  ScanAnyExpression(if_statement.condition);
+  ScanStatement(if_statement.if_true);
+  ScanStatement(if_statement.if_false);
+}
+
+void Usage::ScanStatement(const AnnotatedAst::While& while_statement) {
+  ScanAnyExpression(while_statement.condition);
+  ScanStatement(while_statement.body);
+}
+
+// The loop variable is defined by the loop and never assigned.
+void Usage::ScanStatement(const AnnotatedAst::ParallelFor& parallel_for) {
+  ScanAnyExpression(parallel_for.begin);
+  ScanAnyExpression(parallel_for.end);
+  definitions_[parallel_for.variable.name]++;
+  ScanStatement(parallel_for.body);
+}
+
+void Usage::ScanStatement(const AnnotatedAst::Return& return_statement) {
+  ScanAnyExpression(return_statement.value);
+}
+
+void Usage::ScanStatement(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  for (const auto& statement : statements) ScanAnyStatement(statement);
+}
+
+void Usage::ScanAnyStatement(const AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { ScanStatement(x); });
+}
+
+// Rewrites a program bottom-up, simplifying arithmetic as it goes. Before each
+// loop is rewritten, multiplications `i * k` are chosen for strength reduction
+// if i is only ever changed within the loop by adding constants to it and k is
+// either a constant or a variable which the loop doesn't modify. Each chosen
+// product gets a new variable which is initialized before the loop and
+// adjusted after every change to i, and the multiplications in the loop are
+// replaced by reads of that variable. Variables are tracked by name, so i and
+// k must be the only variables with their names in the function.
+class Optimizer {
+ public:
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Identifier&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Boolean&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Integer&);
+  AnnotatedAst::Expression OptimizeExpression(
+      const AnnotatedAst::ArrayLiteral&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Arithmetic&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Compare&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Logical&);
+  AnnotatedAst::FunctionCall OptimizeExpression(
+      const AnnotatedAst::FunctionCall&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::LogicalNot&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Index&);
+  AnnotatedAst::Expression OptimizeExpression(const AnnotatedAst::Size&);
+  AnnotatedAst::Expression OptimizeAnyExpression(
+      const AnnotatedAst::Expression&);
+
+  // Each statement is replaced by one or more statements in the output.
+  using Output = std::vector<AnnotatedAst::Statement>;
+  void OptimizeStatement(const AnnotatedAst::DefineVariable&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::Assign&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::AssignElement&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::DoFunction&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::If&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::While&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::ParallelFor&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::ReturnVoid&, Output* output);
+  void OptimizeStatement(const AnnotatedAst::Return&, Output* output);
+  Output OptimizeStatement(const std::vector<AnnotatedAst::Statement>&);
+  void OptimizeAnyStatement(const AnnotatedAst::Statement&, Output* output);
+
+  AnnotatedAst::DefineFunction OptimizeTopLevel(
+      const AnnotatedAst::DefineFunction&);
+  std::vector<AnnotatedAst::DefineFunction> OptimizeTopLevel(
+      const std::vector<AnnotatedAst::DefineFunction>&);
+  AnnotatedAst::TopLevel OptimizeAnyTopLevel(const AnnotatedAst::TopLevel&);
+
+ private:
+  // A variable which holds the value of `induction * factor`.
+  struct Reduction {
+    std::string induction;
+    // The factor is either a constant or the name of a variable.
+    std::variant<std::int64_t, std::string> factor;
+    std::string variable;
+  };
+
+  // Choose the products in the loop to strength reduce.
+  std::vector<Reduction> FindReductions(const AnnotatedAst::While&);
+  // Returns the variable holding the product, if there is one.
+  const Reduction* FindReduction(const AnnotatedAst::Expression& left,
+                                 const AnnotatedAst::Expression& right) const;
+  bool IsUnique(std::string_view name) const;
+
+  // The number of definitions of each name in the current function.
+  std::map<std::string, int, std::less<>> definitions_;
+  // Reductions for the loops enclosing the current statement.
+  std::vector<Reduction> reductions_;
+  int next_id_ = 0;
+};
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Identifier& identifier) {
+  return identifier;
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Boolean& boolean) {
+  return boolean;
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Integer& integer) {
+  return integer;
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::ArrayLiteral& array) {
+  std::vector<AnnotatedAst::Expression> parts;
+  for (const auto& part : array.parts)
+    parts.push_back(OptimizeAnyExpression(part));
+  return AnnotatedAst::ArrayLiteral{{array.type}, std::move(parts)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Arithmetic& binary) {
+  auto left = OptimizeAnyExpression(binary.left);
+  auto right = OptimizeAnyExpression(binary.right);
+  // Element-wise array arithmetic has nothing to fold.
+  if (binary.type.is<types::Array>()) {
+    return AnnotatedAst::Arithmetic{
+        {binary.type}, binary.operation, std::move(left), std::move(right)};
+  }
+  auto result = Simplify(binary.operation, std::move(left), std::move(right));
+  const auto* product = result.get_if<AnnotatedAst::Arithmetic>();
+  if (product && product->operation == ast::Arithmetic::MULTIPLY) {
+    if (const auto* reduction = FindReduction(product->left, product->right))
+      return MakeVariable(reduction->variable);
+  }
+  return result;
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Compare& binary) {
+  auto left = OptimizeAnyExpression(binary.left);
+  auto right = OptimizeAnyExpression(binary.right);
+  const auto* a = left.get_if<AnnotatedAst::Integer>();
+  const auto* b = right.get_if<AnnotatedAst::Integer>();
+  if (a && b) {
+    bool value = false;
+    switch (binary.operation) {
+      case ast::Compare::EQUAL:
+        value = a->value == b->value;
+        break;
+      case ast::Compare::GREATER_OR_EQUAL:
+        value = a->value >= b->value;
+        break;
+      case ast::Compare::GREATER_THAN:
+        value = a->value > b->value;
+        break;
+      case ast::Compare::LESS_OR_EQUAL:
+        value = a->value <= b->value;
+        break;
+      case ast::Compare::LESS_THAN:
+        value = a->value < b->value;
+        break;
+      case ast::Compare::NOT_EQUAL:
+        value = a->value != b->value;
+        break;
+    }
+    return AnnotatedAst::Boolean{{types::Primitive::BOOLEAN}, value};
+  }
+  return AnnotatedAst::Compare{
+      {binary.type}, binary.operation, std::move(left), std::move(right)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Logical& binary) {
+  auto left = OptimizeAnyExpression(binary.left);
+  auto right = OptimizeAnyExpression(binary.right);
+  // A constant left hand side either decides the result or defers to the
+  // right hand side.
+  if (const auto* constant = left.get_if<AnnotatedAst::Boolean>()) {
+    const bool decisive =
+        constant->value == (binary.operation == ast::Logical::OR);
+    return decisive ? std::move(left) : std::move(right);
+  }
+  return AnnotatedAst::Logical{
+      {binary.type}, binary.operation, std::move(left), std::move(right)};
+}
+
+AnnotatedAst::FunctionCall Optimizer::OptimizeExpression(
+    const AnnotatedAst::FunctionCall& call) {
+  std::vector<AnnotatedAst::Expression> arguments;
+  for (const auto& argument : call.arguments)
+    arguments.push_back(OptimizeAnyExpression(argument));
+  return AnnotatedAst::FunctionCall{
+      {call.type}, call.function, std::move(arguments)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::LogicalNot& op) {
+  auto argument = OptimizeAnyExpression(op.argument);
+  if (const auto* constant = argument.get_if<AnnotatedAst::Boolean>())
+    return AnnotatedAst::Boolean{{types::Primitive::BOOLEAN}, !constant->value};
+  return AnnotatedAst::LogicalNot{{op.type}, std::move(argument)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Index& index) {
+  return AnnotatedAst::Index{{index.type},
+                             OptimizeAnyExpression(index.array),
+                             OptimizeAnyExpression(index.index)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeExpression(
+    const AnnotatedAst::Size& size) {
+  return AnnotatedAst::Size{{size.type}, OptimizeAnyExpression(size.array)};
+}
+
+AnnotatedAst::Expression Optimizer::OptimizeAnyExpression(
+    const AnnotatedAst::Expression& expression) {
+  return expression.visit([&](const auto& x) -> AnnotatedAst::Expression {
+    return OptimizeExpression(x);
+  });
+}
+
+void Optimizer::OptimizeStatement(
+    const AnnotatedAst::DefineVariable& definition, Output* output) {
+  output->push_back(AnnotatedAst::DefineVariable{
+      {}, definition.variable, OptimizeAnyExpression(definition.value)});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::Assign& assignment,
+                                  Output* output) {
+  output->push_back(AnnotatedAst::Assign{
+      {}, assignment.variable, OptimizeAnyExpression(assignment.value)});
+  // Keep each product involving the variable up to date.
+  for (const auto& reduction : reductions_) {
+    if (reduction.induction != assignment.variable.name) continue;
+    auto step = Increment(assignment);
+    if (!step) throw std::logic_error("Induction variable is not incremented.");
+    AnnotatedAst::Expression value = MakeVariable(reduction.variable);
+    if (const auto* factor = std::get_if<std::int64_t>(&reduction.factor)) {
+      value = Simplify(ast::Arithmetic::ADD, std::move(value),
+                       MakeInteger(Wrap(Bits(*step) * Bits(*factor))));
+    } else {
+      const auto& name = std::get<std::string>(reduction.factor);
+      auto operation = ast::Arithmetic::ADD;
+      if (*step < 0 && *step != kMinInteger) {
+        operation = ast::Arithmetic::SUBTRACT;
+        *step = -*step;
+      }
+      value = Simplify(
+          operation, std::move(value),
+          Simplify(ast::Arithmetic::MULTIPLY, MakeVariable(name),
+                   MakeInteger(*step)));
+    }
+    output->push_back(AnnotatedAst::Assign{
+        {},
+        AnnotatedAst::Identifier{{types::Primitive::INTEGER},
+                                 reduction.variable},
+        std::move(value)});
+  }
+}
+
+void Optimizer::OptimizeStatement(
+    const AnnotatedAst::AssignElement& assignment, Output* output) {
+  output->push_back(
+      AnnotatedAst::AssignElement{{},
+                                  assignment.variable,
+                                  OptimizeAnyExpression(assignment.index),
+                                  OptimizeAnyExpression(assignment.value)});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::DoFunction& do_function,
+                                  Output* output) {
+  output->push_back(AnnotatedAst::DoFunction{
+      {}, OptimizeExpression(do_function.function_call)});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::If& if_statement,
+                                  Output* output) {
+  output->push_back(
+      AnnotatedAst::If{{},
+                       OptimizeAnyExpression(if_statement.condition),
+                       OptimizeStatement(if_statement.if_true),
+                       OptimizeStatement(if_statement.if_false)});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::While& while_statement,
+                                  Output* output) {
+  auto reductions = FindReductions(while_statement);
+  for (const auto& reduction : reductions) {
+    AnnotatedAst::Expression factor =
+        std::holds_alternative<std::int64_t>(reduction.factor)
+            ? MakeInteger(std::get<std::int64_t>(reduction.factor))
+            : MakeVariable(std::get<std::string>(reduction.factor));
+    output->push_back(AnnotatedAst::DefineVariable{
+        {},
+        AnnotatedAst::Identifier{{types::Primitive::INTEGER},
+                                 reduction.variable},
+        Simplify(ast::Arithmetic::MULTIPLY, MakeVariable(reduction.induction),
+                 std::move(factor))});
+  }
+  reductions_.insert(reductions_.end(), reductions.begin(), reductions.end());
+  auto condition = OptimizeAnyExpression(while_statement.condition);
+  auto body = OptimizeStatement(while_statement.body);
+  reductions_.resize(reductions_.size() - reductions.size());
+  output->push_back(
+      AnnotatedAst::While{{}, std::move(condition), std::move(body)});
+}
+
+// Products are not strength reduced across the iterations of a parallel loop,
+// since each iteration may run on its own.
+void Optimizer::OptimizeStatement(const AnnotatedAst::ParallelFor& parallel_for,
+                                  Output* output) {
+  output->push_back(
+      AnnotatedAst::ParallelFor{{},
+                                parallel_for.variable,
+                                OptimizeAnyExpression(parallel_for.begin),
+                                OptimizeAnyExpression(parallel_for.end),
+                                OptimizeStatement(parallel_for.body)});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::ReturnVoid&,
+                                  Output* output) {
+  output->push_back(AnnotatedAst::ReturnVoid{});
+}
+
+void Optimizer::OptimizeStatement(const AnnotatedAst::Return& return_statement,
+                                  Output* output) {
+  output->push_back(
+      AnnotatedAst::Return{{}, OptimizeAnyExpression(return_statement.value)});
+}
+
+Optimizer::Output Optimizer::OptimizeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  Output output;
+  for (const auto& statement : statements)
+    OptimizeAnyStatement(statement, &output);
+  return output;
+}
+
+void Optimizer::OptimizeAnyStatement(const AnnotatedAst::Statement& statement,
+                                     Output* output) {
+  statement.visit([&](const auto& x) { OptimizeStatement(x, output); });
+}
+
+AnnotatedAst::DefineFunction Optimizer::OptimizeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  Usage usage;
+  usage.ScanStatement(definition.body);
+  definitions_ = usage.definitions();
+  for (const auto& parameter : definition.parameters)
+    definitions_[parameter.name]++;
+  return AnnotatedAst::DefineFunction{{},
+                                      definition.type,
+                                      definition.name,
+                                      definition.parameters,
+                                      OptimizeStatement(definition.body)};
+}
+
+std::vector<AnnotatedAst::DefineFunction> Optimizer::OptimizeTopLevel(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions) {
+  std::vector<AnnotatedAst::DefineFunction> output;
+  for (const auto& definition : definitions)
+    output.push_back(OptimizeTopLevel(definition));
+  return output;
+}
+
+AnnotatedAst::TopLevel Optimizer::OptimizeAnyTopLevel(
+    const AnnotatedAst::TopLevel& top_level) {
+  return top_level.visit([&](const auto& x) -> AnnotatedAst::TopLevel {
+    return OptimizeTopLevel(x);
+  });
+}
+
+std::vector<Optimizer::Reduction> Optimizer::FindReductions(
+    const AnnotatedAst::While& while_statement) {
+  Usage usage;
+  usage.ScanAnyExpression(while_statement.condition);
+  usage.ScanStatement(while_statement.body);
+  const auto& increments = usage.increments();
+  // Variables defined in the loop are reinitialized on each iteration.
+  auto invariant = [&](std::string_view name) {
+    return IsUnique(name) && !usage.definitions().count(name) &&
+           !increments.count(name);
+  };
+  auto induction = [&](std::string_view name) {
+    auto i = increments.find(name);
+    return IsUnique(name) && !usage.definitions().count(name) &&
+           i != increments.end() && i->second;
+  };
+  std::vector<Reduction> reductions;
+  auto add = [&](const AnnotatedAst::Expression& left,
+                 const AnnotatedAst::Expression& right) {
+    const auto* variable = left.get_if<AnnotatedAst::Identifier>();
+    if (!variable || !induction(variable->name)) return false;
+    Reduction reduction{variable->name, 0, ""};
+    if (auto constant = Constant(right)) {
+      reduction.factor = *constant;
+    } else if (const auto* factor = right.get_if<AnnotatedAst::Identifier>();
+               factor && invariant(factor->name)) {
+      reduction.factor = factor->name;
+    } else {
+      return false;
+    }
+    for (const auto& existing : reductions) {
+      if (existing.induction == reduction.induction &&
+          existing.factor == reduction.factor) {
+        return true;
+      }
+    }
+    reduction.variable = "_sr" + std::to_string(next_id_++);
+    reductions.push_back(std::move(reduction));
+    return true;
+  };
+  for (const auto& [left, right] : usage.multiplies()) {
+    if (!add(*left, *right)) add(*right, *left);
+  }
+  return reductions;
+}
+
+const Optimizer::Reduction* Optimizer::FindReduction(
+    const AnnotatedAst::Expression& left,
+    const AnnotatedAst::Expression& right) const {
+  auto matches = [](const Reduction& reduction,
+                    const AnnotatedAst::Expression& variable,
+                    const AnnotatedAst::Expression& factor) {
+    const auto* identifier = variable.get_if<AnnotatedAst::Identifier>();
+    if (!identifier || identifier->name != reduction.induction) return false;
+    if (const auto* constant = factor.get_if<AnnotatedAst::Integer>())
+      return reduction.factor == decltype(reduction.factor){constant->value};
+    const auto* name = factor.get_if<AnnotatedAst::Identifier>();
+    return name &&
+           reduction.factor == decltype(reduction.factor){name->name};
+  };
+  // Inner loops take precedence, although any match is correct.
+  for (auto i = reductions_.rbegin(); i != reductions_.rend(); ++i) {
+    if (matches(*i, left, right) || matches(*i, right, left)) return &*i;
+  }
+  return nullptr;
+}
+
+bool Optimizer::IsUnique(std::string_view name) const {
+  auto i = definitions_.find(name);
+  return i != definitions_.end() && i->second == 1;
+}
+
+}  // namespace
+
+analysis::AnnotatedAst::TopLevel Optimize(
+    const analysis::AnnotatedAst::TopLevel& top_level) {
+  return Optimizer{}.OptimizeAnyTopLevel(top_level);
+}
+
+DivisionMagic SignedDivisionMagic(std::int64_t divisor) {
+  constexpr std::uint64_t kTwo63 = std::uint64_t{1} << 63;
+  const std::uint64_t d = Bits(divisor);
+  const std::uint64_t ad = divisor < 0 ? -d : d;
+  const std::uint64_t t = kTwo63 + (d >> 63);
+  // The absolute value of the largest dividend which is congruent to -1
+  // modulo the divisor.
+  const std::uint64_t anc = t - 1 - t % ad;
+  int p = 63;
+  std::uint64_t q1 = kTwo63 / anc, r1 = kTwo63 - q1 * anc;
+  std::uint64_t q2 = kTwo63 / ad, r2 = kTwo63 - q2 * ad;
+  std::uint64_t delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  std::uint64_t multiplier = q2 + 1;
+  if (divisor < 0) multiplier = -multiplier;
+  return DivisionMagic{Wrap(multiplier), p - 64};
+}
+
+std::optional<int> Log2(std::int64_t value) {
+  std::uint64_t magnitude = Bits(value);
+  if (value < 0) magnitude = -magnitude;
+  if (magnitude == 0 || (magnitude & (magnitude - 1)) != 0) return std::nullopt;
+  int log = 0;
+  while (magnitude > 1) {
+    magnitude >>= 1;
+    log++;
+  }
+  return log;
+}
+
+}  // namespace optimize
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "analysis.h"
+
+#include <cstdint>
+#include <optional>
+
+namespace optimize {
+
+// Simplify the integer arithmetic in a checked program. Constant expressions
+// are folded, chains of operations with constant operands are combined, and
+// multiplications of loop induction variables are replaced by variables which
+// are updated with additions whenever the induction variable changes.
+analysis::AnnotatedAst::TopLevel Optimize(
+    const analysis::AnnotatedAst::TopLevel& top_level);
+
+// Signed division by a constant can be computed as the high half of
+// a multiplication by a magic number, followed by a shift and corrections for
+// the sign. See Hacker's Delight, chapter 10.
+struct DivisionMagic {
+  std::int64_t multiplier;
+  int shift;
+};
+// The divisor must not be -1, 0, or 1.
+DivisionMagic SignedDivisionMagic(std::int64_t divisor);
+
+// If the magnitude of the value is a power of two, returns its logarithm.
+std::optional<int> Log2(std::int64_t value);
+
+}  // namespace optimize
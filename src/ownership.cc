@@ -0,0 +1,747 @@
+#include "ownership.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace ownership {
+namespace {
+
+using AnnotatedAst = analysis::AnnotatedAst;
+
+// Returns the variable whose storage is accessed in place when reading the
+// given array expression, or null if the array is a temporary value.
+const AnnotatedAst::Identifier* PlaceRoot(
+    const AnnotatedAst::Expression& expression) {
+  if (const auto* index = expression.get_if<AnnotatedAst::Index>())
+    return PlaceRoot(index->array);
+  return expression.get_if<AnnotatedAst::Identifier>();
+}
+
+// Finds variables which are never assigned after their definition. When one
+// such variable is initialized from another, neither can change while the
+// other is in use, so the new variable can alias the existing value. The
+// analysis makes two passes over each function: the first finds all assigned
+// variables and the second chooses the aliases. Later passes track aliases by
+// name, so both names involved must be unique within the function. The same
+// reasoning allows a variable which is the only value ever returned by its
+// function to live in the caller's storage for the result.
+class AliasAnalysis {
+ public:
+  explicit AliasAnalysis(Info* info) : info_(info) {}
+
+  void AnalyzeStatement(const AnnotatedAst::DefineVariable&);
+  void AnalyzeStatement(const AnnotatedAst::Assign&);
+  void AnalyzeStatement(const AnnotatedAst::AssignElement&);
+  void AnalyzeStatement(const AnnotatedAst::DoFunction&);
+  void AnalyzeStatement(const AnnotatedAst::If&);
+  void AnalyzeStatement(const AnnotatedAst::While&);
+  void AnalyzeStatement(const AnnotatedAst::ParallelFor&);
+  void AnalyzeStatement(const AnnotatedAst::ReturnVoid&);
+  void AnalyzeStatement(const AnnotatedAst::Return&);
+  void AnalyzeStatement(const std::vector<AnnotatedAst::Statement>&);
+  void AnalyzeAnyStatement(const AnnotatedAst::Statement&);
+
+  void AnalyzeTopLevel(const AnnotatedAst::DefineFunction&);
+  void AnalyzeTopLevel(const std::vector<AnnotatedAst::DefineFunction>&);
+  void AnalyzeAnyTopLevel(const AnnotatedAst::TopLevel&);
+
+ private:
+  // Variables are identified by the node which declares them.
+  using Variable = const AnnotatedAst::Identifier*;
+  Variable Lookup(std::string_view name) const;
+
+  Info* info_;
+  std::vector<std::map<std::string, Variable, std::less<>>> scopes_;
+  std::set<Variable> assigned_;
+  // The number of variables with each name in the current function.
+  std::map<std::string, int, std::less<>> definitions_;
+  std::vector<const AnnotatedAst::Return*> returns_;
+  bool choose_aliases_ = false;
+};
+
+void AliasAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DefineVariable& definition) {
+  const auto* source = definition.value.get_if<AnnotatedAst::Identifier>();
+  if (choose_aliases_ && source && definition.variable.type.is<types::Array>() &&
+      !assigned_.count(&definition.variable) &&
+      !assigned_.count(Lookup(source->name)) &&
+      definitions_[definition.variable.name] == 1 &&
+      definitions_[source->name] == 1) {
+    info_->aliases.insert(&definition);
+  }
+  if (!choose_aliases_) definitions_[definition.variable.name]++;
+  scopes_.back().emplace(definition.variable.name, &definition.variable);
+}
+
+void AliasAnalysis::AnalyzeStatement(const AnnotatedAst::Assign& assignment) {
+  assigned_.insert(Lookup(assignment.variable.name));
+}
+
+// Modifying an element modifies the array, so it can't be shared.
+void AliasAnalysis::AnalyzeStatement(
+    const AnnotatedAst::AssignElement& assignment) {
+  assigned_.insert(Lookup(assignment.variable.name));
+}
+
+void AliasAnalysis::AnalyzeStatement(const AnnotatedAst::DoFunction&) {}
+
+void AliasAnalysis::AnalyzeStatement(const AnnotatedAst::If& if_statement) {
+  AnalyzeStatement(if_statement.if_true);
+  AnalyzeStatement(if_statement.if_false);
+}
+
+void AliasAnalysis::AnalyzeStatement(
+    const AnnotatedAst::While& while_statement) {
+  AnalyzeStatement(while_statement.body);
+}
+
+void AliasAnalysis::AnalyzeStatement(
+    const AnnotatedAst::ParallelFor& parallel_for) {
+  if (!choose_aliases_) definitions_[parallel_for.variable.name]++;
+  scopes_.emplace_back();
+  scopes_.back().emplace(parallel_for.variable.name, &parallel_for.variable);
+  AnalyzeStatement(parallel_for.body);
+  scopes_.pop_back();
+}
+
+void AliasAnalysis::AnalyzeStatement(const AnnotatedAst::ReturnVoid&) {}
+
+void AliasAnalysis::AnalyzeStatement(
+    const AnnotatedAst::Return& return_statement) {
+  if (!choose_aliases_) returns_.push_back(&return_statement);
+}
+
+void AliasAnalysis::AnalyzeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  scopes_.emplace_back();
+  for (const auto& statement : statements) AnalyzeAnyStatement(statement);
+  scopes_.pop_back();
+}
+
+void AliasAnalysis::AnalyzeAnyStatement(
+    const AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { AnalyzeStatement(x); });
+}
+
+void AliasAnalysis::AnalyzeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  definitions_.clear();
+  returns_.clear();
+  for (const auto& parameter : definition.parameters)
+    definitions_[parameter.name]++;
+  for (bool choose_aliases : {false, true}) {
+    choose_aliases_ = choose_aliases;
+    scopes_.emplace_back();
+    for (const auto& parameter : definition.parameters)
+      scopes_.back().emplace(parameter.name, &parameter);
+    AnalyzeStatement(definition.body);
+    scopes_.pop_back();
+  }
+
+  // Look for a named return value. The variable must be defined at the top
+  // level of the body so that it is in scope for the rest of the function.
+  if (returns_.empty() || !definition.type.return_type.is<types::Array>())
+    return;
+  const auto* result =
+      returns_.front()->value.get_if<AnnotatedAst::Identifier>();
+  if (!result || definitions_[result->name] != 1) return;
+  for (const auto* return_statement : returns_) {
+    const auto* value =
+        return_statement->value.get_if<AnnotatedAst::Identifier>();
+    if (!value || value->name != result->name) return;
+  }
+  for (const auto& statement : definition.body) {
+    const auto* local = statement.get_if<AnnotatedAst::DefineVariable>();
+    if (local && local->variable.name == result->name &&
+        !info_->aliases.count(local)) {
+      info_->named_returns.insert(local);
+    }
+  }
+}
+
+void AliasAnalysis::AnalyzeTopLevel(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) AnalyzeTopLevel(definition);
+}
+
+void AliasAnalysis::AnalyzeAnyTopLevel(
+    const AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { AnalyzeTopLevel(x); });
+}
+
+AliasAnalysis::Variable AliasAnalysis::Lookup(std::string_view name) const {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = i->find(name);
+    if (j != i->end()) return j->second;
+  }
+  return nullptr;
+}
+
+// Infers which array parameters can be borrowed. A parameter can be borrowed
+// if the function never assigns to it and only passes it on as an argument for
+// other borrowed parameters. Any other read would either copy the value or
+// move it somewhere that outlives the call. Inference starts by assuming that
+// every array parameter can be borrowed and demotes parameters until nothing
+// changes.
+class BorrowAnalysis {
+ public:
+  explicit BorrowAnalysis(Info* info) : info_(info) {}
+
+  void AnalyzeExpression(const AnnotatedAst::Identifier&);
+  void AnalyzeExpression(const AnnotatedAst::Boolean&);
+  void AnalyzeExpression(const AnnotatedAst::Integer&);
+  void AnalyzeExpression(const AnnotatedAst::ArrayLiteral&);
+  void AnalyzeExpression(const AnnotatedAst::Arithmetic&);
+  void AnalyzeExpression(const AnnotatedAst::Compare&);
+  void AnalyzeExpression(const AnnotatedAst::Logical&);
+  void AnalyzeExpression(const AnnotatedAst::FunctionCall&);
+  void AnalyzeExpression(const AnnotatedAst::LogicalNot&);
+  void AnalyzeExpression(const AnnotatedAst::Index&);
+  void AnalyzeExpression(const AnnotatedAst::Size&);
+  void AnalyzeAnyExpression(const AnnotatedAst::Expression&);
+
+  void AnalyzeStatement(const AnnotatedAst::DefineVariable&);
+  void AnalyzeStatement(const AnnotatedAst::Assign&);
+  void AnalyzeStatement(const AnnotatedAst::AssignElement&);
+  void AnalyzeStatement(const AnnotatedAst::DoFunction&);
+  void AnalyzeStatement(const AnnotatedAst::If&);
+  void AnalyzeStatement(const AnnotatedAst::While&);
+  void AnalyzeStatement(const AnnotatedAst::ParallelFor&);
+  void AnalyzeStatement(const AnnotatedAst::ReturnVoid&);
+  void AnalyzeStatement(const AnnotatedAst::Return&);
+  void AnalyzeStatement(const std::vector<AnnotatedAst::Statement>&);
+  void AnalyzeAnyStatement(const AnnotatedAst::Statement&);
+
+  void AnalyzeTopLevel(const AnnotatedAst::DefineFunction&);
+  void AnalyzeTopLevel(const std::vector<AnnotatedAst::DefineFunction>&);
+  void AnalyzeAnyTopLevel(const AnnotatedAst::TopLevel&);
+
+ private:
+  // Returns the parameter modes for the given function, initially assuming
+  // that every array parameter can be borrowed.
+  std::vector<bool>& Initialize(const AnnotatedAst::DefineFunction&);
+  // Record that the named variable, if it is a parameter of the current
+  // function, can't be borrowed.
+  void Demote(std::string_view name);
+
+  Info* info_;
+  // The parameters of the function being analysed.
+  std::vector<bool>* borrowed_ = nullptr;
+  std::map<std::string, std::size_t, std::less<>> parameters_;
+  // Local variables in scope, which may shadow parameters. Aliases map to the
+  // name of the variable that they alias, and other variables to "".
+  std::vector<std::map<std::string, std::string, std::less<>>> scopes_;
+  bool changed_ = false;
+};
+
+void BorrowAnalysis::AnalyzeExpression(
+    const AnnotatedAst::Identifier& identifier) {
+  Demote(identifier.name);
+}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Boolean&) {}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Integer&) {}
+
+void BorrowAnalysis::AnalyzeExpression(
+    const AnnotatedAst::ArrayLiteral& array) {
+  for (const auto& part : array.parts) AnalyzeAnyExpression(part);
+}
+
+// Arrays which are combined element by element are read in place.
+void BorrowAnalysis::AnalyzeExpression(
+    const AnnotatedAst::Arithmetic& binary) {
+  if (!binary.left.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(binary.left);
+  if (!binary.right.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(binary.right);
+}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Compare& binary) {
+  if (!binary.left.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(binary.left);
+  if (!binary.right.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(binary.right);
+}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Logical& binary) {
+  AnalyzeAnyExpression(binary.left);
+  AnalyzeAnyExpression(binary.right);
+}
+
+void BorrowAnalysis::AnalyzeExpression(
+    const AnnotatedAst::FunctionCall& call) {
+  for (std::size_t i = 0, n = call.arguments.size(); i < n; i++) {
+    // Passing a variable on to a borrowed parameter doesn't copy it.
+    if (call.arguments[i].is<AnnotatedAst::Identifier>() &&
+        info_->IsBorrowed(call.function, i)) {
+      continue;
+    }
+    AnalyzeAnyExpression(call.arguments[i]);
+  }
+}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::LogicalNot& op) {
+  AnalyzeAnyExpression(op.argument);
+}
+
+// Arrays which are named by a variable are read in place, which doesn't copy
+// them.
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Index& index) {
+  if (!index.array.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(index.array);
+  AnalyzeAnyExpression(index.index);
+}
+
+void BorrowAnalysis::AnalyzeExpression(const AnnotatedAst::Size& size) {
+  if (!size.array.is<AnnotatedAst::Identifier>())
+    AnalyzeAnyExpression(size.array);
+}
+
+void BorrowAnalysis::AnalyzeAnyExpression(
+    const AnnotatedAst::Expression& expression) {
+  expression.visit([&](const auto& x) { AnalyzeExpression(x); });
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DefineVariable& definition) {
+  if (info_->aliases.count(&definition)) {
+    // Defining an alias doesn't read the value, but reading the alias does.
+    const auto& source = definition.value.get_if<AnnotatedAst::Identifier>();
+    scopes_.back().emplace(definition.variable.name, source->name);
+  } else {
+    AnalyzeAnyExpression(definition.value);
+    scopes_.back().emplace(definition.variable.name, "");
+  }
+}
+
+void BorrowAnalysis::AnalyzeStatement(const AnnotatedAst::Assign& assignment) {
+  AnalyzeAnyExpression(assignment.value);
+  Demote(assignment.variable.name);
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::AssignElement& assignment) {
+  AnalyzeAnyExpression(assignment.index);
+  AnalyzeAnyExpression(assignment.value);
+  Demote(assignment.variable.name);
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DoFunction& do_function) {
+  AnalyzeExpression(do_function.function_call);
+}
+
+void BorrowAnalysis::AnalyzeStatement(const AnnotatedAst::If& if_statement) {
+  AnalyzeAnyExpression(if_statement.condition);
+  AnalyzeStatement(if_statement.if_true);
+  AnalyzeStatement(if_statement.if_false);
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::While& while_statement) {
+  AnalyzeAnyExpression(while_statement.condition);
+  AnalyzeStatement(while_statement.body);
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::ParallelFor& parallel_for) {
+  AnalyzeAnyExpression(parallel_for.begin);
+  AnalyzeAnyExpression(parallel_for.end);
+  // The loop variable may shadow a parameter.
+  scopes_.emplace_back();
+  scopes_.back().emplace(parallel_for.variable.name, "");
+  AnalyzeStatement(parallel_for.body);
+  scopes_.pop_back();
+}
+
+void BorrowAnalysis::AnalyzeStatement(const AnnotatedAst::ReturnVoid&) {}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const AnnotatedAst::Return& return_statement) {
+  AnalyzeAnyExpression(return_statement.value);
+}
+
+void BorrowAnalysis::AnalyzeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements) {
+  scopes_.emplace_back();
+  for (const auto& statement : statements) AnalyzeAnyStatement(statement);
+  scopes_.pop_back();
+}
+
+void BorrowAnalysis::AnalyzeAnyStatement(
+    const AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { AnalyzeStatement(x); });
+}
+
+void BorrowAnalysis::AnalyzeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  borrowed_ = &Initialize(definition);
+  parameters_.clear();
+  for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++)
+    parameters_.emplace(definition.parameters[i].name, i);
+  AnalyzeStatement(definition.body);
+}
+
+void BorrowAnalysis::AnalyzeTopLevel(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) Initialize(definition);
+  do {
+    changed_ = false;
+    for (const auto& definition : definitions) AnalyzeTopLevel(definition);
+  } while (changed_);
+}
+
+void BorrowAnalysis::AnalyzeAnyTopLevel(
+    const AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { AnalyzeTopLevel(x); });
+}
+
+std::vector<bool>& BorrowAnalysis::Initialize(
+    const AnnotatedAst::DefineFunction& definition) {
+  auto [i, inserted] = info_->borrowed_parameters.try_emplace(definition.name);
+  if (inserted) {
+    for (const auto& parameter : definition.parameters)
+      i->second.push_back(parameter.type.is<types::Array>());
+  }
+  return i->second;
+}
+
+void BorrowAnalysis::Demote(std::string_view name) {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = i->find(name);
+    if (j == i->end()) continue;
+    if (!j->second.empty()) Demote(j->second);
+    return;
+  }
+  auto i = parameters_.find(name);
+  if (i == parameters_.end()) return;
+  auto&& borrowed = (*borrowed_)[i->second];
+  if (borrowed) {
+    borrowed = false;
+    changed_ = true;
+  }
+}
+
+// Names of the variables whose current value may still be read.
+using Live = std::set<std::string, std::less<>>;
+
+// Backwards liveness analysis over the structured AST. Each method takes the
+// set of variables which are live after the given construct and updates it to
+// the set of variables which are live before it. Any read of a variable which
+// is not live after the read is the last use of its value.
+class LastUseAnalysis {
+ public:
+  explicit LastUseAnalysis(Info* info) : info_(info) {}
+
+  void AnalyzeExpression(const AnnotatedAst::Identifier&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Boolean&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Integer&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::ArrayLiteral&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Arithmetic&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Compare&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Logical&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::FunctionCall&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::LogicalNot&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Index&, Live* live);
+  void AnalyzeExpression(const AnnotatedAst::Size&, Live* live);
+  void AnalyzeAnyExpression(const AnnotatedAst::Expression&, Live* live);
+
+  void AnalyzeStatement(const AnnotatedAst::DefineVariable&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::Assign&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::AssignElement&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::DoFunction&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::If&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::While&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::ParallelFor&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::ReturnVoid&, Live* live);
+  void AnalyzeStatement(const AnnotatedAst::Return&, Live* live);
+  void AnalyzeStatement(const std::vector<AnnotatedAst::Statement>&,
+                        Live* live);
+  void AnalyzeAnyStatement(const AnnotatedAst::Statement&, Live* live);
+
+  void AnalyzeTopLevel(const AnnotatedAst::DefineFunction&);
+  void AnalyzeTopLevel(const std::vector<AnnotatedAst::DefineFunction>&);
+  void AnalyzeAnyTopLevel(const AnnotatedAst::TopLevel&);
+
+ private:
+  std::string_view Owner(std::string_view name) const;
+  void KeepOperands(const AnnotatedAst::Expression& left,
+                    const AnnotatedAst::Expression& right, Live* live);
+
+  Info* info_;
+  // Loops are analysed repeatedly until the live set reaches a fixed point.
+  // Moves are only recorded once the final live sets are known.
+  bool record_ = true;
+  // Variables which are never considered dead within the current block.
+  Live shadowed_;
+  // Aliases in scope, mapped to the variable which owns their value. Reading
+  // an alias reads the owner.
+  std::map<std::string, std::string, std::less<>> owners_;
+};
+
+std::string_view LastUseAnalysis::Owner(std::string_view name) const {
+  auto i = owners_.find(name);
+  return i == owners_.end() ? name : i->second;
+}
+
+void LastUseAnalysis::AnalyzeExpression(
+    const AnnotatedAst::Identifier& identifier, Live* live) {
+  bool last_use = live->emplace(Owner(identifier.name)).second;
+  if (last_use && record_) info_->moves.insert(&identifier);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Boolean&, Live*) {}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Integer&, Live*) {}
+
+void LastUseAnalysis::AnalyzeExpression(
+    const AnnotatedAst::ArrayLiteral& array, Live* live) {
+  for (auto i = array.parts.rbegin(); i != array.parts.rend(); ++i)
+    AnalyzeAnyExpression(*i, live);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Arithmetic& binary,
+                                        Live* live) {
+  if (binary.type.is<types::Array>())
+    KeepOperands(binary.left, binary.right, live);
+  AnalyzeAnyExpression(binary.right, live);
+  AnalyzeAnyExpression(binary.left, live);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Compare& binary,
+                                        Live* live) {
+  if (AnnotatedAst::GetMeta(binary.left).type.is<types::Array>())
+    KeepOperands(binary.left, binary.right, live);
+  AnalyzeAnyExpression(binary.right, live);
+  AnalyzeAnyExpression(binary.left, live);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Logical& binary,
+                                        Live* live) {
+  // The right hand side may be skipped, but anything it reads is only live
+  // after the left hand side, so the order of analysis is unaffected.
+  AnalyzeAnyExpression(binary.right, live);
+  AnalyzeAnyExpression(binary.left, live);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::FunctionCall& call,
+                                        Live* live) {
+  // Variables passed to borrowed parameters are read by the callee, so they
+  // must remain valid until the call itself rather than being moved out by the
+  // evaluation of a later argument.
+  auto borrowed = [&](std::size_t i) {
+    return call.arguments[i].is<AnnotatedAst::Identifier>() &&
+           info_->IsBorrowed(call.function, i);
+  };
+  for (std::size_t i = 0, n = call.arguments.size(); i < n; i++) {
+    if (borrowed(i)) {
+      const auto& name =
+          call.arguments[i].get_if<AnnotatedAst::Identifier>()->name;
+      live->emplace(Owner(name));
+    }
+  }
+  for (std::size_t i = call.arguments.size(); i-- > 0;) {
+    if (!borrowed(i)) AnalyzeAnyExpression(call.arguments[i], live);
+  }
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::LogicalNot& op,
+                                        Live* live) {
+  AnalyzeAnyExpression(op.argument, live);
+}
+
+// Arrays which are named by a variable are read in place once all of the
+// indices have been evaluated, so the variable must still be valid then.
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Index& index,
+                                        Live* live) {
+  if (const auto* root = PlaceRoot(index.array))
+    live->emplace(Owner(root->name));
+  AnalyzeAnyExpression(index.index, live);
+  AnalyzeAnyExpression(index.array, live);
+}
+
+void LastUseAnalysis::AnalyzeExpression(const AnnotatedAst::Size& size,
+                                        Live* live) {
+  if (const auto* root = PlaceRoot(size.array))
+    live->emplace(Owner(root->name));
+  AnalyzeAnyExpression(size.array, live);
+}
+
+// Arrays which are combined element by element are read in place once both
+// operands have been evaluated, so any variables holding them must still be
+// valid then.
+void LastUseAnalysis::KeepOperands(const AnnotatedAst::Expression& left,
+                                   const AnnotatedAst::Expression& right,
+                                   Live* live) {
+  for (const auto* operand : {&left, &right}) {
+    if (const auto* root = PlaceRoot(*operand))
+      live->emplace(Owner(root->name));
+  }
+}
+
+void LastUseAnalysis::AnalyzeAnyExpression(
+    const AnnotatedAst::Expression& expression, Live* live) {
+  expression.visit([&](const auto& x) { AnalyzeExpression(x, live); });
+}
+
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DefineVariable& definition, Live* live) {
+  // Aliases share the lifetime of their owner, so there is nothing to do.
+  if (info_->aliases.count(&definition)) return;
+  if (!shadowed_.count(definition.variable.name))
+    live->erase(definition.variable.name);
+  AnalyzeAnyExpression(definition.value, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(const AnnotatedAst::Assign& assignment,
+                                       Live* live) {
+  if (!shadowed_.count(assignment.variable.name))
+    live->erase(assignment.variable.name);
+  AnalyzeAnyExpression(assignment.value, live);
+}
+
+// The rest of the array is preserved by the assignment, so the array must hold
+// its value until then.
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::AssignElement& assignment, Live* live) {
+  live->emplace(Owner(assignment.variable.name));
+  AnalyzeAnyExpression(assignment.value, live);
+  AnalyzeAnyExpression(assignment.index, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::DoFunction& do_function, Live* live) {
+  AnalyzeExpression(do_function.function_call, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(const AnnotatedAst::If& if_statement,
+                                       Live* live) {
+  Live if_true = *live;
+  AnalyzeStatement(if_statement.if_true, &if_true);
+  Live if_false = std::move(*live);
+  AnalyzeStatement(if_statement.if_false, &if_false);
+  *live = std::move(if_true);
+  live->insert(if_false.begin(), if_false.end());
+  AnalyzeAnyExpression(if_statement.condition, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::While& while_statement, Live* live) {
+  // Anything which is live at the head of the loop is also live at the end of
+  // the body. Iterate to find the smallest set satisfying this.
+  const Live after = std::move(*live);
+  auto head = [&](const Live& body_end) {
+    Live result = body_end;
+    AnalyzeStatement(while_statement.body, &result);
+    result.insert(after.begin(), after.end());
+    AnalyzeAnyExpression(while_statement.condition, &result);
+    return result;
+  };
+  const bool record = record_;
+  record_ = false;
+  Live current, next = head(current);
+  while (next != current) {
+    current = std::move(next);
+    next = head(current);
+  }
+  record_ = record;
+  *live = head(current);
+}
+
+// The body runs any number of times, like the body of a while loop, so
+// anything which it reads from outside stays live throughout. The loop
+// variable is an integer, so there is no need to track it.
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::ParallelFor& parallel_for, Live* live) {
+  const Live after = std::move(*live);
+  auto head = [&](const Live& body_end) {
+    Live result = body_end;
+    AnalyzeStatement(parallel_for.body, &result);
+    result.insert(after.begin(), after.end());
+    return result;
+  };
+  const bool record = record_;
+  record_ = false;
+  Live current, next = head(current);
+  while (next != current) {
+    current = std::move(next);
+    next = head(current);
+  }
+  record_ = record;
+  *live = head(current);
+  AnalyzeAnyExpression(parallel_for.end, live);
+  AnalyzeAnyExpression(parallel_for.begin, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(const AnnotatedAst::ReturnVoid&,
+                                       Live* live) {
+  live->clear();
+}
+
+void LastUseAnalysis::AnalyzeStatement(
+    const AnnotatedAst::Return& return_statement, Live* live) {
+  live->clear();
+  AnalyzeAnyExpression(return_statement.value, live);
+}
+
+void LastUseAnalysis::AnalyzeStatement(
+    const std::vector<AnnotatedAst::Statement>& statements, Live* live) {
+  // Variables defined in this block may shadow live variables of the same name
+  // from an enclosing scope. The analysis tracks variables by name, so it can't
+  // tell the two apart and must conservatively keep both alive throughout.
+  const Live shadowed = shadowed_;
+  const auto owners = owners_;
+  for (const auto& statement : statements) {
+    const auto* definition = statement.get_if<AnnotatedAst::DefineVariable>();
+    if (!definition) continue;
+    if (live->count(definition->variable.name))
+      shadowed_.insert(definition->variable.name);
+    if (info_->aliases.count(definition)) {
+      const auto& source = definition->value.get_if<AnnotatedAst::Identifier>();
+      owners_.emplace(definition->variable.name, Owner(source->name));
+    }
+  }
+  for (auto i = statements.rbegin(); i != statements.rend(); ++i)
+    AnalyzeAnyStatement(*i, live);
+  shadowed_ = shadowed;
+  owners_ = owners;
+}
+
+void LastUseAnalysis::AnalyzeAnyStatement(
+    const AnnotatedAst::Statement& statement, Live* live) {
+  statement.visit([&](const auto& x) { AnalyzeStatement(x, live); });
+}
+
+void LastUseAnalysis::AnalyzeTopLevel(
+    const AnnotatedAst::DefineFunction& definition) {
+  Live live;
+  AnalyzeStatement(definition.body, &live);
+}
+
+void LastUseAnalysis::AnalyzeTopLevel(
+    const std::vector<AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) AnalyzeTopLevel(definition);
+}
+
+void LastUseAnalysis::AnalyzeAnyTopLevel(
+    const AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { AnalyzeTopLevel(x); });
+}
+
+}  // namespace
+
+bool Info::IsBorrowed(std::string_view function, std::size_t parameter) const {
+  auto i = borrowed_parameters.find(function);
+  return i != borrowed_parameters.end() && i->second[parameter];
+}
+
+Info Analyze(const analysis::AnnotatedAst::TopLevel& top_level) {
+  Info info;
+  AliasAnalysis{&info}.AnalyzeAnyTopLevel(top_level);
+  BorrowAnalysis{&info}.AnalyzeAnyTopLevel(top_level);
+  LastUseAnalysis{&info}.AnalyzeAnyTopLevel(top_level);
+  return info;
+}
+
+}  // namespace ownership
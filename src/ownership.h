@@ -0,0 +1,37 @@
+#pragma once
+
+#include "analysis.h"
+
+#include <map>
+#include <set>
+
+namespace ownership {
+
+// Facts about the lifetimes of values in a checked program which allow the
+// code generator to avoid copying them. Nodes are identified by address, so the
+// annotated AST must not be copied or moved between the analysis and code
+// generation.
+struct Info {
+  // Reads of variables which are the last use of the value that the variable
+  // holds at that point. The value can be moved out of the variable instead of
+  // being copied.
+  std::set<const analysis::AnnotatedAst::Identifier*> moves;
+  // For each function, whether each of its parameters is borrowed. The callee
+  // never modifies or retains a borrowed parameter, so the caller can pass
+  // a pointer to its own value instead of a copy.
+  std::map<std::string, std::vector<bool>, std::less<>> borrowed_parameters;
+  // Definitions of the form `let b = a` where neither variable is ever
+  // assigned. The new variable is an alias for the storage of the existing one
+  // rather than a copy, and only the original owner destroys it.
+  std::set<const analysis::AnnotatedAst::DefineVariable*> aliases;
+  // Definitions of local array variables which every return statement in the
+  // function returns. The variable can be constructed directly in the storage
+  // that the caller provided for the result.
+  std::set<const analysis::AnnotatedAst::DefineVariable*> named_returns;
+
+  bool IsBorrowed(std::string_view function, std::size_t parameter) const;
+};
+
+Info Analyze(const analysis::AnnotatedAst::TopLevel& top_level);
+
+}  // namespace ownership
@@ -1,16 +1,24 @@
 #include "parser.h"
 
+#include "allocations.h"
+
 #include <algorithm>
 
 constexpr const char* kReservedIdentifiers[] = {
-    "boolean", "else",   "function", "if",   "integer",
-    "let",     "return", "while",    "true", "false",
+    "boolean", "else",   "function", "if",   "integer", "let",
+    "return",  "size",   "while",    "true", "false",   "parallel",
+    "for",     "in",
 };
 
 constexpr int kSpacesPerIndent = 2;
 
 types::Type Parser::ParseType() {
   Reader::Location location = reader_->location();
+  if (reader_->Consume("[")) {
+    auto element_type = ParseType();
+    CheckConsume("]");
+    return types::Array{std::move(element_type)};
+  }
   auto name = IdentifierPrefix();
   reader_->remove_prefix(name.length());
   if (name == "void") return types::Void{};
@@ -69,6 +77,18 @@ std::vector<ParsedAst::Expression> Parser::ParseExpressionList(
 }
 
 ParsedAst::Expression Parser::ParseTerm() {
+  auto term = ParsePrimary();
+  while (!reader_->empty() && reader_->front() == '[') {
+    auto location = reader_->location();
+    CheckConsume("[");
+    auto index = ParseExpression();
+    CheckConsume("]");
+    term = ParsedAst::Index{{location}, std::move(term), std::move(index)};
+  }
+  return term;
+}
+
+ParsedAst::Expression Parser::ParsePrimary() {
   // Check if this term is a nested expression.
   auto location = reader_->location();
   if (reader_->Consume("(")) {
@@ -90,6 +110,13 @@ ParsedAst::Expression Parser::ParseTerm() {
       reader_->remove_prefix(candidate.length());
       return ParsedAst::Boolean{{location}, candidate == "true"};
     }
+    if (candidate == "size") {
+      reader_->remove_prefix(candidate.length());
+      CheckConsume("(");
+      auto array = ParseExpression();
+      CheckConsume(")");
+      return ParsedAst::Size{{location}, std::move(array)};
+    }
     // Variables or function calls.
     auto identifier = ParseIdentifier();
     if (!reader_->empty() && reader_->front() == '(') {
@@ -245,8 +272,19 @@ ParsedAst::DefineVariable Parser::ParseVariableDefinition() {
       {location}, std::move(identifier), std::move(value)};
 }
 
-ParsedAst::Assign Parser::ParseAssignment() {
+ParsedAst::Statement Parser::ParseAssignment() {
   auto identifier = ParseIdentifier();
+  if (reader_->Consume("[")) {
+    auto index = ParseExpression();
+    CheckConsume("] ");
+    auto location = reader_->location();
+    CheckConsume("= ");
+    auto value = ParseExpression();
+    return ParsedAst::AssignElement{{location},
+                                    std::move(identifier),
+                                    std::move(index),
+                                    std::move(value)};
+  }
   CheckConsume(" ");
   auto location = reader_->location();
   CheckConsume("= ");
@@ -299,6 +337,23 @@ ParsedAst::While Parser::ParseWhileStatement(std::size_t indent) {
       {location}, std::move(condition), std::move(statements)};
 }
 
+ParsedAst::ParallelFor Parser::ParseParallelForStatement(std::size_t indent) {
+  auto location = reader_->location();
+  CheckConsume("parallel for (");
+  auto variable = ParseIdentifier();
+  CheckConsume(" in ");
+  auto begin = ParseExpression();
+  CheckConsume(" .. ");
+  auto end = ParseExpression();
+  CheckConsume(") ");
+  auto statements = ParseStatementBlock(indent);
+  return ParsedAst::ParallelFor{{location},
+                                std::move(variable),
+                                std::move(begin),
+                                std::move(end),
+                                std::move(statements)};
+}
+
 ParsedAst::Statement Parser::ParseStatement(std::size_t indent) {
   ParseComment(indent);
   if (reader_->starts_with("let ")) {
@@ -309,6 +364,8 @@ ParsedAst::Statement Parser::ParseStatement(std::size_t indent) {
     return ParseIfStatement(indent);
   } else if (reader_->starts_with("while ")) {
     return ParseWhileStatement(indent);
+  } else if (reader_->starts_with("parallel ")) {
+    return ParseParallelForStatement(indent);
   } else if (reader_->starts_with("return\n")) {
     auto location = reader_->location();
     CheckConsume("return");
@@ -373,6 +430,7 @@ ParsedAst::DefineFunction Parser::ParseFunctionDefinition() {
 }
 
 std::vector<ParsedAst::DefineFunction> Parser::ParseProgram() {
+  allocations::Scope scope{"Parser"};
   std::vector<ParsedAst::DefineFunction> definitions;
   definitions.push_back(ParseFunctionDefinition());
   while (!reader_->empty()) {
@@ -29,6 +29,7 @@ class Parser {
   ParsedAst::Integer ParseInteger();
   std::vector<ParsedAst::Expression> ParseExpressionList(std::string_view begin,
                                                          std::string_view end);
+  ParsedAst::Expression ParsePrimary();
   ParsedAst::Expression ParseTerm();
   ParsedAst::Expression ParseUnary();
   ParsedAst::Expression ParseProduct();
@@ -39,10 +40,11 @@ class Parser {
   ParsedAst::Expression ParseExpression();
 
   ParsedAst::DefineVariable ParseVariableDefinition();
-  ParsedAst::Assign ParseAssignment();
+  ParsedAst::Statement ParseAssignment();
   ParsedAst::DoFunction ParseDoFunction();
   ParsedAst::If ParseIfStatement(std::size_t indent);
   ParsedAst::While ParseWhileStatement(std::size_t indent);
+  ParsedAst::ParallelFor ParseParallelForStatement(std::size_t indent);
   ParsedAst::Statement ParseStatement(std::size_t indent);
   std::vector<ParsedAst::Statement> ParseStatementBlock(std::size_t indent);
 
@@ -0,0 +1,223 @@
+#include "process.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <thread>
+
+extern char** environ;
+
+namespace process {
+namespace {
+
+// The argument vector for exec, which refers to the strings in place.
+std::vector<char*> Arguments(const std::vector<std::string>& arguments) {
+  std::vector<char*> result;
+  for (const auto& argument : arguments) {
+    result.push_back(const_cast<char*>(argument.c_str()));
+  }
+  result.push_back(nullptr);
+  return result;
+}
+
+int Failed(std::string_view name, int error) {
+  std::cerr << "Failed to run " << name << ": " << std::strerror(error)
+            << '\n';
+  return 127;
+}
+
+// The innermost measurement in progress on this thread.
+thread_local ChildUsage* current_usage;
+
+std::int64_t Microseconds(const timeval& time) {
+  return std::int64_t{time.tv_sec} * 1'000'000 + time.tv_usec;
+}
+
+int Wait(std::string_view name, pid_t child, int watch) {
+  if (watch >= 0) {
+    const int process = static_cast<int>(syscall(SYS_pidfd_open, child, 0));
+    if (process >= 0) {
+      pollfd events[] = {{process, POLLIN, 0}, {watch, POLLRDHUP, 0}};
+      while (poll(events, 2, -1) < 0 && errno == EINTR) {
+      }
+      if (events[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+        kill(child, SIGKILL);
+      }
+      close(process);
+    }
+  }
+  int status;
+  rusage usage;
+  while (wait4(child, &status, 0, &usage) < 0) {
+    if (errno != EINTR) return Failed(name, errno);
+  }
+  if (current_usage) {
+    current_usage->Add(Usage{
+        Microseconds(usage.ru_utime) + Microseconds(usage.ru_stime),
+        usage.ru_maxrss});
+  }
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+}  // namespace
+
+ChildUsage::ChildUsage() : outer_(current_usage) { current_usage = this; }
+
+ChildUsage::~ChildUsage() { current_usage = outer_; }
+
+void ChildUsage::Add(const Usage& child) {
+  for (auto* usage = this; usage; usage = usage->outer_) {
+    usage->usage_.cpu += child.cpu;
+    usage->usage_.peak_memory =
+        std::max(usage->usage_.peak_memory, child.peak_memory);
+  }
+}
+
+MemoryFile::MemoryFile(const char* name)
+    : descriptor_(memfd_create(name, MFD_CLOEXEC)) {
+  if (descriptor_ < 0) {
+    throw std::system_error(errno, std::generic_category(), "memfd_create");
+  }
+  // The descriptor is not inherited, so other processes reach it through this
+  // process instead of through /proc/self.
+  path_ = "/proc/" + std::to_string(getpid()) + "/fd/" +
+          std::to_string(descriptor_);
+}
+
+MemoryFile::~MemoryFile() { close(descriptor_); }
+
+int Run(const std::vector<std::string>& arguments, const Options& options) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (int i = 0; i < 3; i++) {
+    const int descriptor = options.descriptors[static_cast<std::size_t>(i)];
+    if (descriptor != i) {
+      posix_spawn_file_actions_adddup2(&actions, descriptor, i);
+    }
+  }
+  // Programs get the default action for SIGPIPE even if this process ignores
+  // it.
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &defaults);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+  int pipe_ends[2] = {-1, -1};
+  if (options.input) {
+    if (pipe2(pipe_ends, O_CLOEXEC) != 0) return Failed(arguments[0], errno);
+    posix_spawn_file_actions_adddup2(&actions, pipe_ends[0], STDIN_FILENO);
+  }
+  if (options.quiet) {
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  }
+  auto argv = Arguments(arguments);
+  pid_t child;
+  const int error = posix_spawnp(&child, argv[0], &actions, &attributes,
+                                 argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  if (options.input) {
+    close(pipe_ends[0]);
+    if (error == 0) {
+      // A program which exits without reading all of its input would
+      // otherwise kill this process with SIGPIPE. The signal is blocked in
+      // this thread alone and then discarded, so that other threads can run
+      // programs at the same time.
+      sigset_t pipe_signal, previous;
+      sigemptyset(&pipe_signal);
+      sigaddset(&pipe_signal, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &pipe_signal, &previous);
+      bool broken = false;
+      std::string_view input = *options.input;
+      while (!input.empty()) {
+        const ssize_t written = write(pipe_ends[1], input.data(), input.size());
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+          broken = written < 0 && errno == EPIPE;
+          break;
+        }
+        input.remove_prefix(static_cast<std::size_t>(written));
+      }
+      if (broken && !sigismember(&previous, SIGPIPE)) {
+        const timespec now = {};
+        while (sigtimedwait(&pipe_signal, nullptr, &now) < 0 &&
+               errno == EINTR) {
+        }
+      }
+      pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+    close(pipe_ends[1]);
+  }
+  if (error != 0) return Failed(arguments[0], error);
+  return Wait(arguments[0], child, options.watch);
+}
+
+std::vector<int> RunAll(const std::vector<std::function<int()>>& tasks,
+                        unsigned jobs) {
+  std::vector<int> statuses(tasks.size());
+  std::atomic<std::size_t> next = 0;
+  auto work = [&] {
+    for (std::size_t i = next++; i < tasks.size(); i = next++) {
+      statuses[i] = tasks[i]();
+    }
+  };
+  std::vector<std::thread> threads;
+  const std::size_t extra = std::min<std::size_t>(jobs, tasks.size());
+  for (std::size_t i = 1; i < extra; i++) threads.emplace_back(work);
+  work();
+  for (auto& thread : threads) thread.join();
+  return statuses;
+}
+
+int Call(const std::function<int()>& function, const Options& options) {
+  const pid_t child = fork();
+  if (child < 0) return Failed("child process", errno);
+  if (child == 0) {
+    for (int i = 0; i < 3; i++) {
+      const int descriptor = options.descriptors[static_cast<std::size_t>(i)];
+      if (descriptor != i) dup2(descriptor, i);
+    }
+    signal(SIGPIPE, SIG_DFL);
+    const int status = function();
+    std::fflush(nullptr);
+    _exit(status);
+  }
+  return Wait("child process", child, options.watch);
+}
+
+int Exec(const MemoryFile& file) {
+  std::cout.flush();
+  const std::vector<std::string> arguments = {"gel-output"};
+  auto argv = Arguments(arguments);
+  fexecve(file.descriptor(), argv.data(), environ);
+  return Failed(arguments[0], errno);
+}
+
+int Exec(const std::string& path) {
+  std::cout.flush();
+  const std::vector<std::string> arguments = {path};
+  auto argv = Arguments(arguments);
+  execv(path.c_str(), argv.data());
+  return Failed(path, errno);
+}
+
+}  // namespace process
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace process {
+
+// A file which only exists in memory and disappears once it is closed.
+class MemoryFile {
+ public:
+  explicit MemoryFile(const char* name);
+  ~MemoryFile();
+  MemoryFile(const MemoryFile&) = delete;
+  MemoryFile& operator=(const MemoryFile&) = delete;
+
+  // A path which refers to the file for as long as this process is alive, so
+  // that other programs can read and write it.
+  const std::string& path() const { return path_; }
+  int descriptor() const { return descriptor_; }
+
+ private:
+  int descriptor_;
+  std::string path_;
+};
+
+struct Options {
+  // The standard input, output and error of the program. By default, these are
+  // shared with this process.
+  std::array<int, 3> descriptors = {0, 1, 2};
+  // Written to the standard input of the program through a pipe. Otherwise,
+  // the program shares the standard input of this process.
+  std::optional<std::string_view> input;
+  // Discard everything the program writes to its standard output and error.
+  bool quiet = false;
+  // If set, the program is killed as soon as the other end of this socket
+  // hangs up, since nobody is waiting for it any more.
+  int watch = -1;
+};
+
+// The resources used by child processes, as the kernel reports them when each
+// one exits.
+struct Usage {
+  // User and system CPU time in microseconds.
+  std::int64_t cpu = 0;
+  // The largest peak resident set size of any of them, in KiB.
+  std::int64_t peak_memory = 0;
+};
+
+// Measures the child processes which the current thread waits for between
+// construction and destruction. Measurements on one thread nest, and a child
+// counts towards every one in progress. Children which other threads wait for
+// are not counted, so concurrent compilations are measured separately.
+class ChildUsage {
+ public:
+  ChildUsage();
+  ~ChildUsage();
+  ChildUsage(const ChildUsage&) = delete;
+  ChildUsage& operator=(const ChildUsage&) = delete;
+
+  const Usage& usage() const { return usage_; }
+  // Count a child towards this measurement and the ones enclosing it.
+  void Add(const Usage& child);
+
+ private:
+  ChildUsage* outer_;
+  Usage usage_;
+};
+
+// Run a program without going through a shell and wait for it to finish. The
+// program is looked up in PATH unless its name contains a slash. Returns its
+// exit status, 128 plus the signal number if it was killed by a signal, or 127
+// if it could not be started.
+int Run(const std::vector<std::string>& arguments,
+        const Options& options = {});
+
+// Call the functions on a pool of threads with at most the given number of
+// them running at once, and return their results in the same order. Each one
+// typically runs a program and waits for it.
+std::vector<int> RunAll(const std::vector<std::function<int()>>& tasks,
+                        unsigned jobs);
+
+// Run the function in a child process, as though it were a program. Only the
+// descriptors and watch options apply. Returns its result like Run.
+int Call(const std::function<int()>& function, const Options& options);
+
+// Replace this process with the program in the file, or with the program at
+// the path. These only return if the program could not be started, in which
+// case they return 127 like Run.
+int Exec(const MemoryFile& file);
+int Exec(const std::string& path);
+
+}  // namespace process
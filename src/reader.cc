@@ -48,6 +48,7 @@ void Reader::remove_prefix(std::size_t length) {
     }
   }
   offset_ += length;
+  if (length > 0) tokens_++;
 }
 
 bool Reader::Consume(std::string_view prefix) {
@@ -25,6 +25,9 @@ class Reader {
       : input_name_(std::move(input_name)), source_(std::move(source)) {}
 
   Location location() const;
+  // The number of tokens consumed so far: each keyword, name, literal,
+  // operator, indent and line break counts as one.
+  std::size_t tokens() const { return tokens_; }
   std::string_view remaining() const;
   std::string_view prefix(std::size_t length) const;
 
@@ -43,6 +46,7 @@ class Reader {
   std::string input_name_;
   std::string source_;
   std::size_t offset_ = 0;
+  std::size_t tokens_ = 0;
   int line_ = 1, column_ = 1;
 };
 
@@ -0,0 +1,172 @@
+#include "report.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+
+namespace report {
+namespace {
+
+// Threads are numbered in the order that they first finish a phase.
+int ThreadNumber() {
+  static std::atomic<int> next;
+  thread_local const int number = next++;
+  return number;
+}
+
+// The number of phases being measured on this thread.
+thread_local int depth;
+
+std::int64_t Microseconds(const timeval& time) {
+  return std::int64_t{time.tv_sec} * 1'000'000 + time.tv_usec;
+}
+
+// The CPU time used by this thread. Tools such as gcc run in child processes,
+// and phases add the time of the ones they wait for separately.
+std::int64_t CpuTime() {
+  rusage thread;
+  getrusage(RUSAGE_THREAD, &thread);
+  return Microseconds(thread.ru_utime) + Microseconds(thread.ru_stime);
+}
+
+struct Quoted {
+  std::string_view text;
+};
+
+std::ostream& operator<<(std::ostream& output, Quoted quoted) {
+  output << '"';
+  for (char c : quoted.text) {
+    if (c == '"' || c == '\\') {
+      output << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      output << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << int{c} << std::dec << std::setfill(' ');
+    } else {
+      output << c;
+    }
+  }
+  return output << '"';
+}
+
+}  // namespace
+
+Report::Report() : start_(std::chrono::steady_clock::now()) {}
+
+std::int64_t Report::Now() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start_)
+      .count();
+}
+
+void Report::Count(std::string_view name, std::int64_t amount) {
+  const std::int64_t time = Now();
+  std::lock_guard lock{mutex_};
+  auto i = std::find_if(counters_.begin(), counters_.end(),
+                        [&](const Counter& counter) {
+                          return counter.name == name;
+                        });
+  if (i == counters_.end()) {
+    counters_.push_back(Counter{std::string{name}, amount, time});
+  } else {
+    i->total += amount;
+    i->time = time;
+  }
+}
+
+void Report::Print(std::ostream& output) const {
+  std::vector<Span> spans;
+  std::vector<Counter> counters;
+  {
+    std::lock_guard lock{mutex_};
+    spans = spans_;
+    counters = counters_;
+  }
+  // Phases are recorded when they finish, so enclosing phases come after the
+  // phases within them until they are sorted.
+  std::stable_sort(spans.begin(), spans.end(),
+                   [](const Span& left, const Span& right) {
+                     return left.start < right.start;
+                   });
+  std::ostringstream table;
+  table << std::fixed << std::left << std::setw(32) << "Phase" << std::right
+        << std::setw(12) << "Wall (ms)" << std::setw(12) << "CPU (ms)"
+        << std::setw(20) << "Process peak (MiB)" << std::setw(17)
+        << "Tool peak (MiB)" << '\n';
+  for (const auto& span : spans) {
+    const std::string name =
+        std::string(2 * static_cast<std::size_t>(span.depth), ' ') + span.name;
+    table << std::left << std::setw(32) << name << std::right
+          << std::setprecision(2) << std::setw(12)
+          << static_cast<double>(span.end - span.start) / 1000
+          << std::setw(12) << static_cast<double>(span.cpu) / 1000
+          << std::setprecision(1) << std::setw(20)
+          << static_cast<double>(span.process_peak_memory) / 1024
+          << std::setw(17) << static_cast<double>(span.tool_peak_memory) / 1024
+          << '\n';
+  }
+  if (!counters.empty()) {
+    table << "\nCounter\n";
+    for (const auto& counter : counters) {
+      table << std::left << std::setw(32) << counter.name << std::right
+            << std::setw(12) << counter.total << '\n';
+    }
+  }
+  output << table.str();
+}
+
+void Report::PrintTrace(std::ostream& output) const {
+  std::lock_guard lock{mutex_};
+  const pid_t process = getpid();
+  output << "{\"traceEvents\": [";
+  bool first = true;
+  for (const auto& span : spans_) {
+    output << (first ? "\n" : ",\n") << "  {\"name\": " << Quoted{span.name}
+           << ", \"cat\": \"gel\", \"ph\": \"X\", \"pid\": " << process
+           << ", \"tid\": " << span.thread << ", \"ts\": " << span.start
+           << ", \"dur\": " << span.end - span.start
+           << ", \"args\": {\"cpu_us\": " << span.cpu
+           << ", \"process_peak_rss_kib\": " << span.process_peak_memory
+           << ", \"tool_peak_rss_kib\": " << span.tool_peak_memory << "}}";
+    first = false;
+  }
+  for (const auto& counter : counters_) {
+    output << (first ? "\n" : ",\n") << "  {\"name\": " << Quoted{counter.name}
+           << ", \"cat\": \"gel\", \"ph\": \"C\", \"pid\": " << process
+           << ", \"ts\": " << counter.time << ", \"args\": {\"value\": "
+           << counter.total << "}}";
+    first = false;
+  }
+  output << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+Phase::Phase(Report* report, std::string name)
+    : report_(report), name_(std::move(name)), scope_(name_) {
+  if (!report_) return;
+  depth_ = depth++;
+  start_ = report_->Now();
+  cpu_ = CpuTime();
+}
+
+Phase::~Phase() {
+  if (!report_) return;
+  depth--;
+  rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  const process::Usage& children = children_.usage();
+  Report::Span span{name_,
+                    ThreadNumber(),
+                    depth_,
+                    start_,
+                    report_->Now(),
+                    CpuTime() - cpu_ + children.cpu,
+                    self.ru_maxrss,
+                    children.peak_memory};
+  std::lock_guard lock{report_->mutex_};
+  report_->spans_.push_back(std::move(span));
+}
+
+}  // namespace report
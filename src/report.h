@@ -0,0 +1,88 @@
+#pragma once
+
+#include "allocations.h"
+#include "process.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace report {
+
+// The time and memory spent in each phase of a compilation, along with
+// counters of the work done. Phases may be measured on several threads at
+// once, such as when translation units are compiled in parallel.
+class Report {
+ public:
+  Report();
+
+  // Add to the counter with the given name.
+  void Count(std::string_view name, std::int64_t amount);
+
+  // Write a table of the phases in the order they started, followed by the
+  // counters.
+  void Print(std::ostream& output) const;
+  // Write the phases and counters as Chrome trace events, which can be shown
+  // on a timeline by chrome://tracing or Perfetto.
+  void PrintTrace(std::ostream& output) const;
+
+ private:
+  friend class Phase;
+
+  struct Span {
+    std::string name;
+    int thread;
+    // The depth of phases enclosing this one on the same thread.
+    int depth;
+    // Microseconds since the report was created.
+    std::int64_t start, end;
+    // CPU time of the thread and of the processes it waited for.
+    std::int64_t cpu;
+    // The peak resident set size of the whole process so far, which includes
+    // every phase before this one and those on other threads, in KiB.
+    std::int64_t process_peak_memory;
+    // The peak resident set size of the largest process that the thread waited
+    // for during the phase, in KiB.
+    std::int64_t tool_peak_memory;
+  };
+
+  struct Counter {
+    std::string name;
+    std::int64_t total;
+    // When the counter last changed, in microseconds.
+    std::int64_t time;
+  };
+
+  std::int64_t Now() const;
+
+  const std::chrono::steady_clock::time_point start_;
+  mutable std::mutex mutex_;
+  std::vector<Span> spans_;
+  std::vector<Counter> counters_;
+};
+
+// Measures a phase from construction to destruction. Phases which are given
+// no report measure nothing, so they can be left in place. Phases are counted
+// as allocation sites either way.
+class Phase {
+ public:
+  Phase(Report* report, std::string name);
+  ~Phase();
+  Phase(const Phase&) = delete;
+  Phase& operator=(const Phase&) = delete;
+
+ private:
+  Report* report_;
+  std::string name_;
+  allocations::Scope scope_;
+  process::ChildUsage children_;
+  int depth_ = 0;
+  std::int64_t start_ = 0;
+  std::int64_t cpu_ = 0;
+};
+
+}  // namespace report
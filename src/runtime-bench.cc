@@ -0,0 +1,409 @@
+#include "driver.h"
+#include "process.h"
+#include "target-c.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+struct Options {
+  // The directory of gel programs, with hand-written C versions of some of
+  // them in a baselines directory within it.
+  std::filesystem::path corpus = "bench";
+  std::size_t runs = 5;
+  // Where to write the results, and the results of an earlier run to compare
+  // against.
+  std::string json;
+  std::string compare;
+  // How much slower than before a program may get, in percent, before it
+  // counts as a regression.
+  double threshold = 10;
+};
+
+constexpr int kLevels[] = {0, 1, 2, 3};
+// The levels at which programs also run on the bytecode interpreter. Higher
+// levels only change how gcc builds the C, so they would run the same bytecode.
+constexpr int kInterpreterLevels[] = {0, 1};
+
+// Programs which take less time than this are too noisy to compare between
+// runs, so they never count as regressions.
+constexpr double kMinimumCompared = 5;
+
+// The median and the fastest of the runs of one build of a program.
+struct Timing {
+  std::string program;
+  int level;
+  // "gel", "c", or "vm" for gel's bytecode interpreter.
+  std::string build;
+  double median, min;
+};
+
+// gel's C and the baselines are both built with the same command as gel uses
+// for its own C, so that only the code differs.
+int Compile(const std::string& code, int level,
+            const process::MemoryFile& binary) {
+  process::Options options;
+  options.input = code;
+  auto command = target::c::CompileCommand(level);
+  command.insert(command.end(), {"-o", binary.path()});
+  return process::Run(command, options);
+}
+
+// Runs one build of a program once with the given descriptors, and returns its
+// exit status.
+using Runner = std::function<int(const process::Options&)>;
+
+// Run the program once and return what it printed, or nothing if it failed.
+std::optional<std::string> Output(const Runner& run) {
+  process::MemoryFile output{"gel-runtime-bench-output"};
+  process::Options options;
+  options.descriptors[1] = output.descriptor();
+  if (run(options) != 0) return std::nullopt;
+  std::string text;
+  char buffer[4096];
+  lseek(output.descriptor(), 0, SEEK_SET);
+  while (true) {
+    const ssize_t size = read(output.descriptor(), buffer, sizeof(buffer));
+    if (size <= 0) break;
+    text.append(buffer, static_cast<std::size_t>(size));
+  }
+  return text;
+}
+
+// The time each run takes, including starting the process, in milliseconds.
+std::optional<std::pair<double, double>> Time(const Runner& run,
+                                              std::size_t runs) {
+  const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  process::Options options;
+  options.descriptors[1] = null;
+  std::vector<double> times;
+  for (std::size_t i = 0; i < runs; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    const int status = run(options);
+    const auto end = std::chrono::steady_clock::now();
+    if (status != 0) break;
+    times.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  close(null);
+  if (times.size() != runs) return std::nullopt;
+  std::sort(times.begin(), times.end());
+  const std::size_t middle = runs / 2;
+  const double median =
+      runs % 2 ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+  return std::pair{median, times.front()};
+}
+
+std::string Name(const Timing& build) {
+  return build.program + " -O" + std::to_string(build.level) + " (" +
+         build.build + ")";
+}
+
+// Check that the program prints the expected output, and time it. The first
+// build of each program decides what the output should be.
+bool Measure(const Runner& run, const Timing& build, const Options& options,
+             std::optional<std::string>* expected,
+             std::vector<Timing>* timings) {
+  const auto name = Name(build);
+  const auto output = Output(run);
+  if (!output) {
+    std::cerr << name << " failed.\n";
+    return false;
+  }
+  if (!*expected) *expected = output;
+  if (*output != **expected) {
+    std::cerr << name << " printed something different from "
+              << build.program << " -O0 (gel).\n";
+    return false;
+  }
+  const auto time = Time(run, options.runs);
+  if (!time) {
+    std::cerr << name << " failed.\n";
+    return false;
+  }
+  Timing timing = build;
+  std::tie(timing.median, timing.min) = *time;
+  timings->push_back(timing);
+  return true;
+}
+
+bool MeasureC(const std::string& code, const Timing& build,
+              const Options& options, std::optional<std::string>* expected,
+              std::vector<Timing>* timings) {
+  process::MemoryFile binary{"gel-runtime-bench"};
+  if (Compile(code, build.level, binary) != 0) {
+    std::cerr << "Failed to compile " << Name(build) << ".\n";
+    return false;
+  }
+  auto run = [&](const process::Options& run_options) {
+    return process::Run({binary.path()}, run_options);
+  };
+  return Measure(run, build, options, expected, timings);
+}
+
+// The interpreter has no binary to run, so each run goes through the driver
+// from the source. The time includes translating the program to bytecode,
+// which is small next to running it.
+bool MeasureInterpreter(const std::string& source, const Timing& build,
+                        const Options& options,
+                        std::optional<std::string>* expected,
+                        std::vector<Timing>* timings) {
+  const std::string flag = "-O" + std::to_string(build.level);
+  auto run = [&](const process::Options& run_options) {
+    driver::Environment environment;
+    environment.descriptors = run_options.descriptors;
+    environment.exec = false;
+    return driver::Run({"--vm", flag}, source, environment);
+  };
+  return Measure(run, build, options, expected, timings);
+}
+
+bool MeasureProgram(const std::filesystem::path& path, const Options& options,
+                    std::vector<Timing>* timings) {
+  const std::string program = path.stem().string();
+  std::ifstream file{path};
+  const std::string source{std::istreambuf_iterator<char>{file}, {}};
+  const auto baseline_path =
+      options.corpus / "baselines" / (program + ".c");
+  std::optional<std::string> baseline;
+  if (std::ifstream baseline_file{baseline_path}) {
+    baseline.emplace(std::istreambuf_iterator<char>{baseline_file},
+                     std::istreambuf_iterator<char>{});
+  }
+  std::optional<std::string> expected;
+  bool ok = true;
+  for (int level : kLevels) {
+    std::ostringstream code;
+    driver::Environment environment;
+    environment.output = &code;
+    const std::string flag = "-O" + std::to_string(level);
+    if (driver::Run({"--emit", flag}, source, environment) != 0) {
+      std::cerr << "Failed to compile " << program << " " << flag << ".\n";
+      return false;
+    }
+    ok = MeasureC(code.str(), Timing{program, level, "gel", 0, 0}, options,
+                  &expected, timings) &&
+         ok;
+    if (baseline) {
+      ok = MeasureC(*baseline, Timing{program, level, "c", 0, 0}, options,
+                    &expected, timings) &&
+           ok;
+    }
+  }
+  for (int level : kInterpreterLevels) {
+    ok = MeasureInterpreter(source, Timing{program, level, "vm", 0, 0},
+                            options, &expected, timings) &&
+         ok;
+  }
+  return ok;
+}
+
+void PrintTable(const std::vector<Timing>& timings) {
+  std::map<std::tuple<std::string, int, std::string>, double> medians;
+  for (const auto& timing : timings) {
+    medians[{timing.program, timing.level, timing.build}] = timing.median;
+  }
+  std::cout << std::left << std::setw(16) << "Program" << std::setw(7)
+            << "Level" << std::right << std::setw(12) << "gel (ms)"
+            << std::setw(12) << "C (ms)" << std::setw(10) << "gel / C"
+            << std::setw(12) << "VM (ms)" << std::setw(10) << "VM / C" << '\n'
+            << std::fixed << std::setprecision(2);
+  for (const auto& timing : timings) {
+    if (timing.build != "gel") continue;
+    std::cout << std::left << std::setw(16) << timing.program << std::setw(7)
+              << "-O" + std::to_string(timing.level) << std::right
+              << std::setw(12) << timing.median;
+    const auto c = medians.find({timing.program, timing.level, "c"});
+    const auto vm = medians.find({timing.program, timing.level, "vm"});
+    if (c == medians.end()) {
+      std::cout << std::setw(12) << "-" << std::setw(10) << "-";
+    } else {
+      std::cout << std::setw(12) << c->second << std::setw(10)
+                << timing.median / c->second;
+    }
+    if (vm == medians.end()) {
+      std::cout << std::setw(12) << "-" << std::setw(10) << "-";
+    } else if (c == medians.end()) {
+      std::cout << std::setw(12) << vm->second << std::setw(10) << "-";
+    } else {
+      std::cout << std::setw(12) << vm->second << std::setw(10)
+                << vm->second / c->second;
+    }
+    std::cout << '\n';
+  }
+}
+
+// Results are written one to a line, so that --compare can read them back
+// without a JSON parser.
+void PrintJson(std::ostream& output, const std::vector<Timing>& timings,
+               const Options& options) {
+  output << std::fixed << std::setprecision(3) << "{\"runs\": " << options.runs
+         << ", \"results\": [";
+  for (std::size_t i = 0; i < timings.size(); i++) {
+    const auto& timing = timings[i];
+    output << (i ? ",\n" : "\n") << "  {\"program\": \"" << timing.program
+           << "\", \"level\": " << timing.level << ", \"build\": \""
+           << timing.build << "\", \"median_ms\": " << timing.median
+           << ", \"min_ms\": " << timing.min << "}";
+  }
+  output << "\n]}\n";
+}
+
+// The value of a field in a line written by PrintJson, without quotes.
+std::string_view Field(std::string_view line, std::string_view key) {
+  const std::string pattern = "\"" + std::string{key} + "\": ";
+  const auto start = line.find(pattern);
+  if (start == std::string_view::npos) return {};
+  auto value = line.substr(start + pattern.size());
+  value = value.substr(0, value.find_first_of(",}"));
+  if (value.size() >= 2 && value.front() == '"') {
+    value = value.substr(1, value.size() - 2);
+  }
+  return value;
+}
+
+template <typename T>
+bool ParseNumber(std::string_view text, T* value) {
+  const auto end = text.data() + text.size();
+  const auto [parsed, error] = std::from_chars(text.data(), end, *value);
+  return error == std::errc{} && parsed == end;
+}
+
+// Report every program which gel has made slower than it was in the earlier
+// results by more than the threshold, whether compiled or interpreted. Returns
+// whether there were any. Programs with a baseline are compared by how much
+// slower than C they are, so that results from a slower or busier machine are
+// still comparable.
+bool Compare(std::istream& input, const std::vector<Timing>& timings,
+             const Options& options) {
+  using Key = std::tuple<std::string, int, std::string>;
+  std::map<Key, double> before, after;
+  std::string line;
+  while (std::getline(input, line)) {
+    int level;
+    double median;
+    if (ParseNumber(Field(line, "level"), &level) &&
+        ParseNumber(Field(line, "median_ms"), &median)) {
+      before[{std::string{Field(line, "program")}, level,
+              std::string{Field(line, "build")}}] = median;
+    }
+  }
+  for (const auto& timing : timings) {
+    after[{timing.program, timing.level, timing.build}] = timing.median;
+  }
+  bool regressed = false;
+  for (const auto& timing : timings) {
+    if (timing.build == "c") continue;
+    const auto old = before.find({timing.program, timing.level, timing.build});
+    if (old == before.end() || old->second < kMinimumCompared) continue;
+    const auto old_c = before.find({timing.program, timing.level, "c"});
+    const auto new_c = after.find({timing.program, timing.level, "c"});
+    const bool relative = old_c != before.end() && new_c != after.end();
+    const double change =
+        relative ? (timing.median / new_c->second) /
+                           (old->second / old_c->second) * 100 - 100
+                 : (timing.median / old->second - 1) * 100;
+    if (change <= options.threshold) continue;
+    std::cout << "Regression: " << Name(timing) << " took " << timing.median
+              << " ms, up from " << old->second << " ms";
+    if (relative) {
+      std::cout << ", and " << timing.median / new_c->second
+                << " times as long as C, up from "
+                << old->second / old_c->second;
+    }
+    std::cout << " (+" << change << "%).\n";
+    regressed = true;
+  }
+  return regressed;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Every program in the corpus is built at each optimization level, and so
+  // is its baseline if it has one, and it also runs on the interpreter at the
+  // levels in kInterpreterLevels. The exit status is non-zero if anything
+  // fails to build or run, prints the wrong output, or has regressed since
+  // the results given by --compare.
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string_view argument = argv[i];
+    const auto equals = argument.find('=');
+    const auto name = argument.substr(
+        0, equals == std::string_view::npos ? argument.size() : equals + 1);
+    const auto value =
+        equals == std::string_view::npos ? "" : argument.substr(equals + 1);
+    bool valid = !value.empty();
+    if (name == "--corpus=") {
+      options.corpus = std::string{value};
+    } else if (name == "--runs=") {
+      valid = ParseNumber(value, &options.runs) && options.runs > 0;
+    } else if (name == "--json=") {
+      options.json = std::string{value};
+    } else if (name == "--compare=") {
+      options.compare = std::string{value};
+    } else if (name == "--threshold=") {
+      valid = ParseNumber(value, &options.threshold);
+    } else {
+      std::cerr << "Unknown option: " << argument << '\n';
+      return 1;
+    }
+    if (!valid) {
+      std::cerr << "Invalid value: " << argument << '\n';
+      return 1;
+    }
+  }
+  std::vector<std::filesystem::path> programs;
+  std::error_code error;
+  for (const auto& entry :
+       std::filesystem::directory_iterator{options.corpus, error}) {
+    if (entry.path().extension() == ".gel") programs.push_back(entry.path());
+  }
+  if (error || programs.empty()) {
+    std::cerr << "No programs in " << options.corpus << ".\n";
+    return 1;
+  }
+  std::sort(programs.begin(), programs.end());
+  std::vector<Timing> timings;
+  bool ok = true;
+  for (const auto& program : programs) {
+    ok = MeasureProgram(program, options, &timings) && ok;
+  }
+  PrintTable(timings);
+  if (!options.json.empty()) {
+    std::ofstream file{options.json};
+    PrintJson(file, timings, options);
+    if (!file) {
+      std::cerr << "Failed to write " << options.json << '\n';
+      ok = false;
+    }
+  }
+  if (!options.compare.empty()) {
+    std::ifstream file{options.compare};
+    if (!file) {
+      std::cerr << "Failed to read " << options.compare << '\n';
+      ok = false;
+    } else if (Compare(file, timings, options)) {
+      ok = false;
+    }
+  }
+  return ok ? 0 : 1;
+}
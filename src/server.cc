@@ -0,0 +1,353 @@
+#include "server.h"
+
+#include "driver.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <streambuf>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace server {
+namespace {
+
+// A request is the number of arguments, the arguments, the client's working
+// directory and cache directory, and then the program, with each string
+// preceded by its length. The standard input, output and error of the client
+// are attached to the first byte. The server replies with the exit status once
+// the request has finished.
+using Descriptors = std::array<int, 3>;
+
+// A request, besides its descriptors. It is compiled as though in the client's
+// working directory and environment, so that it behaves as it would have done
+// in the client.
+struct Message {
+  std::vector<std::string> arguments;
+  std::string directory;
+  // Empty if the client doesn't cache compiled programs.
+  std::string cache_directory;
+  std::string source;
+};
+
+// Requests with more arguments or longer strings than this are refused, so that
+// a malformed request can't make the server allocate without bound.
+constexpr std::uint64_t kMaxArguments = 1024;
+constexpr std::uint64_t kMaxLength = std::uint64_t{1} << 28;
+
+// How long to wait before accepting again after a failure which may pass.
+constexpr std::chrono::milliseconds kRetryDelay{100};
+
+void Append(std::string* message, std::uint64_t value) {
+  char bytes[sizeof(value)];
+  std::memcpy(bytes, &value, sizeof(value));
+  message->append(bytes, sizeof(bytes));
+}
+
+void Append(std::string* message, std::string_view text) {
+  Append(message, std::uint64_t{text.size()});
+  message->append(text);
+}
+
+// Send all of the data, along with the descriptors if there are any.
+bool Send(int socket, std::string_view data,
+          const Descriptors* descriptors = nullptr) {
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(Descriptors))];
+  while (!data.empty()) {
+    iovec vector = {const_cast<char*>(data.data()), data.size()};
+    msghdr header = {};
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    if (descriptors) {
+      header.msg_control = control;
+      header.msg_controllen = sizeof(control);
+      cmsghdr* message = CMSG_FIRSTHDR(&header);
+      message->cmsg_level = SOL_SOCKET;
+      message->cmsg_type = SCM_RIGHTS;
+      message->cmsg_len = CMSG_LEN(sizeof(Descriptors));
+      std::memcpy(CMSG_DATA(message), descriptors->data(),
+                  sizeof(Descriptors));
+    }
+    const ssize_t sent = sendmsg(socket, &header, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    descriptors = nullptr;
+    data.remove_prefix(static_cast<std::size_t>(sent));
+  }
+  return true;
+}
+
+// Take every descriptor which arrived with a message, and check that they are
+// the three which a request carries. The kernel has already installed them in
+// this process, so they are all closed if they are anything else.
+bool TakeDescriptors(msghdr* header, Descriptors* descriptors) {
+  std::vector<int> received;
+  for (cmsghdr* message = CMSG_FIRSTHDR(header); message;
+       message = CMSG_NXTHDR(header, message)) {
+    if (message->cmsg_level != SOL_SOCKET || message->cmsg_type != SCM_RIGHTS)
+      continue;
+    const std::size_t count = (message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; i++) {
+      int descriptor;
+      std::memcpy(&descriptor, CMSG_DATA(message) + i * sizeof(int),
+                  sizeof(int));
+      received.push_back(descriptor);
+    }
+  }
+  if (received.size() != descriptors->size() ||
+      (header->msg_flags & MSG_CTRUNC)) {
+    for (int descriptor : received) close(descriptor);
+    return false;
+  }
+  std::copy(received.begin(), received.end(), descriptors->begin());
+  return true;
+}
+
+// Receive exactly the given number of bytes, and the descriptors which are
+// attached to them if asked to. The descriptors are stored as soon as they
+// arrive, even if the rest of the bytes don't, so that the caller can close
+// them.
+bool Receive(int socket, void* data, std::size_t size,
+             Descriptors* descriptors = nullptr) {
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(Descriptors))];
+  auto* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    iovec vector = {bytes, size};
+    msghdr header = {};
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    if (descriptors) {
+      header.msg_control = control;
+      header.msg_controllen = sizeof(control);
+    }
+    // Descriptors must not leak into the programs run for other requests.
+    const ssize_t received = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return false;
+    if (descriptors) {
+      if (!TakeDescriptors(&header, descriptors)) return false;
+      descriptors = nullptr;
+    }
+    bytes += received;
+    size -= static_cast<std::size_t>(received);
+  }
+  return true;
+}
+
+bool Receive(int socket, std::string* text) {
+  std::uint64_t size;
+  if (!Receive(socket, &size, sizeof(size)) || size > kMaxLength) return false;
+  text->resize(size);
+  return Receive(socket, text->data(), text->size());
+}
+
+// An output stream buffer which writes straight to a descriptor, so that the
+// client sees diagnostics as soon as they are produced.
+class DescriptorBuffer : public std::streambuf {
+ public:
+  explicit DescriptorBuffer(int descriptor) : descriptor_(descriptor) {}
+
+ protected:
+  std::streamsize xsputn(const char* data, std::streamsize size) override {
+    std::string_view remaining{data, static_cast<std::size_t>(size)};
+    while (!remaining.empty()) {
+      const ssize_t written =
+          write(descriptor_, remaining.data(), remaining.size());
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) break;
+      remaining.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return size - static_cast<std::streamsize>(remaining.size());
+  }
+
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    const char value = traits_type::to_char_type(c);
+    return xsputn(&value, 1) == 1 ? c : traits_type::eof();
+  }
+
+ private:
+  int descriptor_;
+};
+
+std::optional<sockaddr_un> Address(const std::string& path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) return std::nullopt;
+  path.copy(address.sun_path, path.size());
+  return address;
+}
+
+int Connect(const std::string& path) {
+  const auto address = Address(path);
+  if (!address) return -1;
+  const int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection < 0) return -1;
+  if (connect(connection, reinterpret_cast<const sockaddr*>(&*address),
+              sizeof(sockaddr_un)) != 0) {
+    close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+// Compile and run a request, with everything going to the client.
+int Run(const Message& message, const Descriptors& descriptors,
+        int connection) {
+  DescriptorBuffer output_buffer{descriptors[1]};
+  DescriptorBuffer error_buffer{descriptors[2]};
+  std::ostream output{&output_buffer};
+  std::ostream errors{&error_buffer};
+  driver::Environment environment;
+  environment.output = &output;
+  environment.errors = &errors;
+  environment.descriptors = descriptors;
+  environment.watch = connection;
+  environment.exec = false;
+  environment.directory = message.directory;
+  environment.cache_directory = message.cache_directory;
+  try {
+    return driver::Run({message.arguments.begin(), message.arguments.end()},
+                       message.source, environment);
+  } catch (const std::exception& error) {
+    // One bad request must not take down the server.
+    errors << "Failed to compile: " << error.what() << '\n';
+    return 1;
+  }
+}
+
+// Read a request from the connection, run it, and reply with its exit status.
+// Requests which are malformed or too large get no reply. Whatever happens, the
+// client's descriptors are closed again afterwards.
+void Handle(int connection) {
+  Descriptors descriptors = {-1, -1, -1};
+  try {
+    std::uint64_t count;
+    Message message;
+    bool received =
+        Receive(connection, &count, sizeof(count), &descriptors) &&
+        count <= kMaxArguments;
+    for (std::uint64_t i = 0; received && i < count; i++) {
+      received = Receive(connection, &message.arguments.emplace_back());
+    }
+    if (received && Receive(connection, &message.directory) &&
+        Receive(connection, &message.cache_directory) &&
+        Receive(connection, &message.source)) {
+      std::string reply;
+      Append(&reply, static_cast<std::uint64_t>(
+                         Run(message, descriptors, connection)));
+      Send(connection, reply);
+    }
+  } catch (const std::exception& error) {
+    // One bad request must not take down the server.
+    std::cerr << "Failed to handle a request: " << error.what() << '\n';
+  }
+  for (int descriptor : descriptors) {
+    if (descriptor >= 0) close(descriptor);
+  }
+}
+
+void Work(int listener) {
+  while (true) {
+    const int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0) {
+      const int error = errno;
+      if (error == EINTR || error == ECONNABORTED) continue;
+      // Only these mean that the listener itself is broken. Anything else,
+      // such as running out of descriptors or memory, may pass once other
+      // requests have finished, so wait a little and try again.
+      if (error == EBADF || error == EINVAL || error == ENOTSOCK) {
+        std::cerr << "Failed to accept a connection: " << std::strerror(error)
+                  << '\n';
+        return;
+      }
+      if (error != EMFILE && error != ENFILE && error != ENOBUFS &&
+          error != ENOMEM) {
+        std::cerr << "Failed to accept a connection: " << std::strerror(error)
+                  << '\n';
+      }
+      std::this_thread::sleep_for(kRetryDelay);
+      continue;
+    }
+    Handle(connection);
+    close(connection);
+  }
+}
+
+}  // namespace
+
+int Serve(const std::string& path) {
+  // Clients which hang up early must not take the server down with them.
+  signal(SIGPIPE, SIG_IGN);
+  const auto address = Address(path);
+  if (!address) {
+    std::cerr << "Socket path is too long: " << path << '\n';
+    return 1;
+  }
+  // A socket left behind by a server which has exited is replaced, but one
+  // which a server is still listening on is not.
+  if (const int connection = Connect(path); connection >= 0) {
+    close(connection);
+    std::cerr << "A server is already listening on " << path << '\n';
+    return 1;
+  }
+  unlink(path.c_str());
+  const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<const sockaddr*>(&*address),
+           sizeof(sockaddr_un)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno)
+              << '\n';
+    return 1;
+  }
+  // Each thread waits for a connection and handles the request itself.
+  const unsigned count = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < count; i++) threads.emplace_back(Work, listener);
+  Work(listener);
+  for (auto& thread : threads) thread.join();
+  close(listener);
+  return 1;
+}
+
+std::optional<int> Request(const std::string& path,
+                           const std::vector<std::string_view>& arguments,
+                           std::string_view source) {
+  const int connection = Connect(path);
+  if (connection < 0) return std::nullopt;
+  // Without a working directory, relative paths are left to the server.
+  std::error_code error;
+  const auto directory = std::filesystem::current_path(error);
+  std::string message;
+  Append(&message, std::uint64_t{arguments.size()});
+  for (const auto argument : arguments) Append(&message, argument);
+  Append(&message, error ? std::string{} : directory.string());
+  Append(&message, driver::DefaultCacheDirectory());
+  Append(&message, source);
+  const Descriptors descriptors = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  std::uint64_t status;
+  const bool ok = Send(connection, message, &descriptors) &&
+                  Receive(connection, &status, sizeof(status));
+  close(connection);
+  if (!ok) {
+    std::cerr << "Lost the connection to the server at " << path << '\n';
+    return 1;
+  }
+  return static_cast<int>(status);
+}
+
+}  // namespace server
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace server {
+
+// Listen on a Unix domain socket at the path and handle requests from clients
+// on a pool of threads, for as long as this process runs. Each request is a
+// command line and a program, which are compiled and run as the gel command
+// would. Clients pass their standard input, output and error along with the
+// request, so diagnostics, generated code and the output of the program go
+// straight to them. Only returns if the socket could not be set up.
+int Serve(const std::string& path);
+
+// Send a request to the server at the path and wait for it to finish. Returns
+// the exit status of the request, or nothing if there is no server there.
+std::optional<int> Request(const std::string& path,
+                           const std::vector<std::string_view>& arguments,
+                           std::string_view source);
+
+}  // namespace server
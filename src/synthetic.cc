@@ -0,0 +1,233 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <vector>
+
+namespace synthetic {
+namespace {
+
+std::string Name(std::string_view prefix, std::size_t index) {
+  return std::string{prefix} + std::to_string(index);
+}
+
+class Generator {
+ public:
+  explicit Generator(const Shape& shape);
+
+  std::string Program();
+
+ private:
+  // A number in [0, n). The engine's output is fully specified by the
+  // standard, unlike the distributions, so programs are the same everywhere.
+  std::size_t Random(std::size_t n) { return random_() % n; }
+
+  void Function(std::size_t index);
+  void Statement();
+  void Line(std::size_t indent, const std::string& text);
+
+  std::string Integer(std::size_t depth);
+  std::string Boolean(std::size_t depth);
+  std::string ArrayLiteral(std::size_t nesting);
+  std::string Element(const std::string& array);
+  std::string Call(std::size_t depth);
+
+  Shape shape_;
+  std::mt19937 random_;
+  std::ostringstream output_;
+  // The functions which call nothing themselves. Every other function only
+  // calls these, so however many functions there are, running the program
+  // takes time proportional to its size.
+  std::size_t leaves_;
+  std::size_t function_ = 0;
+  // The variables defined at the top level of the current function, which are
+  // in scope for the rest of it. Parameters can be read but not assigned.
+  std::vector<std::string> integers_, arrays_;
+  std::size_t parameters_ = 0;
+  std::size_t next_variable_ = 0;
+};
+
+Generator::Generator(const Shape& shape)
+    : shape_(shape),
+      random_(shape.seed),
+      leaves_(std::max<std::size_t>(shape.functions / 4, 1)) {
+  // Empty array literals have no type, and arrays must be arrays of something.
+  shape_.array_size = std::max<std::size_t>(shape_.array_size, 1);
+  shape_.nesting = std::max<std::size_t>(shape_.nesting, 1);
+}
+
+std::string Generator::Program() {
+  output_ << "# Generated with " << shape_.functions << " functions, "
+          << shape_.statements << " statements, depth " << shape_.depth
+          << ", arrays of " << shape_.array_size << " nested "
+          << shape_.nesting << " deep, and seed " << shape_.seed << ".\n";
+  for (std::size_t i = 0; i < shape_.functions; i++) Function(i);
+  output_ << "function main() : integer {\n";
+  Line(1, "let total = 0");
+  for (std::size_t i = 0; i < shape_.functions; i++) {
+    Line(1, "total = total + " + Name("f", i) + "(" + std::to_string(i) +
+                ", 1)");
+  }
+  Line(1, "do print(total)");
+  Line(1, "return 0");
+  output_ << "}\n";
+  return output_.str();
+}
+
+void Generator::Function(std::size_t index) {
+  function_ = index;
+  integers_ = {"a", "b"};
+  parameters_ = integers_.size();
+  arrays_.clear();
+  next_variable_ = 0;
+  output_ << "function " << Name("f", index)
+          << "(a : integer, b : integer) : integer {\n";
+  for (std::size_t i = 0; i < shape_.statements; i++) Statement();
+  Line(1, "return " + Integer(shape_.depth));
+  output_ << "}\n\n";
+}
+
+void Generator::Statement() {
+  const bool assignable = integers_.size() > parameters_;
+  switch (Random(8)) {
+    case 0:
+    case 1:
+      break;
+    case 2:
+      if (!arrays_.empty() && Random(2)) {
+        // Only the outermost level can be assigned to, so the elements of
+        // nested arrays are replaced a whole array at a time.
+        const auto& array = arrays_[Random(arrays_.size())];
+        const auto index = std::to_string(Random(shape_.array_size));
+        Line(1, array + "[" + index + "] = " +
+                    (shape_.nesting > 1 ? ArrayLiteral(shape_.nesting - 1)
+                                        : Integer(shape_.depth)));
+        return;
+      }
+      {
+        const auto literal = ArrayLiteral(shape_.nesting);
+        arrays_.push_back(Name("v", next_variable_++));
+        Line(1, "let " + arrays_.back() + " = " + literal);
+      }
+      return;
+    case 3:
+    case 4:
+      if (!assignable) break;
+      Line(1, integers_[parameters_ + Random(integers_.size() - parameters_)] +
+                  " = " + Integer(shape_.depth));
+      return;
+    case 5:
+      if (!assignable) break;
+      Line(1, "if (" + Boolean(shape_.depth) + ") {");
+      Line(2, integers_.back() + " = " + Integer(shape_.depth));
+      Line(1, "} else {");
+      Line(2, integers_.back() + " = " + Integer(shape_.depth));
+      Line(1, "}");
+      return;
+    case 6:
+    case 7: {
+      if (!assignable) break;
+      const auto target =
+          integers_[parameters_ + Random(integers_.size() - parameters_)];
+      const auto counter = Name("i", next_variable_++);
+      Line(1, "let " + counter + " = 0");
+      Line(1, "while (" + counter + " < 4) {");
+      Line(2, target + " = " + Integer(shape_.depth));
+      Line(2, counter + " = " + counter + " + 1");
+      Line(1, "}");
+      integers_.push_back(counter);
+      return;
+    }
+  }
+  const auto value = Integer(shape_.depth);
+  integers_.push_back(Name("v", next_variable_++));
+  Line(1, "let " + integers_.back() + " = " + value);
+}
+
+void Generator::Line(std::size_t indent, const std::string& text) {
+  output_ << std::string(2 * indent, ' ') << text << '\n';
+}
+
+std::string Generator::Integer(std::size_t depth) {
+  if (depth == 0) {
+    switch (Random(4)) {
+      case 0:
+        return std::to_string(Random(10));
+      case 1:
+        if (!arrays_.empty()) return Element(arrays_[Random(arrays_.size())]);
+        break;
+      case 2:
+        if (!arrays_.empty()) {
+          return "size(" + arrays_[Random(arrays_.size())] + ")";
+        }
+        break;
+    }
+    return integers_[Random(integers_.size())];
+  }
+  switch (Random(6)) {
+    case 0:
+      return "(" + Integer(depth - 1) + " + " + Integer(depth - 1) + ")";
+    case 1:
+      return "(" + Integer(depth - 1) + " - " + Integer(depth - 1) + ")";
+    case 2:
+      return "(" + Integer(depth - 1) + " * " + std::to_string(Random(4)) +
+             ")";
+    case 3:
+      return "(" + Integer(depth - 1) + " / " +
+             std::to_string(1 + Random(9)) + ")";
+    case 4:
+      if (function_ >= leaves_) return Call(depth);
+      break;
+  }
+  return Integer(depth - 1);
+}
+
+std::string Generator::Boolean(std::size_t depth) {
+  const std::size_t operand = depth > 0 ? depth - 1 : 0;
+  if (depth > 1) {
+    switch (Random(4)) {
+      case 0:
+        return "(" + Boolean(depth - 1) + " && " + Boolean(depth - 1) + ")";
+      case 1:
+        return "(" + Boolean(depth - 1) + " || " + Boolean(depth - 1) + ")";
+      case 2:
+        return "!" + Boolean(depth - 1);
+    }
+  }
+  constexpr const char* kComparisons[] = {" < ",  " <= ", " > ",
+                                          " >= ", " == ", " != "};
+  return "(" + Integer(operand) + kComparisons[Random(6)] + Integer(operand) +
+         ")";
+}
+
+std::string Generator::ArrayLiteral(std::size_t nesting) {
+  std::string literal = "[";
+  for (std::size_t i = 0; i < shape_.array_size; i++) {
+    if (i > 0) literal += ", ";
+    literal += nesting > 1 ? ArrayLiteral(nesting - 1) : Integer(0);
+  }
+  return literal + "]";
+}
+
+std::string Generator::Element(const std::string& array) {
+  // Arrays and their elements are only ever assigned literals of the full
+  // size, so constant indices are always in bounds.
+  std::string element = array;
+  for (std::size_t i = 0; i < shape_.nesting; i++) {
+    element += "[" + std::to_string(Random(shape_.array_size)) + "]";
+  }
+  return element;
+}
+
+std::string Generator::Call(std::size_t depth) {
+  return Name("f", Random(leaves_)) + "(" + Integer(depth - 1) + ", " +
+         Integer(depth - 1) + ")";
+}
+
+}  // namespace
+
+std::string Generate(const Shape& shape) { return Generator{shape}.Program(); }
+
+}  // namespace synthetic
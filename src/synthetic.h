@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace synthetic {
+
+// The shape of a generated program. Programs of the same shape and seed are
+// always the same.
+struct Shape {
+  // Functions besides main. Each one may call the functions before it.
+  std::size_t functions = 50;
+  // Statements at the top level of each function, not counting those within
+  // ifs and loops.
+  std::size_t statements = 20;
+  // The depth of the expressions.
+  std::size_t depth = 3;
+  // Elements at each level of an array literal.
+  std::size_t array_size = 8;
+  // Levels of nested arrays, so 1 is an [integer] and 2 is an [[integer]].
+  std::size_t nesting = 1;
+  std::uint32_t seed = 1;
+};
+
+// Generate a program which type checks and terminates, with every kind of
+// statement and expression that gel has in proportion to the shape.
+std::string Generate(const Shape& shape);
+
+}  // namespace synthetic
@@ -1,11 +1,21 @@
 #include "target-c.h"
 
+#include "allocations.h"
+#include "bounds.h"
+#include "optimize.h"
+#include "ownership.h"
 #include "types.h"
 #include "util.h"
 
 #include <algorithm>
 #include <iterator>
+#include <limits>
 #include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
 
 namespace target::c {
 namespace {
@@ -19,6 +29,12 @@ constexpr char kHeader[] = R"(
 #include <stdio.h>
 #include <stdlib.h>
 
+// Runtime state is shared by every translation unit of a program which is split
+// into several, so that they all use the same thread pools.
+#ifndef GELSHARED
+#define GELSHARED static
+#endif
+
 // gel_void is an actual value type to simplify code generation.
 typedef struct gel_void {} gel_void;
 
@@ -39,10 +55,41 @@ static inline gel_integer gelcopy_gel_integer(gel_integer source) {
   return source;
 }
 
+static inline gel_void gelmove_gel_void(gel_void* source) { return *source; }
+
+static inline gel_boolean gelmove_gel_boolean(gel_boolean* source) {
+  return *source;
+}
+
+static inline gel_integer gelmove_gel_integer(gel_integer* source) {
+  return *source;
+}
+
 static inline void geldestroy_gel_void(gel_void unused) {}
 static inline void geldestroy_gel_boolean(gel_boolean unused) {}
 static inline void geldestroy_gel_integer(gel_integer unused) {}
 
+static void gelindexerror(gel_integer index, gel_integer size) {
+  fprintf(stderr, "Array index %lld is out of bounds for array of size %lld.\n",
+          (long long) index, (long long) size);
+  exit(EXIT_FAILURE);
+}
+
+static inline void gelcheckindex(gel_integer index, gel_integer size) {
+  if (index < 0 || index >= size) gelindexerror(index, size);
+}
+
+// Check an index and return it, for use inside an expression.
+static inline gel_integer gelindex(gel_integer index, gel_integer size) {
+  gelcheckindex(index, size);
+  return index;
+}
+
+// Shared arrays store their reference count immediately before the elements.
+static inline gel_integer* gelrefcount(void* data) {
+  return (gel_integer*) data - 1;
+}
+
 // Start of user code.
 )";
 
@@ -52,9 +99,960 @@ constexpr char kFooter[] = R"(
 int main() { return gel_main(); }
 )";
 
+// Memoization tables map the arguments of a call to its result using open
+// addressing. Each entry is a flag marking it as used, followed by the
+// arguments and then the result.
+constexpr char kMemoization[] = R"(
+#include <string.h>
+
+typedef struct gelmemo {
+  gel_integer arity, capacity, size;
+  gel_integer* entries;
+} gelmemo;
+
+// Tables are cleared rather than grown beyond this many entries, which bounds
+// their memory use while still catching the repeated calls of a recursion.
+#define GELMEMO_MAX_CAPACITY ((gel_integer) 1 << 20)
+
+// Find the entry for the given arguments, or the unused entry where they
+// belong.
+static gel_integer* gelmemo_find(const gelmemo* memo, const gel_integer* key) {
+  const gel_integer stride = memo->arity + 2;
+  uint64_t hash = 0;
+  for (gel_integer i = 0; i < memo->arity; i++) {
+    hash = (hash ^ (uint64_t) key[i]) * 0x9e3779b97f4a7c15u;
+    hash ^= hash >> 29;
+  }
+  const gel_integer mask = memo->capacity - 1;
+  for (gel_integer i = (gel_integer) hash & mask;; i = (i + 1) & mask) {
+    gel_integer* entry = memo->entries + i * stride;
+    if (!entry[0] ||
+        memcmp(entry + 1, key, memo->arity * sizeof(gel_integer)) == 0) {
+      return entry;
+    }
+  }
+}
+
+static bool gelmemo_lookup(const gelmemo* memo, const gel_integer* key,
+                           gel_integer* result) {
+  if (memo->size == 0) return false;
+  const gel_integer* entry = gelmemo_find(memo, key);
+  if (!entry[0]) return false;
+  *result = entry[memo->arity + 1];
+  return true;
+}
+
+static void gelmemo_insert(gelmemo* memo, const gel_integer* key,
+                           gel_integer result) {
+  const gel_integer stride = memo->arity + 2;
+  if (2 * (memo->size + 1) > memo->capacity) {
+    gel_integer* old = memo->entries;
+    const gel_integer old_capacity = memo->capacity;
+    if (old_capacity == 0) {
+      memo->capacity = 64;
+    } else if (old_capacity < GELMEMO_MAX_CAPACITY) {
+      memo->capacity = 2 * old_capacity;
+    }
+    memo->entries = calloc(memo->capacity * stride, sizeof(gel_integer));
+    memo->size = 0;
+    // A table which is already as large as it may grow starts afresh.
+    if (memo->capacity != old_capacity) {
+      for (gel_integer i = 0; i < old_capacity; i++) {
+        const gel_integer* entry = old + i * stride;
+        if (!entry[0]) continue;
+        memcpy(gelmemo_find(memo, entry + 1), entry,
+               stride * sizeof(gel_integer));
+        memo->size++;
+      }
+    }
+    free(old);
+  }
+  gel_integer* entry = gelmemo_find(memo, key);
+  if (!entry[0]) {
+    entry[0] = 1;
+    memcpy(entry + 1, key, memo->arity * sizeof(gel_integer));
+    memo->size++;
+  }
+  entry[memo->arity + 1] = result;
+}
+)";
+
+// Element-wise operations on arrays of integers. Every operation has
+// a portable scalar kernel. On x86-64, vector kernels handle as many elements
+// as fill whole registers and pass the rest to the scalar kernel, and the
+// widest kernel which the processor supports is chosen from the level found
+// when the program starts. Integer division has no vector instruction, so it
+// is always scalar.
+constexpr char kElementwise[] = R"(
+static void gelsizeerror(gel_integer left, gel_integer right) {
+  fprintf(stderr, "Array sizes %lld and %lld do not match.\n",
+          (long long) left, (long long) right);
+  exit(EXIT_FAILURE);
+}
+
+static inline void gelchecksizes(gel_integer left, gel_integer right) {
+  if (left != right) gelsizeerror(left, right);
+}
+
+#define GELSCALAR(name, type, op)                                             \
+  static void gelscalar_##name(type* result, const gel_integer* left,         \
+                               const gel_integer* right, gel_integer size) {  \
+    for (gel_integer i = 0; i < size; i++) result[i] = left[i] op right[i];   \
+  }
+GELSCALAR(add, gel_integer, +)
+GELSCALAR(subtract, gel_integer, -)
+GELSCALAR(multiply, gel_integer, *)
+GELSCALAR(divide, gel_integer, /)
+GELSCALAR(equal, gel_boolean, ==)
+GELSCALAR(not_equal, gel_boolean, !=)
+GELSCALAR(less, gel_boolean, <)
+GELSCALAR(less_or_equal, gel_boolean, <=)
+GELSCALAR(greater, gel_boolean, >)
+GELSCALAR(greater_or_equal, gel_boolean, >=)
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Levels of vector support, from the SSE2 which every x86-64 processor has.
+enum { GELSSE2 = 1, GELSSE42, GELAVX2 };
+
+// Detected before main so that threads running parallel loops only ever read
+// it.
+static int gellevel;
+
+__attribute__((constructor)) static void gelcpu(void) {
+  __builtin_cpu_init();
+  gellevel = __builtin_cpu_supports("avx2")     ? GELAVX2
+             : __builtin_cpu_supports("sse4.2") ? GELSSE42
+                                                : GELSSE2;
+}
+
+// There is no instruction to multiply 64-bit lanes before AVX-512, so the
+// product is assembled from 32-bit halves. The high halves of the cross terms
+// are shifted out, as they are in a wrapping 64-bit multiplication.
+__attribute__((target("sse2"))) static inline __m128i gelsse2_mul(__m128i a,
+                                                                 __m128i b) {
+  __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+  return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) static inline __m256i gelavx2_mul(__m256i a,
+                                                                 __m256i b) {
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+                          _mm256_slli_epi64(cross, 32));
+}
+
+// Comparisons produce a mask with one bit per lane.
+__attribute__((target("sse4.2"))) static inline int gelsse42_mask(__m128i v) {
+  return _mm_movemask_pd(_mm_castsi128_pd(v));
+}
+
+__attribute__((target("avx2"))) static inline int gelavx2_mask(__m256i v) {
+  return _mm256_movemask_pd(_mm256_castsi256_pd(v));
+}
+
+#define GELARITHMETIC(prefix, feature, vector, lanes, load, store, name, op)  \
+  __attribute__((target(feature))) static void prefix##_##name(               \
+      gel_integer* result, const gel_integer* left,                           \
+      const gel_integer* right, gel_integer size) {                           \
+    gel_integer i = 0;                                                        \
+    for (; i + lanes <= size; i += lanes) {                                   \
+      vector a = load((const vector*) (left + i));                            \
+      vector b = load((const vector*) (right + i));                           \
+      store((vector*) (result + i), op(a, b));                                \
+    }                                                                         \
+    gelscalar_##name(result + i, left + i, right + i, size - i);              \
+  }
+GELARITHMETIC(gelsse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128,
+              add, _mm_add_epi64)
+GELARITHMETIC(gelsse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128,
+              subtract, _mm_sub_epi64)
+GELARITHMETIC(gelsse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128,
+              multiply, gelsse2_mul)
+GELARITHMETIC(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+              _mm256_storeu_si256, add, _mm256_add_epi64)
+GELARITHMETIC(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+              _mm256_storeu_si256, subtract, _mm256_sub_epi64)
+GELARITHMETIC(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+              _mm256_storeu_si256, multiply, gelavx2_mul)
+
+// Every comparison is an equality or greater-than test, with the operands
+// swapped or the result inverted.
+#define GELCOMPARISON(prefix, feature, vector, lanes, load, name, op, x, y,  \
+                      invert)                                                 \
+  __attribute__((target(feature))) static void prefix##_##name(               \
+      gel_boolean* result, const gel_integer* left,                           \
+      const gel_integer* right, gel_integer size) {                           \
+    gel_integer i = 0;                                                        \
+    for (; i + lanes <= size; i += lanes) {                                   \
+      vector a = load((const vector*) (left + i));                            \
+      vector b = load((const vector*) (right + i));                           \
+      int bits = prefix##_mask(op(x, y)) ^ invert;                            \
+      for (int j = 0; j < lanes; j++) result[i + j] = (bits >> j) & 1;        \
+    }                                                                         \
+    gelscalar_##name(result + i, left + i, right + i, size - i);              \
+  }
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128, equal,
+              _mm_cmpeq_epi64, a, b, 0)
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128, not_equal,
+              _mm_cmpeq_epi64, a, b, 3)
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128, less,
+              _mm_cmpgt_epi64, b, a, 0)
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128, less_or_equal,
+              _mm_cmpgt_epi64, a, b, 3)
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128, greater,
+              _mm_cmpgt_epi64, a, b, 0)
+GELCOMPARISON(gelsse42, "sse4.2", __m128i, 2, _mm_loadu_si128,
+              greater_or_equal, _mm_cmpgt_epi64, b, a, 3)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256, equal,
+              _mm256_cmpeq_epi64, a, b, 0)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256, not_equal,
+              _mm256_cmpeq_epi64, a, b, 15)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256, less,
+              _mm256_cmpgt_epi64, b, a, 0)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256, less_or_equal,
+              _mm256_cmpgt_epi64, a, b, 15)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256, greater,
+              _mm256_cmpgt_epi64, a, b, 0)
+GELCOMPARISON(gelavx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+              greater_or_equal, _mm256_cmpgt_epi64, b, a, 15)
+
+#define GELKERNEL(name, sse_level)                                            \
+  (gellevel >= GELAVX2                ? gelavx2_##name                        \
+   : gellevel >= GELSSE##sse_level ? gelsse##sse_level##_##name               \
+                                   : gelscalar_##name)
+#else
+#define GELKERNEL(name, sse_level) gelscalar_##name
+#endif
+
+#define GELELEMENTWISE(name, type, kernel)                                    \
+  static void gelelementwise_##name(type* result, const gel_integer* left,    \
+                                    const gel_integer* right,                 \
+                                    gel_integer size) {                       \
+    (kernel)(result, left, right, size);                                      \
+  }
+GELELEMENTWISE(add, gel_integer, GELKERNEL(add, 2))
+GELELEMENTWISE(subtract, gel_integer, GELKERNEL(subtract, 2))
+GELELEMENTWISE(multiply, gel_integer, GELKERNEL(multiply, 2))
+GELELEMENTWISE(divide, gel_integer, gelscalar_divide)
+GELELEMENTWISE(equal, gel_boolean, GELKERNEL(equal, 42))
+GELELEMENTWISE(not_equal, gel_boolean, GELKERNEL(not_equal, 42))
+GELELEMENTWISE(less, gel_boolean, GELKERNEL(less, 42))
+GELELEMENTWISE(less_or_equal, gel_boolean, GELKERNEL(less_or_equal, 42))
+GELELEMENTWISE(greater, gel_boolean, GELKERNEL(greater, 42))
+GELELEMENTWISE(greater_or_equal, gel_boolean,
+               GELKERNEL(greater_or_equal, 42))
+)";
+
+// Parallel loops run on a pool of threads, one per processor, which is
+// started by the first loop that runs. The range of iterations is divided
+// evenly between the threads. Each thread takes chunks from the front of its
+// own range, and a thread which runs out of work steals the back half of
+// another thread's range, so that iterations of uneven cost still keep every
+// thread busy. The thread which starts a loop does its share of the work and
+// then waits for the others. Loops nested inside a running loop, loops which
+// start while another is running on the pool (from a forked call), and loops
+// with a single iteration, run sequentially on the current thread. Ranges are
+// held as unsigned offsets from the start, so that no range can overflow.
+constexpr char kParallel[] = R"(
+#include <pthread.h>
+#include <unistd.h>
+
+#define GELMAXTHREADS 64
+
+typedef void (*gelbody)(void* context, gel_integer begin, gel_integer end);
+
+typedef struct gelrange {
+  pthread_mutex_t lock;
+  uint64_t next, end;
+} __attribute__((aligned(64))) gelrange;
+
+GELSHARED struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  int threads;
+  // Whether a loop is using the threads.
+  bool busy;
+  // Each loop is a new generation, which wakes the waiting threads.
+  uint64_t generation;
+  // The number of threads besides the caller still working on the loop.
+  int active;
+  gelbody body;
+  void* context;
+  gel_integer begin;
+  uint64_t chunk;
+  gelrange ranges[GELMAXTHREADS];
+} gelpool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+GELSHARED _Thread_local bool gelinside;
+
+// Take the next chunk from the front of the range.
+static bool geltake(gelrange* range, uint64_t* begin, uint64_t* end) {
+  pthread_mutex_lock(&range->lock);
+  const bool found = range->next < range->end;
+  if (found) {
+    const uint64_t remaining = range->end - range->next;
+    *begin = range->next;
+    *end = remaining > gelpool.chunk ? range->next + gelpool.chunk : range->end;
+    range->next = *end;
+  }
+  pthread_mutex_unlock(&range->lock);
+  return found;
+}
+
+// Move the back half of the range of some other thread which has more than
+// a chunk left into the range of this one.
+static bool gelsteal(int self) {
+  for (int i = 1; i < gelpool.threads; i++) {
+    gelrange* victim = &gelpool.ranges[(self + i) % gelpool.threads];
+    pthread_mutex_lock(&victim->lock);
+    const uint64_t remaining = victim->end - victim->next;
+    if (remaining > gelpool.chunk) {
+      const uint64_t middle = victim->end - remaining / 2, end = victim->end;
+      victim->end = middle;
+      pthread_mutex_unlock(&victim->lock);
+      gelrange* range = &gelpool.ranges[self];
+      pthread_mutex_lock(&range->lock);
+      range->next = middle;
+      range->end = end;
+      pthread_mutex_unlock(&range->lock);
+      return true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return false;
+}
+
+static void gelwork(int self) {
+  uint64_t begin, end;
+  do {
+    while (geltake(&gelpool.ranges[self], &begin, &end)) {
+      const uint64_t base = (uint64_t) gelpool.begin;
+      gelpool.body(gelpool.context, (gel_integer) (base + begin),
+                   (gel_integer) (base + end));
+    }
+  } while (gelsteal(self));
+}
+
+static void* gelthread(void* argument) {
+  const int self = (int) (intptr_t) argument;
+  gelinside = true;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&gelpool.lock);
+  while (true) {
+    while (gelpool.generation == generation) {
+      pthread_cond_wait(&gelpool.wake, &gelpool.lock);
+    }
+    generation = gelpool.generation;
+    pthread_mutex_unlock(&gelpool.lock);
+    gelwork(self);
+    pthread_mutex_lock(&gelpool.lock);
+    if (--gelpool.active == 0) pthread_cond_signal(&gelpool.done);
+  }
+  return NULL;
+}
+
+// Start the threads if they haven't been started yet, returning the number of
+// threads including the caller. GEL_THREADS overrides the processor count.
+static int gelstart(void) {
+  if (gelpool.threads > 0) return gelpool.threads;
+  const char* setting = getenv("GEL_THREADS");
+  long threads = setting ? atol(setting) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  if (threads > GELMAXTHREADS) threads = GELMAXTHREADS;
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&gelpool.ranges[i].lock, NULL);
+  }
+  gelpool.threads = 1;
+  for (int i = 1; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, gelthread, (void*) (intptr_t) i) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    gelpool.threads++;
+  }
+  return gelpool.threads;
+}
+
+static void gelparallel(gelbody body, void* context, gel_integer begin,
+                        gel_integer end) {
+  if (begin >= end) return;
+  const uint64_t count = (uint64_t) end - (uint64_t) begin;
+  if (gelinside || count == 1 ||
+      __atomic_exchange_n(&gelpool.busy, true, __ATOMIC_ACQUIRE)) {
+    body(context, begin, end);
+    return;
+  }
+  const int threads = gelstart();
+  if (threads == 1) {
+    body(context, begin, end);
+    __atomic_store_n(&gelpool.busy, false, __ATOMIC_RELEASE);
+    return;
+  }
+  pthread_mutex_lock(&gelpool.lock);
+  gelpool.body = body;
+  gelpool.context = context;
+  gelpool.begin = begin;
+  // Chunks are small enough to balance the load but large enough that the
+  // locking is cheap compared to the work.
+  gelpool.chunk = count / ((uint64_t) threads * 8);
+  if (gelpool.chunk == 0) gelpool.chunk = 1;
+  const uint64_t share = count / (uint64_t) threads;
+  const uint64_t extra = count % (uint64_t) threads;
+  uint64_t next = 0;
+  for (int i = 0; i < threads; i++) {
+    gelpool.ranges[i].next = next;
+    next += share + ((uint64_t) i < extra);
+    gelpool.ranges[i].end = next;
+  }
+  gelpool.active = threads - 1;
+  gelpool.generation++;
+  pthread_cond_broadcast(&gelpool.wake);
+  pthread_mutex_unlock(&gelpool.lock);
+  gelinside = true;
+  gelwork(0);
+  gelinside = false;
+  pthread_mutex_lock(&gelpool.lock);
+  while (gelpool.active > 0) pthread_cond_wait(&gelpool.done, &gelpool.lock);
+  pthread_mutex_unlock(&gelpool.lock);
+  __atomic_store_n(&gelpool.busy, false, __ATOMIC_RELEASE);
+}
+)";
+
+// Forked calls run on a pool of threads of their own, in the style of Cilk.
+// Each thread has a deque of tasks: it pushes the tasks it forks onto the back
+// and pops them again when it joins them, while idle threads steal the oldest
+// task from the front of another thread's deque. Old tasks sit near the root
+// of a divide-and-conquer recursion, so a thief takes a large share of the
+// work each time. A thread waiting for a stolen task runs other stolen tasks
+// meanwhile. Forks nested more deeply than a cutoff which grows with the
+// number of threads run sequentially, so that the cost of a fork stays small
+// compared to the work in a task. Only one thread outside the pool can fork
+// at a time: that is the main thread, unless a parallel loop is forking.
+constexpr char kForkJoin[] = R"(
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define GELMAXTHREADS 64
+#define GELMAXTASKS 32
+
+typedef struct geltask {
+  void (*run)(struct geltask* task);
+  int depth;
+  bool forked, done;
+} geltask;
+
+typedef struct geldeque {
+  pthread_mutex_t lock;
+  int front, back;
+  geltask* tasks[GELMAXTASKS];
+} __attribute__((aligned(64))) geldeque;
+
+GELSHARED struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int threads;
+  // Forks deeper than this run sequentially.
+  int cutoff;
+  // Whether a thread outside the pool is using the first deque.
+  bool claimed;
+  // The number of tasks in the deques, and the number of idle threads.
+  int waiting, sleeping;
+  geldeque deques[GELMAXTHREADS];
+} gelforks = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+};
+
+// The deque of the current thread, if it has one, and the number of forks
+// which enclose the code that it is running.
+GELSHARED _Thread_local int gelforkself = -1;
+GELSHARED _Thread_local int gelforkdepth;
+
+static void gelrun(geltask* task) {
+  const int depth = gelforkdepth;
+  gelforkdepth = task->depth;
+  task->run(task);
+  gelforkdepth = depth;
+  __atomic_store_n(&task->done, true, __ATOMIC_RELEASE);
+}
+
+// Steal the oldest task of another thread and run it.
+static bool gelhelp(void) {
+  const int self = gelforkself;
+  for (int i = 1; i < gelforks.threads; i++) {
+    geldeque* victim = &gelforks.deques[(self + i) % gelforks.threads];
+    pthread_mutex_lock(&victim->lock);
+    geltask* task = NULL;
+    if (victim->front < victim->back) {
+      task = victim->tasks[victim->front++];
+      if (victim->front == victim->back) victim->front = victim->back = 0;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (task) {
+      __atomic_fetch_sub(&gelforks.waiting, 1, __ATOMIC_RELAXED);
+      gelrun(task);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void* gelforkthread(void* argument) {
+  gelforkself = (int) (intptr_t) argument;
+  while (true) {
+    pthread_mutex_lock(&gelforks.lock);
+    gelforks.sleeping++;
+    while (__atomic_load_n(&gelforks.waiting, __ATOMIC_ACQUIRE) == 0) {
+      pthread_cond_wait(&gelforks.wake, &gelforks.lock);
+    }
+    gelforks.sleeping--;
+    pthread_mutex_unlock(&gelforks.lock);
+    while (gelhelp()) continue;
+  }
+  return NULL;
+}
+
+// Take the first deque for the current thread, starting the threads if they
+// haven't been started yet. GEL_THREADS overrides the processor count.
+static bool gelclaim(void) {
+  pthread_mutex_lock(&gelforks.lock);
+  if (gelforks.threads == 0) {
+    const char* setting = getenv("GEL_THREADS");
+    long threads = setting ? atol(setting) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > GELMAXTHREADS) threads = GELMAXTHREADS;
+    for (int i = 0; i < threads; i++) {
+      pthread_mutex_init(&gelforks.deques[i].lock, NULL);
+    }
+    gelforks.threads = 1;
+    for (int i = 1; i < threads; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, gelforkthread, (void*) (intptr_t) i)) {
+        break;
+      }
+      pthread_detach(thread);
+      gelforks.threads++;
+    }
+    // Allow enough tasks to keep every thread busy while some are uneven.
+    gelforks.cutoff = 4;
+    for (int i = 1; i < gelforks.threads; i *= 2) gelforks.cutoff++;
+  }
+  const bool claimed = gelforks.threads > 1 && !gelforks.claimed;
+  if (claimed) {
+    gelforks.claimed = true;
+    gelforkself = 0;
+  }
+  pthread_mutex_unlock(&gelforks.lock);
+  return claimed;
+}
+
+// Give up the first deque once the outermost fork of the thread has joined.
+static void gelunclaim(void) {
+  if (gelforkdepth > 0 || gelforkself != 0) return;
+  gelforkself = -1;
+  pthread_mutex_lock(&gelforks.lock);
+  gelforks.claimed = false;
+  pthread_mutex_unlock(&gelforks.lock);
+}
+
+// Offer a task to the other threads. A task which can't be offered runs now.
+static void gelfork(geltask* task) {
+  task->depth = gelforkdepth + 1;
+  task->forked = false;
+  task->done = false;
+  if (gelforkself < 0 && (gelforkdepth > 0 || !gelclaim())) {
+    gelrun(task);
+    return;
+  }
+  geldeque* deque = &gelforks.deques[gelforkself];
+  pthread_mutex_lock(&deque->lock);
+  if (task->depth <= gelforks.cutoff && deque->back < GELMAXTASKS) {
+    deque->tasks[deque->back++] = task;
+    task->forked = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  if (!task->forked) {
+    gelrun(task);
+  } else {
+    gelforkdepth++;
+    __atomic_fetch_add(&gelforks.waiting, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&gelforks.lock);
+    if (gelforks.sleeping > 0) pthread_cond_signal(&gelforks.wake);
+    pthread_mutex_unlock(&gelforks.lock);
+  }
+  gelunclaim();
+}
+
+// Wait for a forked task to finish, running it here if nobody stole it.
+static void geljoin(geltask* task) {
+  if (!task->forked) return;
+  gelforkdepth--;
+  geldeque* deque = &gelforks.deques[gelforkself];
+  pthread_mutex_lock(&deque->lock);
+  const bool kept =
+      deque->front < deque->back && deque->tasks[deque->back - 1] == task;
+  if (kept) {
+    deque->back--;
+    if (deque->front == deque->back) deque->front = deque->back = 0;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  if (kept) {
+    __atomic_fetch_sub(&gelforks.waiting, 1, __ATOMIC_RELAXED);
+    gelrun(task);
+  } else {
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+      if (!gelhelp()) sched_yield();
+    }
+  }
+  gelunclaim();
+}
+)";
+
+// Instrumented programs count how often each if statement goes each way.
+constexpr char kProfile[] = R"(
+static inline bool gelbranch(uint64_t* counts, bool condition) {
+  __atomic_fetch_add(&counts[!condition], 1, __ATOMIC_RELAXED);
+  return condition;
+}
+)";
+
+// The counts are written out when the program exits, however it exits.
+constexpr char kProfileWriter[] = R"(
+__attribute__((destructor)) static void gelprofile(void) {
+  FILE* file = fopen("${PATH}", "w");
+  if (!file) return;
+${COUNTS}  fclose(file);
+}
+)";
+
+constexpr char kProfileCounts[] = R"(  fprintf(file, "call ${NAME} %llu\n",
+          (unsigned long long) gelcalls_${NAME});
+  for (int i = 0; i < ${BRANCHES}; i++) {
+    fprintf(file, "branch ${NAME} %llu %llu\n",
+            (unsigned long long) gelbranches_${NAME}[i][0],
+            (unsigned long long) gelbranches_${NAME}[i][1]);
+  }
+)";
+
+// Branches are only marked as likely or unlikely if they ran often enough to
+// say so, and went the same way at least nine times out of ten.
+constexpr std::int64_t kMinimumBranches = 16;
+constexpr std::int64_t kBias = 9;
+
+// Functions which make at least one in this many of the calls in a profile are
+// hot, and always inlined if they have at most kInlineStatements statements.
+constexpr std::int64_t kHotFraction = 100;
+constexpr std::size_t kInlineStatements = 8;
+
+// A memoized function is compiled under another name and called through
+// a wrapper which consults its table first. Recursive calls go through the
+// wrapper too. Each thread has its own tables, so that parallel loops can call
+// memoized functions.
+constexpr char kMemoizedDeclaration[] = R"(
+static _Thread_local gelmemo gelmemo_${NAME} = {.arity = ${ARITY}};
+${LINKAGE}${TYPE} gel_${NAME}(${PARAMETERS});
+)";
+
+constexpr char kMemoizedDefinition[] = R"(
+${LINKAGE}${TYPE} gel_${NAME}(${PARAMETERS}) {
+  gel_integer key[] = {${ARGUMENTS}};
+  gel_integer result;
+  if (gelmemo_lookup(&gelmemo_${NAME}, key, &result)) return result;
+  result = gelcompute_${NAME}(${ARGUMENTS});
+  gelmemo_insert(&gelmemo_${NAME}, key, result);
+  return result;
+}
+)";
+
+// Pure functions which call themselves and take and return only primitives
+// are memoized, so that a recursion which makes the same call many times only
+// computes it once. This makes the naive recursive Fibonacci function linear
+// instead of exponential.
+bool Memoizable(const analysis::AnnotatedAst::DefineFunction& definition,
+                const analysis::Purity& purity) {
+  if (!purity.pure.count(definition.name) ||
+      !purity.recursive.count(definition.name) ||
+      definition.parameters.empty() ||
+      !definition.type.return_type.is<types::Primitive>()) {
+    return false;
+  }
+  return std::all_of(
+      definition.parameters.begin(), definition.parameters.end(),
+      [](const auto& parameter) {
+        return parameter.type.template is<types::Primitive>();
+      });
+}
+
+// Returns true if the last statement in the block is a return statement, in
+// which case the end of the block is unreachable.
+bool EndsWithReturn(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  if (statements.empty()) return false;
+  return statements.back().is<analysis::AnnotatedAst::ReturnVoid>() ||
+         statements.back().is<analysis::AnnotatedAst::Return>();
+}
+
+// Returns the number of statements in the block, including nested ones.
+std::size_t CountStatements(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  std::size_t count = statements.size();
+  for (const auto& statement : statements) {
+    if (const auto* if_statement =
+            statement.get_if<analysis::AnnotatedAst::If>()) {
+      count += CountStatements(if_statement->if_true) +
+               CountStatements(if_statement->if_false);
+    } else if (const auto* while_statement =
+                   statement.get_if<analysis::AnnotatedAst::While>()) {
+      count += CountStatements(while_statement->body);
+    } else if (const auto* parallel_for =
+                   statement.get_if<analysis::AnnotatedAst::ParallelFor>()) {
+      count += CountStatements(parallel_for->body);
+    }
+  }
+  return count;
+}
+
+// Returns true if any of the statements is or contains a parallel loop.
+bool ContainsParallelFor(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  return std::any_of(
+      statements.begin(), statements.end(),
+      [](const analysis::AnnotatedAst::Statement& statement) {
+        if (statement.is<analysis::AnnotatedAst::ParallelFor>()) return true;
+        if (const auto* if_statement =
+                statement.get_if<analysis::AnnotatedAst::If>()) {
+          return ContainsParallelFor(if_statement->if_true) ||
+                 ContainsParallelFor(if_statement->if_false);
+        }
+        if (const auto* while_statement =
+                statement.get_if<analysis::AnnotatedAst::While>()) {
+          return ContainsParallelFor(while_statement->body);
+        }
+        return false;
+      });
+}
+
+bool ContainsParallelFor(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  return ContainsParallelFor(definition.body);
+}
+
+bool ContainsParallelFor(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& definitions) {
+  return std::any_of(
+      definitions.begin(), definitions.end(),
+      [](const analysis::AnnotatedAst::DefineFunction& definition) {
+        return ContainsParallelFor(definition);
+      });
+}
+
+// Adds the names of the arrays whose elements the statements assign to.
+void FindElementStores(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements,
+    std::set<std::string, std::less<>>* names) {
+  for (const auto& statement : statements) {
+    if (const auto* store =
+            statement.get_if<analysis::AnnotatedAst::AssignElement>()) {
+      names->insert(store->variable.name);
+    } else if (const auto* if_statement =
+                   statement.get_if<analysis::AnnotatedAst::If>()) {
+      FindElementStores(if_statement->if_true, names);
+      FindElementStores(if_statement->if_false, names);
+    } else if (const auto* while_statement =
+                   statement.get_if<analysis::AnnotatedAst::While>()) {
+      FindElementStores(while_statement->body, names);
+    } else if (const auto* parallel_for =
+                   statement.get_if<analysis::AnnotatedAst::ParallelFor>()) {
+      FindElementStores(parallel_for->body, names);
+    }
+  }
+}
+
+// Returns the order in which to place functions into translation units. Each
+// function is followed by the functions that it calls which have not been
+// placed yet, depth first from the last function defined. Programs are defined
+// bottom-up, so that is usually main.
+std::vector<std::size_t> OrderByCalls(
+    const std::vector<const analysis::AnnotatedAst::DefineFunction*>&
+        definitions,
+    const analysis::Purity& purity) {
+  const std::size_t n = definitions.size();
+  std::map<std::string_view, std::size_t> indices;
+  for (std::size_t i = 0; i < n; i++) indices.emplace(definitions[i]->name, i);
+  std::vector<bool> placed(n);
+  std::vector<std::size_t> order, pending;
+  for (std::size_t root = n; root-- > 0;) {
+    pending.push_back(root);
+    while (!pending.empty()) {
+      const auto index = pending.back();
+      pending.pop_back();
+      if (placed[index]) continue;
+      placed[index] = true;
+      order.push_back(index);
+      const auto calls = purity.calls.find(definitions[index]->name);
+      if (calls == purity.calls.end()) continue;
+      for (auto callee = calls->second.rbegin();
+           callee != calls->second.rend(); ++callee) {
+        const auto i = indices.find(*callee);
+        if (i != indices.end() && !placed[i->second]) {
+          pending.push_back(i->second);
+        }
+      }
+    }
+  }
+  return order;
+}
+
+// Functions returning arrays construct their result directly in storage
+// provided by the caller, which is passed as an extra first parameter.
+bool ReturnsIndirectly(const types::Type& type) {
+  return type.is<types::Array>();
+}
+
+// The name of the parameter which points to the result storage.
+constexpr char kResult[] = "(*gelresult)";
+
+// The names of the element-wise runtime kernels for each operation.
+std::string_view ElementwiseKernel(ast::Arithmetic operation) {
+  switch (operation) {
+    case ast::Arithmetic::ADD: return "add";
+    case ast::Arithmetic::DIVIDE: return "divide";
+    case ast::Arithmetic::MULTIPLY: return "multiply";
+    case ast::Arithmetic::SUBTRACT: return "subtract";
+  }
+  throw std::logic_error("Invalid arithmetic operation.");
+}
+
+std::string_view ElementwiseKernel(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return "equal";
+    case ast::Compare::GREATER_OR_EQUAL: return "greater_or_equal";
+    case ast::Compare::GREATER_THAN: return "greater";
+    case ast::Compare::LESS_OR_EQUAL: return "less_or_equal";
+    case ast::Compare::LESS_THAN: return "less";
+    case ast::Compare::NOT_EQUAL: return "not_equal";
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+// The C spellings of the operators.
+std::string_view Operator(ast::Arithmetic operation) {
+  switch (operation) {
+    case ast::Arithmetic::ADD: return "+";
+    case ast::Arithmetic::DIVIDE: return "/";
+    case ast::Arithmetic::MULTIPLY: return "*";
+    case ast::Arithmetic::SUBTRACT: return "-";
+  }
+  throw std::logic_error("Invalid arithmetic operation.");
+}
+
+std::string_view Operator(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return "==";
+    case ast::Compare::GREATER_OR_EQUAL: return ">=";
+    case ast::Compare::GREATER_THAN: return ">";
+    case ast::Compare::LESS_OR_EQUAL: return "<=";
+    case ast::Compare::LESS_THAN: return "<";
+    case ast::Compare::NOT_EQUAL: return "!=";
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+std::string_view Operator(ast::Logical operation) {
+  switch (operation) {
+    case ast::Logical::AND: return "&&";
+    case ast::Logical::OR: return "||";
+  }
+  throw std::logic_error("Invalid logical operation.");
+}
+
+// An integer as a C expression. The most negative integer has no literal,
+// since -9223372036854775808 negates a literal which is too large for any
+// signed type.
+std::string Literal(std::int64_t value) {
+  if (value == std::numeric_limits<std::int64_t>::min())
+    return "(-9223372036854775807 - 1)";
+  return std::to_string(value);
+}
+
+// Multiplication by a constant as a C expression, using a shift in place of
+// the multiplication where possible.
+std::string Multiply(std::string_view left, std::int64_t factor) {
+  if (factor == 0) return "0";
+  if (factor == 1) return std::string{left};
+  if (auto shift = optimize::Log2(factor)) {
+    // Shifting a negative value left is undefined, so shift the bits instead.
+    return "((gel_integer) " + std::string{factor < 0 ? "-" : ""} +
+           "((uint64_t) " + std::string{left} + " << " +
+           std::to_string(*shift) + "))";
+  }
+  return "(" + std::string{left} + " * " + Literal(factor) + ")";
+}
+
+// Division by a constant as a C expression, using shifts and multiplications
+// in place of the division instruction where gel's truncating signed
+// arithmetic allows. The left operand may appear several times, so it should
+// be a variable.
+std::string Divide(std::string_view left, std::int64_t divisor) {
+  const std::string value{left};
+  if (divisor == 0 || divisor == -1) {
+    // These trap or overflow at run time, so leave them to the C compiler.
+    return "(" + value + " / " + Literal(divisor) + ")";
+  }
+  if (divisor == 1) return value;
+  if (auto shift = optimize::Log2(divisor)) {
+    // Division truncates towards zero, so negative dividends are biased by
+    // 2^shift - 1 before shifting.
+    auto quotient = "((" + value + " + (gel_integer) ((uint64_t) (" + value +
+                    " >> 63) >> " + std::to_string(64 - *shift) + ")) >> " +
+                    std::to_string(*shift) + ")";
+    return divisor < 0 ? "(-" + quotient + ")" : quotient;
+  }
+  const auto magic = optimize::SignedDivisionMagic(divisor);
+  std::ostringstream multiplier;
+  multiplier << std::hex << static_cast<std::uint64_t>(magic.multiplier);
+  auto quotient = "(gel_integer) (((__int128) " + value +
+                  " * (gel_integer) 0x" + multiplier.str() + "ull) >> 64)";
+  if (divisor > 0 && magic.multiplier < 0) {
+    quotient = "(" + quotient + " + " + value + ")";
+  } else if (divisor < 0 && magic.multiplier > 0) {
+    quotient = "(" + quotient + " - " + value + ")";
+  }
+  if (magic.shift > 0) {
+    quotient = "(" + quotient + " >> " + std::to_string(magic.shift) + ")";
+  }
+  // Round towards zero by adding one to negative quotients.
+  return "(" + quotient + " + (gel_integer) ((uint64_t) " + quotient +
+         " >> 63))";
+}
+
 class Compiler {
  public:
-  Compiler(std::ostream* output) : output_(output) {}
+  Compiler(const ownership::Info& ownership, const bounds::Info& bounds,
+           const analysis::Purity& purity, const Options& options,
+           std::ostream* output)
+      : ownership_(&ownership),
+        bounds_(&bounds),
+        purity_(&purity),
+        options_(&options),
+        output_(output) {
+    if (options.profile) {
+      for (const auto& [name, count] : options.profile->calls) {
+        total_calls_ += count;
+      }
+    }
+  }
 
   // Emit code to declare the given type.
   void DeclareType(const types::Void&);
@@ -87,19 +1085,84 @@ class Compiler {
                          int indent);
   void CompileExpression(std::string_view output,
                          const analysis::AnnotatedAst::LogicalNot&, int indent);
+  void CompileExpression(std::string_view output,
+                         const analysis::AnnotatedAst::Index&, int indent);
+  void CompileExpression(std::string_view output,
+                         const analysis::AnnotatedAst::Size&, int indent);
   void CompileAnyExpression(std::string_view output,
                             const analysis::AnnotatedAst::Expression&,
                             int indent);
 
+  // Returns the expression as a single C expression if it has a primitive
+  // type and can be computed without any temporaries or calls. Such an
+  // expression has no effects, so it can be evaluated at any point before its
+  // value is needed, but it may fail. Division by zero is undefined anyway,
+  // but a failed bounds check reports which index was wrong, so the number of
+  // bounds checks in the expression is added to `checks`. Expressions with
+  // more than one check are not inlined, since C doesn't fix which of them
+  // would fail first.
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Identifier&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Boolean&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Integer&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::ArrayLiteral&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Arithmetic&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Compare&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Logical&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::FunctionCall&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::LogicalNot&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Index&,
+                                    int* checks) const;
+  std::optional<std::string> Inline(const analysis::AnnotatedAst::Size&,
+                                    int* checks) const;
+  std::optional<std::string> InlineAny(
+      const analysis::AnnotatedAst::Expression&, int* checks) const;
+  std::optional<std::string> InlineAny(
+      const analysis::AnnotatedAst::Expression&) const;
+  // The value of the variable, which must be a primitive.
+  std::string InlineVariable(std::string_view name) const;
+  // Emit code to apply a binary operator to operands of the given type. An
+  // inline right operand is used directly, since it can be evaluated after
+  // the left one.
+  void CompileBinary(std::string_view output, std::string_view type_name,
+                     const analysis::AnnotatedAst::Expression& left_operand,
+                     std::string_view operation,
+                     const analysis::AnnotatedAst::Expression& right_operand,
+                     int indent);
+  // Evaluate the operands of a binary operator. With fork-join enabled, when
+  // both are calls to pure functions which can take a while, the right one is
+  // forked to run alongside the left one.
+  void CompileOperands(std::string_view left, std::string_view right,
+                       const analysis::AnnotatedAst::Expression& left_operand,
+                       const analysis::AnnotatedAst::Expression& right_operand,
+                       int indent);
+  bool Forkable(const analysis::AnnotatedAst::Expression&) const;
+  void CompileFork(std::string_view left, std::string_view right,
+                   const analysis::AnnotatedAst::Expression& left_operand,
+                   const analysis::AnnotatedAst::FunctionCall& right_operand,
+                   int indent);
+
   // Emit code to execute the given statement. The current line and any
   // additional lines should be indented by the given indent amount. The output
   // should be terminated with a newline.
   void CompileStatement(const analysis::AnnotatedAst::DefineVariable&,
                         int indent);
   void CompileStatement(const analysis::AnnotatedAst::Assign&, int indent);
+  void CompileStatement(const analysis::AnnotatedAst::AssignElement&,
+                        int indent);
   void CompileStatement(const analysis::AnnotatedAst::DoFunction&, int indent);
   void CompileStatement(const analysis::AnnotatedAst::If&, int indent);
   void CompileStatement(const analysis::AnnotatedAst::While&, int indent);
+  void CompileStatement(const analysis::AnnotatedAst::ParallelFor&,
+                        int indent);
   void CompileStatement(const analysis::AnnotatedAst::ReturnVoid&, int indent);
   void CompileStatement(const analysis::AnnotatedAst::Return&, int indent);
   void CompileStatement(const std::vector<analysis::AnnotatedAst::Statement>&,
@@ -112,12 +1175,116 @@ class Compiler {
   void CompileTopLevel(
       const std::vector<analysis::AnnotatedAst::DefineFunction>&);
   void CompileAnyTopLevel(const analysis::AnnotatedAst::TopLevel&);
+  // Emit code to write out the counts of an instrumented program.
+  void CompileProfile();
+  // Compile the functions into the given number of translation units, and
+  // emit the runtimes and function declarations which they share.
+  std::vector<std::string> CompileUnits(
+      const std::vector<const analysis::AnnotatedAst::DefineFunction*>&,
+      std::size_t count);
 
  private:
+  struct Variable {
+    std::string name;
+    std::string c_name;
+    types::Type type;
+    // Borrowed variables are pointers to a value owned by the caller.
+    bool borrowed;
+    // Variables which are borrowed or which alias another variable don't own
+    // their value and must not destroy it.
+    bool owned;
+  };
+
+  // Values computed into temporary variables, with the names of their types.
+  using Temporaries = std::vector<std::pair<std::string, std::string>>;
+
   // Generate a new unique identifier.
   std::string NextIdentifier();
 
+  // Compile a function, along with the functions outlined from it and its
+  // counters if the program is instrumented.
+  std::string CompileFunction(const analysis::AnnotatedAst::DefineFunction&);
+  // Returns the runtimes which the code so far needs and which have not been
+  // emitted yet.
+  std::string Runtimes();
+  // Functions are local to the translation unit unless the program is split
+  // into several.
+  std::string Linkage() const { return split_ ? "" : "static "; }
+
+  // Returns the start of the definition of a function, up to its return type.
+  // The profile decides whether it is hot, cold, or always inlined.
+  std::string FunctionPrefix(
+      const analysis::AnnotatedAst::DefineFunction& definition,
+      bool memoized) const;
+  // Returns the condition of the next if statement in the function, either
+  // counting its outcomes or telling the C compiler which way it usually goes.
+  std::string Branch(std::string condition);
+
+  // Emit code to locate the value of an array expression and return a C
+  // expression which refers to it. Arrays held in variables are accessed in
+  // place. Other arrays are computed into temporaries which are added to the
+  // list and must be destroyed by the caller once the value is no longer used.
+  std::string CompilePlace(const analysis::AnnotatedAst::Expression&,
+                           int indent, Temporaries* temporaries);
+  std::string CompileElement(const analysis::AnnotatedAst::Index&, int indent,
+                             Temporaries* temporaries);
+  void DestroyTemporaries(const Temporaries& temporaries, int indent);
+
+  // Emit code to combine two arrays of integers element by element with the
+  // named kernel from the element-wise runtime. The result is allocated once,
+  // or reuses the buffer of an operand which is a temporary.
+  void CompileElementwise(std::string_view output, std::string_view kernel,
+                          const types::Type& type,
+                          const analysis::AnnotatedAst::Expression& left,
+                          const analysis::AnnotatedAst::Expression& right,
+                          int indent);
+
+  // Enter a new scope. Variables defined in the scope are destroyed when the
+  // scope is left.
+  void PushScope();
+  void PopScope(int indent);
+  // Choose the name in the generated code for a new variable.
+  std::string VariableName(const std::string& name);
+  // Add a variable to the innermost scope.
+  void DefineVariable(std::string name, std::string c_name, types::Type type,
+                      bool borrowed = false, bool owned = true);
+  const Variable& LookupVariable(std::string_view name) const;
+  // Emit code to destroy the variables in the given number of innermost scopes,
+  // except for the named return value if there is one.
+  void DestroyScopes(std::size_t count, int indent);
+
+  const ownership::Info* ownership_;
+  const bounds::Info* bounds_;
+  const analysis::Purity* purity_;
+  const Options* options_;
   std::ostream* output_;
+  std::vector<std::vector<Variable>> scopes_;
+  // Whether the memoization runtime is needed and whether it has been emitted.
+  bool memoization_used_ = false;
+  bool memoization_declared_ = false;
+  // Whether the element-wise runtime is needed and whether it has been emitted.
+  bool elementwise_used_ = false;
+  bool elementwise_declared_ = false;
+  // Likewise for the parallel and fork-join runtimes.
+  bool parallel_used_ = false;
+  bool parallel_declared_ = false;
+  bool fork_used_ = false;
+  bool fork_declared_ = false;
+  // The bodies of parallel loops and forked calls are compiled into functions
+  // of their own, which must be emitted before the function containing them.
+  std::string outlined_;
+  // Whether the program is split into several translation units, which share
+  // declarations of every function.
+  bool split_ = false;
+  std::string prototypes_;
+  // The instrumented functions, with the number of if statements in each.
+  std::vector<std::pair<std::string, std::size_t>> profiled_;
+  std::int64_t total_calls_ = 0;
+  // Properties of the function which is being compiled.
+  std::string function_;
+  std::size_t branches_ = 0;
+  bool returns_indirectly_ = false;
+  std::string named_return_;
   std::uint64_t next_id_ = 0;
   std::map<types::Type, std::string> type_names_ = {
       {types::Void{}, "gel_void"},
@@ -144,8 +1311,12 @@ typedef struct ${TYPE} {
   gel_integer size;
 } ${TYPE};
 
+static ${ELEMENT_TYPE}* gelalloc_${TYPE}(gel_integer size) {
+  return malloc(size * sizeof(${ELEMENT_TYPE}));
+}
+
 static ${TYPE} gelcopy_${TYPE}(${TYPE} source) {
-  ${ELEMENT_TYPE}* data = malloc(source.size * sizeof(${ELEMENT_TYPE}));
+  ${ELEMENT_TYPE}* data = gelalloc_${TYPE}(source.size);
   for (gel_integer i = 0; i < source.size; i++) {
     data[i] = gelcopy_${ELEMENT_TYPE}(source.data[i]);
   }
@@ -155,6 +1326,19 @@ static ${TYPE} gelcopy_${TYPE}(${TYPE} source) {
   };
 }
 
+// Transfer ownership of the array. The source is left empty so that
+// destroying it has no effect.
+static ${TYPE} gelmove_${TYPE}(${TYPE}* source) {
+  ${TYPE} result = *source;
+  source->data = NULL;
+  source->size = 0;
+  return result;
+}
+
+// Every array exclusively owns its elements, so there is nothing to do before
+// modifying one.
+static inline void gelunshare_${TYPE}(${TYPE}* array) {}
+
 static void geldestroy_${TYPE}(${TYPE} source) {
   for (gel_integer i = source.size - 1; i >= 0; i--) {
     geldestroy_${ELEMENT_TYPE}(source.data[i]);
@@ -162,10 +1346,90 @@ static void geldestroy_${TYPE}(${TYPE} source) {
   free(source.data);
 }
 )";
+
+// Reference counting for the copy-on-write representation. Only programs with
+// parallel loops can share an array between threads, so only those pay for
+// atomic updates.
+constexpr char kReferenceCounts[] = R"(
+static inline void gelretain(void* data) { ++*gelrefcount(data); }
+
+static inline gel_integer gelrelease(void* data) {
+  return --*gelrefcount(data);
+}
+
+static inline bool gelunique(void* data) { return *gelrefcount(data) == 1; }
+)";
+
+constexpr char kAtomicReferenceCounts[] = R"(
+static inline void gelretain(void* data) {
+  __atomic_fetch_add(gelrefcount(data), 1, __ATOMIC_RELAXED);
+}
+
+static inline gel_integer gelrelease(void* data) {
+  return __atomic_sub_fetch(gelrefcount(data), 1, __ATOMIC_ACQ_REL);
+}
+
+static inline bool gelunique(void* data) {
+  return __atomic_load_n(gelrefcount(data), __ATOMIC_ACQUIRE) == 1;
+}
+)";
+
+// Copy-on-write representation: copies of an array share a single buffer
+// which is prefixed by a reference count. Modifying an array must first call
+// gelunshare to obtain a private buffer if the current one is shared.
+constexpr char kSharedDeclaration[] = R"(
+typedef struct ${TYPE} {
+  ${ELEMENT_TYPE}* data;
+  gel_integer size;
+} ${TYPE};
+
+static ${ELEMENT_TYPE}* gelalloc_${TYPE}(gel_integer size) {
+  gel_integer* block =
+      malloc(sizeof(gel_integer) + size * sizeof(${ELEMENT_TYPE}));
+  *block = 1;
+  return (${ELEMENT_TYPE}*) (block + 1);
+}
+
+static ${TYPE} gelcopy_${TYPE}(${TYPE} source) {
+  if (source.data) gelretain(source.data);
+  return source;
+}
+
+// Transfer ownership of the array. The source is left empty so that
+// destroying it has no effect.
+static ${TYPE} gelmove_${TYPE}(${TYPE}* source) {
+  ${TYPE} result = *source;
+  source->data = NULL;
+  source->size = 0;
+  return result;
+}
+
+static void geldestroy_${TYPE}(${TYPE} source) {
+  if (!source.data || gelrelease(source.data) > 0) return;
+  for (gel_integer i = source.size - 1; i >= 0; i--) {
+    geldestroy_${ELEMENT_TYPE}(source.data[i]);
+  }
+  free(gelrefcount(source.data));
+}
+
+// The other owners may release the shared buffer in the meantime, so this
+// array's reference is released like any other.
+static void gelunshare_${TYPE}(${TYPE}* array) {
+  if (!array->data || gelunique(array->data)) return;
+  ${ELEMENT_TYPE}* data = gelalloc_${TYPE}(array->size);
+  for (gel_integer i = 0; i < array->size; i++) {
+    data[i] = gelcopy_${ELEMENT_TYPE}(array->data[i]);
+  }
+  const ${TYPE} shared = *array;
+  array->data = data;
+  geldestroy_${TYPE}(shared);
+}
+)";
 void Compiler::DeclareType(const types::Array& array) {
   auto name = NextIdentifier();
   const auto& element_name = type_names_.at(array.element_type);
-  util::substitute(*output_, kDeclaration,
+  util::substitute(*output_,
+                   options_->copy_on_write ? kSharedDeclaration : kDeclaration,
                    {
                        {"TYPE"sv, name},
                        {"ELEMENT_TYPE"sv, element_name},
@@ -182,8 +1446,22 @@ void Compiler::CompileExpression(
     std::string_view variable,
     const analysis::AnnotatedAst::Identifier& identifier, int indent) {
   const auto& type_name = type_names_.at(identifier.type);
-  *output_ << util::Spaces{indent} << variable << " = gelcopy_" << type_name
-           << "(gel_" << identifier.name << ");\n";
+  const auto& source = LookupVariable(identifier.name);
+  if (source.borrowed) {
+    *output_ << util::Spaces{indent} << variable << " = gelcopy_" << type_name
+             << "(*" << source.c_name << ");\n";
+  } else if (identifier.type.is<types::Primitive>()) {
+    // Copying or moving a primitive is a plain assignment, and spelling it
+    // that way keeps loops cheap even when the C compiler isn't optimizing.
+    *output_ << util::Spaces{indent} << variable << " = " << source.c_name
+             << ";\n";
+  } else if (ownership_->moves.count(&identifier)) {
+    *output_ << util::Spaces{indent} << variable << " = gelmove_" << type_name
+             << "(&" << source.c_name << ");\n";
+  } else {
+    *output_ << util::Spaces{indent} << variable << " = gelcopy_" << type_name
+             << "(" << source.c_name << ");\n";
+  }
 }
 
 void Compiler::CompileExpression(std::string_view variable,
@@ -196,8 +1474,8 @@ void Compiler::CompileExpression(std::string_view variable,
 void Compiler::CompileExpression(std::string_view variable,
                                  const analysis::AnnotatedAst::Integer& integer,
                                  int indent) {
-  *output_ << util::Spaces{indent} << variable << " = " << integer.value
-           << ";\n";
+  *output_ << util::Spaces{indent} << variable << " = "
+           << Literal(integer.value) << ";\n";
 }
 
 void Compiler::CompileExpression(
@@ -206,16 +1484,16 @@ void Compiler::CompileExpression(
   const types::Type& element_type =
       array.type.get_if<types::Array>()->element_type;
   const auto& element_type_name = type_names_.at(element_type);
+  const auto& array_type_name = type_names_.at(array.type);
   auto temp = NextIdentifier();
   *output_ << util::Spaces{indent} << "{\n"
            << util::Spaces{indent + 2} << element_type_name << "* " << temp
-           << " = malloc(" << array.parts.size() << " * sizeof("
-           << element_type_name << "));\n";
+           << " = gelalloc_" << array_type_name << "(" << array.parts.size()
+           << ");\n";
   for (std::size_t i = 0, n = array.parts.size(); i < n; i++) {
     CompileAnyExpression(temp + "[" + std::to_string(i) + "]", array.parts[i],
                          indent + 2);
   }
-  const auto& array_type_name = type_names_.at(array.type);
   *output_ << util::Spaces{indent + 2} << variable << " = (struct "
            << array_type_name << ") {\n"
            << util::Spaces{indent + 4} << ".data = " << temp << ",\n"
@@ -228,64 +1506,169 @@ void Compiler::CompileExpression(
 void Compiler::CompileExpression(
     std::string_view variable, const analysis::AnnotatedAst::Arithmetic& binary,
     int indent) {
+  if (binary.type.is<types::Array>()) {
+    CompileElementwise(variable, ElementwiseKernel(binary.operation),
+                       binary.type, binary.left, binary.right, indent);
+    return;
+  }
   const auto& type_name = type_names_.at(binary.type);
-  auto left = NextIdentifier(), right = NextIdentifier();
-  *output_ << util::Spaces{indent} << "{\n"
-           << util::Spaces{indent + 2} << type_name << " " << left << ", "
-           << right << ";\n";
-  CompileAnyExpression(left, binary.left, indent + 2);
-  CompileAnyExpression(right, binary.right, indent + 2);
-  *output_ << util::Spaces{indent + 2} << variable << " = " << left << " ";
-  switch (binary.operation) {
-    case ast::Arithmetic::ADD:
-      *output_ << "+";
-      break;
-    case ast::Arithmetic::DIVIDE:
-      *output_ << "/";
-      break;
-    case ast::Arithmetic::MULTIPLY:
-      *output_ << "*";
-      break;
-    case ast::Arithmetic::SUBTRACT:
-      *output_ << "-";
-      break;
+  const auto* constant =
+      binary.right.get_if<analysis::AnnotatedAst::Integer>();
+  if (constant && (binary.operation == ast::Arithmetic::MULTIPLY ||
+                   binary.operation == ast::Arithmetic::DIVIDE)) {
+    auto left = NextIdentifier();
+    *output_ << util::Spaces{indent} << "{\n"
+             << util::Spaces{indent + 2} << type_name << " " << left << ";\n";
+    CompileAnyExpression(left, binary.left, indent + 2);
+    if (binary.operation == ast::Arithmetic::MULTIPLY) {
+      *output_ << util::Spaces{indent + 2} << variable << " = "
+               << Multiply(left, constant->value) << ";\n";
+    } else {
+      *output_ << util::Spaces{indent + 2} << variable << " = "
+               << Divide(left, constant->value) << ";\n";
+    }
+    *output_ << util::Spaces{indent} << "}\n";
+    return;
   }
-  *output_ << " " << right << ";\n" << util::Spaces{indent} << "}\n";
+  CompileBinary(variable, type_name, binary.left, Operator(binary.operation),
+                binary.right, indent);
 }
 
 void Compiler::CompileExpression(std::string_view variable,
                                  const analysis::AnnotatedAst::Compare& binary,
                                  int indent) {
+  if (binary.type.is<types::Array>()) {
+    CompileElementwise(variable, ElementwiseKernel(binary.operation),
+                       binary.type, binary.left, binary.right, indent);
+    return;
+  }
   const auto& type_name =
       type_names_.at(analysis::AnnotatedAst::GetMeta(binary.left).type);
-  auto left = NextIdentifier(), right = NextIdentifier();
+  CompileBinary(variable, type_name, binary.left, Operator(binary.operation),
+                binary.right, indent);
+}
+
+void Compiler::CompileBinary(
+    std::string_view variable, std::string_view type_name,
+    const analysis::AnnotatedAst::Expression& left_operand,
+    std::string_view operation,
+    const analysis::AnnotatedAst::Expression& right_operand, int indent) {
+  auto left = NextIdentifier();
+  auto right = InlineAny(right_operand);
   *output_ << util::Spaces{indent} << "{\n"
-           << util::Spaces{indent + 2} << type_name << " " << left << ", "
-           << right << ";\n";
-  CompileAnyExpression(left, binary.left, indent + 2);
-  CompileAnyExpression(right, binary.right, indent + 2);
-  *output_ << util::Spaces{indent + 2} << variable << " = " << left << " ";
-  switch (binary.operation) {
-    case ast::Compare::EQUAL:
-      *output_ << "==";
-      break;
-    case ast::Compare::GREATER_OR_EQUAL:
-      *output_ << ">=";
-      break;
-    case ast::Compare::GREATER_THAN:
-      *output_ << ">";
-      break;
-    case ast::Compare::LESS_OR_EQUAL:
-      *output_ << "<=";
-      break;
-    case ast::Compare::LESS_THAN:
-      *output_ << "<";
-      break;
-    case ast::Compare::NOT_EQUAL:
-      *output_ << "!=";
-      break;
+           << util::Spaces{indent + 2} << type_name << " " << left;
+  if (right) {
+    *output_ << ";\n";
+    CompileAnyExpression(left, left_operand, indent + 2);
+  } else {
+    right = NextIdentifier();
+    *output_ << ", " << *right << ";\n";
+    CompileOperands(left, *right, left_operand, right_operand, indent + 2);
+  }
+  *output_ << util::Spaces{indent + 2} << variable << " = " << left << " "
+           << operation << " " << *right << ";\n"
+           << util::Spaces{indent} << "}\n";
+}
+
+void Compiler::CompileOperands(
+    std::string_view left, std::string_view right,
+    const analysis::AnnotatedAst::Expression& left_operand,
+    const analysis::AnnotatedAst::Expression& right_operand, int indent) {
+  if (options_->fork_join && Forkable(left_operand) &&
+      Forkable(right_operand)) {
+    CompileFork(left, right, left_operand,
+                *right_operand.get_if<analysis::AnnotatedAst::FunctionCall>(),
+                indent);
+    return;
+  }
+  CompileAnyExpression(left, left_operand, indent);
+  CompileAnyExpression(right, right_operand, indent);
+}
+
+bool Compiler::Forkable(
+    const analysis::AnnotatedAst::Expression& expression) const {
+  const auto* call = expression.get_if<analysis::AnnotatedAst::FunctionCall>();
+  return call && purity_->pure.count(call->function) &&
+         purity_->unbounded.count(call->function);
+}
+
+void Compiler::CompileFork(
+    std::string_view left, std::string_view right,
+    const analysis::AnnotatedAst::Expression& left_operand,
+    const analysis::AnnotatedAst::FunctionCall& right_operand, int indent) {
+  fork_used_ = true;
+  const auto id = NextIdentifier();
+  const auto task_type = id + "_task", run = id + "_run";
+  // The task holds the arguments of the call and its result. The function is
+  // declared again since it may be the one being compiled.
+  std::ostringstream function;
+  function << "\ntypedef struct " << task_type << " {\n"
+           << "  geltask task;\n";
+  std::string parameters, arguments;
+  const auto n = right_operand.arguments.size();
+  for (std::size_t i = 0; i < n; i++) {
+    const bool borrowed = ownership_->IsBorrowed(right_operand.function, i);
+    const auto& type_name = type_names_.at(
+        analysis::AnnotatedAst::GetMeta(right_operand.arguments[i]).type);
+    const auto parameter =
+        (borrowed ? "const " : "") + type_name + (borrowed ? "*" : "");
+    function << "  " << parameter << " a" << i << ";\n";
+    if (i > 0) {
+      parameters += ", ";
+      arguments += ", ";
+    }
+    parameters += parameter;
+    arguments += "gelself->a" + std::to_string(i);
   }
-  *output_ << " " << right << ";\n" << util::Spaces{indent} << "}\n";
+  const auto& result_type_name = type_names_.at(right_operand.type);
+  function << "  " << result_type_name << " result;\n"
+           << "} " << task_type << ";\n\n"
+           << Linkage() << result_type_name << " gel_"
+           << right_operand.function << "(" << parameters << ");\n\n"
+           << "static void " << run << "(geltask* task) {\n"
+           << "  " << task_type << "* gelself = (" << task_type << "*) task;\n"
+           << "  gelself->result = gel_" << right_operand.function << "("
+           << arguments << ");\n"
+           << "}\n";
+  outlined_ += function.str();
+
+  // The arguments are evaluated before the task is forked. Values computed for
+  // borrowed parameters are still owned by the caller, which destroys them
+  // once the task has joined.
+  const auto task = NextIdentifier();
+  Temporaries temporaries;
+  *output_ << util::Spaces{indent} << "{\n"
+           << util::Spaces{indent + 2} << task_type << " " << task
+           << " = {.task.run = " << run << "};\n";
+  for (std::size_t i = 0; i < n; i++) {
+    const auto& argument = right_operand.arguments[i];
+    const auto field = task + ".a" + std::to_string(i);
+    if (!ownership_->IsBorrowed(right_operand.function, i)) {
+      CompileAnyExpression(field, argument, indent + 2);
+      continue;
+    }
+    if (const auto* identifier =
+            argument.get_if<analysis::AnnotatedAst::Identifier>()) {
+      const auto& source = LookupVariable(identifier->name);
+      *output_ << util::Spaces{indent + 2} << field << " = "
+               << (source.borrowed ? "" : "&") << source.c_name << ";\n";
+      continue;
+    }
+    auto temp = NextIdentifier();
+    const auto& type_name =
+        type_names_.at(analysis::AnnotatedAst::GetMeta(argument).type);
+    *output_ << util::Spaces{indent + 2} << type_name << " " << temp << ";\n";
+    CompileAnyExpression(temp, argument, indent + 2);
+    *output_ << util::Spaces{indent + 2} << field << " = &" << temp << ";\n";
+    temporaries.emplace_back(std::move(temp), type_name);
+  }
+  *output_ << util::Spaces{indent + 2} << "gelfork(&" << task << ".task);\n";
+  CompileAnyExpression(left, left_operand, indent + 2);
+  *output_ << util::Spaces{indent + 2} << "geljoin(&" << task << ".task);\n"
+           << util::Spaces{indent + 2} << right << " = " << task
+           << ".result;\n";
+  DestroyTemporaries(temporaries, indent + 2);
+  *output_ << util::Spaces{indent} << "}\n";
 }
 
 void Compiler::CompileExpression(std::string_view variable,
@@ -311,24 +1694,72 @@ void Compiler::CompileExpression(std::string_view variable,
 void Compiler::CompileExpression(
     std::string_view variable, const analysis::AnnotatedAst::FunctionCall& call,
     int indent) {
-  *output_ << util::Spaces{indent} << "{\n";
   // Generate each argument, left-to-right, and store them in variables.
+  // Trailing arguments which need no temporaries are passed directly, since
+  // nothing is evaluated after them.
   auto n = call.arguments.size();
+  // They can't fail in more than one place, since C doesn't fix the order in
+  // which they are evaluated.
+  int checks = 0;
+  auto direct = [&](std::size_t i) {
+    if (ownership_->IsBorrowed(call.function, i)) {
+      return call.arguments[i].is<analysis::AnnotatedAst::Identifier>();
+    }
+    return InlineAny(call.arguments[i], &checks).has_value() && checks <= 1;
+  };
+  auto first_direct = n;
+  while (first_direct > 0 && direct(first_direct - 1)) first_direct--;
+  // The other arguments are computed into temporaries in a block of their
+  // own, except for borrowed variables which are passed by address.
+  bool block = false;
+  for (std::size_t i = 0; i < first_direct; i++) {
+    if (!ownership_->IsBorrowed(call.function, i) ||
+        !call.arguments[i].is<analysis::AnnotatedAst::Identifier>()) {
+      block = true;
+    }
+  }
+  if (block) *output_ << util::Spaces{indent} << "{\n";
   std::vector<std::string> arguments;
   arguments.reserve(n);
+  // Values computed for borrowed parameters are still owned by the caller.
+  std::vector<std::pair<std::string, std::string>> temporaries;
   for (std::size_t i = 0; i < n; i++) {
-    arguments.push_back(NextIdentifier());
+    const bool borrowed = ownership_->IsBorrowed(call.function, i);
+    const auto* identifier =
+        call.arguments[i].get_if<analysis::AnnotatedAst::Identifier>();
+    if (borrowed && identifier) {
+      const auto& source = LookupVariable(identifier->name);
+      arguments.push_back(source.borrowed ? source.c_name
+                                          : "&" + source.c_name);
+      continue;
+    }
+    if (i >= first_direct) {
+      arguments.push_back(*InlineAny(call.arguments[i]));
+      continue;
+    }
+    auto temp = NextIdentifier();
     const auto& type_name =
         type_names_.at(analysis::AnnotatedAst::GetMeta(call.arguments[i]).type);
-    *output_ << util::Spaces{indent + 2} << type_name << " " << arguments.back()
-             << ";\n";
-    CompileAnyExpression(arguments.back(), call.arguments[i], indent + 2);
+    *output_ << util::Spaces{indent + 2} << type_name << " " << temp << ";\n";
+    CompileAnyExpression(temp, call.arguments[i], indent + 2);
+    if (borrowed) {
+      arguments.push_back("&" + temp);
+      temporaries.emplace_back(std::move(temp), type_name);
+    } else {
+      arguments.push_back(std::move(temp));
+    }
   }
 
   // Call the function with all of the arguments.
-  *output_ << util::Spaces{indent} << variable << " = gel_" << call.function
-           << "(";
   bool first = true;
+  if (ReturnsIndirectly(call.type)) {
+    *output_ << util::Spaces{indent} << "gel_" << call.function << "(&"
+             << variable;
+    first = false;
+  } else {
+    *output_ << util::Spaces{indent} << variable << " = gel_" << call.function
+             << "(";
+  }
   for (const auto& argument : arguments) {
     if (first) {
       first = false;
@@ -337,7 +1768,12 @@ void Compiler::CompileExpression(
     }
     *output_ << argument;
   }
-  *output_ << ");\n" << util::Spaces{indent} << "}\n";
+  *output_ << ");\n";
+  for (const auto& [temp, type_name] : temporaries) {
+    *output_ << util::Spaces{indent + 2} << "geldestroy_" << type_name << "("
+             << temp << ");\n";
+  }
+  if (block) *output_ << util::Spaces{indent} << "}\n";
 }
 
 void Compiler::CompileExpression(std::string_view variable,
@@ -347,26 +1783,233 @@ void Compiler::CompileExpression(std::string_view variable,
   *output_ << util::Spaces{indent} << variable << " = !" << variable << ";\n";
 }
 
+void Compiler::CompileExpression(std::string_view variable,
+                                 const analysis::AnnotatedAst::Index& index,
+                                 int indent) {
+  const auto& type_name = type_names_.at(index.type);
+  Temporaries temporaries;
+  *output_ << util::Spaces{indent} << "{\n";
+  auto element = CompileElement(index, indent + 2, &temporaries);
+  *output_ << util::Spaces{indent + 2} << variable << " = gelcopy_" << type_name
+           << "(" << element << ");\n";
+  DestroyTemporaries(temporaries, indent + 2);
+  *output_ << util::Spaces{indent} << "}\n";
+}
+
+void Compiler::CompileExpression(std::string_view variable,
+                                 const analysis::AnnotatedAst::Size& size,
+                                 int indent) {
+  Temporaries temporaries;
+  *output_ << util::Spaces{indent} << "{\n";
+  auto array = CompilePlace(size.array, indent + 2, &temporaries);
+  *output_ << util::Spaces{indent + 2} << variable << " = " << array
+           << ".size;\n";
+  DestroyTemporaries(temporaries, indent + 2);
+  *output_ << util::Spaces{indent} << "}\n";
+}
+
 void Compiler::CompileAnyExpression(
     std::string_view variable,
     const analysis::AnnotatedAst::Expression& expression, int indent) {
+  if (auto value = InlineAny(expression)) {
+    *output_ << util::Spaces{indent} << variable << " = " << *value << ";\n";
+    return;
+  }
   expression.visit(
       [&](const auto& node) { CompileExpression(variable, node, indent); });
 }
 
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Identifier& identifier, int*) const {
+  if (!identifier.type.is<types::Primitive>()) return std::nullopt;
+  return InlineVariable(identifier.name);
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Boolean& boolean, int*) const {
+  return boolean.value ? "true" : "false";
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Integer& integer, int*) const {
+  return Literal(integer.value);
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::ArrayLiteral&, int*) const {
+  return std::nullopt;
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Arithmetic& binary, int* checks) const {
+  if (binary.type.is<types::Array>()) return std::nullopt;
+  auto left = InlineAny(binary.left, checks);
+  if (!left) return std::nullopt;
+  if (const auto* constant =
+          binary.right.get_if<analysis::AnnotatedAst::Integer>()) {
+    // Multiplying by zero must still evaluate the left operand, in case it
+    // fails. Dividing uses the left operand several times, so it must be a
+    // variable.
+    if (binary.operation == ast::Arithmetic::MULTIPLY) {
+      if (constant->value != 0) return Multiply(*left, constant->value);
+    } else if (binary.operation == ast::Arithmetic::DIVIDE) {
+      if (!binary.left.is<analysis::AnnotatedAst::Identifier>())
+        return std::nullopt;
+      return Divide(*left, constant->value);
+    }
+  }
+  auto right = InlineAny(binary.right, checks);
+  if (!right) return std::nullopt;
+  return "(" + *left + " " + std::string{Operator(binary.operation)} + " " +
+         *right + ")";
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Compare& binary, int* checks) const {
+  if (binary.type.is<types::Array>()) return std::nullopt;
+  auto left = InlineAny(binary.left, checks);
+  if (!left) return std::nullopt;
+  auto right = InlineAny(binary.right, checks);
+  if (!right) return std::nullopt;
+  return "(" + *left + " " + std::string{Operator(binary.operation)} + " " +
+         *right + ")";
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Logical& binary, int* checks) const {
+  auto left = InlineAny(binary.left, checks);
+  if (!left) return std::nullopt;
+  auto right = InlineAny(binary.right, checks);
+  if (!right) return std::nullopt;
+  return "(" + *left + " " + std::string{Operator(binary.operation)} + " " +
+         *right + ")";
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::FunctionCall&, int*) const {
+  return std::nullopt;
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::LogicalNot& op, int* checks) const {
+  auto argument = InlineAny(op.argument, checks);
+  if (!argument) return std::nullopt;
+  return "!" + *argument;
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Index& index, int* checks) const {
+  const auto* array = index.array.get_if<analysis::AnnotatedAst::Identifier>();
+  if (!index.type.is<types::Primitive>() || array == nullptr)
+    return std::nullopt;
+  auto offset = InlineAny(index.index, checks);
+  if (!offset) return std::nullopt;
+  const auto place = InlineVariable(array->name);
+  if (bounds_->loads.count(&index)) return place + ".data[" + *offset + "]";
+  ++*checks;
+  return place + ".data[gelindex(" + *offset + ", " + place + ".size)]";
+}
+
+std::optional<std::string> Compiler::Inline(
+    const analysis::AnnotatedAst::Size& size, int*) const {
+  const auto* array = size.array.get_if<analysis::AnnotatedAst::Identifier>();
+  if (array == nullptr) return std::nullopt;
+  return InlineVariable(array->name) + ".size";
+}
+
+std::optional<std::string> Compiler::InlineAny(
+    const analysis::AnnotatedAst::Expression& expression, int* checks) const {
+  return expression.visit(
+      [&](const auto& node) { return Inline(node, checks); });
+}
+
+std::optional<std::string> Compiler::InlineAny(
+    const analysis::AnnotatedAst::Expression& expression) const {
+  int checks = 0;
+  auto value = InlineAny(expression, &checks);
+  if (checks > 1) return std::nullopt;
+  return value;
+}
+
+std::string Compiler::InlineVariable(std::string_view name) const {
+  const auto& variable = LookupVariable(name);
+  return variable.borrowed ? "(*" + variable.c_name + ")" : variable.c_name;
+}
+
 void Compiler::CompileStatement(
     const analysis::AnnotatedAst::DefineVariable& definition, int indent) {
+  if (ownership_->aliases.count(&definition)) {
+    // The new variable refers to the same storage as the existing one.
+    const auto& source = LookupVariable(
+        definition.value.get_if<analysis::AnnotatedAst::Identifier>()->name);
+    *output_ << util::Spaces{indent} << "// " << definition.variable.name
+             << " is an alias for " << source.name << ".\n";
+    DefineVariable(definition.variable.name, source.c_name,
+                   definition.variable.type, source.borrowed, false);
+    return;
+  }
+  if (ownership_->named_returns.count(&definition)) {
+    CompileAnyExpression(kResult, definition.value, indent);
+    DefineVariable(definition.variable.name, kResult, definition.variable.type);
+    named_return_ = definition.variable.name;
+    return;
+  }
   const auto& type_name = type_names_.at(definition.variable.type);
-  *output_ << util::Spaces{indent} << type_name << " gel_"
-           << definition.variable.name << ";\n";
-  CompileAnyExpression("gel_" + definition.variable.name, definition.value,
-                       indent);
+  // The initializer may refer to a variable of the same name in an enclosing
+  // scope, so the new variable is only brought into scope afterwards.
+  auto name = VariableName(definition.variable.name);
+  *output_ << util::Spaces{indent} << type_name << " " << name << ";\n";
+  CompileAnyExpression(name, definition.value, indent);
+  DefineVariable(definition.variable.name, std::move(name),
+                 definition.variable.type);
 }
 
 void Compiler::CompileStatement(
     const analysis::AnnotatedAst::Assign& assignment, int indent) {
-  CompileAnyExpression("gel_" + assignment.variable.name, assignment.value,
-                       indent);
+  const auto& variable = LookupVariable(assignment.variable.name);
+  if (!variable.type.is<types::Array>()) {
+    CompileAnyExpression(variable.c_name, assignment.value, indent);
+    return;
+  }
+  // The old value can only be destroyed once the new value has been computed,
+  // since the computation may read it.
+  auto temp = NextIdentifier();
+  const auto& type_name = type_names_.at(variable.type);
+  *output_ << util::Spaces{indent} << "{\n"
+           << util::Spaces{indent + 2} << type_name << " " << temp << ";\n";
+  CompileAnyExpression(temp, assignment.value, indent + 2);
+  *output_ << util::Spaces{indent + 2} << "geldestroy_" << type_name << "("
+           << variable.c_name << ");\n"
+           << util::Spaces{indent + 2} << variable.c_name << " = " << temp
+           << ";\n"
+           << util::Spaces{indent} << "}\n";
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::AssignElement& assignment, int indent) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  const auto& type_name = type_names_.at(variable.type);
+  const auto& element_type_name =
+      type_names_.at(variable.type.get_if<types::Array>()->element_type);
+  auto offset = NextIdentifier(), value = NextIdentifier();
+  *output_ << util::Spaces{indent} << "{\n"
+           << util::Spaces{indent + 2} << "gel_integer " << offset << ";\n";
+  CompileAnyExpression(offset, assignment.index, indent + 2);
+  *output_ << util::Spaces{indent + 2} << element_type_name << " " << value
+           << ";\n";
+  CompileAnyExpression(value, assignment.value, indent + 2);
+  // A shared array must be copied before it can be modified.
+  *output_ << util::Spaces{indent + 2} << "gelunshare_" << type_name << "(&"
+           << variable.c_name << ");\n";
+  if (!bounds_->stores.count(&assignment)) {
+    *output_ << util::Spaces{indent + 2} << "gelcheckindex(" << offset << ", "
+             << variable.c_name << ".size);\n";
+  }
+  const auto element = variable.c_name + ".data[" + offset + "]";
+  *output_ << util::Spaces{indent + 2} << "geldestroy_" << element_type_name
+           << "(" << element << ");\n"
+           << util::Spaces{indent + 2} << element << " = " << value << ";\n"
+           << util::Spaces{indent} << "}\n";
 }
 
 void Compiler::CompileStatement(
@@ -377,16 +2020,32 @@ void Compiler::CompileStatement(
            << util::Spaces{indent + 2} << result_type_name << " "
            << ignored_result << ";\n";
   CompileExpression(ignored_result, do_function.function_call, indent + 2);
+  if (!do_function.function_call.type.is<types::Primitive>()) {
+    *output_ << util::Spaces{indent + 2} << "geldestroy_" << result_type_name
+             << "(" << ignored_result << ");\n";
+  }
   *output_ << util::Spaces{indent} << "}\n";
 }
 
 void Compiler::CompileStatement(const analysis::AnnotatedAst::If& if_statement,
                                 int indent) {
+  if (auto condition = InlineAny(if_statement.condition)) {
+    *output_ << util::Spaces{indent} << "if ("
+             << Branch(std::move(*condition)) << ") {\n";
+    CompileStatement(if_statement.if_true, indent + 2);
+    if (!if_statement.if_false.empty()) {
+      *output_ << util::Spaces{indent} << "} else {\n";
+      CompileStatement(if_statement.if_false, indent + 2);
+    }
+    *output_ << util::Spaces{indent} << "}\n";
+    return;
+  }
   auto condition = NextIdentifier();
   *output_ << util::Spaces{indent} << "{\n"
            << util::Spaces{indent + 2} << "bool " << condition << ";\n";
   CompileAnyExpression(condition, if_statement.condition, indent + 2);
-  *output_ << util::Spaces{indent + 2} << "if (" << condition << ") {\n";
+  *output_ << util::Spaces{indent + 2} << "if (" << Branch(condition)
+           << ") {\n";
   CompileStatement(if_statement.if_true, indent + 4);
   *output_ << util::Spaces{indent + 2} << "} else {\n";
   CompileStatement(if_statement.if_false, indent + 4);
@@ -396,6 +2055,12 @@ void Compiler::CompileStatement(const analysis::AnnotatedAst::If& if_statement,
 
 void Compiler::CompileStatement(
     const analysis::AnnotatedAst::While& while_statement, int indent) {
+  if (auto condition = InlineAny(while_statement.condition)) {
+    *output_ << util::Spaces{indent} << "while (" << *condition << ") {\n";
+    CompileStatement(while_statement.body, indent + 2);
+    *output_ << util::Spaces{indent} << "}\n";
+    return;
+  }
   auto condition = NextIdentifier();
   *output_ << util::Spaces{indent} << "while (true) {\n"
            << util::Spaces{indent + 2} << "bool " << condition << ";\n";
@@ -405,13 +2070,129 @@ void Compiler::CompileStatement(
   *output_ << util::Spaces{indent} << "}\n";
 }
 
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::ParallelFor& parallel_for, int indent) {
+  parallel_used_ = true;
+  const auto id = NextIdentifier();
+  const auto context_type = id + "_context", body = id + "_body";
+  // The body can see every variable in scope. Iterations can't assign to
+  // them, so primitives are captured by value and anything else by address.
+  std::vector<const Variable*> visible;
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    for (auto j = i->rbegin(); j != i->rend(); ++j) {
+      auto hidden = std::any_of(
+          visible.begin(), visible.end(),
+          [&](const Variable* variable) { return variable->name == j->name; });
+      if (!hidden) visible.push_back(&*j);
+    }
+  }
+  std::ostringstream function;
+  function << "\ntypedef struct " << context_type << " {\n";
+  std::vector<Variable> captured;
+  std::string values;
+  for (std::size_t i = 0, n = visible.size(); i < n; i++) {
+    const auto& variable = *visible[i];
+    const auto field = "v" + std::to_string(i);
+    const auto& type_name = type_names_.at(variable.type);
+    if (i > 0) values += ", ";
+    if (variable.borrowed) {
+      function << "  const " << type_name << "* " << field << ";\n";
+      values += variable.c_name;
+      captured.push_back(Variable{variable.name, "gelctx->" + field,
+                                  variable.type, true, false});
+    } else if (variable.type.is<types::Primitive>()) {
+      function << "  " << type_name << " " << field << ";\n";
+      values += variable.c_name;
+      captured.push_back(Variable{variable.name, "gelctx->" + field,
+                                  variable.type, false, false});
+    } else {
+      function << "  " << type_name << "* " << field << ";\n";
+      values += "&" + variable.c_name;
+      captured.push_back(Variable{variable.name, "(*gelctx->" + field + ")",
+                                  variable.type, false, false});
+    }
+  }
+  // C doesn't allow empty structures.
+  if (visible.empty()) {
+    function << "  char unused;\n";
+    values = "0";
+  }
+  function << "} " << context_type << ";\n\n"
+           << "static void " << body
+           << "(void* gelcontext, gel_integer gelbegin, gel_integer gelend) {\n"
+           << "  " << context_type << "* gelctx = gelcontext;\n";
+
+  // Compile the body in the context of the new function.
+  auto scopes = std::exchange(scopes_, {std::move(captured)});
+  auto named_return = std::exchange(named_return_, "");
+  auto* output = std::exchange(output_, &function);
+  PushScope();
+  auto variable = VariableName(parallel_for.variable.name);
+  *output_ << "  for (gel_integer " << variable << " = gelbegin; " << variable
+           << " < gelend; " << variable << "++) {\n";
+  DefineVariable(parallel_for.variable.name, variable,
+                 types::Primitive::INTEGER);
+  CompileStatement(parallel_for.body, 4);
+  *output_ << "  }\n}\n";
+  output_ = output;
+  named_return_ = std::move(named_return);
+  scopes_ = std::move(scopes);
+  outlined_ += function.str();
+
+  auto begin = NextIdentifier(), end = NextIdentifier();
+  auto context = NextIdentifier();
+  *output_ << util::Spaces{indent} << "{\n"
+           << util::Spaces{indent + 2} << "gel_integer " << begin << ", " << end
+           << ";\n";
+  CompileAnyExpression(begin, parallel_for.begin, indent + 2);
+  CompileAnyExpression(end, parallel_for.end, indent + 2);
+  // Arrays whose elements the iterations assign to must not be shared with
+  // other arrays, since copying them from inside the loop would race.
+  std::set<std::string, std::less<>> stores;
+  FindElementStores(parallel_for.body, &stores);
+  for (const auto* array : visible) {
+    if (!stores.count(array->name) || array->borrowed) continue;
+    *output_ << util::Spaces{indent + 2} << "gelunshare_"
+             << type_names_.at(array->type) << "(&" << array->c_name << ");\n";
+  }
+  *output_ << util::Spaces{indent + 2} << context_type << " " << context
+           << " = {" << values << "};\n"
+           << util::Spaces{indent + 2} << "gelparallel(" << body << ", &"
+           << context << ", " << begin << ", " << end << ");\n"
+           << util::Spaces{indent} << "}\n";
+}
+
 void Compiler::CompileStatement(const analysis::AnnotatedAst::ReturnVoid&,
                                 int indent) {
+  DestroyScopes(scopes_.size(), indent);
   *output_ << util::Spaces{indent} << "return;\n";
 }
 
 void Compiler::CompileStatement(
     const analysis::AnnotatedAst::Return& return_statement, int indent) {
+  if (returns_indirectly_) {
+    const auto* identifier =
+        return_statement.value.get_if<analysis::AnnotatedAst::Identifier>();
+    // The named return value is already in the result storage.
+    if (identifier == nullptr || identifier->name != named_return_)
+      CompileAnyExpression(kResult, return_statement.value, indent);
+    DestroyScopes(scopes_.size(), indent);
+    *output_ << util::Spaces{indent} << "return;\n";
+    return;
+  }
+  // An inline value can be returned directly if nothing needs to be destroyed
+  // after computing it.
+  const bool owns_arrays = std::any_of(
+      scopes_.begin(), scopes_.end(), [&](const auto& scope) {
+        return std::any_of(scope.begin(), scope.end(), [&](const auto& x) {
+          return x.owned && !x.type.template is<types::Primitive>();
+        });
+      });
+  auto value = InlineAny(return_statement.value);
+  if (value && !owns_arrays) {
+    *output_ << util::Spaces{indent} << "return " << *value << ";\n";
+    return;
+  }
   auto result = NextIdentifier();
   const auto& result_type_name = type_names_.at(
       analysis::AnnotatedAst::GetMeta(return_statement.value).type);
@@ -419,6 +2200,7 @@ void Compiler::CompileStatement(
            << util::Spaces{indent + 2} << result_type_name << " " << result
            << ";\n";
   CompileAnyExpression(result, return_statement.value, indent + 2);
+  DestroyScopes(scopes_.size(), indent + 2);
   *output_ << util::Spaces{indent + 2} << "return " << result << ";\n"
            << util::Spaces{indent} << "}\n";
 }
@@ -426,8 +2208,15 @@ void Compiler::CompileStatement(
 void Compiler::CompileStatement(
     const std::vector<analysis::AnnotatedAst::Statement>& statements,
     int indent) {
+  PushScope();
   for (const auto& statement : statements)
     CompileAnyStatement(statement, indent);
+  if (EndsWithReturn(statements)) {
+    // The variables were already destroyed by the return statement.
+    scopes_.pop_back();
+  } else {
+    PopScope(indent);
+  }
 }
 
 void Compiler::CompileAnyStatement(
@@ -438,21 +2227,86 @@ void Compiler::CompileAnyStatement(
 void Compiler::CompileTopLevel(
     const analysis::AnnotatedAst::DefineFunction& definition) {
   const auto& return_type_name = type_names_.at(definition.type.return_type);
-  *output_ << "static " << return_type_name << " gel_" << definition.name
-           << "(";
-  bool first = true;
-  for (const auto& parameter : definition.parameters) {
-    if (first) {
-      first = false;
-    } else {
-      *output_ << ", ";
+  const bool memoized =
+      options_->memoize && Memoizable(definition, *purity_);
+  function_ = definition.name;
+  branches_ = 0;
+  std::string parameters, arguments;
+  if (memoized) {
+    memoization_used_ = true;
+    for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++) {
+      if (i > 0) {
+        parameters += ", ";
+        arguments += ", ";
+      }
+      const auto argument = "gelarg" + std::to_string(i);
+      parameters +=
+          type_names_.at(definition.parameters[i].type) + " " + argument;
+      arguments += argument;
+    }
+    const auto arity = std::to_string(definition.parameters.size());
+    util::substitute(*output_, kMemoizedDeclaration,
+                     {
+                         {"NAME"sv, definition.name},
+                         {"ARITY"sv, arity},
+                         {"LINKAGE"sv, Linkage()},
+                         {"TYPE"sv, return_type_name},
+                         {"PARAMETERS"sv, parameters},
+                     });
+    if (split_) {
+      prototypes_ += return_type_name + " gel_" + definition.name + "(" +
+                     parameters + ");\n";
     }
+  }
+  const auto function_name =
+      (memoized ? "gelcompute_" : "gel_") + definition.name;
+  returns_indirectly_ = ReturnsIndirectly(definition.type.return_type);
+  named_return_.clear();
+  std::ostringstream signature;
+  signature << FunctionPrefix(definition, memoized);
+  if (returns_indirectly_) {
+    signature << "void " << function_name << "(" << return_type_name
+              << "* gelresult";
+  } else {
+    signature << return_type_name << " " << function_name << "(";
+  }
+  // Parameters are owned by the callee unless they are borrowed.
+  PushScope();
+  for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++) {
+    if (i > 0 || returns_indirectly_) signature << ", ";
+    const auto& parameter = definition.parameters[i];
     const auto& parameter_type_name = type_names_.at(parameter.type);
-    *output_ << parameter_type_name << " gel_" << parameter.name;
+    const bool borrowed = ownership_->IsBorrowed(definition.name, i);
+    auto name = VariableName(parameter.name);
+    signature << (borrowed ? "const " : "") << parameter_type_name
+              << (borrowed ? "* " : " ") << name;
+    DefineVariable(parameter.name, std::move(name), parameter.type, borrowed,
+                   !borrowed);
+  }
+  signature << ")";
+  if (split_) prototypes_ += signature.str() + ";\n";
+  *output_ << signature.str() << " {\n";
+  if (!options_->instrument.empty()) {
+    *output_ << "  __atomic_fetch_add(&gelcalls_" << definition.name
+             << ", 1, __ATOMIC_RELAXED);\n";
   }
-  *output_ << ") {\n";
   CompileStatement(definition.body, 2);
+  if (EndsWithReturn(definition.body)) {
+    scopes_.pop_back();
+  } else {
+    PopScope(2);
+  }
   *output_ << "}\n";
+  if (memoized) {
+    util::substitute(*output_, kMemoizedDefinition,
+                     {
+                         {"NAME"sv, definition.name},
+                         {"LINKAGE"sv, Linkage()},
+                         {"TYPE"sv, return_type_name},
+                         {"PARAMETERS"sv, parameters},
+                         {"ARGUMENTS"sv, arguments},
+                     });
+  }
 }
 
 void Compiler::CompileTopLevel(
@@ -464,8 +2318,91 @@ void Compiler::CompileTopLevel(
     } else {
       *output_ << "\n";
     }
-    CompileTopLevel(definition);
+    // The runtimes are only emitted ahead of the first function which uses
+    // them, so each function is compiled before they are.
+    const auto function = CompileFunction(definition);
+    *output_ << Runtimes() << function;
+  }
+}
+
+std::vector<std::string> Compiler::CompileUnits(
+    const std::vector<const analysis::AnnotatedAst::DefineFunction*>&
+        definitions,
+    std::size_t count) {
+  split_ = true;
+  std::vector<std::string> functions;
+  std::size_t total = 0;
+  for (const auto* definition : definitions) {
+    functions.push_back(CompileFunction(*definition) + "\n");
+    total += functions.back().size();
+  }
+  *output_ << Runtimes() << "\n" << prototypes_;
+  // Each unit is filled up to its share of the code, taking functions in an
+  // order which keeps them close to the functions they call.
+  std::vector<std::string> units(1);
+  std::size_t filled = 0;
+  for (const auto index : OrderByCalls(definitions, *purity_)) {
+    if (!units.back().empty() && units.size() < count &&
+        filled * count >= total * units.size()) {
+      units.emplace_back();
+    }
+    units.back() += functions[index];
+    filled += functions[index].size();
+  }
+  if (!options_->instrument.empty()) {
+    std::ostringstream profile;
+    auto* output = std::exchange(output_, &profile);
+    CompileProfile();
+    output_ = output;
+    units.back() += profile.str();
+  }
+  units.back() += kFooter;
+  return units;
+}
+
+std::string Compiler::CompileFunction(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  std::ostringstream function;
+  auto* output = std::exchange(output_, &function);
+  CompileTopLevel(definition);
+  output_ = output;
+  std::string counters;
+  if (!options_->instrument.empty()) {
+    // Functions without if statements still get a row of counts, since C
+    // doesn't allow empty arrays.
+    const auto calls = "uint64_t gelcalls_" + definition.name;
+    const auto branches = "uint64_t gelbranches_" + definition.name + "[" +
+                          std::to_string(std::max<std::size_t>(branches_, 1)) +
+                          "][2]";
+    counters = Linkage() + calls + ";\n" + Linkage() + branches + ";\n";
+    if (split_) {
+      prototypes_ += "extern " + calls + ";\nextern " + branches + ";\n";
+    }
+    profiled_.emplace_back(definition.name, branches_);
   }
+  // Outlined functions must be defined ahead of the function which uses them.
+  return counters + std::exchange(outlined_, {}) + function.str();
+}
+
+std::string Compiler::Runtimes() {
+  std::string runtimes;
+  if (memoization_used_ && !memoization_declared_) {
+    runtimes += kMemoization;
+    memoization_declared_ = true;
+  }
+  if (elementwise_used_ && !elementwise_declared_) {
+    runtimes += kElementwise;
+    elementwise_declared_ = true;
+  }
+  if (parallel_used_ && !parallel_declared_) {
+    runtimes += kParallel;
+    parallel_declared_ = true;
+  }
+  if (fork_used_ && !fork_declared_) {
+    runtimes += kForkJoin;
+    fork_declared_ = true;
+  }
+  return runtimes;
 }
 
 void Compiler::CompileAnyTopLevel(
@@ -473,21 +2410,294 @@ void Compiler::CompileAnyTopLevel(
   top_level.visit([&](const auto& x) { CompileTopLevel(x); });
 }
 
+void Compiler::CompileProfile() {
+  std::ostringstream counts;
+  for (const auto& [name, branches] : profiled_) {
+    util::substitute(counts, kProfileCounts,
+                     {
+                         {"NAME"sv, name},
+                         {"BRANCHES"sv, std::to_string(branches)},
+                     });
+  }
+  std::string path;
+  for (char c : options_->instrument) {
+    if (c == '\\' || c == '"') path.push_back('\\');
+    path.push_back(c);
+  }
+  util::substitute(*output_, kProfileWriter,
+                   {
+                       {"PATH"sv, path},
+                       {"COUNTS"sv, counts.str()},
+                   });
+}
+
 std::string Compiler::NextIdentifier() {
   auto id = next_id_++;
   return "gel" + std::to_string(id);
 }
 
+std::string Compiler::FunctionPrefix(
+    const analysis::AnnotatedAst::DefineFunction& definition,
+    bool memoized) const {
+  if (!options_->profile) return Linkage();
+  const auto& calls = options_->profile->calls;
+  const auto i = calls.find(definition.name);
+  const std::int64_t count = i == calls.end() ? 0 : i->second;
+  if (count == 0) return "__attribute__((cold)) " + Linkage();
+  if (count * kHotFraction < total_calls_) return Linkage();
+  // Inlining a function which calls itself would never finish, and calls from
+  // other translation units can't be inlined.
+  if (!split_ && !memoized && !purity_->recursive.count(definition.name) &&
+      CountStatements(definition.body) <= kInlineStatements) {
+    return "__attribute__((always_inline)) static inline ";
+  }
+  return "__attribute__((hot)) " + Linkage();
+}
+
+std::string Compiler::Branch(std::string condition) {
+  const auto index = branches_++;
+  if (!options_->instrument.empty()) {
+    return "gelbranch(gelbranches_" + function_ + "[" +
+           std::to_string(index) + "], " + condition + ")";
+  }
+  if (!options_->profile) return condition;
+  const auto& branches = options_->profile->branches;
+  const auto i = branches.find(function_);
+  if (i == branches.end() || index >= i->second.size()) return condition;
+  const auto [taken, not_taken] = i->second[index];
+  if (taken + not_taken < kMinimumBranches) return condition;
+  if (taken >= kBias * not_taken) {
+    return "__builtin_expect(" + condition + ", 1)";
+  }
+  if (not_taken >= kBias * taken) {
+    return "__builtin_expect(" + condition + ", 0)";
+  }
+  return condition;
+}
+
+std::string Compiler::CompilePlace(
+    const analysis::AnnotatedAst::Expression& expression, int indent,
+    Temporaries* temporaries) {
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    const auto& variable = LookupVariable(identifier->name);
+    return variable.borrowed ? "(*" + variable.c_name + ")" : variable.c_name;
+  }
+  if (const auto* index = expression.get_if<analysis::AnnotatedAst::Index>())
+    return CompileElement(*index, indent, temporaries);
+  auto temp = NextIdentifier();
+  const auto& type_name =
+      type_names_.at(analysis::AnnotatedAst::GetMeta(expression).type);
+  *output_ << util::Spaces{indent} << type_name << " " << temp << ";\n";
+  CompileAnyExpression(temp, expression, indent);
+  temporaries->emplace_back(temp, type_name);
+  return temp;
+}
+
+std::string Compiler::CompileElement(
+    const analysis::AnnotatedAst::Index& index, int indent,
+    Temporaries* temporaries) {
+  auto array = CompilePlace(index.array, indent, temporaries);
+  // An index which is known to be in bounds is only used once.
+  if (bounds_->loads.count(&index)) {
+    if (auto offset = InlineAny(index.index))
+      return array + ".data[" + *offset + "]";
+  }
+  auto offset = NextIdentifier();
+  *output_ << util::Spaces{indent} << "gel_integer " << offset << ";\n";
+  CompileAnyExpression(offset, index.index, indent);
+  if (!bounds_->loads.count(&index)) {
+    *output_ << util::Spaces{indent} << "gelcheckindex(" << offset << ", "
+             << array << ".size);\n";
+  }
+  return array + ".data[" + offset + "]";
+}
+
+void Compiler::DestroyTemporaries(const Temporaries& temporaries, int indent) {
+  for (auto i = temporaries.rbegin(); i != temporaries.rend(); ++i) {
+    *output_ << util::Spaces{indent} << "geldestroy_" << i->second << "("
+             << i->first << ");\n";
+  }
+}
+
+void Compiler::CompileElementwise(
+    std::string_view variable, std::string_view kernel,
+    const types::Type& type, const analysis::AnnotatedAst::Expression& left,
+    const analysis::AnnotatedAst::Expression& right, int indent) {
+  elementwise_used_ = true;
+  const auto& type_name = type_names_.at(type);
+  Temporaries temporaries;
+  *output_ << util::Spaces{indent} << "{\n";
+  const auto left_place = CompilePlace(left, indent + 2, &temporaries);
+  const auto right_place = CompilePlace(right, indent + 2, &temporaries);
+  *output_ << util::Spaces{indent + 2} << "gelchecksizes(" << left_place
+           << ".size, " << right_place << ".size);\n";
+  // An operand which was computed into a temporary of the result type is
+  // never used again, so its buffer can hold the result: each element of the
+  // result only depends on the elements in the same position.
+  auto reused = std::find_if(
+      temporaries.begin(), temporaries.end(), [&](const auto& temporary) {
+        return temporary.second == type_name &&
+               (temporary.first == left_place ||
+                temporary.first == right_place);
+      });
+  if (reused != temporaries.end()) {
+    *output_ << util::Spaces{indent + 2} << "gelunshare_" << type_name << "(&"
+             << reused->first << ");\n"
+             << util::Spaces{indent + 2} << variable << " = " << reused->first
+             << ";\n";
+    temporaries.erase(reused);
+  } else {
+    *output_ << util::Spaces{indent + 2} << variable << " = (struct "
+             << type_name << ") {\n"
+             << util::Spaces{indent + 4} << ".data = gelalloc_" << type_name
+             << "(" << left_place << ".size),\n"
+             << util::Spaces{indent + 4} << ".size = " << left_place
+             << ".size,\n"
+             << util::Spaces{indent + 2} << "};\n";
+  }
+  *output_ << util::Spaces{indent + 2} << "gelelementwise_" << kernel << "("
+           << variable << ".data, " << left_place << ".data, " << right_place
+           << ".data, " << left_place << ".size);\n";
+  DestroyTemporaries(temporaries, indent + 2);
+  *output_ << util::Spaces{indent} << "}\n";
+}
+
+void Compiler::PushScope() { scopes_.emplace_back(); }
+
+void Compiler::PopScope(int indent) {
+  DestroyScopes(1, indent);
+  scopes_.pop_back();
+}
+
+std::string Compiler::VariableName(const std::string& name) {
+  // Variables that shadow an outer variable need a distinct name so that the
+  // outer variable can still be destroyed from within the inner scope.
+  bool shadows = std::any_of(scopes_.begin(), scopes_.end(), [&](auto& scope) {
+    return std::any_of(scope.begin(), scope.end(),
+                       [&](auto& variable) { return variable.name == name; });
+  });
+  return shadows ? NextIdentifier() + "_" + name : "gel_" + name;
+}
+
+void Compiler::DefineVariable(std::string name, std::string c_name,
+                              types::Type type, bool borrowed, bool owned) {
+  scopes_.back().push_back(Variable{std::move(name), std::move(c_name),
+                                    std::move(type), borrowed, owned});
+}
+
+const Compiler::Variable& Compiler::LookupVariable(
+    std::string_view name) const {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = std::find_if(i->rbegin(), i->rend(),
+                          [&](auto& variable) { return variable.name == name; });
+    if (j != i->rend()) return *j;
+  }
+  throw std::logic_error("Undefined variable " + std::string{name} + ".");
+}
+
+void Compiler::DestroyScopes(std::size_t count, int indent) {
+  for (auto i = scopes_.rbegin(), end = i + static_cast<std::ptrdiff_t>(count);
+       i != end; ++i) {
+    for (auto j = i->rbegin(); j != i->rend(); ++j) {
+      if (!j->owned || j->name == named_return_ ||
+          j->type.is<types::Primitive>()) {
+        continue;
+      }
+      *output_ << util::Spaces{indent} << "geldestroy_"
+               << type_names_.at(j->type) << "(" << j->c_name << ");\n";
+    }
+  }
+}
+
+// Emit everything which comes ahead of the functions: the runtime and the
+// declarations of the types.
+void CompilePreamble(const std::vector<types::Type>& types,
+                     const analysis::AnnotatedAst::TopLevel& top_level,
+                     const Options& options, Compiler* compiler,
+                     std::ostream* output) {
+  *output << kHeader;
+  if (!options.instrument.empty()) *output << kProfile;
+  if (options.copy_on_write) {
+    bool threaded = options.fork_join;
+    top_level.visit([&](const auto& x) {
+      if (ContainsParallelFor(x)) threaded = true;
+    });
+    *output << (threaded ? kAtomicReferenceCounts : kReferenceCounts);
+  }
+  for (const auto& type : types) compiler->DeclareAnyType(type);
+}
+
+void AddDefinitions(
+    const analysis::AnnotatedAst::DefineFunction& definition,
+    std::vector<const analysis::AnnotatedAst::DefineFunction*>* definitions) {
+  definitions->push_back(&definition);
+}
+
+void AddDefinitions(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& list,
+    std::vector<const analysis::AnnotatedAst::DefineFunction*>* definitions) {
+  for (const auto& definition : list) definitions->push_back(&definition);
+}
+
 }  // namespace
 
 void Compile(const std::vector<types::Type>& types,
              const analysis::AnnotatedAst::TopLevel& top_level,
-             std::ostream* output) {
-  Compiler compiler{output};
-  *output << kHeader;
-  for (const auto& type : types) compiler.DeclareAnyType(type);
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output) {
+  allocations::Scope scope{"target::c::Compiler"};
+  const auto purity = analysis::AnalyzePurity(top_level);
+  Compiler compiler{ownership, bounds, purity, options, output};
+  CompilePreamble(types, top_level, options, &compiler, output);
   compiler.CompileAnyTopLevel(top_level);
+  if (!options.instrument.empty()) compiler.CompileProfile();
   *output << kFooter;
 }
 
+Units CompileUnits(const std::vector<types::Type>& types,
+                   const analysis::AnnotatedAst::TopLevel& top_level,
+                   const ownership::Info& ownership,
+                   const bounds::Info& bounds, const Options& options,
+                   std::size_t count) {
+  allocations::Scope scope{"target::c::Compiler"};
+  const auto purity = analysis::AnalyzePurity(top_level);
+  std::ostringstream header;
+  Compiler compiler{ownership, bounds, purity, options, &header};
+  // Every unit has its own copy of the runtime, but weak definitions of its
+  // state are merged into one by the linker.
+  header << "#define GELSHARED __attribute__((weak))\n";
+  CompilePreamble(types, top_level, options, &compiler, &header);
+  std::vector<const analysis::AnnotatedAst::DefineFunction*> definitions;
+  top_level.visit([&](const auto& x) { AddDefinitions(x, &definitions); });
+  Units units;
+  units.sources = compiler.CompileUnits(definitions, count);
+  units.header = header.str();
+  return units;
+}
+
+Profile ReadProfile(std::istream& input) {
+  Profile profile;
+  std::string kind, name;
+  while (input >> kind >> name) {
+    if (kind == "call") {
+      input >> profile.calls[name];
+    } else if (kind == "branch") {
+      std::array<std::int64_t, 2> counts;
+      input >> counts[0] >> counts[1];
+      profile.branches[name].push_back(counts);
+    } else {
+      throw std::runtime_error("Malformed profile.");
+    }
+  }
+  return profile;
+}
+
+std::vector<std::string> CompileCommand(int level) {
+  // Parallel loops run on a pool of POSIX threads. Integer arithmetic wraps
+  // around on overflow, as it does in gel's optimizer and other targets.
+  return {"gcc", "-O" + std::to_string(level), "-fwrapv", "-x", "c", "-",
+          "-pthread"};
+}
+
 }  // namespace target::c
@@ -2,13 +2,81 @@
 
 #include "analysis.h"
 #include "ast.h"
+#include "bounds.h"
+#include "ownership.h"
 
+#include <array>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace target::c {
 
+// Counts collected by running an instrumented program.
+struct Profile {
+  // The number of calls to each function.
+  std::map<std::string, std::int64_t, std::less<>> calls;
+  // For each if statement in each function, in order, the number of times its
+  // condition was true and false.
+  std::map<std::string, std::vector<std::array<std::int64_t, 2>>, std::less<>>
+      branches;
+};
+
+// Read the counts which an instrumented program writes when it exits.
+Profile ReadProfile(std::istream& input);
+
+struct Options {
+  // Represent arrays as reference-counted buffers which are shared between
+  // copies and only duplicated when a shared array is modified. Copying an
+  // array becomes a reference count increment instead of a deep copy.
+  bool copy_on_write = false;
+  // Run the two operands of an arithmetic operator or comparison at the same
+  // time when both are calls to pure functions which loop or recurse.
+  bool fork_join = false;
+  // Memoize pure functions which call themselves.
+  bool memoize = true;
+  // If not empty, count the calls to each function and the outcomes of each
+  // if statement, and write the counts to this file when the program exits.
+  std::string instrument;
+  // Counts from a run of the instrumented program. Branches which nearly
+  // always go the same way are marked as such, small functions which account
+  // for many of the calls are always inlined, and functions which were never
+  // called are marked as cold.
+  const Profile* profile = nullptr;
+};
+
+// The gcc command which builds generated C from its standard input at the given
+// optimization level. Flags for the output go on the end.
+std::vector<std::string> CompileCommand(int level);
+
+// Identifies the runtime which generated programs are built against. Cached
+// binaries are keyed on it along with the generated code, so it must change
+// whenever a program could be built differently from the same code, such as
+// when the runtime needs different compiler flags or libraries.
+constexpr std::string_view kRuntimeVersion = "1";
+
 void Compile(const std::vector<types::Type>& types,
              const analysis::AnnotatedAst::TopLevel& top_level,
-             std::ostream* output);
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output);
+
+// A program split into translation units which can be compiled separately.
+// Each source must be compiled with the header in front of it.
+struct Units {
+  std::string header;
+  std::vector<std::string> sources;
+};
+
+// Compile the program into at most the given number of units. Functions are
+// spread evenly by size, and each unit takes functions which call each other
+// so that most calls stay within a unit.
+Units CompileUnits(const std::vector<types::Type>& types,
+                   const analysis::AnnotatedAst::TopLevel& top_level,
+                   const ownership::Info& ownership,
+                   const bounds::Info& bounds, const Options& options,
+                   std::size_t count);
 
 }  // namespace target::c
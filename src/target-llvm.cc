@@ -0,0 +1,1126 @@
+#include "target-llvm.h"
+
+#include "bounds.h"
+#include "ownership.h"
+#include "types.h"
+#include "util.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+namespace target::llvm {
+namespace {
+
+using std::literals::operator""sv;
+
+constexpr char kHeader[] = R"(; Generated by the gel compiler.
+
+@gelprintformat = private unnamed_addr constant [6 x i8] c"%lld\0A\00"
+@gelindexerrorformat = private unnamed_addr constant [59 x i8] c"Array index %lld is out of bounds for array of size %lld.\0A\00"
+@gelsizeerrorformat = private unnamed_addr constant [41 x i8] c"Array sizes %lld and %lld do not match.\0A\00"
+@stderr = external global ptr
+
+declare i32 @printf(ptr nocapture readonly, ...) nounwind
+declare i32 @fprintf(ptr nocapture, ptr nocapture readonly, ...) nounwind
+declare noalias ptr @malloc(i64) nounwind
+declare void @free(ptr nocapture) nounwind
+declare void @exit(i32) noreturn nounwind
+
+define internal void @gel_print(i64 %number) nounwind {
+  call i32 (ptr, ...) @printf(ptr @gelprintformat, i64 %number)
+  ret void
+}
+
+define internal void @gelindexerror(i64 %index, i64 %size) cold noinline noreturn nounwind {
+  %stream = load ptr, ptr @stderr
+  call i32 (ptr, ptr, ...) @fprintf(ptr %stream, ptr @gelindexerrorformat, i64 %index, i64 %size)
+  call void @exit(i32 1)
+  unreachable
+}
+
+define internal void @gelsizeerror(i64 %left, i64 %right) cold noinline noreturn nounwind {
+  %stream = load ptr, ptr @stderr
+  call i32 (ptr, ptr, ...) @fprintf(ptr %stream, ptr @gelsizeerrorformat, i64 %left, i64 %right)
+  call void @exit(i32 1)
+  unreachable
+}
+
+; Copying or destroying a primitive does nothing, but having functions for them
+; lets the array runtime treat every element type alike.
+define internal {} @gelcopy_void({} %source) alwaysinline nounwind readnone {
+  ret {} %source
+}
+
+define internal i1 @gelcopy_boolean(i1 %source) alwaysinline nounwind readnone {
+  ret i1 %source
+}
+
+define internal i64 @gelcopy_integer(i64 %source) alwaysinline nounwind readnone {
+  ret i64 %source
+}
+
+define internal void @geldestroy_void({} %unused) alwaysinline nounwind readnone {
+  ret void
+}
+
+define internal void @geldestroy_boolean(i1 %unused) alwaysinline nounwind readnone {
+  ret void
+}
+
+define internal void @geldestroy_integer(i64 %unused) alwaysinline nounwind readnone {
+  ret void
+}
+
+; Shared arrays store their reference count immediately before the elements.
+define internal ptr @gelrefcount(ptr %data) alwaysinline nounwind readnone {
+  %count = getelementptr inbounds i64, ptr %data, i64 -1
+  ret ptr %count
+}
+
+; Start of user code.
+)";
+
+constexpr char kFooter[] = R"(
+; End of user code.
+
+define i32 @main() nounwind {
+  %status = call i64 @gel_main()
+  %result = trunc i64 %status to i32
+  ret i32 %result
+}
+)";
+
+// The representation of every array type: a pointer to the elements, followed
+// by the number of elements.
+constexpr char kArray[] = "{ ptr, i64 }";
+
+constexpr char kDeclaration[] = R"(
+define internal noalias ptr @gelalloc_${TYPE}(i64 %size) nounwind {
+  %bytes = mul i64 %size, ptrtoint (ptr getelementptr (${ELEMENT_TYPE}, ptr null, i64 1) to i64)
+  %data = call noalias ptr @malloc(i64 %bytes)
+  ret ptr %data
+}
+
+define internal { ptr, i64 } @gelcopy_${TYPE}({ ptr, i64 } %source) nounwind {
+entry:
+  %source.data = extractvalue { ptr, i64 } %source, 0
+  %size = extractvalue { ptr, i64 } %source, 1
+  %data = call ptr @gelalloc_${TYPE}(i64 %size)
+  br label %check
+check:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %done = icmp sge i64 %i, %size
+  br i1 %done, label %end, label %loop
+loop:
+  %from = getelementptr inbounds ${ELEMENT_TYPE}, ptr %source.data, i64 %i
+  %to = getelementptr inbounds ${ELEMENT_TYPE}, ptr %data, i64 %i
+  %element = load ${ELEMENT_TYPE}, ptr %from
+  %copy = call ${ELEMENT_TYPE} @gelcopy_${ELEMENT_NAME}(${ELEMENT_TYPE} %element)
+  store ${ELEMENT_TYPE} %copy, ptr %to
+  %next = add nsw i64 %i, 1
+  br label %check
+end:
+  %result = insertvalue { ptr, i64 } %source, ptr %data, 0
+  ret { ptr, i64 } %result
+}
+
+define internal void @geldestroy_${TYPE}({ ptr, i64 } %source) nounwind {
+entry:
+  %data = extractvalue { ptr, i64 } %source, 0
+  %size = extractvalue { ptr, i64 } %source, 1
+  br label %check
+check:
+  %i = phi i64 [ %size, %entry ], [ %index, %loop ]
+  %done = icmp sle i64 %i, 0
+  br i1 %done, label %end, label %loop
+loop:
+  %index = sub nsw i64 %i, 1
+  %address = getelementptr inbounds ${ELEMENT_TYPE}, ptr %data, i64 %index
+  %element = load ${ELEMENT_TYPE}, ptr %address
+  call void @geldestroy_${ELEMENT_NAME}(${ELEMENT_TYPE} %element)
+  br label %check
+end:
+  call void @free(ptr %data)
+  ret void
+}
+)";
+
+// Copy-on-write representation: copies of an array share a single buffer
+// which is prefixed by a reference count. Modifying an array must first call
+// gelunshare to obtain a private buffer if the current one is shared.
+constexpr char kSharedDeclaration[] = R"(
+define internal noalias ptr @gelalloc_${TYPE}(i64 %size) nounwind {
+  %bytes = mul i64 %size, ptrtoint (ptr getelementptr (${ELEMENT_TYPE}, ptr null, i64 1) to i64)
+  %total = add i64 %bytes, 8
+  %block = call noalias ptr @malloc(i64 %total)
+  store i64 1, ptr %block
+  %data = getelementptr inbounds i64, ptr %block, i64 1
+  ret ptr %data
+}
+
+define internal { ptr, i64 } @gelcopy_${TYPE}({ ptr, i64 } %source) nounwind {
+entry:
+  %data = extractvalue { ptr, i64 } %source, 0
+  %empty = icmp eq ptr %data, null
+  br i1 %empty, label %end, label %share
+share:
+  %count = call ptr @gelrefcount(ptr %data)
+  %references = load i64, ptr %count
+  %incremented = add i64 %references, 1
+  store i64 %incremented, ptr %count
+  br label %end
+end:
+  ret { ptr, i64 } %source
+}
+
+define internal void @gelunshare_${TYPE}(ptr %array) nounwind {
+entry:
+  %shared = load ptr, ptr %array
+  %empty = icmp eq ptr %shared, null
+  br i1 %empty, label %end, label %count
+count:
+  %count.address = call ptr @gelrefcount(ptr %shared)
+  %references = load i64, ptr %count.address
+  %unique = icmp eq i64 %references, 1
+  br i1 %unique, label %end, label %copy
+copy:
+  %size.address = getelementptr inbounds { ptr, i64 }, ptr %array, i32 0, i32 1
+  %size = load i64, ptr %size.address
+  %data = call ptr @gelalloc_${TYPE}(i64 %size)
+  br label %check
+check:
+  %i = phi i64 [ 0, %copy ], [ %next, %loop ]
+  %done = icmp sge i64 %i, %size
+  br i1 %done, label %release, label %loop
+loop:
+  %from = getelementptr inbounds ${ELEMENT_TYPE}, ptr %shared, i64 %i
+  %to = getelementptr inbounds ${ELEMENT_TYPE}, ptr %data, i64 %i
+  %element = load ${ELEMENT_TYPE}, ptr %from
+  %element.copy = call ${ELEMENT_TYPE} @gelcopy_${ELEMENT_NAME}(${ELEMENT_TYPE} %element)
+  store ${ELEMENT_TYPE} %element.copy, ptr %to
+  %next = add nsw i64 %i, 1
+  br label %check
+release:
+  %decremented = sub i64 %references, 1
+  store i64 %decremented, ptr %count.address
+  store ptr %data, ptr %array
+  br label %end
+end:
+  ret void
+}
+
+define internal void @geldestroy_${TYPE}({ ptr, i64 } %source) nounwind {
+entry:
+  %data = extractvalue { ptr, i64 } %source, 0
+  %empty = icmp eq ptr %data, null
+  br i1 %empty, label %end, label %release
+release:
+  %count = call ptr @gelrefcount(ptr %data)
+  %references = load i64, ptr %count
+  %decremented = sub i64 %references, 1
+  store i64 %decremented, ptr %count
+  %shared = icmp sgt i64 %decremented, 0
+  br i1 %shared, label %end, label %destroy
+destroy:
+  %size = extractvalue { ptr, i64 } %source, 1
+  br label %check
+check:
+  %i = phi i64 [ %size, %destroy ], [ %index, %loop ]
+  %done = icmp sle i64 %i, 0
+  br i1 %done, label %free, label %loop
+loop:
+  %index = sub nsw i64 %i, 1
+  %address = getelementptr inbounds ${ELEMENT_TYPE}, ptr %data, i64 %index
+  %element = load ${ELEMENT_TYPE}, ptr %address
+  call void @geldestroy_${ELEMENT_NAME}(${ELEMENT_TYPE} %element)
+  br label %check
+free:
+  call void @free(ptr %count)
+  br label %end
+end:
+  ret void
+}
+)";
+
+// Returns true if the last statement in the block is a return statement, in
+// which case the end of the block is unreachable.
+bool EndsWithReturn(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  if (statements.empty()) return false;
+  return statements.back().is<analysis::AnnotatedAst::ReturnVoid>() ||
+         statements.back().is<analysis::AnnotatedAst::Return>();
+}
+
+std::string IrType(const types::Void&) { return "{}"; }
+
+std::string IrType(const types::Function&) {
+  throw std::logic_error("Functions are not values.");
+}
+
+std::string IrType(const types::Primitive& primitive) {
+  switch (primitive) {
+    case types::Primitive::BOOLEAN:
+      return "i1";
+    case types::Primitive::INTEGER:
+      return "i64";
+  }
+  throw std::logic_error("Bad primitive.");
+}
+
+std::string IrType(const types::Array&) { return kArray; }
+
+std::string IrAnyType(const types::Type& type) {
+  return type.visit([](const auto& x) { return IrType(x); });
+}
+
+class Compiler {
+ public:
+  Compiler(const ownership::Info& ownership, const bounds::Info& bounds,
+           const Options& options,
+           std::set<std::string, std::less<>> readnone, std::ostream* output)
+      : ownership_(&ownership),
+        bounds_(&bounds),
+        options_(&options),
+        readnone_(std::move(readnone)),
+        output_(output) {}
+
+  // Emit code to declare the given type.
+  void DeclareType(const types::Void&);
+  void DeclareType(const types::Function&);
+  void DeclareType(const types::Primitive&);
+  void DeclareType(const types::Array&);
+  void DeclareAnyType(const types::Type&);
+
+  // Emit code to compute the given expression into a new value which is owned
+  // by the caller, and return the operand which holds it.
+  std::string CompileExpression(const analysis::AnnotatedAst::Identifier&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Boolean&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Integer&);
+  std::string CompileExpression(const analysis::AnnotatedAst::ArrayLiteral&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Arithmetic&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Compare&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Logical&);
+  std::string CompileExpression(const analysis::AnnotatedAst::FunctionCall&);
+  std::string CompileExpression(const analysis::AnnotatedAst::LogicalNot&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Index&);
+  std::string CompileExpression(const analysis::AnnotatedAst::Size&);
+  std::string CompileAnyExpression(const analysis::AnnotatedAst::Expression&);
+
+  // Emit code to execute the given statement.
+  void CompileStatement(const analysis::AnnotatedAst::DefineVariable&);
+  void CompileStatement(const analysis::AnnotatedAst::Assign&);
+  void CompileStatement(const analysis::AnnotatedAst::AssignElement&);
+  void CompileStatement(const analysis::AnnotatedAst::DoFunction&);
+  void CompileStatement(const analysis::AnnotatedAst::If&);
+  void CompileStatement(const analysis::AnnotatedAst::While&);
+  void CompileStatement(const analysis::AnnotatedAst::ParallelFor&);
+  void CompileStatement(const analysis::AnnotatedAst::ReturnVoid&);
+  void CompileStatement(const analysis::AnnotatedAst::Return&);
+  void CompileStatement(const std::vector<analysis::AnnotatedAst::Statement>&);
+  void CompileAnyStatement(const analysis::AnnotatedAst::Statement&);
+
+  // Emit code to declare the given constructs.
+  void CompileTopLevel(const analysis::AnnotatedAst::DefineFunction&);
+  void CompileTopLevel(
+      const std::vector<analysis::AnnotatedAst::DefineFunction>&);
+  void CompileAnyTopLevel(const analysis::AnnotatedAst::TopLevel&);
+
+ private:
+  struct Variable {
+    std::string name;
+    // A pointer to the storage for the variable.
+    std::string address;
+    types::Type type;
+    // Borrowed variables are pointers to a value owned by the caller.
+    bool borrowed;
+    // Variables which are borrowed or which alias another variable don't own
+    // their value and must not destroy it.
+    bool owned;
+  };
+
+  // Values stored in temporary stack slots, with their types.
+  using Temporaries = std::vector<std::pair<std::string, types::Type>>;
+
+  // Generate a new unique identifier.
+  std::string NextIdentifier();
+  // Generate a new unique local value name.
+  std::string NextValue();
+
+  // Start a new instruction in the current block.
+  std::ostream& Emit();
+  // End the current block and start a new one with the given label.
+  void StartBlock(std::string label);
+  void Branch(std::string_view label);
+
+  // Allocate a stack slot in the entry block of the function and return its
+  // address. Every slot is allocated there so that it can be promoted to
+  // registers.
+  std::string Allocate(const types::Type& type, std::string_view name = "");
+  std::string Load(const types::Type& type, std::string_view address);
+  void Store(const types::Type& type, std::string_view value,
+             std::string_view address);
+  // Emit code to copy or destroy a value of the given type. Only arrays need
+  // any code at all.
+  std::string Copy(const types::Type& type, std::string value);
+  void Destroy(const types::Type& type, std::string_view value);
+
+  // Emit code to locate the value of an array expression and return its
+  // address. Arrays held in variables are accessed in place. Other arrays are
+  // computed into temporaries which are added to the list and must be
+  // destroyed by the caller once the value is no longer used.
+  std::string CompilePlace(const analysis::AnnotatedAst::Expression&,
+                           Temporaries* temporaries);
+  std::string CompileElement(const analysis::AnnotatedAst::Index&,
+                             Temporaries* temporaries);
+  void DestroyTemporaries(const Temporaries& temporaries);
+  // Emit code to load the size of the array at the given address.
+  std::string CompileSize(std::string_view array);
+  // Emit code to stop the program unless the index is in bounds.
+  void CompileCheckIndex(std::string_view index, std::string_view array);
+  // Emit a loop which applies the instruction to each pair of elements of
+  // two arrays of integers of the same size, giving a new array of the given
+  // type. The loop is left for LLVM to vectorize.
+  std::string CompileElementwise(
+      std::string_view instruction, const types::Type& type,
+      const analysis::AnnotatedAst::Expression& left,
+      const analysis::AnnotatedAst::Expression& right);
+
+  // Enter a new scope. Variables defined in the scope are destroyed when the
+  // scope is left.
+  void PushScope();
+  void PopScope();
+  // Add a variable to the innermost scope.
+  void DefineVariable(std::string name, std::string address, types::Type type,
+                      bool borrowed = false, bool owned = true);
+  const Variable& LookupVariable(std::string_view name) const;
+  // Emit code to destroy the variables in the given number of innermost
+  // scopes.
+  void DestroyScopes(std::size_t count);
+
+  const ownership::Info* ownership_;
+  const bounds::Info* bounds_;
+  const Options* options_;
+  const std::set<std::string, std::less<>> readnone_;
+  std::ostream* output_;
+  std::vector<std::vector<Variable>> scopes_;
+  // Properties of the function which is being compiled. The stack slots are
+  // collected separately from the rest of the body so that they can all be
+  // placed in the entry block.
+  types::Type return_type_ = types::Void{};
+  std::ostringstream allocas_;
+  std::ostringstream body_;
+  std::string block_;
+  std::uint64_t next_id_ = 0;
+  std::map<types::Type, std::string> type_names_ = {
+      {types::Void{}, "void"},
+      {types::Primitive::BOOLEAN, "boolean"},
+      {types::Primitive::INTEGER, "integer"},
+  };
+};
+
+void Compiler::DeclareType(const types::Void&) {
+  *output_ << "; <nothing to declare>\n";
+}
+
+void Compiler::DeclareType(const types::Function&) {
+  *output_ << "; <nothing to declare>\n";
+}
+
+void Compiler::DeclareType(const types::Primitive&) {
+  *output_ << "; <nothing to declare>\n";
+}
+
+void Compiler::DeclareType(const types::Array& array) {
+  auto name = NextIdentifier();
+  const auto element_type = IrAnyType(array.element_type);
+  util::substitute(*output_,
+                   options_->copy_on_write ? kSharedDeclaration : kDeclaration,
+                   {
+                       {"TYPE"sv, name},
+                       {"ELEMENT_TYPE"sv, element_type},
+                       {"ELEMENT_NAME"sv, type_names_.at(array.element_type)},
+                   });
+  type_names_.emplace(array, name);
+}
+
+void Compiler::DeclareAnyType(const types::Type& type) {
+  *output_ << "; " << type << "\n";
+  type.visit([this](auto x) { DeclareType(x); });
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Identifier& identifier) {
+  const auto& source = LookupVariable(identifier.name);
+  auto value = Load(identifier.type, source.address);
+  if (!source.borrowed && identifier.type.is<types::Array>() &&
+      ownership_->moves.count(&identifier)) {
+    // Transfer ownership of the array. The variable is left empty so that
+    // destroying it has no effect.
+    Store(identifier.type, "zeroinitializer", source.address);
+    return value;
+  }
+  return Copy(identifier.type, std::move(value));
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Boolean& boolean) {
+  return boolean.value ? "true" : "false";
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Integer& integer) {
+  return std::to_string(integer.value);
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::ArrayLiteral& array) {
+  const types::Type& element_type =
+      array.type.get_if<types::Array>()->element_type;
+  const auto size = std::to_string(array.parts.size());
+  auto data = NextValue();
+  Emit() << data << " = call ptr @gelalloc_" << type_names_.at(array.type)
+         << "(i64 " << size << ")\n";
+  for (std::size_t i = 0, n = array.parts.size(); i < n; i++) {
+    auto value = CompileAnyExpression(array.parts[i]);
+    auto address = NextValue();
+    Emit() << address << " = getelementptr inbounds "
+           << IrAnyType(element_type) << ", ptr " << data << ", i64 " << i
+           << "\n";
+    Store(element_type, value, address);
+  }
+  auto partial = NextValue(), result = NextValue();
+  Emit() << partial << " = insertvalue " << kArray << " undef, ptr " << data
+         << ", 0\n";
+  Emit() << result << " = insertvalue " << kArray << " " << partial << ", i64 "
+         << size << ", 1\n";
+  return result;
+}
+
+// The instructions for each operation, which are applied to whole values or
+// to each pair of elements of two arrays. Signed overflow wraps rather than
+// being undefined.
+std::string_view Instruction(ast::Arithmetic operation) {
+  switch (operation) {
+    case ast::Arithmetic::ADD: return "add";
+    case ast::Arithmetic::DIVIDE: return "sdiv";
+    case ast::Arithmetic::MULTIPLY: return "mul";
+    case ast::Arithmetic::SUBTRACT: return "sub";
+  }
+  throw std::logic_error("Invalid arithmetic operation.");
+}
+
+std::string_view Instruction(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return "icmp eq";
+    case ast::Compare::GREATER_OR_EQUAL: return "icmp sge";
+    case ast::Compare::GREATER_THAN: return "icmp sgt";
+    case ast::Compare::LESS_OR_EQUAL: return "icmp sle";
+    case ast::Compare::LESS_THAN: return "icmp slt";
+    case ast::Compare::NOT_EQUAL: return "icmp ne";
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Arithmetic& binary) {
+  if (binary.type.is<types::Array>()) {
+    return CompileElementwise(Instruction(binary.operation), binary.type,
+                              binary.left, binary.right);
+  }
+  auto left = CompileAnyExpression(binary.left);
+  auto right = CompileAnyExpression(binary.right);
+  auto result = NextValue();
+  Emit() << result << " = " << Instruction(binary.operation) << " "
+         << IrAnyType(binary.type) << " " << left << ", " << right << "\n";
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Compare& binary) {
+  if (binary.type.is<types::Array>()) {
+    return CompileElementwise(Instruction(binary.operation), binary.type,
+                              binary.left, binary.right);
+  }
+  const auto type =
+      IrAnyType(analysis::AnnotatedAst::GetMeta(binary.left).type);
+  auto left = CompileAnyExpression(binary.left);
+  auto right = CompileAnyExpression(binary.right);
+  auto result = NextValue();
+  Emit() << result << " = " << Instruction(binary.operation) << " " << type
+         << " " << left << ", " << right << "\n";
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Logical& binary) {
+  auto left = CompileAnyExpression(binary.left);
+  const auto left_block = block_;
+  auto right_label = NextIdentifier(), end = NextIdentifier();
+  // Generate the short-circuit path.
+  Emit() << "br i1 " << left << ", label %";
+  switch (binary.operation) {
+    case ast::Logical::AND:
+      body_ << right_label << ", label %" << end << "\n";
+      break;
+    case ast::Logical::OR:
+      body_ << end << ", label %" << right_label << "\n";
+      break;
+  }
+  StartBlock(right_label);
+  auto right = CompileAnyExpression(binary.right);
+  const auto right_block = block_;
+  Branch(end);
+  StartBlock(end);
+  auto result = NextValue();
+  Emit() << result << " = phi i1 [ " << left << ", %" << left_block << " ], [ "
+         << right << ", %" << right_block << " ]\n";
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::FunctionCall& call) {
+  // Generate each argument, left-to-right.
+  std::vector<std::string> arguments;
+  // Values computed for borrowed parameters are still owned by the caller.
+  Temporaries temporaries;
+  for (std::size_t i = 0, n = call.arguments.size(); i < n; i++) {
+    const bool borrowed = ownership_->IsBorrowed(call.function, i);
+    const auto* identifier =
+        call.arguments[i].get_if<analysis::AnnotatedAst::Identifier>();
+    if (borrowed && identifier) {
+      arguments.push_back("ptr " + LookupVariable(identifier->name).address);
+      continue;
+    }
+    const auto& type = analysis::AnnotatedAst::GetMeta(call.arguments[i]).type;
+    auto value = CompileAnyExpression(call.arguments[i]);
+    if (borrowed) {
+      auto address = Allocate(type);
+      Store(type, value, address);
+      arguments.push_back("ptr " + address);
+      temporaries.emplace_back(std::move(address), type);
+    } else if (type.is<types::Array>()) {
+      // Arrays are passed as separate data and size arguments so that the
+      // data pointer can be marked as not aliasing anything else.
+      auto data = NextValue(), size = NextValue();
+      Emit() << data << " = extractvalue " << kArray << " " << value
+             << ", 0\n";
+      Emit() << size << " = extractvalue " << kArray << " " << value
+             << ", 1\n";
+      arguments.push_back("ptr " + data);
+      arguments.push_back("i64 " + size);
+    } else {
+      arguments.push_back(IrAnyType(type) + " " + value);
+    }
+  }
+
+  // Call the function with all of the arguments.
+  std::string result = "zeroinitializer";
+  if (call.type.is<types::Void>()) {
+    Emit() << "call void";
+  } else {
+    result = NextValue();
+    Emit() << result << " = call " << IrAnyType(call.type);
+  }
+  body_ << " @gel_" << call.function << "(";
+  bool first = true;
+  for (const auto& argument : arguments) {
+    if (first) {
+      first = false;
+    } else {
+      body_ << ", ";
+    }
+    body_ << argument;
+  }
+  body_ << ")\n";
+  DestroyTemporaries(temporaries);
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::LogicalNot& op) {
+  auto argument = CompileAnyExpression(op.argument);
+  auto result = NextValue();
+  Emit() << result << " = xor i1 " << argument << ", true\n";
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Index& index) {
+  Temporaries temporaries;
+  auto element = CompileElement(index, &temporaries);
+  auto result = Copy(index.type, Load(index.type, element));
+  DestroyTemporaries(temporaries);
+  return result;
+}
+
+std::string Compiler::CompileExpression(
+    const analysis::AnnotatedAst::Size& size) {
+  Temporaries temporaries;
+  auto result = CompileSize(CompilePlace(size.array, &temporaries));
+  DestroyTemporaries(temporaries);
+  return result;
+}
+
+std::string Compiler::CompileAnyExpression(
+    const analysis::AnnotatedAst::Expression& expression) {
+  return expression.visit(
+      [&](const auto& node) { return CompileExpression(node); });
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::DefineVariable& definition) {
+  if (ownership_->aliases.count(&definition)) {
+    // The new variable refers to the same storage as the existing one.
+    const auto& source = LookupVariable(
+        definition.value.get_if<analysis::AnnotatedAst::Identifier>()->name);
+    DefineVariable(definition.variable.name, source.address,
+                   definition.variable.type, source.borrowed, false);
+    return;
+  }
+  // Arrays are returned in registers, so a named return value needs no special
+  // treatment. The initializer may refer to a variable of the same name in an
+  // enclosing scope, so the new variable is only brought into scope
+  // afterwards.
+  auto value = CompileAnyExpression(definition.value);
+  auto address = Allocate(definition.variable.type, definition.variable.name);
+  Store(definition.variable.type, value, address);
+  DefineVariable(definition.variable.name, std::move(address),
+                 definition.variable.type);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::Assign& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  auto value = CompileAnyExpression(assignment.value);
+  // The old value can only be destroyed once the new value has been computed,
+  // since the computation may read it.
+  if (variable.type.is<types::Array>())
+    Destroy(variable.type, Load(variable.type, variable.address));
+  Store(variable.type, value, variable.address);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::AssignElement& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  const auto& element_type =
+      variable.type.get_if<types::Array>()->element_type;
+  auto offset = CompileAnyExpression(assignment.index);
+  auto value = CompileAnyExpression(assignment.value);
+  // A shared array must be copied before it can be modified.
+  if (options_->copy_on_write) {
+    Emit() << "call void @gelunshare_" << type_names_.at(variable.type)
+           << "(ptr " << variable.address << ")\n";
+  }
+  if (!bounds_->stores.count(&assignment))
+    CompileCheckIndex(offset, variable.address);
+  auto data = NextValue(), element = NextValue();
+  Emit() << data << " = load ptr, ptr " << variable.address << "\n";
+  Emit() << element << " = getelementptr inbounds " << IrAnyType(element_type)
+         << ", ptr " << data << ", i64 " << offset << "\n";
+  if (element_type.is<types::Array>())
+    Destroy(element_type, Load(element_type, element));
+  Store(element_type, value, element);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::DoFunction& do_function) {
+  auto result = CompileExpression(do_function.function_call);
+  Destroy(do_function.function_call.type, result);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::If& if_statement) {
+  auto condition = CompileAnyExpression(if_statement.condition);
+  auto if_true = NextIdentifier(), if_false = NextIdentifier(),
+       end = NextIdentifier();
+  Emit() << "br i1 " << condition << ", label %" << if_true << ", label %"
+         << if_false << "\n";
+  StartBlock(if_true);
+  CompileStatement(if_statement.if_true);
+  Branch(end);
+  StartBlock(if_false);
+  CompileStatement(if_statement.if_false);
+  Branch(end);
+  StartBlock(end);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::While& while_statement) {
+  auto check = NextIdentifier(), body = NextIdentifier(), end = NextIdentifier();
+  Branch(check);
+  StartBlock(check);
+  auto condition = CompileAnyExpression(while_statement.condition);
+  Emit() << "br i1 " << condition << ", label %" << body << ", label %" << end
+         << "\n";
+  StartBlock(body);
+  CompileStatement(while_statement.body);
+  Branch(check);
+  StartBlock(end);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::ParallelFor& parallel_for) {
+  // The iterations are independent, so running them in order is correct.
+  auto begin = CompileAnyExpression(parallel_for.begin);
+  auto end = CompileAnyExpression(parallel_for.end);
+  auto address = Allocate(types::Primitive::INTEGER,
+                          parallel_for.variable.name);
+  Store(types::Primitive::INTEGER, begin, address);
+  auto check = NextIdentifier(), body = NextIdentifier(),
+       done = NextIdentifier();
+  Branch(check);
+  StartBlock(check);
+  auto index = Load(types::Primitive::INTEGER, address);
+  auto more = NextValue();
+  Emit() << more << " = icmp slt i64 " << index << ", " << end << "\n";
+  Emit() << "br i1 " << more << ", label %" << body << ", label %" << done
+         << "\n";
+  StartBlock(body);
+  PushScope();
+  DefineVariable(parallel_for.variable.name, address,
+                 types::Primitive::INTEGER);
+  CompileStatement(parallel_for.body);
+  PopScope();
+  auto last = Load(types::Primitive::INTEGER, address), next = NextValue();
+  Emit() << next << " = add nsw i64 " << last << ", 1\n";
+  Store(types::Primitive::INTEGER, next, address);
+  Branch(check);
+  StartBlock(done);
+}
+
+void Compiler::CompileStatement(const analysis::AnnotatedAst::ReturnVoid&) {
+  DestroyScopes(scopes_.size());
+  Emit() << "ret void\n";
+  // Anything which follows the return is unreachable.
+  StartBlock(NextIdentifier());
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::Return& return_statement) {
+  auto result = CompileAnyExpression(return_statement.value);
+  DestroyScopes(scopes_.size());
+  if (return_type_.is<types::Void>()) {
+    Emit() << "ret void\n";
+  } else {
+    Emit() << "ret " << IrAnyType(return_type_) << " " << result << "\n";
+  }
+  StartBlock(NextIdentifier());
+}
+
+void Compiler::CompileStatement(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  PushScope();
+  for (const auto& statement : statements) CompileAnyStatement(statement);
+  if (EndsWithReturn(statements)) {
+    // The variables were already destroyed by the return statement.
+    scopes_.pop_back();
+  } else {
+    PopScope();
+  }
+}
+
+void Compiler::CompileAnyStatement(
+    const analysis::AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { CompileStatement(x); });
+}
+
+void Compiler::CompileTopLevel(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  return_type_ = definition.type.return_type;
+  allocas_.str("");
+  body_.str("");
+  block_ = "entry";
+  // Parameters are owned by the callee unless they are borrowed. Borrowed
+  // parameters are never modified or retained by the callee, and every owned
+  // array is the only reference to its elements unless they are shared.
+  std::ostringstream parameters;
+  PushScope();
+  for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++) {
+    if (i > 0) parameters << ", ";
+    const auto& parameter = definition.parameters[i];
+    const auto prefix = "%" + NextIdentifier() + "." + parameter.name;
+    if (ownership_->IsBorrowed(definition.name, i)) {
+      parameters << "ptr noalias nocapture readonly " << prefix;
+      DefineVariable(parameter.name, prefix, parameter.type, true, false);
+      continue;
+    }
+    auto address = Allocate(parameter.type, parameter.name);
+    if (parameter.type.is<types::Array>()) {
+      const auto data = prefix + ".data", size = prefix + ".size";
+      parameters << "ptr " << (options_->copy_on_write ? "" : "noalias ")
+                 << data << ", i64 " << size;
+      auto partial = NextValue(), value = NextValue();
+      Emit() << partial << " = insertvalue " << kArray << " undef, ptr "
+             << data << ", 0\n";
+      Emit() << value << " = insertvalue " << kArray << " " << partial
+             << ", i64 " << size << ", 1\n";
+      Store(parameter.type, value, address);
+    } else {
+      parameters << IrAnyType(parameter.type) << " " << prefix;
+      Store(parameter.type, prefix, address);
+    }
+    DefineVariable(parameter.name, std::move(address), parameter.type);
+  }
+  CompileStatement(definition.body);
+  if (EndsWithReturn(definition.body)) {
+    scopes_.pop_back();
+  } else {
+    PopScope();
+  }
+  // Falling off the end of a function is only possible if it returns nothing.
+  Emit() << (return_type_.is<types::Void>() ? "ret void" : "unreachable")
+         << "\n";
+
+  const auto result_type = return_type_.is<types::Void>()
+                               ? std::string{"void"}
+                               : IrAnyType(return_type_);
+  *output_ << "define internal " << result_type << " @gel_" << definition.name
+           << "(" << parameters.str() << ") nounwind"
+           << (readnone_.count(definition.name) ? " readnone" : "")
+           << " {\nentry:\n"
+           << allocas_.str() << body_.str() << "}\n";
+}
+
+void Compiler::CompileTopLevel(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& definitions) {
+  bool first = true;
+  for (const auto& definition : definitions) {
+    if (first) {
+      first = false;
+    } else {
+      *output_ << "\n";
+    }
+    CompileTopLevel(definition);
+  }
+}
+
+void Compiler::CompileAnyTopLevel(
+    const analysis::AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { CompileTopLevel(x); });
+}
+
+std::string Compiler::NextIdentifier() {
+  auto id = next_id_++;
+  return "gel" + std::to_string(id);
+}
+
+std::string Compiler::NextValue() { return "%" + NextIdentifier(); }
+
+std::ostream& Compiler::Emit() { return body_ << "  "; }
+
+void Compiler::StartBlock(std::string label) {
+  body_ << label << ":\n";
+  block_ = std::move(label);
+}
+
+void Compiler::Branch(std::string_view label) {
+  Emit() << "br label %" << label << "\n";
+}
+
+std::string Compiler::Allocate(const types::Type& type, std::string_view name) {
+  auto address = NextValue();
+  if (!name.empty()) address.append(".").append(name);
+  allocas_ << "  " << address << " = alloca " << IrAnyType(type) << "\n";
+  return address;
+}
+
+std::string Compiler::Load(const types::Type& type, std::string_view address) {
+  auto value = NextValue();
+  Emit() << value << " = load " << IrAnyType(type) << ", ptr " << address
+         << "\n";
+  return value;
+}
+
+void Compiler::Store(const types::Type& type, std::string_view value,
+                     std::string_view address) {
+  Emit() << "store " << IrAnyType(type) << " " << value << ", ptr " << address
+         << "\n";
+}
+
+std::string Compiler::Copy(const types::Type& type, std::string value) {
+  if (!type.is<types::Array>()) return value;
+  auto result = NextValue();
+  Emit() << result << " = call " << kArray << " @gelcopy_"
+         << type_names_.at(type) << "(" << kArray << " " << value << ")\n";
+  return result;
+}
+
+void Compiler::Destroy(const types::Type& type, std::string_view value) {
+  if (!type.is<types::Array>()) return;
+  Emit() << "call void @geldestroy_" << type_names_.at(type) << "(" << kArray
+         << " " << value << ")\n";
+}
+
+std::string Compiler::CompilePlace(
+    const analysis::AnnotatedAst::Expression& expression,
+    Temporaries* temporaries) {
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    return LookupVariable(identifier->name).address;
+  }
+  if (const auto* index = expression.get_if<analysis::AnnotatedAst::Index>())
+    return CompileElement(*index, temporaries);
+  const auto& type = analysis::AnnotatedAst::GetMeta(expression).type;
+  auto value = CompileAnyExpression(expression);
+  auto address = Allocate(type);
+  Store(type, value, address);
+  temporaries->emplace_back(address, type);
+  return address;
+}
+
+std::string Compiler::CompileElement(const analysis::AnnotatedAst::Index& index,
+                                     Temporaries* temporaries) {
+  auto array = CompilePlace(index.array, temporaries);
+  auto offset = CompileAnyExpression(index.index);
+  if (!bounds_->loads.count(&index)) CompileCheckIndex(offset, array);
+  auto data = NextValue(), element = NextValue();
+  Emit() << data << " = load ptr, ptr " << array << "\n";
+  Emit() << element << " = getelementptr inbounds " << IrAnyType(index.type)
+         << ", ptr " << data << ", i64 " << offset << "\n";
+  return element;
+}
+
+void Compiler::DestroyTemporaries(const Temporaries& temporaries) {
+  for (auto i = temporaries.rbegin(); i != temporaries.rend(); ++i) {
+    Destroy(i->second, Load(i->second, i->first));
+  }
+}
+
+std::string Compiler::CompileSize(std::string_view array) {
+  auto address = NextValue();
+  Emit() << address << " = getelementptr inbounds " << kArray << ", ptr "
+         << array << ", i32 0, i32 1\n";
+  return Load(types::Primitive::INTEGER, address);
+}
+
+void Compiler::CompileCheckIndex(std::string_view index,
+                                 std::string_view array) {
+  auto size = CompileSize(array);
+  // Negative indices compare as large unsigned values, so a single unsigned
+  // comparison checks both bounds.
+  auto in_bounds = NextValue();
+  Emit() << in_bounds << " = icmp ult i64 " << index << ", " << size << "\n";
+  auto ok = NextIdentifier(), error = NextIdentifier();
+  Emit() << "br i1 " << in_bounds << ", label %" << ok << ", label %" << error
+         << "\n";
+  StartBlock(error);
+  Emit() << "call void @gelindexerror(i64 " << index << ", i64 " << size
+         << ")\n";
+  Emit() << "unreachable\n";
+  StartBlock(ok);
+}
+
+std::string Compiler::CompileElementwise(
+    std::string_view instruction, const types::Type& type,
+    const analysis::AnnotatedAst::Expression& left,
+    const analysis::AnnotatedAst::Expression& right) {
+  const auto& element_type = type.get_if<types::Array>()->element_type;
+  Temporaries temporaries;
+  auto left_place = CompilePlace(left, &temporaries);
+  auto right_place = CompilePlace(right, &temporaries);
+  auto size = CompileSize(left_place);
+  auto right_size = CompileSize(right_place);
+  auto same = NextValue();
+  Emit() << same << " = icmp eq i64 " << size << ", " << right_size << "\n";
+  auto ok = NextIdentifier(), error = NextIdentifier();
+  Emit() << "br i1 " << same << ", label %" << ok << ", label %" << error
+         << "\n";
+  StartBlock(error);
+  Emit() << "call void @gelsizeerror(i64 " << size << ", i64 " << right_size
+         << ")\n";
+  Emit() << "unreachable\n";
+  StartBlock(ok);
+  auto left_data = NextValue(), right_data = NextValue(), data = NextValue();
+  Emit() << left_data << " = load ptr, ptr " << left_place << "\n";
+  Emit() << right_data << " = load ptr, ptr " << right_place << "\n";
+  Emit() << data << " = call ptr @gelalloc_" << type_names_.at(type) << "(i64 "
+         << size << ")\n";
+  const auto preheader = block_;
+  auto header = NextIdentifier(), body = NextIdentifier(),
+       end = NextIdentifier();
+  Branch(header);
+  StartBlock(header);
+  auto i = NextValue(), next = NextValue(), more = NextValue();
+  Emit() << i << " = phi i64 [ 0, %" << preheader << " ], [ " << next << ", %"
+         << body << " ]\n";
+  Emit() << more << " = icmp slt i64 " << i << ", " << size << "\n";
+  Emit() << "br i1 " << more << ", label %" << body << ", label %" << end
+         << "\n";
+  StartBlock(body);
+  auto left_address = NextValue(), right_address = NextValue(),
+       address = NextValue();
+  Emit() << left_address << " = getelementptr inbounds i64, ptr " << left_data
+         << ", i64 " << i << "\n";
+  Emit() << right_address << " = getelementptr inbounds i64, ptr "
+         << right_data << ", i64 " << i << "\n";
+  auto a = Load(types::Primitive::INTEGER, left_address);
+  auto b = Load(types::Primitive::INTEGER, right_address);
+  auto element = NextValue();
+  Emit() << element << " = " << instruction << " i64 " << a << ", " << b
+         << "\n";
+  Emit() << address << " = getelementptr inbounds " << IrAnyType(element_type)
+         << ", ptr " << data << ", i64 " << i << "\n";
+  Store(element_type, element, address);
+  Emit() << next << " = add nuw nsw i64 " << i << ", 1\n";
+  Branch(header);
+  StartBlock(end);
+  auto partial = NextValue(), result = NextValue();
+  Emit() << partial << " = insertvalue " << kArray << " undef, ptr " << data
+         << ", 0\n";
+  Emit() << result << " = insertvalue " << kArray << " " << partial << ", i64 "
+         << size << ", 1\n";
+  DestroyTemporaries(temporaries);
+  return result;
+}
+
+void Compiler::PushScope() { scopes_.emplace_back(); }
+
+void Compiler::PopScope() {
+  DestroyScopes(1);
+  scopes_.pop_back();
+}
+
+void Compiler::DefineVariable(std::string name, std::string address,
+                              types::Type type, bool borrowed, bool owned) {
+  scopes_.back().push_back(Variable{std::move(name), std::move(address),
+                                    std::move(type), borrowed, owned});
+}
+
+const Compiler::Variable& Compiler::LookupVariable(
+    std::string_view name) const {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = std::find_if(i->rbegin(), i->rend(),
+                          [&](auto& variable) { return variable.name == name; });
+    if (j != i->rend()) return *j;
+  }
+  throw std::logic_error("Undefined variable " + std::string{name} + ".");
+}
+
+void Compiler::DestroyScopes(std::size_t count) {
+  for (auto i = scopes_.rbegin(), end = i + static_cast<std::ptrdiff_t>(count);
+       i != end; ++i) {
+    for (auto j = i->rbegin(); j != i->rend(); ++j) {
+      if (!j->owned || !j->type.is<types::Array>()) continue;
+      Destroy(j->type, Load(j->type, j->address));
+    }
+  }
+}
+
+}  // namespace
+
+void Compile(const std::vector<types::Type>& types,
+             const analysis::AnnotatedAst::TopLevel& top_level,
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output) {
+  Compiler compiler{ownership, bounds, options,
+                    analysis::AnalyzePurity(top_level).memoryless, output};
+  *output << kHeader;
+  for (const auto& type : types) compiler.DeclareAnyType(type);
+  compiler.CompileAnyTopLevel(top_level);
+  *output << kFooter;
+}
+
+}  // namespace target::llvm
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "analysis.h"
+#include "ast.h"
+#include "bounds.h"
+#include "ownership.h"
+
+#include <iostream>
+
+namespace target::llvm {
+
+struct Options {
+  // Represent arrays as reference-counted buffers which are shared between
+  // copies, as for the C target.
+  bool copy_on_write = false;
+};
+
+// Emit a complete program as textual LLVM IR with opaque pointers. Local
+// variables live in stack slots which the optimizer promotes to SSA registers,
+// arrays are passed and returned as { ptr, i64 } pairs, and functions are
+// annotated with the aliasing and side effect facts which are known about
+// them so that the LLVM optimizer can make full use of them.
+void Compile(const std::vector<types::Type>& types,
+             const analysis::AnnotatedAst::TopLevel& top_level,
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output);
+
+}  // namespace target::llvm
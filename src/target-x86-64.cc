@@ -0,0 +1,1561 @@
+#include "target-x86-64.h"
+
+#include "bounds.h"
+#include "optimize.h"
+#include "ownership.h"
+#include "types.h"
+#include "x86-64.h"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+
+namespace target::x86_64 {
+namespace {
+
+constexpr char kHeader[] = R"(# Generated by the gel compiler.
+  .text
+
+# Program entry point. The kernel starts the program with a 16 byte aligned
+# stack and no C library, so the exit status is passed straight to exit_group.
+  .globl _start
+_start:
+  xorl %ebp, %ebp
+  call gel_main
+  movq %rax, %rbx
+  call gelflush
+  movq %rbx, %rdi
+  movl $231, %eax  # exit_group
+  syscall
+
+# Output is collected in a buffer which is written out when it fills up and
+# when the program exits.
+  .lcomm gelbuffer, 4096
+  .lcomm gelused, 8
+
+gelflush:
+  leaq gelbuffer(%rip), %rsi
+  movq gelused(%rip), %rdx
+1:
+  testq %rdx, %rdx
+  jle 2f
+  movl $1, %edi
+  movl $1, %eax  # write
+  syscall
+  testq %rax, %rax
+  jle 2f
+  addq %rax, %rsi
+  subq %rax, %rdx
+  jmp 1b
+2:
+  movq $0, gelused(%rip)
+  ret
+
+# gelformat(value, end) -> start: write the value in decimal immediately
+# before the end address.
+gelformat:
+  movq %rdi, %rax
+  testq %rax, %rax
+  jns 1f
+  negq %rax
+1:
+  movl $10, %ecx
+2:
+  xorl %edx, %edx
+  divq %rcx
+  addb $48, %dl
+  decq %rsi
+  movb %dl, (%rsi)
+  testq %rax, %rax
+  jnz 2b
+  testq %rdi, %rdi
+  jns 3f
+  decq %rsi
+  movb $45, (%rsi)
+3:
+  movq %rsi, %rax
+  ret
+
+# gel_print(value): a line holds at most 21 characters.
+gel_print:
+  subq $40, %rsp
+  cmpq $4096 - 21, gelused(%rip)
+  jbe 1f
+  movq %rdi, 32(%rsp)
+  call gelflush
+  movq 32(%rsp), %rdi
+1:
+  movb $10, 31(%rsp)
+  leaq 31(%rsp), %rsi
+  call gelformat
+  movq %rax, %rsi
+  leaq 32(%rsp), %rcx
+  subq %rax, %rcx
+  leaq gelbuffer(%rip), %rdi
+  addq gelused(%rip), %rdi
+  rep movsb
+  leaq gelbuffer(%rip), %rax
+  subq %rax, %rdi
+  movq %rdi, gelused(%rip)
+  addq $40, %rsp
+  ret
+
+# gelindexerror(index, size)
+gelindexerror:
+  leaq gelindexerror0(%rip), %rdx
+  leaq gelindexerror1(%rip), %rcx
+  leaq gelindexerror2(%rip), %r8
+  leaq gelindexerror3(%rip), %r9
+  jmp gelreport
+
+# gelsizeerror(left, right)
+gelsizeerror:
+  leaq gelsizeerror0(%rip), %rdx
+  leaq gelsizeerror1(%rip), %rcx
+  leaq gelsizeerror2(%rip), %r8
+  leaq gelsizeerror3(%rip), %r9
+  jmp gelreport
+
+# gelreport(first, second, text0, text1, text2, end) writes text0, first,
+# text1, second and text2 to stderr and exits. Each text ends where the next
+# one begins, and the last one ends at end.
+gelreport:
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $144, %rsp
+  movq %rdi, %r12
+  movq %rsi, %r13
+  movq %rdx, %rbx
+  movq %rcx, %r14
+  movq %r8, %r15
+  movq %r9, 128(%rsp)
+  call gelflush
+  movq %rsp, %rdi
+  movq %rbx, %rsi
+  movq %r14, %rcx
+  subq %rbx, %rcx
+  rep movsb
+  movq %rdi, %rbx
+  movq %r12, %rdi
+  leaq 128(%rsp), %rsi
+  call gelformat
+  movq %rax, %rsi
+  leaq 128(%rsp), %rcx
+  subq %rax, %rcx
+  movq %rbx, %rdi
+  rep movsb
+  movq %r14, %rsi
+  movq %r15, %rcx
+  subq %r14, %rcx
+  rep movsb
+  movq %rdi, %rbx
+  movq %r13, %rdi
+  leaq 128(%rsp), %rsi
+  call gelformat
+  movq %rax, %rsi
+  leaq 128(%rsp), %rcx
+  subq %rax, %rcx
+  movq %rbx, %rdi
+  rep movsb
+  movq %r15, %rsi
+  movq 128(%rsp), %rcx
+  subq %r15, %rcx
+  rep movsb
+  movq %rdi, %rdx
+  subq %rsp, %rdx
+  movq %rsp, %rsi
+  movl $2, %edi
+  movl $1, %eax  # write
+  syscall
+  movl $1, %edi
+  movl $231, %eax  # exit_group
+  syscall
+
+# Memory is managed in blocks whose sizes are powers of two, each preceded by
+# an 8 byte header holding the logarithm of its size. Free blocks are kept in
+# a list for each size, and new blocks are carved out of 1MiB arenas. Blocks
+# which are larger than that are mapped individually.
+  .lcomm gelfreelists, 512
+  .lcomm gelarena, 8
+  .lcomm gelarenaend, 8
+
+# gelallocate(bytes) -> address
+gelallocate:
+  leaq 7(%rdi), %rax
+  bsrq %rax, %rcx
+  incq %rcx
+  cmpq $20, %rcx
+  jae 3f
+  leaq gelfreelists(%rip), %rdx
+  movq (%rdx,%rcx,8), %rax
+  testq %rax, %rax
+  jz 1f
+  movq (%rax), %rsi
+  movq %rsi, (%rdx,%rcx,8)
+  jmp 2f
+1:
+  movl $1, %esi
+  shlq %cl, %rsi
+  movq gelarena(%rip), %rax
+  movq gelarenaend(%rip), %rdx
+  subq %rax, %rdx
+  cmpq %rsi, %rdx
+  jae 4f
+  pushq %rcx
+  pushq %rsi
+  movl $1048576, %esi
+  call gelmap
+  popq %rsi
+  popq %rcx
+  leaq 1048576(%rax), %rdx
+  movq %rdx, gelarenaend(%rip)
+4:
+  leaq (%rax,%rsi), %rdx
+  movq %rdx, gelarena(%rip)
+2:
+  movq %rcx, (%rax)
+  addq $8, %rax
+  ret
+3:
+  pushq %rcx
+  movl $1, %esi
+  shlq %cl, %rsi
+  call gelmap
+  popq %rcx
+  jmp 2b
+
+# gelfree(address)
+gelfree:
+  testq %rdi, %rdi
+  jz 1f
+  subq $8, %rdi
+  movq (%rdi), %rcx
+  cmpq $20, %rcx
+  jae 2f
+  leaq gelfreelists(%rip), %rdx
+  movq (%rdx,%rcx,8), %rax
+  movq %rax, (%rdi)
+  movq %rdi, (%rdx,%rcx,8)
+1:
+  ret
+2:
+  movl $1, %esi
+  shlq %cl, %rsi
+  movl $11, %eax  # munmap
+  syscall
+  ret
+
+# gelmap(unused, bytes) -> address
+gelmap:
+  xorl %edi, %edi
+  movl $3, %edx  # PROT_READ | PROT_WRITE
+  movl $0x22, %r10d  # MAP_PRIVATE | MAP_ANONYMOUS
+  movq $-1, %r8
+  xorl %r9d, %r9d
+  movl $9, %eax  # mmap
+  syscall
+  cmpq $-4096, %rax
+  ja 1f
+  ret
+1:
+  call gelflush
+  movl $2, %edi
+  leaq gelnomemory0(%rip), %rsi
+  movl $(gelnomemory1 - gelnomemory0), %edx
+  movl $1, %eax  # write
+  syscall
+  movl $1, %edi
+  movl $231, %eax  # exit_group
+  syscall
+
+  .section .rodata
+gelindexerror0:
+  .ascii "Array index "
+gelindexerror1:
+  .ascii " is out of bounds for array of size "
+gelindexerror2:
+  .ascii ".\n"
+gelindexerror3:
+gelsizeerror0:
+  .ascii "Array sizes "
+gelsizeerror1:
+  .ascii " and "
+gelsizeerror2:
+  .ascii " do not match.\n"
+gelsizeerror3:
+gelnomemory0:
+  .ascii "Out of memory.\n"
+gelnomemory1:
+  .text
+)";
+
+// Arrays are 16 byte {data, size} structures. An array of depth d has arrays of
+// depth d - 1 as its elements, and an array of depth 1 has 8 byte scalars.
+constexpr char kArrays[] = R"(
+# gelalloc(bytes) -> data
+gelalloc:
+  jmp gelallocate
+
+# gelcopy(destination, source, depth)
+gelcopy:
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  movq %rdi, %rbx
+  movq (%rsi), %r12
+  movq 8(%rsi), %r13
+  movq %rdx, %r14
+  cmpq $1, %r14
+  jne 1f
+  leaq (,%r13,8), %rdi
+  call gelallocate
+  movq %rax, (%rbx)
+  movq %r13, 8(%rbx)
+  movq %rax, %rdi
+  movq %r12, %rsi
+  movq %r13, %rcx
+  rep movsq
+  jmp 3f
+1:
+  movq %r13, %rdi
+  shlq $4, %rdi
+  call gelallocate
+  movq %rax, (%rbx)
+  movq %r13, 8(%rbx)
+  movq %rax, %r15
+  decq %r14
+2:
+  testq %r13, %r13
+  jz 3f
+  movq %r15, %rdi
+  movq %r12, %rsi
+  movq %r14, %rdx
+  call gelcopy
+  addq $16, %r15
+  addq $16, %r12
+  decq %r13
+  jmp 2b
+3:
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  ret
+
+# geldestroy(array, depth)
+geldestroy:
+  cmpq $1, %rsi
+  jne 1f
+  movq (%rdi), %rdi
+  jmp gelfree
+1:
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  movq (%rdi), %rbx
+  movq 8(%rdi), %r12
+  leaq -1(%rsi), %r13
+2:
+  decq %r12
+  js 3f
+  movq %r12, %rdi
+  shlq $4, %rdi
+  addq %rbx, %rdi
+  movq %r13, %rsi
+  call geldestroy
+  jmp 2b
+3:
+  movq %rbx, %rdi
+  popq %r13
+  popq %r12
+  popq %rbx
+  jmp gelfree
+)";
+
+// Copy-on-write representation: copies of an array share a single buffer
+// which is prefixed by a reference count. Modifying an array must first call
+// gelunshare to obtain a private buffer if the current one is shared.
+constexpr char kSharedArrays[] = R"(
+# gelalloc(bytes) -> data
+gelalloc:
+  addq $8, %rdi
+  subq $8, %rsp
+  call gelallocate
+  addq $8, %rsp
+  movq $1, (%rax)
+  addq $8, %rax
+  ret
+
+# gelcopy(destination, source, depth)
+gelcopy:
+  movq (%rsi), %rax
+  movq 8(%rsi), %rcx
+  movq %rax, (%rdi)
+  movq %rcx, 8(%rdi)
+  testq %rax, %rax
+  jz 1f
+  incq -8(%rax)
+1:
+  ret
+
+# gelunshare(array, depth)
+gelunshare:
+  movq (%rdi), %rax
+  testq %rax, %rax
+  jz 1f
+  cmpq $1, -8(%rax)
+  jne 2f
+1:
+  ret
+2:
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  movq %rdi, %rbx
+  movq %rax, %r12
+  movq 8(%rdi), %r13
+  movq %rsi, %r14
+  movq %r13, %rdi
+  shlq $3, %rdi
+  cmpq $1, %r14
+  je 3f
+  shlq $1, %rdi
+3:
+  call gelalloc
+  movq %rax, (%rbx)
+  decq -8(%r12)
+  cmpq $1, %r14
+  jne 4f
+  movq %rax, %rdi
+  movq %r12, %rsi
+  movq %r13, %rcx
+  rep movsq
+  jmp 6f
+4:
+  movq %rax, %r15
+5:
+  testq %r13, %r13
+  jz 6f
+  movq %r15, %rdi
+  movq %r12, %rsi
+  call gelcopy
+  addq $16, %r15
+  addq $16, %r12
+  decq %r13
+  jmp 5b
+6:
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  ret
+
+# geldestroy(array, depth)
+geldestroy:
+  movq (%rdi), %rax
+  testq %rax, %rax
+  jz 1f
+  decq -8(%rax)
+  jz 2f
+1:
+  ret
+2:
+  cmpq $1, %rsi
+  jne 3f
+  leaq -8(%rax), %rdi
+  jmp gelfree
+3:
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  movq %rax, %rbx
+  movq 8(%rdi), %r12
+  leaq -1(%rsi), %r13
+4:
+  decq %r12
+  js 5f
+  movq %r12, %rdi
+  shlq $4, %rdi
+  addq %rbx, %rdi
+  movq %r13, %rsi
+  call geldestroy
+  jmp 4b
+5:
+  leaq -8(%rbx), %rdi
+  popq %r13
+  popq %r12
+  popq %rbx
+  jmp gelfree
+)";
+
+constexpr char kFooter[] = R"(
+# End of user code.
+  .section .note.GNU-stack,"",@progbits
+)";
+
+constexpr Reg kRax = Physical(Register::RAX);
+constexpr Reg kRdx = Physical(Register::RDX);
+constexpr Reg kRsp = Physical(Register::RSP);
+constexpr Reg kRbp = Physical(Register::RBP);
+
+// Returns true if the last statement in the block is a return statement, in
+// which case the end of the block is unreachable.
+bool EndsWithReturn(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  if (statements.empty()) return false;
+  return statements.back().is<analysis::AnnotatedAst::ReturnVoid>() ||
+         statements.back().is<analysis::AnnotatedAst::Return>();
+}
+
+// Functions returning arrays construct their result directly in storage
+// provided by the caller, which is passed as a hidden first parameter.
+bool ReturnsIndirectly(const types::Type& type) {
+  return type.is<types::Array>();
+}
+
+// The number of levels of arrays in the type, which is 0 for scalars.
+std::int64_t Depth(const types::Type& type) {
+  const auto* array = type.get_if<types::Array>();
+  return array ? 1 + Depth(array->element_type) : 0;
+}
+
+// Arrays occupy 16 bytes and every other value occupies 8.
+std::int32_t SizeOf(const types::Type& type) {
+  return type.is<types::Array>() ? 16 : 8;
+}
+
+bool FitsInt32(std::int64_t value) {
+  return std::numeric_limits<std::int32_t>::min() <= value &&
+         value <= std::numeric_limits<std::int32_t>::max();
+}
+
+Memory At(Reg base, std::int32_t displacement = 0) {
+  return Memory{base, std::nullopt, 1, displacement, std::nullopt};
+}
+
+Condition ConditionFor(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return Condition::E;
+    case ast::Compare::GREATER_OR_EQUAL: return Condition::GE;
+    case ast::Compare::GREATER_THAN: return Condition::G;
+    case ast::Compare::LESS_OR_EQUAL: return Condition::LE;
+    case ast::Compare::LESS_THAN: return Condition::L;
+    case ast::Compare::NOT_EQUAL: return Condition::NE;
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+// Returns the comparison which gives the same result with the operands
+// swapped.
+ast::Compare Mirror(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return ast::Compare::EQUAL;
+    case ast::Compare::GREATER_OR_EQUAL: return ast::Compare::LESS_OR_EQUAL;
+    case ast::Compare::GREATER_THAN: return ast::Compare::LESS_THAN;
+    case ast::Compare::LESS_OR_EQUAL: return ast::Compare::GREATER_OR_EQUAL;
+    case ast::Compare::LESS_THAN: return ast::Compare::GREATER_THAN;
+    case ast::Compare::NOT_EQUAL: return ast::Compare::NOT_EQUAL;
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+class Lowerer {
+ public:
+  Lowerer(const ownership::Info& ownership, const bounds::Info& bounds,
+          const Options& options, std::vector<Function>* functions)
+      : ownership_(&ownership),
+        bounds_(&bounds),
+        options_(&options),
+        functions_(functions) {}
+
+  // Emit instructions to store the value of the given expression in the
+  // output, which is a register for scalars and the 16 bytes of memory for
+  // arrays. The output is only written once the value has been computed, so
+  // the expression may read the previous value of the output.
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Identifier&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Boolean&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Integer&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::ArrayLiteral&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Arithmetic&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Compare&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Logical&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::FunctionCall&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::LogicalNot&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Index&);
+  void LowerExpression(const Operand& output,
+                       const analysis::AnnotatedAst::Size&);
+  void LowerAnyExpression(const Operand& output,
+                          const analysis::AnnotatedAst::Expression&);
+
+  // Emit instructions to execute the given statement.
+  void LowerStatement(const analysis::AnnotatedAst::DefineVariable&);
+  void LowerStatement(const analysis::AnnotatedAst::Assign&);
+  void LowerStatement(const analysis::AnnotatedAst::AssignElement&);
+  void LowerStatement(const analysis::AnnotatedAst::DoFunction&);
+  void LowerStatement(const analysis::AnnotatedAst::If&);
+  void LowerStatement(const analysis::AnnotatedAst::While&);
+  void LowerStatement(const analysis::AnnotatedAst::ParallelFor&);
+  void LowerStatement(const analysis::AnnotatedAst::ReturnVoid&);
+  void LowerStatement(const analysis::AnnotatedAst::Return&);
+  void LowerStatement(const std::vector<analysis::AnnotatedAst::Statement>&);
+  void LowerAnyStatement(const analysis::AnnotatedAst::Statement&);
+
+  // Add the allocated code for the given functions to the list.
+  void LowerTopLevel(const analysis::AnnotatedAst::DefineFunction&);
+  void LowerTopLevel(
+      const std::vector<analysis::AnnotatedAst::DefineFunction>&);
+  void LowerAnyTopLevel(const analysis::AnnotatedAst::TopLevel&);
+
+ private:
+  struct Variable {
+    std::string name;
+    types::Type type;
+    // Scalars are held in registers and arrays in memory. Borrowed arrays are
+    // accessed through a pointer to the value owned by the caller.
+    Operand place;
+    bool borrowed;
+    // Variables which are borrowed or which alias another variable don't own
+    // their value and must not destroy it.
+    bool owned;
+  };
+
+  // Arrays computed into temporary storage, with their depths.
+  using Temporaries = std::vector<std::pair<Memory, std::int64_t>>;
+
+  void Emit(Instruction instruction);
+  void EmitLabel(std::uint32_t label);
+  void EmitJump(Opcode opcode, std::uint32_t label,
+                Condition condition = Condition::E);
+  // Emit a call to a runtime function with arguments passed in registers.
+  void EmitCall(std::string symbol, const std::vector<Operand>& arguments);
+
+  // Emit instructions for a scalar expression and return an operand which
+  // holds its value. This is either a 32-bit immediate, the register of
+  // a variable, or a new register.
+  Operand LowerOperand(const analysis::AnnotatedAst::Expression&);
+  Reg LowerRegister(const analysis::AnnotatedAst::Expression&);
+  Reg ToRegister(const Operand& operand);
+  // Emit a comparison and return the condition under which it holds.
+  Condition LowerCompare(const analysis::AnnotatedAst::Compare&);
+  // Emit a branch to the label which is taken when the condition has the
+  // given value. Comparisons and logical operators are lowered to jumps
+  // without materializing any boolean values.
+  void LowerCondition(const analysis::AnnotatedAst::Expression&, bool value,
+                      std::uint32_t label);
+
+  // Emit instructions to locate the value of an array expression and return
+  // its address. Arrays held in variables are accessed in place. Other arrays
+  // are computed into temporaries which are added to the list and must be
+  // destroyed by the caller once the value is no longer used.
+  Memory LowerPlace(const analysis::AnnotatedAst::Expression&,
+                    Temporaries* temporaries);
+  Memory LowerElement(const analysis::AnnotatedAst::Index&,
+                      Temporaries* temporaries);
+  Memory ElementAt(const Memory& array, const Operand& index,
+                   std::int32_t size);
+  void DestroyTemporaries(const Temporaries& temporaries);
+
+  // Emit a loop which stores a new array of integers or booleans in the
+  // output, computing each element from the elements of two arrays of
+  // integers of the same size. The combining function is given registers for
+  // the result and for the two operands, which it may modify.
+  void LowerElementwise(const Memory& output,
+                        const analysis::AnnotatedAst::Expression& left,
+                        const analysis::AnnotatedAst::Expression& right,
+                        const std::function<void(Reg, Reg, Reg)>& combine);
+
+  // Emit instructions to multiply or divide an integer by a constant, using
+  // shifts and multiplications in place of the general instructions where
+  // gel's truncating signed arithmetic allows.
+  void LowerMultiply(Reg output, const Operand& left, std::int64_t factor);
+  void LowerDivide(Reg output, Reg left, std::int64_t divisor);
+
+  // Returns a register holding the address.
+  Reg Address(const Memory& address);
+  // Transfer the 16 bytes of an array without touching its elements.
+  void Move(const Memory& output, const Memory& source);
+  void Copy(const Memory& output, const Memory& source, std::int64_t depth);
+  void Destroy(const Memory& array, std::int64_t depth);
+
+  // Enter a new scope. Variables defined in the scope are destroyed when the
+  // scope is left.
+  void PushScope();
+  void PopScope();
+  void DefineVariable(std::string name, types::Type type, Operand place,
+                      bool borrowed = false, bool owned = true);
+  const Variable& LookupVariable(std::string_view name) const;
+  // Emit code to destroy the variables in the given number of innermost scopes,
+  // except for the named return value if there is one.
+  void DestroyScopes(std::size_t count);
+
+  const ownership::Info* ownership_;
+  const bounds::Info* bounds_;
+  const Options* options_;
+  std::vector<Function>* functions_;
+  std::vector<std::vector<Variable>> scopes_;
+  // Properties of the function which is being lowered.
+  Function function_;
+  bool returns_indirectly_ = false;
+  std::string named_return_;
+  // The address of the result storage for functions returning arrays.
+  Reg result_ = kRax;
+};
+
+void Lowerer::LowerExpression(
+    const Operand& output,
+    const analysis::AnnotatedAst::Identifier& identifier) {
+  const auto& source = LookupVariable(identifier.name);
+  if (!identifier.type.is<types::Array>()) {
+    Emit({Opcode::MOV, output, source.place});
+    return;
+  }
+  const auto& place = std::get<Memory>(source.place);
+  if (!source.borrowed && ownership_->moves.count(&identifier)) {
+    // The source is left empty so that destroying it has no effect.
+    Move(std::get<Memory>(output), place);
+    Emit({Opcode::MOV, place, Immediate{0}});
+    Emit({Opcode::MOV, Offset(place, 8), Immediate{0}});
+  } else {
+    Copy(std::get<Memory>(output), place, Depth(identifier.type));
+  }
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Boolean& boolean) {
+  Emit({Opcode::MOV, output, Immediate{boolean.value ? 1 : 0}});
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Integer& integer) {
+  Emit({Opcode::MOV, output, Immediate{integer.value}});
+}
+
+void Lowerer::LowerExpression(
+    const Operand& output, const analysis::AnnotatedAst::ArrayLiteral& array) {
+  const auto& element_type = array.type.get_if<types::Array>()->element_type;
+  const auto element_size = SizeOf(element_type);
+  const auto count = static_cast<std::int32_t>(array.parts.size());
+  EmitCall("gelalloc", {Immediate{std::int64_t{count} * element_size}});
+  const Reg data = function_.NewRegister();
+  Emit({Opcode::MOV, data, kRax});
+  for (std::int32_t i = 0; i < count; i++) {
+    const auto& part = array.parts[static_cast<std::size_t>(i)];
+    const auto element = At(data, i * element_size);
+    if (element_type.is<types::Array>()) {
+      LowerAnyExpression(element, part);
+    } else {
+      Emit({Opcode::MOV, element, LowerOperand(part)});
+    }
+  }
+  const auto& result = std::get<Memory>(output);
+  Emit({Opcode::MOV, result, data});
+  Emit({Opcode::MOV, Offset(result, 8), Immediate{count}});
+}
+
+void Lowerer::LowerExpression(
+    const Operand& output, const analysis::AnnotatedAst::Arithmetic& binary) {
+  if (binary.type.is<types::Array>()) {
+    LowerElementwise(std::get<Memory>(output), binary.left, binary.right,
+                     [&](Reg result, Reg left, Reg right) {
+                       switch (binary.operation) {
+                         case ast::Arithmetic::ADD:
+                           Emit({Opcode::ADD, left, right});
+                           break;
+                         case ast::Arithmetic::DIVIDE:
+                           Emit({Opcode::MOV, kRax, left});
+                           Emit({Opcode::CQO});
+                           Emit({Opcode::IDIV, right});
+                           Emit({Opcode::MOV, left, kRax});
+                           break;
+                         case ast::Arithmetic::MULTIPLY:
+                           Emit({Opcode::IMUL, left, right});
+                           break;
+                         case ast::Arithmetic::SUBTRACT:
+                           Emit({Opcode::SUB, left, right});
+                           break;
+                       }
+                       Emit({Opcode::MOV, result, left});
+                     });
+    return;
+  }
+  const Reg result = std::get<Reg>(output);
+  const auto* constant =
+      binary.right.get_if<analysis::AnnotatedAst::Integer>();
+  if (constant && binary.operation == ast::Arithmetic::MULTIPLY) {
+    LowerMultiply(result, LowerOperand(binary.left), constant->value);
+    return;
+  }
+  // Division by 0 or -1 can trap, so it is left to the general instruction.
+  if (constant && binary.operation == ast::Arithmetic::DIVIDE &&
+      constant->value != 0 && constant->value != -1) {
+    LowerDivide(result, LowerRegister(binary.left), constant->value);
+    return;
+  }
+  const auto left = LowerOperand(binary.left);
+  auto right = LowerOperand(binary.right);
+  Opcode opcode = Opcode::ADD;
+  switch (binary.operation) {
+    case ast::Arithmetic::ADD:
+      opcode = Opcode::ADD;
+      break;
+    case ast::Arithmetic::DIVIDE: {
+      const Reg divisor = ToRegister(right);
+      Emit({Opcode::MOV, kRax, left});
+      Emit({Opcode::CQO});
+      Emit({Opcode::IDIV, divisor});
+      Emit({Opcode::MOV, result, kRax});
+      return;
+    }
+    case ast::Arithmetic::MULTIPLY:
+      opcode = Opcode::IMUL;
+      break;
+    case ast::Arithmetic::SUBTRACT:
+      opcode = Opcode::SUB;
+      break;
+  }
+  // The result can be computed in place unless the right operand is the
+  // variable being assigned, which would be overwritten by the left operand.
+  const auto* right_register = std::get_if<Reg>(&right);
+  const Reg target = right_register && *right_register == result
+                         ? function_.NewRegister()
+                         : result;
+  Emit({Opcode::MOV, target, left});
+  Emit({opcode, target, right});
+  Emit({Opcode::MOV, result, target});
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Compare& binary) {
+  if (binary.type.is<types::Array>()) {
+    LowerElementwise(std::get<Memory>(output), binary.left, binary.right,
+                     [&](Reg result, Reg left, Reg right) {
+                       Emit({Opcode::CMP, left, right});
+                       Instruction set{Opcode::SET, result};
+                       set.condition = ConditionFor(binary.operation);
+                       Emit(std::move(set));
+                     });
+    return;
+  }
+  Instruction set{Opcode::SET, output};
+  set.condition = LowerCompare(binary);
+  Emit(std::move(set));
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Logical& binary) {
+  // The right operand may read the output, so the result is computed
+  // separately.
+  const Reg result = function_.NewRegister();
+  const auto end = function_.NewLabel();
+  LowerAnyExpression(result, binary.left);
+  // Generate the short-circuit path.
+  Emit({Opcode::TEST, result, result});
+  switch (binary.operation) {
+    case ast::Logical::AND:
+      EmitJump(Opcode::JCC, end, Condition::E);
+      break;
+    case ast::Logical::OR:
+      EmitJump(Opcode::JCC, end, Condition::NE);
+      break;
+  }
+  LowerAnyExpression(result, binary.right);
+  EmitLabel(end);
+  Emit({Opcode::MOV, output, result});
+}
+
+void Lowerer::LowerExpression(
+    const Operand& output, const analysis::AnnotatedAst::FunctionCall& call) {
+  // Evaluate each argument, left-to-right, as a list of eightbytes. Arrays
+  // which are passed by value occupy two eightbytes, and are passed in
+  // registers only if both of them fit.
+  Temporaries temporaries;
+  std::vector<Operand> registers, stack;
+  if (ReturnsIndirectly(call.type))
+    registers.push_back(Address(std::get<Memory>(output)));
+  for (std::size_t i = 0, n = call.arguments.size(); i < n; i++) {
+    const auto& argument = call.arguments[i];
+    const auto& type = analysis::AnnotatedAst::GetMeta(argument).type;
+    std::vector<Operand> words;
+    if (!type.is<types::Array>()) {
+      words.push_back(LowerOperand(argument));
+    } else if (ownership_->IsBorrowed(call.function, i)) {
+      // Values computed for borrowed parameters are still owned by the
+      // caller.
+      const auto* identifier =
+          argument.get_if<analysis::AnnotatedAst::Identifier>();
+      const auto place =
+          identifier ? std::get<Memory>(LookupVariable(identifier->name).place)
+                     : LowerPlace(argument, &temporaries);
+      words.push_back(Address(place));
+    } else {
+      const auto value = function_.NewSlot(16);
+      LowerAnyExpression(value, argument);
+      words.push_back(value);
+      words.push_back(Offset(value, 8));
+    }
+    auto& destination =
+        registers.size() + words.size() <= std::size(kArgumentRegisters)
+            ? registers
+            : stack;
+    destination.insert(destination.end(), words.begin(), words.end());
+  }
+
+  // Call the function with all of the arguments. The stack must be 16 byte
+  // aligned at the call.
+  const auto padding = static_cast<std::int64_t>(8 * (stack.size() % 2));
+  if (padding) Emit({Opcode::SUB, kRsp, Immediate{padding}});
+  for (auto i = stack.rbegin(); i != stack.rend(); ++i)
+    Emit({Opcode::PUSH, *i});
+  for (std::size_t i = 0, n = registers.size(); i < n; i++)
+    Emit({Opcode::MOV, Physical(kArgumentRegisters[i]), registers[i]});
+  Instruction instruction{Opcode::CALL};
+  instruction.symbol = "gel_" + call.function;
+  instruction.arguments = static_cast<int>(registers.size());
+  Emit(std::move(instruction));
+  if (!stack.empty()) {
+    const auto size = static_cast<std::int64_t>(8 * stack.size()) + padding;
+    Emit({Opcode::ADD, kRsp, Immediate{size}});
+  }
+  if (!ReturnsIndirectly(call.type)) Emit({Opcode::MOV, output, kRax});
+  DestroyTemporaries(temporaries);
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::LogicalNot& op) {
+  LowerAnyExpression(output, op.argument);
+  Emit({Opcode::XOR, output, Immediate{1}});
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Index& index) {
+  Temporaries temporaries;
+  const auto element = LowerElement(index, &temporaries);
+  if (index.type.is<types::Array>()) {
+    Copy(std::get<Memory>(output), element, Depth(index.type));
+  } else {
+    Emit({Opcode::MOV, output, element});
+  }
+  DestroyTemporaries(temporaries);
+}
+
+void Lowerer::LowerExpression(const Operand& output,
+                              const analysis::AnnotatedAst::Size& size) {
+  Temporaries temporaries;
+  const auto array = LowerPlace(size.array, &temporaries);
+  Emit({Opcode::MOV, output, Offset(array, 8)});
+  DestroyTemporaries(temporaries);
+}
+
+void Lowerer::LowerAnyExpression(
+    const Operand& output,
+    const analysis::AnnotatedAst::Expression& expression) {
+  expression.visit(
+      [&](const auto& node) { LowerExpression(output, node); });
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::DefineVariable& definition) {
+  const auto& type = definition.variable.type;
+  if (ownership_->aliases.count(&definition)) {
+    // The new variable refers to the same storage as the existing one.
+    const auto& source = LookupVariable(
+        definition.value.get_if<analysis::AnnotatedAst::Identifier>()->name);
+    DefineVariable(definition.variable.name, type, source.place,
+                   source.borrowed, false);
+    return;
+  }
+  if (ownership_->named_returns.count(&definition)) {
+    LowerAnyExpression(At(result_), definition.value);
+    DefineVariable(definition.variable.name, type, At(result_));
+    named_return_ = definition.variable.name;
+    return;
+  }
+  // The initializer may refer to a variable of the same name in an enclosing
+  // scope, so the new variable is only brought into scope afterwards.
+  Operand place = function_.NewRegister();
+  if (type.is<types::Array>()) place = function_.NewSlot(16);
+  LowerAnyExpression(place, definition.value);
+  DefineVariable(definition.variable.name, type, place);
+}
+
+void Lowerer::LowerStatement(const analysis::AnnotatedAst::Assign& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  if (!variable.type.is<types::Array>()) {
+    LowerAnyExpression(variable.place, assignment.value);
+    return;
+  }
+  // The old value can only be destroyed once the new value has been computed,
+  // since the computation may read it.
+  const auto& place = std::get<Memory>(variable.place);
+  const auto value = function_.NewSlot(16);
+  LowerAnyExpression(value, assignment.value);
+  Destroy(place, Depth(variable.type));
+  Move(place, value);
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::AssignElement& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  const auto& place = std::get<Memory>(variable.place);
+  const auto& element_type =
+      variable.type.get_if<types::Array>()->element_type;
+  const auto index = LowerOperand(assignment.index);
+  Operand value = Immediate{0};
+  if (element_type.is<types::Array>()) {
+    value = function_.NewSlot(16);
+    LowerAnyExpression(value, assignment.value);
+  } else {
+    value = LowerOperand(assignment.value);
+  }
+  // A shared array must be copied before it can be modified.
+  if (options_->copy_on_write) {
+    EmitCall("gelunshare", {Address(place), Immediate{Depth(variable.type)}});
+  }
+  if (!bounds_->stores.count(&assignment))
+    Emit({Opcode::CHECK_INDEX, index, Offset(place, 8)});
+  const auto element = ElementAt(place, index, SizeOf(element_type));
+  if (element_type.is<types::Array>()) {
+    Destroy(element, Depth(element_type));
+    Move(element, std::get<Memory>(value));
+  } else {
+    Emit({Opcode::MOV, element, value});
+  }
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::DoFunction& do_function) {
+  const auto& type = do_function.function_call.type;
+  if (!type.is<types::Array>()) {
+    LowerExpression(function_.NewRegister(), do_function.function_call);
+    return;
+  }
+  const auto ignored_result = function_.NewSlot(16);
+  LowerExpression(ignored_result, do_function.function_call);
+  Destroy(ignored_result, Depth(type));
+}
+
+void Lowerer::LowerStatement(const analysis::AnnotatedAst::If& if_statement) {
+  const auto if_false = function_.NewLabel(), end = function_.NewLabel();
+  LowerCondition(if_statement.condition, false, if_false);
+  LowerStatement(if_statement.if_true);
+  if (!if_statement.if_false.empty()) EmitJump(Opcode::JMP, end);
+  EmitLabel(if_false);
+  LowerStatement(if_statement.if_false);
+  EmitLabel(end);
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::While& while_statement) {
+  // The condition is placed after the body so that each iteration only takes
+  // a single branch.
+  const auto body = function_.NewLabel(), condition = function_.NewLabel();
+  EmitJump(Opcode::JMP, condition);
+  EmitLabel(body);
+  LowerStatement(while_statement.body);
+  EmitLabel(condition);
+  LowerCondition(while_statement.condition, true, body);
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::ParallelFor& parallel_for) {
+  // The iterations are independent, so running them in order is correct.
+  const Reg index = function_.NewRegister(), end = function_.NewRegister();
+  LowerAnyExpression(index, parallel_for.begin);
+  LowerAnyExpression(end, parallel_for.end);
+  const auto body = function_.NewLabel(), condition = function_.NewLabel();
+  EmitJump(Opcode::JMP, condition);
+  EmitLabel(body);
+  PushScope();
+  DefineVariable(parallel_for.variable.name, types::Primitive::INTEGER, index);
+  LowerStatement(parallel_for.body);
+  PopScope();
+  Emit({Opcode::ADD, index, Immediate{1}});
+  EmitLabel(condition);
+  Emit({Opcode::CMP, index, end});
+  EmitJump(Opcode::JCC, body, Condition::L);
+}
+
+void Lowerer::LowerStatement(const analysis::AnnotatedAst::ReturnVoid&) {
+  DestroyScopes(scopes_.size());
+  Emit({Opcode::RETURN});
+}
+
+void Lowerer::LowerStatement(
+    const analysis::AnnotatedAst::Return& return_statement) {
+  if (returns_indirectly_) {
+    const auto* identifier =
+        return_statement.value.get_if<analysis::AnnotatedAst::Identifier>();
+    // The named return value is already in the result storage.
+    if (identifier == nullptr || identifier->name != named_return_)
+      LowerAnyExpression(At(result_), return_statement.value);
+    DestroyScopes(scopes_.size());
+    Emit({Opcode::RETURN});
+    return;
+  }
+  const auto result = LowerOperand(return_statement.value);
+  DestroyScopes(scopes_.size());
+  Emit({Opcode::MOV, kRax, result});
+  Instruction instruction{Opcode::RETURN};
+  instruction.arguments = 1;
+  Emit(std::move(instruction));
+}
+
+void Lowerer::LowerStatement(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  PushScope();
+  for (const auto& statement : statements) LowerAnyStatement(statement);
+  if (EndsWithReturn(statements)) {
+    // The variables were already destroyed by the return statement.
+    scopes_.pop_back();
+  } else {
+    PopScope();
+  }
+}
+
+void Lowerer::LowerAnyStatement(
+    const analysis::AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { LowerStatement(x); });
+}
+
+void Lowerer::LowerTopLevel(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  function_ = Function{};
+  function_.name = "gel_" + definition.name;
+  returns_indirectly_ = ReturnsIndirectly(definition.type.return_type);
+  named_return_.clear();
+
+  // Find where each parameter is passed, following the same rules as for
+  // calls. Values passed on the stack are above the return address and the
+  // saved frame pointer.
+  const std::size_t hidden = returns_indirectly_ ? 1 : 0;
+  std::size_t registers = hidden;
+  std::int32_t stack = 16;
+  std::vector<std::vector<Operand>> words;
+  for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++) {
+    const auto& type = definition.parameters[i].type;
+    const bool owned_array = type.is<types::Array>() &&
+                             !ownership_->IsBorrowed(definition.name, i);
+    const std::size_t count = owned_array ? 2 : 1;
+    auto& parameter = words.emplace_back();
+    for (std::size_t j = 0; j < count; j++) {
+      if (registers + count <= std::size(kArgumentRegisters)) {
+        parameter.push_back(Physical(kArgumentRegisters[registers + j]));
+      } else {
+        parameter.push_back(At(kRbp, stack + 8 * static_cast<std::int32_t>(j)));
+      }
+    }
+    if (registers + count <= std::size(kArgumentRegisters)) {
+      registers += count;
+    } else {
+      stack += 8 * static_cast<std::int32_t>(count);
+    }
+  }
+  Instruction entry{Opcode::ENTRY};
+  entry.arguments = static_cast<int>(registers);
+  Emit(std::move(entry));
+  if (returns_indirectly_) {
+    result_ = function_.NewRegister();
+    Emit({Opcode::MOV, result_, Physical(kArgumentRegisters[0])});
+  }
+
+  // Parameters are owned by the callee unless they are borrowed.
+  PushScope();
+  for (std::size_t i = 0, n = definition.parameters.size(); i < n; i++) {
+    const auto& parameter = definition.parameters[i];
+    const bool borrowed = ownership_->IsBorrowed(definition.name, i);
+    Operand place = function_.NewRegister();
+    if (parameter.type.is<types::Array>() && !borrowed) {
+      if (std::holds_alternative<Memory>(words[i][0])) {
+        // Arrays passed on the stack are used in place.
+        place = words[i][0];
+      } else {
+        const auto value = function_.NewSlot(16);
+        Emit({Opcode::MOV, value, words[i][0]});
+        Emit({Opcode::MOV, Offset(value, 8), words[i][1]});
+        place = value;
+      }
+    } else {
+      Emit({Opcode::MOV, place, words[i][0]});
+      if (borrowed) place = At(std::get<Reg>(place));
+    }
+    DefineVariable(parameter.name, parameter.type, std::move(place), borrowed,
+                   !borrowed);
+  }
+  LowerStatement(definition.body);
+  if (EndsWithReturn(definition.body)) {
+    scopes_.pop_back();
+  } else {
+    PopScope();
+    Instruction instruction{Opcode::RETURN};
+    if (!returns_indirectly_) {
+      Emit({Opcode::MOV, kRax, Immediate{0}});
+      instruction.arguments = 1;
+    }
+    Emit(std::move(instruction));
+  }
+  Allocate(&function_);
+  functions_->push_back(std::move(function_));
+}
+
+void Lowerer::LowerTopLevel(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) LowerTopLevel(definition);
+}
+
+void Lowerer::LowerAnyTopLevel(
+    const analysis::AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { LowerTopLevel(x); });
+}
+
+void Lowerer::Emit(Instruction instruction) {
+  function_.code.push_back(std::move(instruction));
+}
+
+void Lowerer::EmitLabel(std::uint32_t label) {
+  Instruction instruction{Opcode::LABEL};
+  instruction.label = label;
+  Emit(std::move(instruction));
+}
+
+void Lowerer::EmitJump(Opcode opcode, std::uint32_t label,
+                       Condition condition) {
+  Instruction instruction{opcode};
+  instruction.label = label;
+  instruction.condition = condition;
+  Emit(std::move(instruction));
+}
+
+void Lowerer::EmitCall(std::string symbol,
+                       const std::vector<Operand>& arguments) {
+  for (std::size_t i = 0, n = arguments.size(); i < n; i++)
+    Emit({Opcode::MOV, Physical(kArgumentRegisters[i]), arguments[i]});
+  Instruction instruction{Opcode::CALL};
+  instruction.symbol = std::move(symbol);
+  instruction.arguments = static_cast<int>(arguments.size());
+  Emit(std::move(instruction));
+}
+
+Operand Lowerer::LowerOperand(
+    const analysis::AnnotatedAst::Expression& expression) {
+  if (const auto* integer =
+          expression.get_if<analysis::AnnotatedAst::Integer>();
+      integer && FitsInt32(integer->value)) {
+    return Immediate{integer->value};
+  }
+  if (const auto* boolean =
+          expression.get_if<analysis::AnnotatedAst::Boolean>()) {
+    return Immediate{boolean->value ? 1 : 0};
+  }
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    return LookupVariable(identifier->name).place;
+  }
+  const Reg result = function_.NewRegister();
+  LowerAnyExpression(result, expression);
+  return result;
+}
+
+Reg Lowerer::LowerRegister(
+    const analysis::AnnotatedAst::Expression& expression) {
+  return ToRegister(LowerOperand(expression));
+}
+
+Reg Lowerer::ToRegister(const Operand& operand) {
+  if (const auto* reg = std::get_if<Reg>(&operand)) return *reg;
+  const Reg result = function_.NewRegister();
+  Emit({Opcode::MOV, result, operand});
+  return result;
+}
+
+Condition Lowerer::LowerCompare(
+    const analysis::AnnotatedAst::Compare& binary) {
+  auto left = LowerOperand(binary.left), right = LowerOperand(binary.right);
+  auto operation = binary.operation;
+  // Only the right operand of a comparison can be an immediate.
+  if (std::holds_alternative<Immediate>(left)) {
+    if (std::holds_alternative<Immediate>(right)) {
+      left = ToRegister(left);
+    } else {
+      std::swap(left, right);
+      operation = Mirror(operation);
+    }
+  }
+  Emit({Opcode::CMP, left, right});
+  return ConditionFor(operation);
+}
+
+void Lowerer::LowerCondition(
+    const analysis::AnnotatedAst::Expression& expression, bool value,
+    std::uint32_t label) {
+  if (const auto* compare =
+          expression.get_if<analysis::AnnotatedAst::Compare>()) {
+    const auto condition = LowerCompare(*compare);
+    EmitJump(Opcode::JCC, label, value ? condition : Negate(condition));
+  } else if (const auto* logical =
+                 expression.get_if<analysis::AnnotatedAst::Logical>()) {
+    // The right operand is skipped when the left operand decides the result.
+    const bool deciding = logical->operation == ast::Logical::OR;
+    if (value == deciding) {
+      LowerCondition(logical->left, value, label);
+      LowerCondition(logical->right, value, label);
+    } else {
+      const auto end = function_.NewLabel();
+      LowerCondition(logical->left, deciding, end);
+      LowerCondition(logical->right, value, label);
+      EmitLabel(end);
+    }
+  } else if (const auto* logical_not =
+                 expression.get_if<analysis::AnnotatedAst::LogicalNot>()) {
+    LowerCondition(logical_not->argument, !value, label);
+  } else if (const auto* boolean =
+                 expression.get_if<analysis::AnnotatedAst::Boolean>()) {
+    if (boolean->value == value) EmitJump(Opcode::JMP, label);
+  } else {
+    const Reg result = LowerRegister(expression);
+    Emit({Opcode::TEST, result, result});
+    EmitJump(Opcode::JCC, label, value ? Condition::NE : Condition::E);
+  }
+}
+
+Memory Lowerer::LowerPlace(const analysis::AnnotatedAst::Expression& expression,
+                           Temporaries* temporaries) {
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    return std::get<Memory>(LookupVariable(identifier->name).place);
+  }
+  if (const auto* index = expression.get_if<analysis::AnnotatedAst::Index>())
+    return LowerElement(*index, temporaries);
+  const auto value = function_.NewSlot(16);
+  LowerAnyExpression(value, expression);
+  temporaries->emplace_back(
+      value, Depth(analysis::AnnotatedAst::GetMeta(expression).type));
+  return value;
+}
+
+Memory Lowerer::LowerElement(const analysis::AnnotatedAst::Index& index,
+                             Temporaries* temporaries) {
+  const auto array = LowerPlace(index.array, temporaries);
+  const auto offset = LowerOperand(index.index);
+  if (!bounds_->loads.count(&index))
+    Emit({Opcode::CHECK_INDEX, offset, Offset(array, 8)});
+  return ElementAt(array, offset, SizeOf(index.type));
+}
+
+void Lowerer::LowerElementwise(
+    const Memory& output, const analysis::AnnotatedAst::Expression& left,
+    const analysis::AnnotatedAst::Expression& right,
+    const std::function<void(Reg, Reg, Reg)>& combine) {
+  Temporaries temporaries;
+  const auto left_place = LowerPlace(left, &temporaries);
+  const auto right_place = LowerPlace(right, &temporaries);
+  const Reg size = function_.NewRegister();
+  Emit({Opcode::MOV, size, Offset(left_place, 8)});
+  Emit({Opcode::CHECK_SIZE, size, Offset(right_place, 8)});
+  const Reg bytes = function_.NewRegister();
+  Emit({Opcode::MOV, bytes, size});
+  Emit({Opcode::SHL, bytes, Immediate{3}});
+  EmitCall("gelalloc", {bytes});
+  const Reg data = function_.NewRegister();
+  Emit({Opcode::MOV, data, kRax});
+  // The condition is placed after the body, as for while loops.
+  const Reg i = function_.NewRegister();
+  const auto body = function_.NewLabel(), condition = function_.NewLabel();
+  Emit({Opcode::MOV, i, Immediate{0}});
+  EmitJump(Opcode::JMP, condition);
+  EmitLabel(body);
+  const Reg a = function_.NewRegister(), b = function_.NewRegister();
+  Emit({Opcode::MOV, a, ElementAt(left_place, i, 8)});
+  Emit({Opcode::MOV, b, ElementAt(right_place, i, 8)});
+  const Reg element = function_.NewRegister();
+  combine(element, a, b);
+  Emit({Opcode::MOV, Memory{data, i, 8, 0, std::nullopt}, element});
+  Emit({Opcode::ADD, i, Immediate{1}});
+  EmitLabel(condition);
+  Emit({Opcode::CMP, i, size});
+  EmitJump(Opcode::JCC, body, Condition::L);
+  Emit({Opcode::MOV, output, data});
+  Emit({Opcode::MOV, Offset(output, 8), size});
+  DestroyTemporaries(temporaries);
+}
+
+Memory Lowerer::ElementAt(const Memory& array, const Operand& index,
+                          std::int32_t size) {
+  const Reg data = function_.NewRegister();
+  Emit({Opcode::MOV, data, array});
+  if (const auto* constant = std::get_if<Immediate>(&index);
+      constant && FitsInt32(constant->value * size)) {
+    return At(data, static_cast<std::int32_t>(constant->value * size));
+  }
+  if (size > 8) {
+    // Addresses can only scale the index by up to 8.
+    const Reg scaled = function_.NewRegister();
+    Emit({Opcode::MOV, scaled, index});
+    Emit({Opcode::SHL, scaled, Immediate{4}});
+    return Memory{data, scaled, 1, 0, std::nullopt};
+  }
+  return Memory{data, ToRegister(index), 8, 0, std::nullopt};
+}
+
+void Lowerer::DestroyTemporaries(const Temporaries& temporaries) {
+  for (auto i = temporaries.rbegin(); i != temporaries.rend(); ++i)
+    Destroy(i->first, i->second);
+}
+
+void Lowerer::LowerMultiply(Reg output, const Operand& left,
+                            std::int64_t factor) {
+  if (factor == 0) {
+    Emit({Opcode::MOV, output, Immediate{0}});
+  } else if (factor == 1) {
+    Emit({Opcode::MOV, output, left});
+  } else if (auto shift = optimize::Log2(factor)) {
+    Emit({Opcode::MOV, output, left});
+    Emit({Opcode::SHL, output, Immediate{*shift}});
+    if (factor < 0) Emit({Opcode::NEG, output});
+  } else if (FitsInt32(factor)) {
+    Emit({Opcode::IMUL3, output, ToRegister(left), Immediate{factor}});
+  } else {
+    const Reg multiplier = ToRegister(Immediate{factor});
+    Emit({Opcode::MOV, output, left});
+    Emit({Opcode::IMUL, output, multiplier});
+  }
+}
+
+void Lowerer::LowerDivide(Reg output, Reg left, std::int64_t divisor) {
+  const Reg result = function_.NewRegister();
+  if (divisor == 1) {
+    Emit({Opcode::MOV, result, left});
+  } else if (auto shift = optimize::Log2(divisor)) {
+    // Division truncates towards zero, so negative dividends are biased by
+    // 2^shift - 1 before shifting.
+    Emit({Opcode::MOV, result, left});
+    Emit({Opcode::SAR, result, Immediate{63}});
+    Emit({Opcode::SHR, result, Immediate{64 - *shift}});
+    Emit({Opcode::ADD, result, left});
+    Emit({Opcode::SAR, result, Immediate{*shift}});
+    if (divisor < 0) Emit({Opcode::NEG, result});
+  } else {
+    const auto magic = optimize::SignedDivisionMagic(divisor);
+    Emit({Opcode::MOV, kRax, Immediate{magic.multiplier}});
+    Emit({Opcode::WIDEMUL, left});
+    Emit({Opcode::MOV, result, kRdx});
+    if (divisor > 0 && magic.multiplier < 0) {
+      Emit({Opcode::ADD, result, left});
+    } else if (divisor < 0 && magic.multiplier > 0) {
+      Emit({Opcode::SUB, result, left});
+    }
+    if (magic.shift > 0) Emit({Opcode::SAR, result, Immediate{magic.shift}});
+    // Round towards zero by adding one to negative quotients.
+    const Reg sign = function_.NewRegister();
+    Emit({Opcode::MOV, sign, result});
+    Emit({Opcode::SHR, sign, Immediate{63}});
+    Emit({Opcode::ADD, result, sign});
+  }
+  Emit({Opcode::MOV, output, result});
+}
+
+Reg Lowerer::Address(const Memory& address) {
+  if (!address.index && !address.slot && address.displacement == 0 &&
+      address.base.id >= kFirstVirtual) {
+    return address.base;
+  }
+  const Reg result = function_.NewRegister();
+  Emit({Opcode::LEA, result, address});
+  return result;
+}
+
+void Lowerer::Move(const Memory& output, const Memory& source) {
+  const Reg data = function_.NewRegister(), size = function_.NewRegister();
+  Emit({Opcode::MOV, data, source});
+  Emit({Opcode::MOV, size, Offset(source, 8)});
+  Emit({Opcode::MOV, output, data});
+  Emit({Opcode::MOV, Offset(output, 8), size});
+}
+
+void Lowerer::Copy(const Memory& output, const Memory& source,
+                   std::int64_t depth) {
+  EmitCall("gelcopy", {Address(output), Address(source), Immediate{depth}});
+}
+
+void Lowerer::Destroy(const Memory& array, std::int64_t depth) {
+  EmitCall("geldestroy", {Address(array), Immediate{depth}});
+}
+
+void Lowerer::PushScope() { scopes_.emplace_back(); }
+
+void Lowerer::PopScope() {
+  DestroyScopes(1);
+  scopes_.pop_back();
+}
+
+void Lowerer::DefineVariable(std::string name, types::Type type, Operand place,
+                             bool borrowed, bool owned) {
+  scopes_.back().push_back(Variable{std::move(name), std::move(type),
+                                    std::move(place), borrowed, owned});
+}
+
+const Lowerer::Variable& Lowerer::LookupVariable(
+    std::string_view name) const {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = std::find_if(i->rbegin(), i->rend(),
+                          [&](auto& variable) { return variable.name == name; });
+    if (j != i->rend()) return *j;
+  }
+  throw std::logic_error("Undefined variable " + std::string{name} + ".");
+}
+
+void Lowerer::DestroyScopes(std::size_t count) {
+  for (auto i = scopes_.rbegin(), end = i + static_cast<std::ptrdiff_t>(count);
+       i != end; ++i) {
+    for (auto j = i->rbegin(); j != i->rend(); ++j) {
+      if (!j->owned || j->name == named_return_ ||
+          !j->type.is<types::Array>()) {
+        continue;
+      }
+      Destroy(std::get<Memory>(j->place), Depth(j->type));
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<Function> Lower(const analysis::AnnotatedAst::TopLevel& top_level,
+                            const ownership::Info& ownership,
+                            const bounds::Info& bounds,
+                            const Options& options) {
+  std::vector<Function> functions;
+  Lowerer{ownership, bounds, options, &functions}.LowerAnyTopLevel(top_level);
+  return functions;
+}
+
+void Compile(const std::vector<types::Type>&,
+             const analysis::AnnotatedAst::TopLevel& top_level,
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output) {
+  *output << kHeader << (options.copy_on_write ? kSharedArrays : kArrays)
+          << "\n# Start of user code.\n";
+  for (const auto& function : Lower(top_level, ownership, bounds, options))
+    *output << '\n' << function;
+  *output << kFooter;
+}
+
+}  // namespace target::x86_64
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "analysis.h"
+#include "ast.h"
+#include "bounds.h"
+#include "ownership.h"
+#include "x86-64.h"
+
+#include <iostream>
+#include <vector>
+
+namespace target::x86_64 {
+
+struct Options {
+  // Represent arrays as reference-counted buffers which are shared between
+  // copies, as for the C target.
+  bool copy_on_write = false;
+};
+
+// Lower each function in the program to machine instructions with registers
+// allocated. Arrays are managed by calls to the runtime functions gelalloc,
+// gelcopy, geldestroy and gelunshare, output goes through gel_print,
+// failed bounds checks call gelindexerror and element-wise operations on
+// arrays of different sizes call gelsizeerror.
+std::vector<Function> Lower(const analysis::AnnotatedAst::TopLevel& top_level,
+                            const ownership::Info& ownership,
+                            const bounds::Info& bounds, const Options& options);
+
+// Emit a complete program as GNU assembly for x86-64 Linux. The output
+// includes a small runtime which talks to the kernel directly, so it can be
+// assembled and linked without a C compiler or C library.
+void Compile(const std::vector<types::Type>& types,
+             const analysis::AnnotatedAst::TopLevel& top_level,
+             const ownership::Info& ownership, const bounds::Info& bounds,
+             const Options& options, std::ostream* output);
+
+}  // namespace target::x86_64
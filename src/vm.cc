@@ -0,0 +1,1161 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+namespace vm {
+namespace {
+
+// Returns the comparison which holds exactly when the given one doesn't.
+ast::Compare Negate(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return ast::Compare::NOT_EQUAL;
+    case ast::Compare::GREATER_OR_EQUAL: return ast::Compare::LESS_THAN;
+    case ast::Compare::GREATER_THAN: return ast::Compare::LESS_OR_EQUAL;
+    case ast::Compare::LESS_OR_EQUAL: return ast::Compare::GREATER_THAN;
+    case ast::Compare::LESS_THAN: return ast::Compare::GREATER_OR_EQUAL;
+    case ast::Compare::NOT_EQUAL: return ast::Compare::EQUAL;
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+// Returns the comparison which gives the same result with the operands
+// swapped.
+ast::Compare Mirror(ast::Compare operation) {
+  switch (operation) {
+    case ast::Compare::EQUAL: return ast::Compare::EQUAL;
+    case ast::Compare::GREATER_OR_EQUAL: return ast::Compare::LESS_OR_EQUAL;
+    case ast::Compare::GREATER_THAN: return ast::Compare::LESS_THAN;
+    case ast::Compare::LESS_OR_EQUAL: return ast::Compare::GREATER_OR_EQUAL;
+    case ast::Compare::LESS_THAN: return ast::Compare::GREATER_THAN;
+    case ast::Compare::NOT_EQUAL: return ast::Compare::NOT_EQUAL;
+  }
+  throw std::logic_error("Invalid comparison.");
+}
+
+bool IsCommutative(ast::Arithmetic operation) {
+  return operation == ast::Arithmetic::ADD ||
+         operation == ast::Arithmetic::MULTIPLY;
+}
+
+// Returns true if the last statement in the block is a return statement, in
+// which case the end of the block is unreachable.
+bool EndsWithReturn(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  if (statements.empty()) return false;
+  return statements.back().is<analysis::AnnotatedAst::ReturnVoid>() ||
+         statements.back().is<analysis::AnnotatedAst::Return>();
+}
+
+bool IsArray(const analysis::AnnotatedAst::Expression& expression) {
+  return analysis::AnnotatedAst::GetMeta(expression).type.is<types::Array>();
+}
+
+class Compiler {
+ public:
+  Compiler(const ownership::Info& ownership, const bounds::Info& bounds,
+           Program* program)
+      : ownership_(&ownership), bounds_(&bounds), program_(program) {}
+
+  // Emit code to store the value of the given expression in the output
+  // register. Arrays are stored as a new reference, so the output must not
+  // already hold one. The output is only written once the operands have been
+  // read, so the expression may read the previous value of the output.
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Identifier&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Boolean&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Integer&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::ArrayLiteral&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Arithmetic&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Compare&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Logical&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::FunctionCall&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::LogicalNot&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Index&);
+  void CompileExpression(std::uint32_t output,
+                         const analysis::AnnotatedAst::Size&);
+  void CompileAnyExpression(std::uint32_t output,
+                            const analysis::AnnotatedAst::Expression&);
+
+  // Emit code to execute the given statement.
+  void CompileStatement(const analysis::AnnotatedAst::DefineVariable&);
+  void CompileStatement(const analysis::AnnotatedAst::Assign&);
+  void CompileStatement(const analysis::AnnotatedAst::AssignElement&);
+  void CompileStatement(const analysis::AnnotatedAst::DoFunction&);
+  void CompileStatement(const analysis::AnnotatedAst::If&);
+  void CompileStatement(const analysis::AnnotatedAst::While&);
+  void CompileStatement(const analysis::AnnotatedAst::ParallelFor&);
+  void CompileStatement(const analysis::AnnotatedAst::ReturnVoid&);
+  void CompileStatement(const analysis::AnnotatedAst::Return&);
+  void CompileStatement(const std::vector<analysis::AnnotatedAst::Statement>&);
+  void CompileAnyStatement(const analysis::AnnotatedAst::Statement&);
+
+  // Add the given functions to the program. Every function in the top level
+  // is declared before any code is compiled, so that calls can refer to
+  // functions which are defined later.
+  void DeclareTopLevel(const analysis::AnnotatedAst::DefineFunction&);
+  void DeclareTopLevel(
+      const std::vector<analysis::AnnotatedAst::DefineFunction>&);
+  void CompileTopLevel(const analysis::AnnotatedAst::DefineFunction&);
+  void CompileTopLevel(
+      const std::vector<analysis::AnnotatedAst::DefineFunction>&);
+  void CompileAnyTopLevel(const analysis::AnnotatedAst::TopLevel&);
+
+ private:
+  struct Variable {
+    std::string name;
+    types::Type type;
+    std::uint32_t reg;
+  };
+
+  void Emit(Opcode opcode, std::uint32_t a = 0, std::uint32_t b = 0,
+            std::int64_t c = 0);
+  std::uint32_t NewLabel();
+  void EmitLabel(std::uint32_t label);
+  void EmitJump(Opcode opcode, std::uint32_t label, std::uint32_t a = 0,
+                std::int64_t c = 0);
+
+  // Registers are allocated in a stack discipline: variables keep theirs until
+  // the end of their scope, and temporaries only until the end of the
+  // statement which uses them.
+  std::uint32_t NewRegister();
+  std::uint32_t NewRegisters(std::uint32_t count);
+
+  // Emit code for a scalar expression and return the register which holds its
+  // value. This is either the register of a variable or a new register.
+  std::uint32_t CompileOperand(const analysis::AnnotatedAst::Expression&);
+  // Emit a branch to the label which is taken when the condition has the
+  // given value. Comparisons and logical operators become compare-and-branch
+  // instructions without materializing any boolean values.
+  void CompileCondition(const analysis::AnnotatedAst::Expression&, bool value,
+                        std::uint32_t label);
+  // Emit code to locate an array and return the register which refers to it.
+  // Arrays held in variables are used in place. Other arrays are computed into
+  // temporaries which are added to the list and must be destroyed by the
+  // caller once the array is no longer used.
+  std::uint32_t CompilePlace(const analysis::AnnotatedAst::Expression&,
+                             std::vector<std::uint32_t>* temporaries);
+  void DestroyTemporaries(const std::vector<std::uint32_t>& temporaries);
+
+  void PushScope();
+  void PopScope();
+  void DefineVariable(std::string name, types::Type type, std::uint32_t reg);
+  const Variable& LookupVariable(std::string_view name) const;
+  // Emit code to destroy the arrays in the given number of innermost scopes.
+  void DestroyScopes(std::size_t count);
+
+  const ownership::Info* ownership_;
+  const bounds::Info* bounds_;
+  Program* program_;
+  std::map<std::string, std::uint32_t, std::less<>> function_indices_;
+  std::vector<std::vector<Variable>> scopes_;
+  // Properties of the function which is being compiled.
+  std::uint32_t next_register_ = 0;
+  std::uint32_t frame_size_ = 0;
+  // The position of each label, and the jumps which target each label.
+  std::vector<std::size_t> labels_;
+  std::vector<std::pair<std::size_t, std::uint32_t>> jumps_;
+};
+
+void Compiler::CompileExpression(
+    std::uint32_t output,
+    const analysis::AnnotatedAst::Identifier& identifier) {
+  const auto& source = LookupVariable(identifier.name);
+  if (!identifier.type.is<types::Array>()) {
+    if (source.reg != output) Emit(Opcode::MOVE, output, source.reg);
+  } else if (ownership_->moves.count(&identifier)) {
+    Emit(Opcode::TAKE, output, source.reg);
+  } else {
+    Emit(Opcode::COPY, output, source.reg);
+  }
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::Boolean& boolean) {
+  Emit(Opcode::CONSTANT, output, 0, boolean.value ? 1 : 0);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::Integer& integer) {
+  Emit(Opcode::CONSTANT, output, 0, integer.value);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::ArrayLiteral& array) {
+  const auto count = static_cast<std::uint32_t>(array.parts.size());
+  const auto parts = NewRegisters(count);
+  for (std::uint32_t i = 0; i < count; i++)
+    CompileAnyExpression(parts + i, array.parts[i]);
+  const bool nested =
+      array.type.get_if<types::Array>()->element_type.is<types::Array>();
+  Emit(nested ? Opcode::NESTED_ARRAY : Opcode::ARRAY, output, parts, count);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::Arithmetic& binary) {
+  auto opcode = Opcode::ADD, immediate = Opcode::ADD_IMMEDIATE,
+       elementwise = Opcode::ARRAY_ADD;
+  switch (binary.operation) {
+    case ast::Arithmetic::ADD:
+      opcode = Opcode::ADD;
+      immediate = Opcode::ADD_IMMEDIATE;
+      elementwise = Opcode::ARRAY_ADD;
+      break;
+    case ast::Arithmetic::DIVIDE:
+      opcode = Opcode::DIVIDE;
+      immediate = Opcode::DIVIDE_IMMEDIATE;
+      elementwise = Opcode::ARRAY_DIVIDE;
+      break;
+    case ast::Arithmetic::MULTIPLY:
+      opcode = Opcode::MULTIPLY;
+      immediate = Opcode::MULTIPLY_IMMEDIATE;
+      elementwise = Opcode::ARRAY_MULTIPLY;
+      break;
+    case ast::Arithmetic::SUBTRACT:
+      opcode = Opcode::SUBTRACT;
+      immediate = Opcode::SUBTRACT_IMMEDIATE;
+      elementwise = Opcode::ARRAY_SUBTRACT;
+      break;
+  }
+  if (binary.type.is<types::Array>()) {
+    std::vector<std::uint32_t> temporaries;
+    const auto a = CompilePlace(binary.left, &temporaries);
+    const auto b = CompilePlace(binary.right, &temporaries);
+    Emit(elementwise, output, a, b);
+    DestroyTemporaries(temporaries);
+    return;
+  }
+  // Constant operands are encoded in the instruction.
+  const auto* left = binary.left.get_if<analysis::AnnotatedAst::Integer>();
+  const auto* right = binary.right.get_if<analysis::AnnotatedAst::Integer>();
+  if (right) {
+    Emit(immediate, output, CompileOperand(binary.left), right->value);
+  } else if (left && IsCommutative(binary.operation)) {
+    Emit(immediate, output, CompileOperand(binary.right), left->value);
+  } else {
+    const auto a = CompileOperand(binary.left);
+    const auto b = CompileOperand(binary.right);
+    Emit(opcode, output, a, b);
+  }
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::Compare& binary) {
+  const bool elementwise = binary.type.is<types::Array>();
+  std::vector<std::uint32_t> temporaries;
+  auto left = elementwise ? CompilePlace(binary.left, &temporaries)
+                          : CompileOperand(binary.left);
+  auto right = elementwise ? CompilePlace(binary.right, &temporaries)
+                           : CompileOperand(binary.right);
+  auto opcode = Opcode::EQUAL;
+  switch (binary.operation) {
+    case ast::Compare::EQUAL: opcode = Opcode::EQUAL; break;
+    case ast::Compare::NOT_EQUAL: opcode = Opcode::NOT_EQUAL; break;
+    case ast::Compare::LESS_THAN: opcode = Opcode::LESS; break;
+    case ast::Compare::LESS_OR_EQUAL: opcode = Opcode::LESS_OR_EQUAL; break;
+    case ast::Compare::GREATER_THAN:
+      opcode = Opcode::LESS;
+      std::swap(left, right);
+      break;
+    case ast::Compare::GREATER_OR_EQUAL:
+      opcode = Opcode::LESS_OR_EQUAL;
+      std::swap(left, right);
+      break;
+  }
+  if (elementwise) {
+    // The element-wise comparisons are in the same order as the scalar ones.
+    static_assert(static_cast<int>(Opcode::ARRAY_LESS_OR_EQUAL) -
+                      static_cast<int>(Opcode::ARRAY_EQUAL) ==
+                  static_cast<int>(Opcode::LESS_OR_EQUAL) -
+                      static_cast<int>(Opcode::EQUAL));
+    opcode = static_cast<Opcode>(static_cast<int>(opcode) -
+                                 static_cast<int>(Opcode::EQUAL) +
+                                 static_cast<int>(Opcode::ARRAY_EQUAL));
+  }
+  Emit(opcode, output, left, right);
+  DestroyTemporaries(temporaries);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::Logical& binary) {
+  // The right operand may read the output, so the result is computed
+  // separately.
+  const auto result = NewRegister();
+  const auto end = NewLabel();
+  CompileAnyExpression(result, binary.left);
+  EmitJump(binary.operation == ast::Logical::AND ? Opcode::JUMP_IF_FALSE
+                                                 : Opcode::JUMP_IF_TRUE,
+           end, result);
+  CompileAnyExpression(result, binary.right);
+  EmitLabel(end);
+  Emit(Opcode::MOVE, output, result);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::FunctionCall& call) {
+  if (call.function == "print") {
+    Emit(Opcode::PRINT, CompileOperand(call.arguments[0]));
+    return;
+  }
+  const auto count = static_cast<std::uint32_t>(call.arguments.size());
+  const auto arguments = NewRegisters(count);
+  for (std::uint32_t i = 0; i < count; i++)
+    CompileAnyExpression(arguments + i, call.arguments[i]);
+  auto function = function_indices_.find(call.function);
+  if (function == function_indices_.end())
+    throw std::logic_error("Call to undefined function " + call.function + ".");
+  Emit(Opcode::CALL, output, arguments, function->second);
+}
+
+void Compiler::CompileExpression(
+    std::uint32_t output, const analysis::AnnotatedAst::LogicalNot& op) {
+  CompileAnyExpression(output, op.argument);
+  Emit(Opcode::NOT, output, output);
+}
+
+void Compiler::CompileExpression(std::uint32_t output,
+                                 const analysis::AnnotatedAst::Index& index) {
+  std::vector<std::uint32_t> temporaries;
+  const auto array = CompilePlace(index.array, &temporaries);
+  const auto offset = CompileOperand(index.index);
+  const bool checked = !bounds_->loads.count(&index);
+  const auto opcode =
+      index.type.is<types::Array>()
+          ? (checked ? Opcode::LOAD_ARRAY : Opcode::LOAD_ARRAY_UNCHECKED)
+          : (checked ? Opcode::LOAD : Opcode::LOAD_UNCHECKED);
+  Emit(opcode, output, array, offset);
+  DestroyTemporaries(temporaries);
+}
+
+void Compiler::CompileExpression(std::uint32_t output,
+                                 const analysis::AnnotatedAst::Size& size) {
+  std::vector<std::uint32_t> temporaries;
+  Emit(Opcode::SIZE, output, CompilePlace(size.array, &temporaries));
+  DestroyTemporaries(temporaries);
+}
+
+void Compiler::CompileAnyExpression(
+    std::uint32_t output,
+    const analysis::AnnotatedAst::Expression& expression) {
+  expression.visit(
+      [&](const auto& node) { CompileExpression(output, node); });
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::DefineVariable& definition) {
+  // The initializer may refer to a variable of the same name in an enclosing
+  // scope, so the new variable is only brought into scope afterwards.
+  const auto reg = NewRegister();
+  CompileAnyExpression(reg, definition.value);
+  DefineVariable(definition.variable.name, definition.variable.type, reg);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::Assign& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  if (!variable.type.is<types::Array>()) {
+    CompileAnyExpression(variable.reg, assignment.value);
+    return;
+  }
+  // The old value can only be released once the new value has been computed,
+  // since the computation may read it.
+  const auto value = NewRegister();
+  CompileAnyExpression(value, assignment.value);
+  Emit(Opcode::DESTROY, variable.reg);
+  Emit(Opcode::MOVE, variable.reg, value);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::AssignElement& assignment) {
+  const auto& variable = LookupVariable(assignment.variable.name);
+  const auto index = CompileOperand(assignment.index);
+  const bool checked = !bounds_->stores.count(&assignment);
+  if (IsArray(assignment.value)) {
+    const auto value = NewRegister();
+    CompileAnyExpression(value, assignment.value);
+    Emit(checked ? Opcode::STORE_ARRAY : Opcode::STORE_ARRAY_UNCHECKED,
+         variable.reg, index, value);
+  } else {
+    Emit(checked ? Opcode::STORE : Opcode::STORE_UNCHECKED, variable.reg,
+         index, CompileOperand(assignment.value));
+  }
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::DoFunction& do_function) {
+  const auto ignored_result = NewRegister();
+  CompileExpression(ignored_result, do_function.function_call);
+  if (do_function.function_call.type.is<types::Array>())
+    Emit(Opcode::DESTROY, ignored_result);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::If& if_statement) {
+  const auto if_false = NewLabel(), end = NewLabel();
+  CompileCondition(if_statement.condition, false, if_false);
+  CompileStatement(if_statement.if_true);
+  if (!if_statement.if_false.empty()) EmitJump(Opcode::JUMP, end);
+  EmitLabel(if_false);
+  CompileStatement(if_statement.if_false);
+  EmitLabel(end);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::While& while_statement) {
+  // The condition is placed after the body so that each iteration only
+  // dispatches a single branch.
+  const auto body = NewLabel(), condition = NewLabel();
+  EmitJump(Opcode::JUMP, condition);
+  EmitLabel(body);
+  CompileStatement(while_statement.body);
+  EmitLabel(condition);
+  CompileCondition(while_statement.condition, true, body);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::ParallelFor& parallel_for) {
+  // The iterations are independent, so running them in order is correct.
+  const auto index = NewRegister(), end = NewRegister();
+  CompileAnyExpression(index, parallel_for.begin);
+  CompileAnyExpression(end, parallel_for.end);
+  const auto body = NewLabel(), condition = NewLabel();
+  EmitJump(Opcode::JUMP, condition);
+  EmitLabel(body);
+  PushScope();
+  DefineVariable(parallel_for.variable.name, types::Primitive::INTEGER, index);
+  CompileStatement(parallel_for.body);
+  PopScope();
+  Emit(Opcode::ADD_IMMEDIATE, index, index, 1);
+  EmitLabel(condition);
+  EmitJump(Opcode::JUMP_IF_LESS, body, index, end);
+}
+
+void Compiler::CompileStatement(const analysis::AnnotatedAst::ReturnVoid&) {
+  const auto result = NewRegister();
+  Emit(Opcode::CONSTANT, result, 0, 0);
+  DestroyScopes(scopes_.size());
+  Emit(Opcode::RETURN, result);
+}
+
+void Compiler::CompileStatement(
+    const analysis::AnnotatedAst::Return& return_statement) {
+  std::uint32_t result;
+  if (IsArray(return_statement.value)) {
+    result = NewRegister();
+    CompileAnyExpression(result, return_statement.value);
+  } else {
+    result = CompileOperand(return_statement.value);
+  }
+  DestroyScopes(scopes_.size());
+  Emit(Opcode::RETURN, result);
+}
+
+void Compiler::CompileStatement(
+    const std::vector<analysis::AnnotatedAst::Statement>& statements) {
+  PushScope();
+  const auto start = next_register_;
+  for (const auto& statement : statements) {
+    // Temporaries are released at the end of each statement, but definitions
+    // allocate the register of the new variable first and keep it until the
+    // end of the scope.
+    const auto temporaries = next_register_;
+    CompileAnyStatement(statement);
+    next_register_ =
+        temporaries +
+        (statement.is<analysis::AnnotatedAst::DefineVariable>() ? 1 : 0);
+  }
+  if (EndsWithReturn(statements)) {
+    // The variables were already destroyed by the return statement.
+    scopes_.pop_back();
+  } else {
+    PopScope();
+  }
+  next_register_ = start;
+}
+
+void Compiler::CompileAnyStatement(
+    const analysis::AnnotatedAst::Statement& statement) {
+  statement.visit([&](const auto& x) { CompileStatement(x); });
+}
+
+void Compiler::DeclareTopLevel(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  const auto index = static_cast<std::uint32_t>(program_->functions.size());
+  function_indices_.emplace(definition.name, index);
+  program_->functions.push_back(Function{definition.name, 0, 0});
+}
+
+void Compiler::DeclareTopLevel(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) DeclareTopLevel(definition);
+}
+
+void Compiler::CompileTopLevel(
+    const analysis::AnnotatedAst::DefineFunction& definition) {
+  next_register_ = 0;
+  frame_size_ = 0;
+  labels_.clear();
+  jumps_.clear();
+  const auto start = program_->code.size();
+
+  // Parameters occupy the first registers of the frame, and are owned by the
+  // callee.
+  PushScope();
+  for (const auto& parameter : definition.parameters)
+    DefineVariable(parameter.name, parameter.type, NewRegister());
+  CompileStatement(definition.body);
+  if (EndsWithReturn(definition.body)) {
+    scopes_.pop_back();
+  } else {
+    PopScope();
+    const auto result = NewRegister();
+    Emit(Opcode::CONSTANT, result, 0, 0);
+    Emit(Opcode::RETURN, result);
+  }
+
+  for (const auto& [position, label] : jumps_) {
+    program_->code[position].b = static_cast<std::uint32_t>(labels_[label]);
+  }
+  auto& function = program_->functions[function_indices_.at(definition.name)];
+  function.entry = start;
+  function.frame_size = frame_size_;
+}
+
+void Compiler::CompileTopLevel(
+    const std::vector<analysis::AnnotatedAst::DefineFunction>& definitions) {
+  for (const auto& definition : definitions) CompileTopLevel(definition);
+}
+
+void Compiler::CompileAnyTopLevel(
+    const analysis::AnnotatedAst::TopLevel& top_level) {
+  top_level.visit([&](const auto& x) { DeclareTopLevel(x); });
+  top_level.visit([&](const auto& x) { CompileTopLevel(x); });
+}
+
+void Compiler::Emit(Opcode opcode, std::uint32_t a, std::uint32_t b,
+                    std::int64_t c) {
+  program_->code.push_back(Instruction{opcode, a, b, c});
+}
+
+std::uint32_t Compiler::NewLabel() {
+  labels_.push_back(0);
+  return static_cast<std::uint32_t>(labels_.size() - 1);
+}
+
+void Compiler::EmitLabel(std::uint32_t label) {
+  labels_[label] = program_->code.size();
+}
+
+void Compiler::EmitJump(Opcode opcode, std::uint32_t label, std::uint32_t a,
+                        std::int64_t c) {
+  jumps_.emplace_back(program_->code.size(), label);
+  Emit(opcode, a, 0, c);
+}
+
+std::uint32_t Compiler::NewRegister() { return NewRegisters(1); }
+
+std::uint32_t Compiler::NewRegisters(std::uint32_t count) {
+  const auto first = next_register_;
+  next_register_ += count;
+  frame_size_ = std::max(frame_size_, next_register_);
+  return first;
+}
+
+std::uint32_t Compiler::CompileOperand(
+    const analysis::AnnotatedAst::Expression& expression) {
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    return LookupVariable(identifier->name).reg;
+  }
+  const auto result = NewRegister();
+  CompileAnyExpression(result, expression);
+  return result;
+}
+
+void Compiler::CompileCondition(
+    const analysis::AnnotatedAst::Expression& expression, bool value,
+    std::uint32_t label) {
+  if (const auto* compare =
+          expression.get_if<analysis::AnnotatedAst::Compare>()) {
+    auto operation = value ? compare->operation : Negate(compare->operation);
+    // Constant operands are encoded in the instruction.
+    const auto* other = &compare->left;
+    const auto* constant =
+        compare->right.get_if<analysis::AnnotatedAst::Integer>();
+    if (!constant) {
+      constant = compare->left.get_if<analysis::AnnotatedAst::Integer>();
+      if (constant) {
+        other = &compare->right;
+        operation = Mirror(operation);
+      }
+    }
+    if (constant) {
+      const auto a = CompileOperand(*other);
+      auto opcode = Opcode::JUMP_IF_EQUAL_IMMEDIATE;
+      switch (operation) {
+        case ast::Compare::EQUAL:
+          opcode = Opcode::JUMP_IF_EQUAL_IMMEDIATE;
+          break;
+        case ast::Compare::NOT_EQUAL:
+          opcode = Opcode::JUMP_IF_NOT_EQUAL_IMMEDIATE;
+          break;
+        case ast::Compare::LESS_THAN:
+          opcode = Opcode::JUMP_IF_LESS_IMMEDIATE;
+          break;
+        case ast::Compare::LESS_OR_EQUAL:
+          opcode = Opcode::JUMP_IF_LESS_OR_EQUAL_IMMEDIATE;
+          break;
+        case ast::Compare::GREATER_THAN:
+          opcode = Opcode::JUMP_IF_GREATER_IMMEDIATE;
+          break;
+        case ast::Compare::GREATER_OR_EQUAL:
+          opcode = Opcode::JUMP_IF_GREATER_OR_EQUAL_IMMEDIATE;
+          break;
+      }
+      EmitJump(opcode, label, a, constant->value);
+      return;
+    }
+    auto a = CompileOperand(compare->left);
+    auto c = CompileOperand(compare->right);
+    auto opcode = Opcode::JUMP_IF_EQUAL;
+    switch (operation) {
+      case ast::Compare::EQUAL: opcode = Opcode::JUMP_IF_EQUAL; break;
+      case ast::Compare::NOT_EQUAL: opcode = Opcode::JUMP_IF_NOT_EQUAL; break;
+      case ast::Compare::LESS_THAN: opcode = Opcode::JUMP_IF_LESS; break;
+      case ast::Compare::LESS_OR_EQUAL:
+        opcode = Opcode::JUMP_IF_LESS_OR_EQUAL;
+        break;
+      case ast::Compare::GREATER_THAN:
+        opcode = Opcode::JUMP_IF_LESS;
+        std::swap(a, c);
+        break;
+      case ast::Compare::GREATER_OR_EQUAL:
+        opcode = Opcode::JUMP_IF_LESS_OR_EQUAL;
+        std::swap(a, c);
+        break;
+    }
+    EmitJump(opcode, label, a, c);
+  } else if (const auto* logical =
+                 expression.get_if<analysis::AnnotatedAst::Logical>()) {
+    // The right operand is skipped when the left operand decides the result.
+    const bool deciding = logical->operation == ast::Logical::OR;
+    if (value == deciding) {
+      CompileCondition(logical->left, value, label);
+      CompileCondition(logical->right, value, label);
+    } else {
+      const auto end = NewLabel();
+      CompileCondition(logical->left, deciding, end);
+      CompileCondition(logical->right, value, label);
+      EmitLabel(end);
+    }
+  } else if (const auto* logical_not =
+                 expression.get_if<analysis::AnnotatedAst::LogicalNot>()) {
+    CompileCondition(logical_not->argument, !value, label);
+  } else if (const auto* boolean =
+                 expression.get_if<analysis::AnnotatedAst::Boolean>()) {
+    if (boolean->value == value) EmitJump(Opcode::JUMP, label);
+  } else {
+    EmitJump(value ? Opcode::JUMP_IF_TRUE : Opcode::JUMP_IF_FALSE, label,
+             CompileOperand(expression));
+  }
+}
+
+std::uint32_t Compiler::CompilePlace(
+    const analysis::AnnotatedAst::Expression& expression,
+    std::vector<std::uint32_t>* temporaries) {
+  if (const auto* identifier =
+          expression.get_if<analysis::AnnotatedAst::Identifier>()) {
+    return LookupVariable(identifier->name).reg;
+  }
+  const auto value = NewRegister();
+  CompileAnyExpression(value, expression);
+  temporaries->push_back(value);
+  return value;
+}
+
+void Compiler::DestroyTemporaries(
+    const std::vector<std::uint32_t>& temporaries) {
+  for (auto i = temporaries.rbegin(); i != temporaries.rend(); ++i)
+    Emit(Opcode::DESTROY, *i);
+}
+
+void Compiler::PushScope() { scopes_.emplace_back(); }
+
+void Compiler::PopScope() {
+  DestroyScopes(1);
+  scopes_.pop_back();
+}
+
+void Compiler::DefineVariable(std::string name, types::Type type,
+                              std::uint32_t reg) {
+  scopes_.back().push_back(
+      Variable{std::move(name), std::move(type), reg});
+}
+
+const Compiler::Variable& Compiler::LookupVariable(
+    std::string_view name) const {
+  for (auto i = scopes_.rbegin(); i != scopes_.rend(); ++i) {
+    auto j = std::find_if(i->rbegin(), i->rend(),
+                          [&](auto& variable) { return variable.name == name; });
+    if (j != i->rend()) return *j;
+  }
+  throw std::logic_error("Undefined variable " + std::string{name} + ".");
+}
+
+void Compiler::DestroyScopes(std::size_t count) {
+  for (auto i = scopes_.rbegin(), end = i + static_cast<std::ptrdiff_t>(count);
+       i != end; ++i) {
+    for (auto j = i->rbegin(); j != i->rend(); ++j) {
+      if (j->type.is<types::Array>()) Emit(Opcode::DESTROY, j->reg);
+    }
+  }
+}
+
+// Arrays are allocated with their elements immediately after the header.
+struct Array;
+
+union Value {
+  std::int64_t integer;
+  Array* array;
+};
+
+struct Array {
+  std::int64_t references;
+  std::int64_t size;
+  // Whether the elements are themselves arrays.
+  bool nested;
+
+  Value* elements() { return reinterpret_cast<Value*>(this + 1); }
+};
+
+Array* NewArray(std::int64_t size, bool nested) {
+  auto* array = static_cast<Array*>(std::malloc(
+      sizeof(Array) + static_cast<std::size_t>(size) * sizeof(Value)));
+  if (!array) {
+    std::fputs("Out of memory.\n", stderr);
+    std::exit(EXIT_FAILURE);
+  }
+  array->references = 1;
+  array->size = size;
+  array->nested = nested;
+  return array;
+}
+
+void Release(Array* array) {
+  if (!array || --array->references > 0) return;
+  if (array->nested) {
+    for (auto i = array->size; i-- > 0;) Release(array->elements()[i].array);
+  }
+  std::free(array);
+}
+
+// Ensure that the array in the register isn't shared, so that it can be
+// modified.
+void Unshare(Value* value) {
+  Array* shared = value->array;
+  if (shared->references == 1) return;
+  Array* copy = NewArray(shared->size, shared->nested);
+  std::copy_n(shared->elements(), shared->size, copy->elements());
+  if (copy->nested) {
+    for (std::int64_t i = 0; i < copy->size; i++)
+      copy->elements()[i].array->references++;
+  }
+  shared->references--;
+  value->array = copy;
+}
+
+[[noreturn]] void IndexError(std::int64_t index, std::int64_t size) {
+  std::fprintf(stderr,
+               "Array index %lld is out of bounds for array of size %lld.\n",
+               static_cast<long long>(index), static_cast<long long>(size));
+  std::exit(EXIT_FAILURE);
+}
+
+[[noreturn]] void SizeError(std::int64_t left, std::int64_t right) {
+  std::fprintf(stderr, "Array sizes %lld and %lld do not match.\n",
+               static_cast<long long>(left), static_cast<long long>(right));
+  std::exit(EXIT_FAILURE);
+}
+
+[[noreturn]] void StackOverflow() {
+  std::fputs("Stack overflow.\n", stderr);
+  std::exit(EXIT_FAILURE);
+}
+
+void CheckIndex(std::int64_t index, const Array* array) {
+  // The index is compared as an unsigned value so that negative indices are
+  // caught by the same comparison.
+  if (static_cast<std::uint64_t>(index) >=
+      static_cast<std::uint64_t>(array->size)) {
+    IndexError(index, array->size);
+  }
+}
+
+// Integer arithmetic wraps around, as it does in the compiled targets.
+std::int64_t Wrap(std::uint64_t value) {
+  return static_cast<std::int64_t>(value);
+}
+
+std::int64_t Add(std::int64_t left, std::int64_t right) {
+  return Wrap(static_cast<std::uint64_t>(left) +
+              static_cast<std::uint64_t>(right));
+}
+
+std::int64_t Subtract(std::int64_t left, std::int64_t right) {
+  return Wrap(static_cast<std::uint64_t>(left) -
+              static_cast<std::uint64_t>(right));
+}
+
+std::int64_t Multiply(std::int64_t left, std::int64_t right) {
+  return Wrap(static_cast<std::uint64_t>(left) *
+              static_cast<std::uint64_t>(right));
+}
+
+// A new array holding op applied to each pair of elements of two arrays of
+// integers.
+template <typename Operation>
+Array* Elementwise(Array* left, Array* right, Operation op) {
+  if (left->size != right->size) SizeError(left->size, right->size);
+  Array* result = NewArray(left->size, false);
+  const Value* a = left->elements();
+  const Value* b = right->elements();
+  Value* out = result->elements();
+  for (std::int64_t i = 0; i < left->size; i++)
+    out[i].integer = op(a[i].integer, b[i].integer);
+  return result;
+}
+
+// The number of registers available to all frames together.
+constexpr std::size_t kStackSize = std::size_t{1} << 24;
+
+// A bytecode instruction with its opcode replaced by the address of its
+// handler, so that each handler can jump directly to the next.
+struct Threaded {
+  const void* handler;
+  std::uint32_t a, b;
+  std::int64_t c;
+};
+
+struct Call {
+  // The CALL instruction and the frame of the caller.
+  const Threaded* instruction;
+  Value* frame;
+};
+
+}  // namespace
+
+Program Compile(const analysis::AnnotatedAst::TopLevel& top_level,
+                const ownership::Info& ownership, const bounds::Info& bounds) {
+  Program program;
+  Compiler{ownership, bounds, &program}.CompileAnyTopLevel(top_level);
+  return program;
+}
+
+// Handlers are addressed with the labels-as-values extension.
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+int Run(const Program& program) {
+  // The handler for each opcode, in the order of the enumeration.
+  static const void* const kHandlers[] = {
+      &&CONSTANT,
+      &&MOVE,
+      &&TAKE,
+      &&COPY,
+      &&DESTROY,
+      &&ADD,
+      &&SUBTRACT,
+      &&MULTIPLY,
+      &&DIVIDE,
+      &&ADD_IMMEDIATE,
+      &&SUBTRACT_IMMEDIATE,
+      &&MULTIPLY_IMMEDIATE,
+      &&DIVIDE_IMMEDIATE,
+      &&EQUAL,
+      &&NOT_EQUAL,
+      &&LESS,
+      &&LESS_OR_EQUAL,
+      &&NOT,
+      &&JUMP,
+      &&JUMP_IF_TRUE,
+      &&JUMP_IF_FALSE,
+      &&JUMP_IF_EQUAL,
+      &&JUMP_IF_NOT_EQUAL,
+      &&JUMP_IF_LESS,
+      &&JUMP_IF_LESS_OR_EQUAL,
+      &&JUMP_IF_EQUAL_IMMEDIATE,
+      &&JUMP_IF_NOT_EQUAL_IMMEDIATE,
+      &&JUMP_IF_LESS_IMMEDIATE,
+      &&JUMP_IF_LESS_OR_EQUAL_IMMEDIATE,
+      &&JUMP_IF_GREATER_IMMEDIATE,
+      &&JUMP_IF_GREATER_OR_EQUAL_IMMEDIATE,
+      &&ARRAY_ADD,
+      &&ARRAY_SUBTRACT,
+      &&ARRAY_MULTIPLY,
+      &&ARRAY_DIVIDE,
+      &&ARRAY_EQUAL,
+      &&ARRAY_NOT_EQUAL,
+      &&ARRAY_LESS,
+      &&ARRAY_LESS_OR_EQUAL,
+      &&ARRAY,
+      &&NESTED_ARRAY,
+      &&SIZE,
+      &&LOAD,
+      &&LOAD_UNCHECKED,
+      &&LOAD_ARRAY,
+      &&LOAD_ARRAY_UNCHECKED,
+      &&STORE,
+      &&STORE_UNCHECKED,
+      &&STORE_ARRAY,
+      &&STORE_ARRAY_UNCHECKED,
+      &&CALL,
+      &&PRINT,
+      &&RETURN,
+  };
+  static_assert(std::size(kHandlers) ==
+                static_cast<std::size_t>(Opcode::RETURN) + 1);
+
+  const auto main = std::find_if(
+      program.functions.begin(), program.functions.end(),
+      [](const Function& function) { return function.name == "main"; });
+  if (main == program.functions.end()) {
+    std::cerr << "Program has no main function.\n";
+    return 1;
+  }
+  std::vector<Threaded> code;
+  code.reserve(program.code.size());
+  for (const auto& [opcode, a, b, c] : program.code)
+    code.push_back(Threaded{kHandlers[static_cast<int>(opcode)], a, b, c});
+
+  // Registers are only initialized when they are first written, so the stack
+  // is left uninitialized.
+  std::unique_ptr<Value[]> stack{new Value[kStackSize]};
+  const Value* const stack_end = stack.get() + kStackSize;
+  std::vector<Call> calls;
+  Value* r = stack.get();
+  if (main->frame_size > kStackSize) StackOverflow();
+  const Threaded* pc = code.data() + main->entry;
+
+#define DISPATCH() goto* pc->handler
+#define NEXT() goto*(++pc)->handler
+#define BRANCH(condition)                  \
+  do {                                     \
+    if (condition) {                       \
+      pc = code.data() + pc->b;            \
+      DISPATCH();                          \
+    }                                      \
+    NEXT();                                \
+  } while (false)
+#define A r[pc->a]
+#define B r[pc->b]
+#define C r[pc->c]
+
+  DISPATCH();
+CONSTANT:
+  A.integer = pc->c;
+  NEXT();
+MOVE:
+  A = B;
+  NEXT();
+TAKE:
+  A = B;
+  B.array = nullptr;
+  NEXT();
+COPY:
+  A = B;
+  if (A.array) A.array->references++;
+  NEXT();
+DESTROY:
+  Release(A.array);
+  NEXT();
+ADD:
+  A.integer = Add(B.integer, C.integer);
+  NEXT();
+SUBTRACT:
+  A.integer = Subtract(B.integer, C.integer);
+  NEXT();
+MULTIPLY:
+  A.integer = Multiply(B.integer, C.integer);
+  NEXT();
+DIVIDE:
+  A.integer = B.integer / C.integer;
+  NEXT();
+ADD_IMMEDIATE:
+  A.integer = Add(B.integer, pc->c);
+  NEXT();
+SUBTRACT_IMMEDIATE:
+  A.integer = Subtract(B.integer, pc->c);
+  NEXT();
+MULTIPLY_IMMEDIATE:
+  A.integer = Multiply(B.integer, pc->c);
+  NEXT();
+DIVIDE_IMMEDIATE:
+  A.integer = B.integer / pc->c;
+  NEXT();
+EQUAL:
+  A.integer = B.integer == C.integer;
+  NEXT();
+NOT_EQUAL:
+  A.integer = B.integer != C.integer;
+  NEXT();
+LESS:
+  A.integer = B.integer < C.integer;
+  NEXT();
+LESS_OR_EQUAL:
+  A.integer = B.integer <= C.integer;
+  NEXT();
+NOT:
+  A.integer = 1 - B.integer;
+  NEXT();
+JUMP:
+  pc = code.data() + pc->b;
+  DISPATCH();
+JUMP_IF_TRUE:
+  BRANCH(A.integer);
+JUMP_IF_FALSE:
+  BRANCH(!A.integer);
+JUMP_IF_EQUAL:
+  BRANCH(A.integer == C.integer);
+JUMP_IF_NOT_EQUAL:
+  BRANCH(A.integer != C.integer);
+JUMP_IF_LESS:
+  BRANCH(A.integer < C.integer);
+JUMP_IF_LESS_OR_EQUAL:
+  BRANCH(A.integer <= C.integer);
+JUMP_IF_EQUAL_IMMEDIATE:
+  BRANCH(A.integer == pc->c);
+JUMP_IF_NOT_EQUAL_IMMEDIATE:
+  BRANCH(A.integer != pc->c);
+JUMP_IF_LESS_IMMEDIATE:
+  BRANCH(A.integer < pc->c);
+JUMP_IF_LESS_OR_EQUAL_IMMEDIATE:
+  BRANCH(A.integer <= pc->c);
+JUMP_IF_GREATER_IMMEDIATE:
+  BRANCH(A.integer > pc->c);
+JUMP_IF_GREATER_OR_EQUAL_IMMEDIATE:
+  BRANCH(A.integer >= pc->c);
+ARRAY_ADD:
+  A.array = Elementwise(B.array, C.array, Add);
+  NEXT();
+ARRAY_SUBTRACT:
+  A.array = Elementwise(B.array, C.array, Subtract);
+  NEXT();
+ARRAY_MULTIPLY:
+  A.array = Elementwise(B.array, C.array, Multiply);
+  NEXT();
+ARRAY_DIVIDE:
+  A.array = Elementwise(B.array, C.array, std::divides<std::int64_t>{});
+  NEXT();
+ARRAY_EQUAL:
+  A.array = Elementwise(B.array, C.array, std::equal_to<std::int64_t>{});
+  NEXT();
+ARRAY_NOT_EQUAL:
+  A.array = Elementwise(B.array, C.array, std::not_equal_to<std::int64_t>{});
+  NEXT();
+ARRAY_LESS:
+  A.array = Elementwise(B.array, C.array, std::less<std::int64_t>{});
+  NEXT();
+ARRAY_LESS_OR_EQUAL:
+  A.array = Elementwise(B.array, C.array, std::less_equal<std::int64_t>{});
+  NEXT();
+ARRAY: {
+  Array* array = NewArray(pc->c, false);
+  std::copy_n(&B, pc->c, array->elements());
+  A.array = array;
+  NEXT();
+}
+NESTED_ARRAY: {
+  Array* array = NewArray(pc->c, true);
+  std::copy_n(&B, pc->c, array->elements());
+  A.array = array;
+  NEXT();
+}
+SIZE:
+  A.integer = B.array->size;
+  NEXT();
+LOAD:
+  CheckIndex(C.integer, B.array);
+LOAD_UNCHECKED:
+  A = B.array->elements()[C.integer];
+  NEXT();
+LOAD_ARRAY:
+  CheckIndex(C.integer, B.array);
+LOAD_ARRAY_UNCHECKED:
+  A = B.array->elements()[C.integer];
+  A.array->references++;
+  NEXT();
+STORE:
+  CheckIndex(B.integer, A.array);
+STORE_UNCHECKED:
+  Unshare(&A);
+  A.array->elements()[B.integer] = C;
+  NEXT();
+STORE_ARRAY:
+  CheckIndex(B.integer, A.array);
+STORE_ARRAY_UNCHECKED: {
+  Unshare(&A);
+  Value& element = A.array->elements()[B.integer];
+  Release(element.array);
+  element = C;
+  NEXT();
+}
+CALL: {
+  const auto& callee = program.functions[static_cast<std::size_t>(pc->c)];
+  Value* frame = r + pc->b;
+  if (callee.frame_size > static_cast<std::size_t>(stack_end - frame))
+    StackOverflow();
+  calls.push_back(Call{pc, r});
+  r = frame;
+  pc = code.data() + callee.entry;
+  DISPATCH();
+}
+PRINT:
+  std::printf("%lld\n", static_cast<long long>(A.integer));
+  NEXT();
+RETURN: {
+  const Value result = A;
+  if (calls.empty()) {
+    std::fflush(stdout);
+    return static_cast<int>(result.integer);
+  }
+  pc = calls.back().instruction;
+  r = calls.back().frame;
+  calls.pop_back();
+  A = result;
+  NEXT();
+}
+
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+#undef A
+#undef B
+#undef C
+}
+
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+}  // namespace vm
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "analysis.h"
+#include "ast.h"
+#include "bounds.h"
+#include "ownership.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vm {
+
+// Each function runs in a frame of registers, which start with its parameters.
+// Registers hold integers, booleans as 0 or 1, or references to arrays. Arrays
+// are reference counted and shared between copies, and are only duplicated
+// when a shared array is modified. A register which owns a reference may also
+// be empty, in which case releasing it has no effect.
+//
+// In the descriptions below, a and b are registers. c is a register, an
+// immediate value or a function index depending on the opcode. Jump targets
+// are always in b, as an index into the code.
+enum class Opcode : std::uint8_t {
+  // a = c.
+  CONSTANT,
+  // a = b.
+  MOVE,
+  // a = b, leaving b empty. Transfers a reference without counting it.
+  TAKE,
+  // a = b, adding a reference to the array in b.
+  COPY,
+  // Release the reference held by a.
+  DESTROY,
+
+  // a = b op c, where c is a register.
+  ADD,
+  SUBTRACT,
+  MULTIPLY,
+  DIVIDE,
+  // a = b op c, where c is an immediate.
+  ADD_IMMEDIATE,
+  SUBTRACT_IMMEDIATE,
+  MULTIPLY_IMMEDIATE,
+  DIVIDE_IMMEDIATE,
+  // a = 1 if b op c, otherwise 0. Greater-than comparisons swap the operands.
+  EQUAL,
+  NOT_EQUAL,
+  LESS,
+  LESS_OR_EQUAL,
+  // a = 1 - b.
+  NOT,
+
+  JUMP,
+  // Jump if a is 1 or 0 respectively.
+  JUMP_IF_TRUE,
+  JUMP_IF_FALSE,
+  // Compare-and-branch superinstructions: jump if a op c, where c is
+  // a register.
+  JUMP_IF_EQUAL,
+  JUMP_IF_NOT_EQUAL,
+  JUMP_IF_LESS,
+  JUMP_IF_LESS_OR_EQUAL,
+  // Jump if a op c, where c is an immediate.
+  JUMP_IF_EQUAL_IMMEDIATE,
+  JUMP_IF_NOT_EQUAL_IMMEDIATE,
+  JUMP_IF_LESS_IMMEDIATE,
+  JUMP_IF_LESS_OR_EQUAL_IMMEDIATE,
+  JUMP_IF_GREATER_IMMEDIATE,
+  JUMP_IF_GREATER_OR_EQUAL_IMMEDIATE,
+
+  // a = a new array of b op c for each pair of elements of the arrays in b
+  // and c, which must have the same size. Greater-than comparisons swap the
+  // operands.
+  ARRAY_ADD,
+  ARRAY_SUBTRACT,
+  ARRAY_MULTIPLY,
+  ARRAY_DIVIDE,
+  ARRAY_EQUAL,
+  ARRAY_NOT_EQUAL,
+  ARRAY_LESS,
+  ARRAY_LESS_OR_EQUAL,
+  // a = a new array of the c values in the registers starting at b, which are
+  // moved into it. NESTED_ARRAY builds an array whose elements are arrays.
+  ARRAY,
+  NESTED_ARRAY,
+  // a = the number of elements in the array in b.
+  SIZE,
+  // a = element c of the array in b, where c is a register. LOAD_ARRAY adds
+  // a reference to the element. The unchecked forms are used for indices
+  // which are known to be in bounds.
+  LOAD,
+  LOAD_UNCHECKED,
+  LOAD_ARRAY,
+  LOAD_ARRAY_UNCHECKED,
+  // Set element b of the array in a to c, where b and c are registers, first
+  // duplicating the array if it is shared. STORE_ARRAY releases the old
+  // element and moves the new one out of c.
+  STORE,
+  STORE_UNCHECKED,
+  STORE_ARRAY,
+  STORE_ARRAY_UNCHECKED,
+
+  // Call function c with a frame starting at register b, which holds the
+  // arguments. The callee takes ownership of them, and its result is stored
+  // in a.
+  CALL,
+  PRINT,
+  // Return the value in a, whose ownership passes to the caller.
+  RETURN,
+};
+
+struct Instruction {
+  Opcode opcode;
+  std::uint32_t a = 0, b = 0;
+  std::int64_t c = 0;
+};
+
+struct Function {
+  std::string name;
+  // The index of the first instruction of the function.
+  std::size_t entry;
+  // The number of registers in each frame.
+  std::uint32_t frame_size;
+};
+
+struct Program {
+  std::vector<Instruction> code;
+  std::vector<Function> functions;
+};
+
+// Compile a checked program to bytecode.
+Program Compile(const analysis::AnnotatedAst::TopLevel& top_level,
+                const ownership::Info& ownership, const bounds::Info& bounds);
+
+// Run the main function of the program with a direct-threaded interpreter and
+// return its exit status.
+int Run(const Program& program);
+
+}  // namespace vm
@@ -0,0 +1,1120 @@
+#include "x86-64.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string_view>
+
+namespace target::x86_64 {
+
+const Register kArgumentRegisters[6] = {
+    Register::RDI, Register::RSI, Register::RDX,
+    Register::RCX, Register::R8,  Register::R9,
+};
+
+Memory Offset(Memory address, std::int32_t bytes) {
+  address.displacement += bytes;
+  return address;
+}
+
+Condition Negate(Condition condition) {
+  // Conditions come in pairs which differ only in the lowest bit.
+  return static_cast<Condition>(static_cast<std::uint8_t>(condition) ^ 1);
+}
+
+Memory Function::NewSlot(std::int32_t size) {
+  slots.push_back(size);
+  return Memory{Physical(Register::RBP), std::nullopt, 1, 0,
+                static_cast<std::uint32_t>(slots.size() - 1)};
+}
+
+namespace {
+
+// R10 and R11 are never allocated, so that they are always available for
+// accessing spilled values.
+constexpr Register kScratch[] = {Register::R10, Register::R11};
+
+// Registers in the order in which they are preferred by the allocator. Values
+// which live across calls can only use the callee-saved ones at the end.
+constexpr Register kAllocatable[] = {
+    Register::RAX, Register::RCX, Register::RDX, Register::RSI,
+    Register::RDI, Register::R8,  Register::R9,  Register::RBX,
+    Register::R12, Register::R13, Register::R14, Register::R15,
+};
+
+constexpr Register kCalleeSaved[] = {
+    Register::RBX, Register::R12, Register::R13, Register::R14, Register::R15,
+};
+
+constexpr Register kCallerSaved[] = {
+    Register::RAX, Register::RCX, Register::RDX, Register::RSI, Register::RDI,
+    Register::R8,  Register::R9,  Register::R10, Register::R11,
+};
+
+bool IsCalleeSaved(Register r) {
+  return std::find(std::begin(kCalleeSaved), std::end(kCalleeSaved), r) !=
+         std::end(kCalleeSaved);
+}
+
+// Registers which take part in register allocation. The stack and frame
+// pointers and the scratch registers are managed separately.
+bool IsTracked(Reg r) {
+  if (r.id >= kFirstVirtual) return true;
+  auto physical = static_cast<Register>(r.id);
+  return physical != Register::RSP && physical != Register::RBP &&
+         physical != Register::R10 && physical != Register::R11;
+}
+
+// Apply the function to each register mentioned by the operands of the
+// instruction, in order.
+template <typename F>
+void ForEachRegister(Instruction* instruction, F f) {
+  for (Operand* operand : {&instruction->a, &instruction->b, &instruction->c}) {
+    if (auto* reg = std::get_if<Reg>(operand)) {
+      f(*reg);
+    } else if (auto* memory = std::get_if<Memory>(operand)) {
+      f(memory->base);
+      if (memory->index) f(*memory->index);
+    }
+  }
+}
+
+void AddUses(const Operand& operand, std::vector<Reg>* uses) {
+  if (const auto* reg = std::get_if<Reg>(&operand)) {
+    uses->push_back(*reg);
+  } else if (const auto* memory = std::get_if<Memory>(&operand)) {
+    uses->push_back(memory->base);
+    if (memory->index) uses->push_back(*memory->index);
+  }
+}
+
+// Determine which registers the instruction reads and writes.
+void UsesAndDefinitions(const Instruction& instruction, std::vector<Reg>* uses,
+                        std::vector<Reg>* definitions) {
+  const Reg* a = std::get_if<Reg>(&instruction.a);
+  switch (instruction.opcode) {
+    case Opcode::MOV:
+    case Opcode::LEA:
+    case Opcode::IMUL3:
+    case Opcode::SET:
+    case Opcode::POP:
+      if (a) {
+        definitions->push_back(*a);
+      } else {
+        AddUses(instruction.a, uses);
+      }
+      AddUses(instruction.b, uses);
+      break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::IMUL:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+    case Opcode::SHL:
+    case Opcode::SHR:
+    case Opcode::SAR:
+    case Opcode::NEG:
+      AddUses(instruction.a, uses);
+      AddUses(instruction.b, uses);
+      if (a) definitions->push_back(*a);
+      break;
+    case Opcode::CMP:
+    case Opcode::TEST:
+    case Opcode::PUSH:
+    case Opcode::CHECK_INDEX:
+    case Opcode::CHECK_SIZE:
+      AddUses(instruction.a, uses);
+      AddUses(instruction.b, uses);
+      break;
+    case Opcode::WIDEMUL:
+      AddUses(instruction.a, uses);
+      uses->push_back(Physical(Register::RAX));
+      definitions->push_back(Physical(Register::RAX));
+      definitions->push_back(Physical(Register::RDX));
+      break;
+    case Opcode::CQO:
+      uses->push_back(Physical(Register::RAX));
+      definitions->push_back(Physical(Register::RDX));
+      break;
+    case Opcode::IDIV:
+      AddUses(instruction.a, uses);
+      uses->push_back(Physical(Register::RAX));
+      uses->push_back(Physical(Register::RDX));
+      definitions->push_back(Physical(Register::RAX));
+      definitions->push_back(Physical(Register::RDX));
+      break;
+    case Opcode::CALL:
+      for (int i = 0; i < instruction.arguments; i++)
+        uses->push_back(Physical(kArgumentRegisters[i]));
+      for (Register r : kCallerSaved) definitions->push_back(Physical(r));
+      break;
+    case Opcode::ENTRY:
+      for (int i = 0; i < instruction.arguments; i++)
+        definitions->push_back(Physical(kArgumentRegisters[i]));
+      break;
+    case Opcode::RETURN:
+      if (instruction.arguments == 1) uses->push_back(Physical(Register::RAX));
+      break;
+    case Opcode::LABEL:
+    case Opcode::JMP:
+    case Opcode::JCC:
+    case Opcode::RET:
+      break;
+  }
+}
+
+Instruction Label(std::uint32_t label) {
+  Instruction instruction{Opcode::LABEL};
+  instruction.label = label;
+  return instruction;
+}
+
+Instruction Branch(Condition condition, std::uint32_t label) {
+  Instruction instruction{Opcode::JCC};
+  instruction.condition = condition;
+  instruction.label = label;
+  return instruction;
+}
+
+// A set of register ids.
+class RegisterSet {
+ public:
+  explicit RegisterSet(std::uint32_t size) : words_((size + 63) / 64) {}
+
+  bool Contains(std::uint32_t id) const {
+    return (words_[id / 64] >> (id % 64)) & 1;
+  }
+  void Insert(std::uint32_t id) { words_[id / 64] |= std::uint64_t{1} << (id % 64); }
+  void Erase(std::uint32_t id) {
+    words_[id / 64] &= ~(std::uint64_t{1} << (id % 64));
+  }
+  // Returns true if this changed the set.
+  bool InsertAll(const RegisterSet& other) {
+    bool changed = false;
+    for (std::size_t i = 0, n = words_.size(); i < n; i++) {
+      auto merged = words_[i] | other.words_[i];
+      changed = changed || merged != words_[i];
+      words_[i] = merged;
+    }
+    return changed;
+  }
+  template <typename F>
+  void ForEach(F f) const {
+    for (std::size_t i = 0, n = words_.size(); i < n; i++) {
+      for (auto word = words_[i]; word; word &= word - 1) {
+        const auto bit = static_cast<std::uint32_t>(__builtin_ctzll(word));
+        f(static_cast<std::uint32_t>(i * 64) + bit);
+      }
+    }
+  }
+
+ private:
+  std::vector<std::uint64_t> words_;
+};
+
+struct Block {
+  std::size_t begin, end;
+  std::vector<std::size_t> successors;
+};
+
+std::vector<Block> FindBlocks(const std::vector<Instruction>& code) {
+  std::vector<Block> blocks;
+  std::map<std::uint32_t, std::size_t> labels;
+  std::size_t begin = 0;
+  auto finish = [&](std::size_t end) {
+    if (begin < end) blocks.push_back(Block{begin, end, {}});
+    begin = end;
+  };
+  for (std::size_t i = 0, n = code.size(); i < n; i++) {
+    const auto opcode = code[i].opcode;
+    if (opcode == Opcode::LABEL) {
+      finish(i);
+      labels.emplace(code[i].label, blocks.size());
+    } else if (opcode == Opcode::JMP || opcode == Opcode::JCC ||
+               opcode == Opcode::RETURN || opcode == Opcode::RET) {
+      finish(i + 1);
+    }
+  }
+  finish(code.size());
+  for (std::size_t i = 0, n = blocks.size(); i < n; i++) {
+    const auto& last = code[blocks[i].end - 1];
+    if (last.opcode == Opcode::JMP || last.opcode == Opcode::JCC)
+      blocks[i].successors.push_back(labels.at(last.label));
+    const bool falls_through = last.opcode != Opcode::JMP &&
+                               last.opcode != Opcode::RETURN &&
+                               last.opcode != Opcode::RET;
+    if (falls_through && i + 1 < n) blocks[i].successors.push_back(i + 1);
+  }
+  return blocks;
+}
+
+// Program points: instruction k reads its inputs at point 2k and writes its
+// outputs at point 2k + 1.
+struct Interval {
+  std::uint32_t start = std::numeric_limits<std::uint32_t>::max();
+  std::uint32_t end = 0;
+  void Add(std::uint32_t point) {
+    start = std::min(start, point);
+    end = std::max(end, point);
+  }
+};
+
+class Allocator {
+ public:
+  explicit Allocator(Function* function) : function_(function) {}
+
+  void Run() {
+    ComputeLiveness();
+    Scan();
+    Rewrite();
+    Finalize();
+  }
+
+ private:
+  void ComputeLiveness();
+  bool IsFree(Register r, const Interval& interval) const;
+  void Scan();
+  void Rewrite();
+  void Finalize();
+  Memory SpillSlot(std::uint32_t id);
+
+  Function* function_;
+  // The live interval of each virtual register.
+  std::vector<Interval> intervals_;
+  // For each physical register, the sorted points at which it is in use.
+  std::vector<std::uint32_t> occupied_[16];
+  // Registers which would be good choices for each virtual register, since
+  // they are moved to or from it.
+  std::vector<std::vector<Reg>> hints_;
+  // The physical register or spill slot chosen for each virtual register.
+  std::vector<std::optional<Register>> registers_;
+  std::map<std::uint32_t, Memory> spills_;
+  std::vector<Register> saved_;
+};
+
+void Allocator::ComputeLiveness() {
+  const auto& code = function_->code;
+  const std::uint32_t size = function_->next_register;
+  auto blocks = FindBlocks(code);
+  std::vector<RegisterSet> gen(blocks.size(), RegisterSet{size}),
+      kill(blocks.size(), RegisterSet{size}),
+      live_in(blocks.size(), RegisterSet{size}),
+      live_out(blocks.size(), RegisterSet{size});
+  std::vector<Reg> uses, definitions;
+  for (std::size_t b = 0, n = blocks.size(); b < n; b++) {
+    for (std::size_t k = blocks[b].begin; k < blocks[b].end; k++) {
+      uses.clear();
+      definitions.clear();
+      UsesAndDefinitions(code[k], &uses, &definitions);
+      for (Reg r : uses) {
+        if (IsTracked(r) && !kill[b].Contains(r.id)) gen[b].Insert(r.id);
+      }
+      for (Reg r : definitions) {
+        if (IsTracked(r)) kill[b].Insert(r.id);
+      }
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (std::size_t b = blocks.size(); b-- > 0;) {
+      for (auto successor : blocks[b].successors)
+        live_out[b].InsertAll(live_in[successor]);
+      RegisterSet in = gen[b];
+      live_out[b].ForEach([&](std::uint32_t id) {
+        if (!kill[b].Contains(id)) in.Insert(id);
+      });
+      changed = live_in[b].InsertAll(in) || changed;
+    }
+  }
+
+  intervals_.assign(size, Interval{});
+  hints_.assign(size, {});
+  auto occupy = [&](std::uint32_t id, std::uint32_t point) {
+    if (id >= kFirstVirtual) {
+      intervals_[id].Add(point);
+    } else {
+      occupied_[id].push_back(point);
+    }
+  };
+  for (std::size_t b = 0, n = blocks.size(); b < n; b++) {
+    RegisterSet live = live_out[b];
+    for (std::size_t k = blocks[b].end; k-- > blocks[b].begin;) {
+      const auto point = static_cast<std::uint32_t>(2 * k);
+      uses.clear();
+      definitions.clear();
+      UsesAndDefinitions(code[k], &uses, &definitions);
+      live.ForEach([&](std::uint32_t id) { occupy(id, point + 1); });
+      for (Reg r : definitions) {
+        if (!IsTracked(r)) continue;
+        occupy(r.id, point + 1);
+        live.Erase(r.id);
+      }
+      for (Reg r : uses) {
+        if (IsTracked(r)) live.Insert(r.id);
+      }
+      live.ForEach([&](std::uint32_t id) { occupy(id, point); });
+      // Moves between registers can be removed if both sides are given the
+      // same register.
+      const auto* to = std::get_if<Reg>(&code[k].a);
+      const auto* from = std::get_if<Reg>(&code[k].b);
+      if (code[k].opcode == Opcode::MOV && to && from && IsTracked(*to) &&
+          IsTracked(*from)) {
+        if (to->id >= kFirstVirtual) hints_[to->id].push_back(*from);
+        if (from->id >= kFirstVirtual) hints_[from->id].push_back(*to);
+      }
+    }
+  }
+  for (auto& points : occupied_) {
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+  }
+}
+
+bool Allocator::IsFree(Register r, const Interval& interval) const {
+  const auto& points = occupied_[static_cast<int>(r)];
+  auto i = std::lower_bound(points.begin(), points.end(), interval.start);
+  return i == points.end() || *i > interval.end;
+}
+
+void Allocator::Scan() {
+  const std::uint32_t size = function_->next_register;
+  registers_.assign(size, std::nullopt);
+  std::vector<std::uint32_t> order;
+  for (std::uint32_t id = kFirstVirtual; id < size; id++) {
+    if (intervals_[id].start <= intervals_[id].end) order.push_back(id);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](auto l, auto r) {
+    return intervals_[l].start < intervals_[r].start;
+  });
+  // The virtual register currently held by each physical register.
+  std::optional<std::uint32_t> holder[16];
+  std::vector<std::uint32_t> active;
+  for (std::uint32_t id : order) {
+    const auto& interval = intervals_[id];
+    // Release the registers of intervals which have ended.
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [&](std::uint32_t other) {
+                                  if (intervals_[other].end >= interval.start)
+                                    return false;
+                                  holder[static_cast<int>(*registers_[other])]
+                                      .reset();
+                                  return true;
+                                }),
+                 active.end());
+    auto available = [&](Register r) {
+      return !holder[static_cast<int>(r)] && IsFree(r, interval);
+    };
+    std::optional<Register> choice;
+    for (Reg hint : hints_[id]) {
+      std::optional<Register> r;
+      if (hint.id < kFirstVirtual) {
+        r = static_cast<Register>(hint.id);
+      } else {
+        r = registers_[hint.id];
+      }
+      if (r && IsTracked(Physical(*r)) && available(*r)) {
+        choice = r;
+        break;
+      }
+    }
+    if (!choice) {
+      for (Register r : kAllocatable) {
+        if (available(r)) {
+          choice = r;
+          break;
+        }
+      }
+    }
+    if (!choice) {
+      // Spill whichever interval ends last, since that frees a register for
+      // the longest time.
+      std::optional<std::uint32_t> victim;
+      for (std::uint32_t other : active) {
+        if (!IsFree(*registers_[other], interval)) continue;
+        if (!victim || intervals_[other].end > intervals_[*victim].end)
+          victim = other;
+      }
+      if (!victim || intervals_[*victim].end <= interval.end) {
+        spills_.emplace(id, SpillSlot(id));
+        continue;
+      }
+      choice = registers_[*victim];
+      registers_[*victim].reset();
+      spills_.emplace(*victim, SpillSlot(*victim));
+      active.erase(std::find(active.begin(), active.end(), *victim));
+    }
+    registers_[id] = choice;
+    holder[static_cast<int>(*choice)] = id;
+    active.push_back(id);
+    if (IsCalleeSaved(*choice) &&
+        std::find(saved_.begin(), saved_.end(), *choice) == saved_.end()) {
+      saved_.push_back(*choice);
+    }
+  }
+  std::sort(saved_.begin(), saved_.end());
+}
+
+Memory Allocator::SpillSlot(std::uint32_t) { return function_->NewSlot(8); }
+
+void Allocator::Rewrite() {
+  std::vector<Instruction> output;
+  std::vector<Reg> uses, definitions;
+  auto is_spilled = [&](Reg r) {
+    return r.id >= kFirstVirtual && spills_.count(r.id);
+  };
+  auto assign = [&](Reg& r) {
+    if (r.id < kFirstVirtual) return;
+    if (!registers_[r.id]) {
+      throw std::logic_error("Virtual register was not allocated.");
+    }
+    r = Physical(*registers_[r.id]);
+  };
+  for (auto instruction : function_->code) {
+    const auto* to = std::get_if<Reg>(&instruction.a);
+    const auto* from = std::get_if<Reg>(&instruction.b);
+    if (instruction.opcode == Opcode::MOV && to && from &&
+        (is_spilled(*to) || is_spilled(*from))) {
+      // Moves can read from or write to memory directly.
+      if (!is_spilled(*from)) {
+        Reg source = *from;
+        assign(source);
+        output.push_back(Instruction{Opcode::MOV, spills_.at(to->id), source});
+      } else if (!is_spilled(*to)) {
+        Reg destination = *to;
+        assign(destination);
+        output.push_back(
+            Instruction{Opcode::MOV, destination, spills_.at(from->id)});
+      } else {
+        const Reg scratch = Physical(kScratch[0]);
+        output.push_back(
+            Instruction{Opcode::MOV, scratch, spills_.at(from->id)});
+        output.push_back(Instruction{Opcode::MOV, spills_.at(to->id), scratch});
+      }
+      continue;
+    }
+    // Every other instruction accesses spilled values through the scratch
+    // registers. Values which are only written can share a scratch register
+    // with an input, since the inputs are read first.
+    uses.clear();
+    definitions.clear();
+    UsesAndDefinitions(instruction, &uses, &definitions);
+    auto mentions = [](const auto& registers, std::uint32_t id) {
+      return std::any_of(registers.begin(), registers.end(),
+                         [&](const auto& r) { return r.first == id; });
+    };
+    std::vector<std::pair<std::uint32_t, Register>> scratch;
+    for (Reg r : uses) {
+      if (!is_spilled(r) || mentions(scratch, r.id)) continue;
+      if (scratch.size() == std::size(kScratch)) {
+        throw std::logic_error("Too many spilled operands.");
+      }
+      scratch.emplace_back(r.id, kScratch[scratch.size()]);
+    }
+    const auto inputs = scratch.size();
+    for (Reg r : definitions) {
+      if (!is_spilled(r) || mentions(scratch, r.id)) continue;
+      scratch.emplace_back(r.id, kScratch[0]);
+    }
+    for (std::size_t i = 0; i < inputs; i++) {
+      output.push_back(Instruction{Opcode::MOV, Physical(scratch[i].second),
+                                   spills_.at(scratch[i].first)});
+    }
+    ForEachRegister(&instruction, [&](Reg& r) {
+      for (const auto& [id, replacement] : scratch) {
+        if (id == r.id) {
+          r = Physical(replacement);
+          return;
+        }
+      }
+      assign(r);
+    });
+    output.push_back(std::move(instruction));
+    for (const auto& [id, r] : scratch) {
+      const bool written = std::any_of(definitions.begin(), definitions.end(),
+                                       [&](Reg d) { return d.id == id; });
+      if (written) {
+        output.push_back(
+            Instruction{Opcode::MOV, spills_.at(id), Physical(r)});
+      }
+    }
+  }
+  function_->code = std::move(output);
+}
+
+void Allocator::Finalize() {
+  // The callee-saved registers are stored immediately below the saved frame
+  // pointer, followed by the frame slots.
+  const auto saved_size = static_cast<std::int32_t>(8 * saved_.size());
+  std::vector<std::int32_t> positions;
+  std::int32_t offset = saved_size;
+  for (auto size : function_->slots) {
+    offset += size;
+    positions.push_back(-offset);
+  }
+  // Calls require the stack pointer to be a multiple of 16.
+  const std::int32_t frame_size = (offset + 15) / 16 * 16 - saved_size;
+
+  const auto rbp = Physical(Register::RBP), rsp = Physical(Register::RSP);
+  std::vector<Instruction> output;
+  std::vector<Instruction> stubs;
+  for (auto instruction : function_->code) {
+    for (Operand* operand :
+         {&instruction.a, &instruction.b, &instruction.c}) {
+      if (auto* memory = std::get_if<Memory>(operand); memory && memory->slot) {
+        memory->displacement += positions[*memory->slot];
+        memory->slot.reset();
+      }
+    }
+    switch (instruction.opcode) {
+      case Opcode::ENTRY:
+        output.push_back(Instruction{Opcode::PUSH, rbp});
+        output.push_back(Instruction{Opcode::MOV, rbp, rsp});
+        for (Register r : saved_)
+          output.push_back(Instruction{Opcode::PUSH, Physical(r)});
+        if (frame_size > 0) {
+          output.push_back(
+              Instruction{Opcode::SUB, rsp, Immediate{frame_size}});
+        }
+        break;
+      case Opcode::RETURN:
+        if (saved_.empty()) {
+          output.push_back(Instruction{Opcode::MOV, rsp, rbp});
+        } else {
+          output.push_back(Instruction{Opcode::LEA, rsp,
+                                       Memory{rbp, std::nullopt, 1,
+                                              -saved_size}});
+          for (auto i = saved_.rbegin(); i != saved_.rend(); ++i)
+            output.push_back(Instruction{Opcode::POP, Physical(*i)});
+        }
+        output.push_back(Instruction{Opcode::POP, rbp});
+        output.push_back(Instruction{Opcode::RET});
+        break;
+      case Opcode::CHECK_INDEX: {
+        // The index is compared as an unsigned value so that negative
+        // indices are caught by the same comparison.
+        const auto stub = function_->NewLabel();
+        if (std::holds_alternative<Immediate>(instruction.a)) {
+          output.push_back(
+              Instruction{Opcode::CMP, instruction.b, instruction.a});
+          output.push_back(Branch(Condition::BE, stub));
+        } else {
+          output.push_back(
+              Instruction{Opcode::CMP, instruction.a, instruction.b});
+          output.push_back(Branch(Condition::AE, stub));
+        }
+        // The index is never in R11, since it is the first operand.
+        const auto scratch = Physical(Register::R11);
+        stubs.push_back(Label(stub));
+        stubs.push_back(Instruction{Opcode::MOV, scratch, instruction.b});
+        stubs.push_back(Instruction{Opcode::MOV, Physical(Register::RDI),
+                                    instruction.a});
+        stubs.push_back(
+            Instruction{Opcode::MOV, Physical(Register::RSI), scratch});
+        Instruction call{Opcode::CALL};
+        call.symbol = "gelindexerror";
+        call.arguments = 2;
+        stubs.push_back(std::move(call));
+        break;
+      }
+      case Opcode::CHECK_SIZE: {
+        const auto stub = function_->NewLabel();
+        output.push_back(
+            Instruction{Opcode::CMP, instruction.a, instruction.b});
+        output.push_back(Branch(Condition::NE, stub));
+        // As for CHECK_INDEX, the first operand is never in R11.
+        const auto scratch = Physical(Register::R11);
+        stubs.push_back(Label(stub));
+        stubs.push_back(Instruction{Opcode::MOV, scratch, instruction.b});
+        stubs.push_back(Instruction{Opcode::MOV, Physical(Register::RDI),
+                                    instruction.a});
+        stubs.push_back(
+            Instruction{Opcode::MOV, Physical(Register::RSI), scratch});
+        Instruction call{Opcode::CALL};
+        call.symbol = "gelsizeerror";
+        call.arguments = 2;
+        stubs.push_back(std::move(call));
+        break;
+      }
+      case Opcode::MOV: {
+        const auto* to = std::get_if<Reg>(&instruction.a);
+        const auto* from = std::get_if<Reg>(&instruction.b);
+        if (to && from && *to == *from) break;
+        output.push_back(std::move(instruction));
+        break;
+      }
+      case Opcode::ADD:
+      case Opcode::SUB:
+      case Opcode::IMUL:
+      case Opcode::AND:
+      case Opcode::OR:
+      case Opcode::XOR:
+      case Opcode::CMP:
+      case Opcode::TEST:
+      case Opcode::LEA:
+      case Opcode::IMUL3:
+      case Opcode::SHL:
+      case Opcode::SHR:
+      case Opcode::SAR:
+      case Opcode::NEG:
+      case Opcode::WIDEMUL:
+      case Opcode::CQO:
+      case Opcode::IDIV:
+      case Opcode::SET:
+      case Opcode::PUSH:
+      case Opcode::POP:
+      case Opcode::LABEL:
+      case Opcode::JMP:
+      case Opcode::JCC:
+      case Opcode::CALL:
+      case Opcode::RET:
+        output.push_back(std::move(instruction));
+        break;
+    }
+  }
+  output.insert(output.end(), stubs.begin(), stubs.end());
+  function_->code = std::move(output);
+}
+
+constexpr const char* kRegisterNames[16] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+constexpr const char* kByteRegisterNames[16] = {
+    "al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+constexpr const char* kDoubleWordRegisterNames[16] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+constexpr const char* kConditionNames[16] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+Register PhysicalRegister(Reg r) {
+  if (r.id >= kFirstVirtual) {
+    throw std::logic_error("Using an unallocated register.");
+  }
+  return static_cast<Register>(r.id);
+}
+
+struct Print {
+  const Operand& operand;
+};
+
+std::ostream& operator<<(std::ostream& output, Reg r) {
+  return output << '%' << kRegisterNames[static_cast<int>(PhysicalRegister(r))];
+}
+
+std::ostream& operator<<(std::ostream& output, Print print) {
+  if (const auto* reg = std::get_if<Reg>(&print.operand)) {
+    return output << *reg;
+  } else if (const auto* immediate = std::get_if<Immediate>(&print.operand)) {
+    return output << '$' << immediate->value;
+  }
+  const auto& memory = std::get<Memory>(print.operand);
+  if (memory.slot) throw std::logic_error("Printing an unplaced frame slot.");
+  if (memory.displacement) output << memory.displacement;
+  output << '(' << memory.base;
+  if (memory.index) {
+    output << ", " << *memory.index << ", " << static_cast<int>(memory.scale);
+  }
+  return output << ')';
+}
+
+std::string_view Mnemonic(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::MOV: return "movq";
+    case Opcode::ADD: return "addq";
+    case Opcode::SUB: return "subq";
+    case Opcode::IMUL: return "imulq";
+    case Opcode::AND: return "andq";
+    case Opcode::OR: return "orq";
+    case Opcode::XOR: return "xorq";
+    case Opcode::CMP: return "cmpq";
+    case Opcode::TEST: return "testq";
+    case Opcode::LEA: return "leaq";
+    case Opcode::IMUL3: return "imulq";
+    case Opcode::SHL: return "shlq";
+    case Opcode::SHR: return "shrq";
+    case Opcode::SAR: return "sarq";
+    case Opcode::NEG: return "negq";
+    case Opcode::WIDEMUL: return "imulq";
+    case Opcode::CQO: return "cqto";
+    case Opcode::IDIV: return "idivq";
+    case Opcode::PUSH: return "pushq";
+    case Opcode::POP: return "popq";
+    case Opcode::RET: return "ret";
+    case Opcode::SET:
+    case Opcode::LABEL:
+    case Opcode::JMP:
+    case Opcode::JCC:
+    case Opcode::CALL:
+    case Opcode::ENTRY:
+    case Opcode::CHECK_INDEX:
+    case Opcode::CHECK_SIZE:
+    case Opcode::RETURN:
+      break;
+  }
+  throw std::logic_error("Instruction has no simple mnemonic.");
+}
+
+bool FitsInt8(std::int64_t value) {
+  return std::numeric_limits<std::int8_t>::min() <= value &&
+         value <= std::numeric_limits<std::int8_t>::max();
+}
+
+bool FitsInt32(std::int64_t value) {
+  return std::numeric_limits<std::int32_t>::min() <= value &&
+         value <= std::numeric_limits<std::int32_t>::max();
+}
+
+int Code(Reg r) { return static_cast<int>(PhysicalRegister(r)); }
+int Code(const Operand& operand) { return Code(std::get<Reg>(operand)); }
+
+// Encodes functions one after another into a single buffer. The encodings
+// match the ones which GNU as picks for the printed assembly, except that
+// jumps always use 32-bit displacements so that every instruction has a known
+// size when it is emitted.
+class Encoder {
+ public:
+  explicit Encoder(
+      const std::map<std::string, std::uint64_t, std::less<>>& externals)
+      : externals_(&externals) {}
+
+  void Add(const Function& function);
+  MachineCode Finish();
+
+ private:
+  void Byte(int value);
+  // Emit the low bytes of the value in little-endian order.
+  void Value(std::int64_t value, int size);
+  // Emit an instruction whose ModRM byte selects the given register (or
+  // opcode extension) and register or memory operand. Operations on bytes use
+  // the low byte of the register, which needs a REX prefix for SPL to DIL.
+  void ModRM(std::initializer_list<int> opcode, int reg, const Operand& rm,
+             bool wide = true, bool byte = false);
+  // Emit a two-operand arithmetic instruction with the given opcode
+  // extension, which is also the base opcode shifted down by 3 bits.
+  void Arithmetic(int extension, const Operand& a, const Operand& b);
+  void Multiply(const Operand& a, const Operand& b, std::int64_t c);
+  void Move(const Operand& a, const Operand& b);
+  void Call(const std::string& symbol);
+  // Fill in the 32-bit displacement at the given position so that it refers
+  // to the target.
+  void Patch(std::size_t position, std::size_t target);
+
+  const std::map<std::string, std::uint64_t, std::less<>>* externals_;
+  MachineCode code_;
+  // Displacements which refer to other functions.
+  std::vector<std::pair<std::size_t, std::string>> calls_;
+};
+
+void Encoder::Add(const Function& function) {
+  constexpr int kInt3 = 0xCC;
+  while (code_.bytes.size() % 16) Byte(kInt3);
+  if (!code_.symbols.emplace(function.name, code_.bytes.size()).second) {
+    throw std::logic_error("Function " + function.name + " is defined twice.");
+  }
+  std::vector<std::optional<std::size_t>> labels(function.next_label);
+  std::vector<std::pair<std::size_t, std::uint32_t>> jumps;
+  auto jump = [&](std::uint32_t label) {
+    jumps.emplace_back(code_.bytes.size(), label);
+    Value(0, 4);
+  };
+  for (const auto& instruction : function.code) {
+    const auto& [opcode, a, b, c, condition, label, symbol, arguments] =
+        instruction;
+    const int cc = static_cast<int>(condition);
+    switch (opcode) {
+      case Opcode::MOV: Move(a, b); break;
+      case Opcode::ADD: Arithmetic(0, a, b); break;
+      case Opcode::OR: Arithmetic(1, a, b); break;
+      case Opcode::AND: Arithmetic(4, a, b); break;
+      case Opcode::SUB: Arithmetic(5, a, b); break;
+      case Opcode::XOR: Arithmetic(6, a, b); break;
+      case Opcode::CMP: Arithmetic(7, a, b); break;
+      case Opcode::TEST: ModRM({0x85}, Code(b), a); break;
+      case Opcode::IMUL:
+        if (const auto* value = std::get_if<Immediate>(&b)) {
+          Multiply(a, a, value->value);
+        } else {
+          ModRM({0x0F, 0xAF}, Code(a), b);
+        }
+        break;
+      case Opcode::IMUL3: Multiply(a, b, std::get<Immediate>(c).value); break;
+      case Opcode::LEA: ModRM({0x8D}, Code(a), b); break;
+      case Opcode::SHL:
+      case Opcode::SHR:
+      case Opcode::SAR: {
+        const int extension = opcode == Opcode::SHL   ? 4
+                              : opcode == Opcode::SHR ? 5
+                                                      : 7;
+        // Shifts by 1 have a shorter form without the count.
+        const auto count = std::get<Immediate>(b).value;
+        ModRM({count == 1 ? 0xD1 : 0xC1}, extension, a);
+        if (count != 1) Value(count, 1);
+        break;
+      }
+      case Opcode::NEG: ModRM({0xF7}, 3, a); break;
+      case Opcode::WIDEMUL: ModRM({0xF7}, 5, a); break;
+      case Opcode::CQO:
+        Byte(0x48);
+        Byte(0x99);
+        break;
+      case Opcode::IDIV: ModRM({0xF7}, 7, a); break;
+      case Opcode::SET:
+        // setcc followed by movzbl, as for the printed form.
+        ModRM({0x0F, 0x90 + cc}, 0, a, false, true);
+        ModRM({0x0F, 0xB6}, Code(a), a, false, true);
+        break;
+      case Opcode::PUSH:
+      case Opcode::POP:
+        if (const auto* value = std::get_if<Immediate>(&a)) {
+          if (opcode == Opcode::POP) {
+            throw std::logic_error("Popping into an immediate.");
+          }
+          const bool small = FitsInt8(value->value);
+          Byte(small ? 0x6A : 0x68);
+          Value(value->value, small ? 1 : 4);
+        } else if (std::holds_alternative<Memory>(a)) {
+          ModRM({opcode == Opcode::PUSH ? 0xFF : 0x8F},
+                opcode == Opcode::PUSH ? 6 : 0, a, false);
+        } else {
+          const int r = Code(a);
+          if (r & 8) Byte(0x41);
+          Byte((opcode == Opcode::PUSH ? 0x50 : 0x58) + (r & 7));
+        }
+        break;
+      case Opcode::LABEL: labels.at(label) = code_.bytes.size(); break;
+      case Opcode::JMP:
+        Byte(0xE9);
+        jump(label);
+        break;
+      case Opcode::JCC:
+        Byte(0x0F);
+        Byte(0x80 + cc);
+        jump(label);
+        break;
+      case Opcode::CALL: Call(symbol); break;
+      case Opcode::RET: Byte(0xC3); break;
+      case Opcode::ENTRY:
+      case Opcode::CHECK_INDEX:
+      case Opcode::CHECK_SIZE:
+      case Opcode::RETURN:
+        throw std::logic_error("Encoding a pseudo-instruction.");
+    }
+  }
+  for (const auto& [position, label] : jumps) {
+    if (!labels.at(label)) {
+      throw std::logic_error("Jump to a label which is never defined.");
+    }
+    Patch(position, *labels[label]);
+  }
+}
+
+MachineCode Encoder::Finish() {
+  for (const auto& [position, symbol] : calls_) {
+    auto i = code_.symbols.find(symbol);
+    if (i == code_.symbols.end()) {
+      throw std::logic_error("Call to undefined function " + symbol + ".");
+    }
+    Patch(position, i->second);
+  }
+  calls_.clear();
+  return std::move(code_);
+}
+
+void Encoder::Byte(int value) {
+  code_.bytes.push_back(static_cast<std::uint8_t>(value & 0xFF));
+}
+
+void Encoder::Value(std::int64_t value, int size) {
+  const auto bits = static_cast<std::uint64_t>(value);
+  for (int i = 0; i < size; i++) Byte(static_cast<int>(bits >> (8 * i) & 0xFF));
+}
+
+void Encoder::ModRM(std::initializer_list<int> opcode, int reg,
+                    const Operand& rm, bool wide, bool byte) {
+  int rex = wide ? 0x48 : 0;
+  auto extend = [&](int code, int bit) {
+    if (code & 8) rex |= 0x40 | bit;
+  };
+  extend(reg, 0x4);
+  if (const auto* r = std::get_if<Reg>(&rm)) {
+    const int code = Code(*r);
+    extend(code, 0x1);
+    if (byte && code >= 4) rex |= 0x40;
+    if (rex) Byte(rex);
+    for (int op : opcode) Byte(op);
+    Byte(0xC0 | (reg & 7) << 3 | (code & 7));
+    return;
+  }
+  const auto* memory = std::get_if<Memory>(&rm);
+  if (!memory) throw std::logic_error("Immediate used as a register.");
+  if (memory->slot) throw std::logic_error("Encoding an unplaced frame slot.");
+  const int base = Code(memory->base);
+  extend(base, 0x1);
+  if (memory->index) extend(Code(*memory->index), 0x2);
+  if (rex) Byte(rex);
+  for (int op : opcode) Byte(op);
+  // An RSP or R12 base needs a SIB byte, and an RBP or R13 base has no form
+  // without a displacement.
+  const bool sib = memory->index || (base & 7) == 4;
+  const int mod = memory->displacement == 0 && (base & 7) != 5 ? 0
+                  : FitsInt8(memory->displacement)             ? 1
+                                                               : 2;
+  Byte(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base & 7));
+  if (sib) {
+    int scale = 0;
+    while ((1 << scale) < memory->scale) scale++;
+    if ((1 << scale) != memory->scale || scale > 3) {
+      throw std::logic_error("Invalid index scale.");
+    }
+    const int index = memory->index ? Code(*memory->index) & 7 : 4;
+    Byte(scale << 6 | index << 3 | (base & 7));
+  }
+  if (mod == 1) Value(memory->displacement, 1);
+  if (mod == 2) Value(memory->displacement, 4);
+}
+
+void Encoder::Arithmetic(int extension, const Operand& a, const Operand& b) {
+  if (const auto* value = std::get_if<Immediate>(&b)) {
+    if (!FitsInt32(value->value)) {
+      throw std::logic_error("Immediate operand is too large.");
+    }
+    if (FitsInt8(value->value)) {
+      ModRM({0x83}, extension, a);
+      Value(value->value, 1);
+    } else if (const auto* r = std::get_if<Reg>(&a);
+               r && *r == Physical(Register::RAX)) {
+      Byte(0x48);
+      Byte(extension << 3 | 5);
+      Value(value->value, 4);
+    } else {
+      ModRM({0x81}, extension, a);
+      Value(value->value, 4);
+    }
+  } else if (std::holds_alternative<Reg>(b)) {
+    ModRM({extension << 3 | 1}, Code(b), a);
+  } else {
+    ModRM({extension << 3 | 3}, Code(a), b);
+  }
+}
+
+void Encoder::Multiply(const Operand& a, const Operand& b, std::int64_t c) {
+  if (!FitsInt32(c)) throw std::logic_error("Immediate operand is too large.");
+  const bool small = FitsInt8(c);
+  ModRM({small ? 0x6B : 0x69}, Code(a), b);
+  Value(c, small ? 1 : 4);
+}
+
+void Encoder::Move(const Operand& a, const Operand& b) {
+  if (const auto* value = std::get_if<Immediate>(&b)) {
+    if (FitsInt32(value->value)) {
+      ModRM({0xC7}, 0, a);
+      Value(value->value, 4);
+    } else {
+      // movabsq, which only takes a register destination.
+      const int r = Code(a);
+      Byte(0x48 | (r & 8) >> 3);
+      Byte(0xB8 + (r & 7));
+      Value(value->value, 8);
+    }
+  } else if (std::holds_alternative<Reg>(b)) {
+    ModRM({0x89}, Code(b), a);
+  } else {
+    ModRM({0x8B}, Code(a), b);
+  }
+}
+
+void Encoder::Call(const std::string& symbol) {
+  if (auto i = externals_->find(symbol); i != externals_->end()) {
+    // movabsq $address, %r11; call *%r11. R11 is never allocated and is
+    // clobbered by calls anyway.
+    Byte(0x49);
+    Byte(0xBB);
+    Value(static_cast<std::int64_t>(i->second), 8);
+    Byte(0x41);
+    Byte(0xFF);
+    Byte(0xD3);
+  } else {
+    Byte(0xE8);
+    calls_.emplace_back(code_.bytes.size(), symbol);
+    Value(0, 4);
+  }
+}
+
+void Encoder::Patch(std::size_t position, std::size_t target) {
+  const auto displacement = static_cast<std::int64_t>(target) -
+                            static_cast<std::int64_t>(position + 4);
+  if (!FitsInt32(displacement)) throw std::logic_error("Jump is out of range.");
+  const auto bits = static_cast<std::uint64_t>(displacement);
+  for (std::size_t i = 0; i < 4; i++) {
+    code_.bytes[position + i] = static_cast<std::uint8_t>(bits >> (8 * i));
+  }
+}
+
+}  // namespace
+
+void Allocate(Function* function) { Allocator{function}.Run(); }
+
+std::ostream& operator<<(std::ostream& output, const Function& function) {
+  auto label = [&](std::uint32_t id) {
+    return ".L" + function.name + "_" + std::to_string(id);
+  };
+  output << "  .p2align 4\n" << function.name << ":\n";
+  for (const auto& instruction : function.code) {
+    const auto& [opcode, a, b, c, condition, target, symbol, arguments] =
+        instruction;
+    if (opcode == Opcode::LABEL) {
+      output << label(target) << ":\n";
+    } else if (opcode == Opcode::JMP) {
+      output << "  jmp " << label(target) << "\n";
+    } else if (opcode == Opcode::JCC) {
+      output << "  j" << kConditionNames[static_cast<int>(condition)] << ' '
+             << label(target) << "\n";
+    } else if (opcode == Opcode::CALL) {
+      output << "  call " << symbol << "\n";
+    } else if (opcode == Opcode::SET) {
+      auto r = static_cast<int>(PhysicalRegister(std::get<Reg>(a)));
+      output << "  set" << kConditionNames[static_cast<int>(condition)] << " %"
+             << kByteRegisterNames[r] << "\n  movzbl %" << kByteRegisterNames[r]
+             << ", %" << kDoubleWordRegisterNames[r] << "\n";
+    } else if (opcode == Opcode::IMUL3) {
+      output << "  imulq " << Print{c} << ", " << Print{b} << ", " << Print{a}
+             << "\n";
+    } else if (const auto* value = std::get_if<Immediate>(&b);
+               opcode == Opcode::MOV && value && !FitsInt32(value->value)) {
+      output << "  movabsq " << Print{b} << ", " << Print{a} << "\n";
+    } else if (opcode == Opcode::CQO || opcode == Opcode::RET) {
+      output << "  " << Mnemonic(opcode) << "\n";
+    } else if (opcode == Opcode::NEG || opcode == Opcode::WIDEMUL ||
+               opcode == Opcode::IDIV || opcode == Opcode::PUSH ||
+               opcode == Opcode::POP) {
+      output << "  " << Mnemonic(opcode) << ' ' << Print{a} << "\n";
+    } else {
+      // Pseudo-instructions have no mnemonic, so Mnemonic() rejects them.
+      output << "  " << Mnemonic(opcode) << ' ' << Print{b} << ", " << Print{a}
+             << "\n";
+    }
+  }
+  return output;
+}
+
+MachineCode Encode(
+    const std::vector<Function>& functions,
+    const std::map<std::string, std::uint64_t, std::less<>>& externals) {
+  Encoder encoder{externals};
+  for (const auto& function : functions) encoder.Add(function);
+  return encoder.Finish();
+}
+
+}  // namespace target::x86_64
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace target::x86_64 {
+
+// General purpose registers, numbered by their encoding.
+enum class Register : std::uint8_t {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+// Registers which carry the integer arguments of a call, in order.
+extern const Register kArgumentRegisters[6];
+
+// A register operand. Before register allocation, this may name a virtual
+// register: ids below kFirstVirtual name the physical register with that
+// encoding, and higher ids are virtual.
+struct Reg {
+  std::uint32_t id;
+};
+
+constexpr std::uint32_t kFirstVirtual = 16;
+
+inline bool operator==(Reg left, Reg right) { return left.id == right.id; }
+inline bool operator!=(Reg left, Reg right) { return left.id != right.id; }
+
+constexpr Reg Physical(Register r) { return Reg{static_cast<std::uint32_t>(r)}; }
+
+struct Immediate {
+  std::int64_t value;
+};
+
+// The address base + index * scale + displacement. Stack frame addresses use
+// RBP as the base and name a frame slot, since the position of each slot is
+// only known once the frame has been laid out.
+struct Memory {
+  Reg base;
+  std::optional<Reg> index = std::nullopt;
+  std::uint8_t scale = 1;
+  std::int32_t displacement = 0;
+  std::optional<std::uint32_t> slot = std::nullopt;
+};
+
+// Returns the address which is the given number of bytes after the original.
+Memory Offset(Memory address, std::int32_t bytes);
+
+using Operand = std::variant<Reg, Immediate, Memory>;
+
+// Condition codes, numbered by their encoding.
+enum class Condition : std::uint8_t {
+  O,
+  NO,
+  B,
+  AE,
+  E,
+  NE,
+  BE,
+  A,
+  S,
+  NS,
+  P,
+  NP,
+  L,
+  GE,
+  LE,
+  G,
+};
+
+// Returns the condition which holds exactly when the given one doesn't.
+Condition Negate(Condition condition);
+
+enum class Opcode : std::uint8_t {
+  // Two operand instructions, a = a op b. The destination is always
+  // a register except for MOV, which can also store to memory.
+  MOV,
+  ADD,
+  SUB,
+  IMUL,
+  AND,
+  OR,
+  XOR,
+  // Comparisons of a with b, which only set the flags.
+  CMP,
+  TEST,
+  // a = the address b.
+  LEA,
+  // a = b * c, where c is an immediate.
+  IMUL3,
+  // Shift a by the immediate b.
+  SHL,
+  SHR,
+  SAR,
+  NEG,
+  // RDX:RAX = RAX * a.
+  WIDEMUL,
+  // RDX:RAX = RAX, sign-extended.
+  CQO,
+  // RAX, RDX = RDX:RAX / a, RDX:RAX % a.
+  IDIV,
+  // a = 1 if the condition holds, otherwise 0.
+  SET,
+  PUSH,
+  POP,
+  LABEL,
+  JMP,
+  JCC,
+  // Call the symbol, passing the given number of arguments in registers. All
+  // registers which aren't preserved across calls are clobbered.
+  CALL,
+  RET,
+
+  // Pseudo-instructions, which are removed by register allocation.
+
+  // The start of the function, where the given number of arguments are
+  // available in registers.
+  ENTRY,
+  // Unless 0 <= a < b, report an invalid array index and exit.
+  CHECK_INDEX,
+  // Unless a == b, report mismatched array sizes and exit. a is a register.
+  CHECK_SIZE,
+  // Return from the function. If the number of arguments is 1, the result is
+  // in RAX.
+  RETURN,
+};
+
+struct Instruction {
+  Instruction(Opcode op, Operand first = Immediate{0},
+              Operand second = Immediate{0}, Operand third = Immediate{0})
+      : opcode(op), a(first), b(second), c(third) {}
+
+  Opcode opcode;
+  Operand a, b, c;
+  Condition condition = Condition::E;
+  // The label which is defined or targeted.
+  std::uint32_t label = 0;
+  // The symbol which is called.
+  std::string symbol;
+  int arguments = 0;
+};
+
+struct Function {
+  std::string name;
+  std::vector<Instruction> code;
+  std::uint32_t next_register = kFirstVirtual;
+  std::uint32_t next_label = 0;
+  // The size in bytes of each stack frame slot.
+  std::vector<std::int32_t> slots;
+
+  Reg NewRegister() { return Reg{next_register++}; }
+  std::uint32_t NewLabel() { return next_label++; }
+  Memory NewSlot(std::int32_t size);
+};
+
+// Assign physical registers to the virtual registers in the function and lay
+// out its stack frame. Registers are allocated by linear scan over live
+// intervals, and values which don't fit are spilled to the frame. The
+// pseudo-instructions are replaced by the prologue, epilogue and out-of-line
+// error handling, so the result contains only real instructions.
+void Allocate(Function* function);
+
+// Print an allocated function in GNU assembler syntax.
+std::ostream& operator<<(std::ostream& output, const Function& function);
+
+// Machine code for a set of functions. Calls between the functions are
+// relative and calls to anything else use absolute addresses, so the code can
+// be placed anywhere in memory.
+struct MachineCode {
+  std::vector<std::uint8_t> bytes;
+  // The offset of each function within the code.
+  std::map<std::string, std::size_t, std::less<>> symbols;
+};
+
+// Encode allocated functions as machine code. Calls to symbols which aren't
+// defined by any of the functions go to the given addresses.
+MachineCode Encode(
+    const std::vector<Function>& functions,
+    const std::map<std::string, std::uint64_t, std::less<>>& externals);
+
+}  // namespace target::x86_64
@@ -0,0 +1,100 @@
+#!/bin/bash
+# Runs each program in test/ and checks it against the files next to it:
+# NAME.expected for what it prints, NAME.errors for its errors if it has any,
+# and NAME.status for its exit status if that isn't 0. Each line of NAME.flags
+# is a set of flags to run the program with. Programs without one run on every
+# backend at every optimization level. GEL is the compiler to test.
+gel=$(realpath "${GEL:-bin/gel}")
+directory=$(realpath "$(dirname "$0")")
+backends=(-O0 -O1 -O2 -O3 --vm --jit --target=x86-64 --target=llvm)
+# The LLVM backend needs clang to build its output.
+if ! command -v clang > /dev/null; then
+  echo "Skipping --target=llvm, since clang is not installed."
+  skip=--target=llvm
+fi
+temporary=$(mktemp -d)
+failures=0
+
+# Programs which are already in the cache must run without compiling them
+# again, so they are run a second time with a C compiler that always fails.
+mkdir "$temporary/no-compiler"
+printf '#!/bin/sh\nexit 1\n' > "$temporary/no-compiler/gcc"
+chmod +x "$temporary/no-compiler/gcc"
+cached() {
+  local flags="--cache-dir=$temporary/cache $2"
+  check "$1" "$flags"
+  PATH=$temporary/no-compiler:$PATH check "$1" "$flags"
+}
+
+# Programs compiled by a server must behave as they do when compiled locally,
+# so each one also runs through a server with its first set of flags.
+"$gel" --server="$temporary/socket" 2> "$temporary/server-errors" &
+server=$!
+trap 'kill $server; rm -rf "$temporary"' EXIT
+for i in {1..50}; do
+  [[ -S $temporary/socket ]] && break
+  sleep 0.1
+done
+if [[ ! -S $temporary/socket ]]; then
+  echo "The server didn't start."
+  failures=$((failures + 1))
+fi
+
+# Run the program with the given flags from the current directory, and check
+# the results. The flags are split into words on purpose.
+check() {
+  local program=$1 flags=$2 name=${1%.gel}
+  local expected_status=0 expected_errors=/dev/null
+  [[ -f $name.status ]] && expected_status=$(< "$name.status")
+  [[ -f $name.errors ]] && expected_errors=$name.errors
+  "$gel" $flags < "$program" > "$temporary/output" 2> "$temporary/errors"
+  local status=$?
+  local problems=()
+  cmp -s "$temporary/output" "$name.expected" || problems+=(output)
+  cmp -s "$temporary/errors" "$expected_errors" || problems+=(errors)
+  [[ $status == "$expected_status" ]] || problems+=("status $status")
+  if (( ${#problems[@]} )); then
+    echo "$program $flags: unexpected ${problems[*]}"
+    failures=$((failures + 1))
+  fi
+}
+
+for program in "$directory"/*.gel; do
+  name=${program%.gel}
+  if [[ -f $name.flags ]]; then
+    mapfile -t runs < "$name.flags"
+  else
+    runs=("${backends[@]}")
+  fi
+  for flags in "${runs[@]}"; do
+    [[ -n $skip && $flags == *$skip* ]] && continue
+    check "$program" "$flags"
+  done
+  check "$program" "--client=$temporary/socket ${runs[0]}"
+  # Profile-guided builds depend on a training run, so they aren't cached.
+  [[ ${runs[0]} == *--pgo* ]] || cached "$program" "${runs[0]}"
+done
+cached "$directory/minimum.gel" --units=2
+
+# Relative paths are relative to the client's working directory, as they would
+# be for a local compile, rather than the server's.
+mkdir "$temporary/client"
+(
+  cd "$temporary/client" &&
+    GEL_CACHE_DIR=cache "$gel" --client="$temporary/socket" --trace=trace.json \
+      < "$directory/minimum.gel" > /dev/null
+)
+if [[ ! -f $temporary/client/trace.json || ! -d $temporary/client/cache ]]; then
+  echo "The server ignored the client's working directory."
+  failures=$((failures + 1))
+fi
+if ! kill -0 $server 2> /dev/null; then
+  echo "The server exited:"
+  cat "$temporary/server-errors"
+  failures=$((failures + 1))
+fi
+
+if (( failures )); then
+  echo "$failures failed."
+  exit 1
+fi